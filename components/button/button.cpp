@@ -4,6 +4,7 @@
 #include "esp_log.h"
 #include "esp_system.h"
 #include "event_manager.h"
+#include "hal/gpio_ll.h"
 #include "mysleep.h"
 
 constexpr auto *TAG = "Button";
@@ -67,6 +68,10 @@ void Button::stop() {
 
 void IRAM_ATTR Button::gpio_isr_handler(void *arg) {
   Button *button = static_cast<Button *>(arg);
+  // A light sleep wakes up on the low level, which would fire again and
+  // again while the button is held
+  gpio_ll_set_intr_type(GPIO_LL_GET_HW(GPIO_PORT_0), button->button_pin,
+                        GPIO_INTR_ANYEDGE);
   uint32_t now = xTaskGetTickCountFromISR();
   xQueueSendFromISR(button->event_queue, &now, nullptr);
 }
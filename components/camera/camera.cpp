@@ -70,8 +70,9 @@ Camera::Camera(bool qr_reader_app) {
       .frame_size = size,
 
       .jpeg_quality = 4, // 0-63
-      .fb_count = 1, // When jpeg mode is used, if fb_count more than one, the
-                     // driver will work in continuous mode.
+      // When jpeg mode is used, if fb_count more than one, the driver will
+      // work in continuous mode.
+      .fb_count = qr_reader_app ? QR_FRAME_BUFFER_COUNT : 1,
       .fb_location = CAMERA_FB_IN_PSRAM,
       .grab_mode = CAMERA_GRAB_LATEST,
   };
@@ -126,6 +127,13 @@ esp_err_t Camera::start() {
   return err;
 }
 
+esp_err_t Camera::power_down() {
+  _fb = nullptr;
+  esp_err_t err = esp_camera_deinit();
+  gpio_set_level(CAM_PIN_PWDN, 1); // Power down the camera
+  return err;
+}
+
 esp_err_t Camera::take_image() {
   // flush the old frame buffer
   _fb = esp_camera_fb_get();
@@ -5,6 +5,10 @@
 #include "pins.h"
 #include <string>
 
+// Frame buffers of the QR reader app: one for each of the two decoders and
+// their queued frames, the driver fills them while the decoders work
+constexpr size_t QR_FRAME_BUFFER_COUNT{4};
+
 /**
  * @brief Handles the OV5640 camera
  */
@@ -29,6 +33,16 @@ public:
    */
   esp_err_t start();
 
+  /**
+   * @brief Powers the camera down through CAM_PIN_PWDN and frees the frame
+   * buffer, start() brings it up again
+   *
+   * @return
+   *     - ESP_OK : camera powered down
+   *     - ESP_ERR_INVALID_STATE : the camera wasn't started
+   */
+  esp_err_t power_down();
+
   /**
    * @brief Takes image
    *
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Lock-free queue of log lines, written by any task and read by one
+ *
+ * The log hook formats a line straight into a free slot and never waits:
+ * a producer claims the next slot with a compare-and-swap on the head, and
+ * marks it readable with the slot's sequence number once the line is
+ * written. When every slot is taken the line is dropped and counted. A
+ * single consumer takes the lines in order.
+ */
+class LogRing {
+public:
+  static constexpr size_t SLOTS = 32; /*!< a power of two */
+  static constexpr size_t LINE_SIZE = 256;
+
+  LogRing();
+
+  LogRing(const LogRing &) = delete;
+  LogRing &operator=(const LogRing &) = delete;
+
+  /**
+   * @brief Formats a line into the ring, cut at LINE_SIZE - 1 characters
+   *
+   * @param fmt The format string of the line
+   * @param args The arguments of the format string
+   *
+   * @return false if the ring was full and the line was dropped
+   */
+  bool append(const char *fmt, va_list args);
+
+  /**
+   * @brief Takes the oldest line, only one task may call this
+   *
+   * @param line The buffer for the line, it isn't terminated
+   * @param size The size of the buffer, a longer line is cut
+   *
+   * @return The length of the line, 0 if the ring is empty or the oldest line
+   * is still being written
+   */
+  size_t pop(char *line, size_t size);
+
+  /**
+   * @return The length of the oldest line, 0 if there is none yet
+   */
+  size_t peek_length() const;
+
+  /**
+   * @return The number of lines dropped because the ring was full
+   */
+  uint32_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+private:
+  struct Slot {
+    // The position the slot is free for, or that position + 1 once the line
+    // is written
+    std::atomic<uint32_t> sequence{0};
+    uint16_t length = 0;
+    char text[LINE_SIZE];
+  };
+
+  static_assert((SLOTS & (SLOTS - 1)) == 0, "The slot index is a mask");
+
+  Slot _slots[SLOTS];
+  std::atomic<uint32_t> _head{0}; /*!< the next position to write */
+  uint32_t _tail = 0;             /*!< the next position to read */
+  std::atomic<uint32_t> _dropped{0};
+};
@@ -1,13 +1,68 @@
 #pragma once
 
 #include "esp_err.h"
+#include "log_ring.h"
 #include "mqtt_client.h"
+#include "topic_router.h"
 #include <ArduinoJson.h>
+#include <atomic>
 #include <string>
 
 constexpr int TIMESTAMP_SIZE{21};
+constexpr int ACK_SIZE{96};
 constexpr int NAME_SIZE{64};
-constexpr int LOG_SIZE{256};
+constexpr int KEY_SIZE{32};
+constexpr uint32_t IMAGE_CHUNK_SIZE{32 * 1024};
+constexpr int MAX_CHUNKS_IN_FLIGHT{2};
+constexpr uint32_t CHUNK_PUBLISH_TIMEOUT_MS{10000};
+constexpr size_t MAX_HEADER_PROPERTIES{12};
+// A message the client receives in fragments is reassembled up to this size
+constexpr size_t MAX_FRAGMENTED_MESSAGE_SIZE{16 * 1024};
+constexpr uint32_t LOG_BATCH_SIZE{2048};
+constexpr uint32_t LOG_LINGER_MS{100};
+constexpr uint32_t LOG_FLUSH_TIMEOUT_MS{2000};
+// The broker keeps the session and its subscriptions this long after the
+// disconnect, it outlasts the longest sleep
+constexpr uint32_t SESSION_EXPIRY_S{24 * 60 * 60};
+
+/**
+ * @brief The options of a header acknowledgement
+ */
+struct HeaderAck {
+  /**
+   * @brief What the server asks for after a progressive thumbnail
+   */
+  enum class Request { FULL, SKIP, ROI };
+
+  uint32_t keyframe_id = 0;        /*!< the keyframe the server holds, or 0 */
+  uint32_t chunks = 0; /*!< the leading chunks of the image the server holds */
+  Request request = Request::FULL; /*!< the requested part of the image */
+  uint16_t roi_x = 0;              /*!< left edge of the requested region */
+  uint16_t roi_y = 0;              /*!< top edge of the requested region */
+  uint16_t roi_width = 0;          /*!< width of the requested region */
+  uint16_t roi_height = 0;         /*!< height of the requested region */
+};
+
+/**
+ * @brief What a published message is, it decides the QoS of the message
+ */
+enum class MessageKind {
+  CONTROL,     /*!< the config exchange and the image headers */
+  IMAGE_CHUNK, /*!< a chunk of publish_chunked(), it carries a dedupe key */
+  TELEMETRY,   /*!< a report which is harmless if it arrives twice */
+};
+
+/**
+ * @brief The QoS of each kind of message
+ *
+ * Only the messages which are answered stay at QoS 2, a duplicate would be
+ * answered twice. The chunks are published at QoS 1, which takes one round
+ * trip instead of two and frees the outbox sooner, and the receiver drops a
+ * chunk which arrives twice by its dedupe key.
+ */
+constexpr int qos_for(MessageKind kind) {
+  return kind == MessageKind::CONTROL ? 2 : 1;
+}
 
 /**
  * @brief Manages MQTT connections and messaging
@@ -33,12 +88,45 @@ public:
    */
   void start();
 
+  /**
+   * @return Whether the client was started, it reconnects by itself until
+   * it is deinitialized, e.g. through a light sleep
+   *
+   */
+  static bool is_started() { return _connected; }
+
+  /**
+   * @brief Waits until the client is connected and subscribed to the header
+   * acknowledgement and config topics
+   *
+   * When the broker resumed the session of the previous wake with the same
+   * subscriptions, the client is ready as soon as it is connected. After a
+   * disconnection it waits until the client is ready again.
+   *
+   * @param timeout The timeout in milliseconds
+   *
+   * @return
+   *     - true : if the client is ready
+   *
+   *     - false : if the client is not ready within the timeout
+   *
+   */
+  bool wait_for_ready(uint32_t timeout);
+
+  /**
+   * @return Whether the broker resumed the session of the previous wake, so
+   * the subscriptions were not sent again
+   *
+   */
+  static bool get_session_resumed() { return _session_resumed; }
+
   /**
    * @brief Publishes a message to a specified topic
    *
    * @param topic The topic to publish the message to
    * @param data The message data to publish
    * @param len The length of the message data
+   * @param kind The kind of the message, see qos_for()
    *
    * @return
    * - ESP_OK: the message was published successfully
@@ -46,24 +134,106 @@ public:
    * - ESP_FAIL: the message failed to publish
    *
    */
-  esp_err_t publish(const char *topic, const char *data, uint32_t len);
+  esp_err_t publish(const char *topic, const char *data, uint32_t len,
+                    MessageKind kind = MessageKind::CONTROL);
+
+  /**
+   * @brief Publishes a large buffer as a sequence of fixed-size chunks
+   *
+   * The chunks are published straight from the caller's buffer, the data is
+   * never copied as a whole. Each chunk carries its index, the total chunk
+   * count and the CRC-32 of its payload in the "chunk", "chunks" and "crc"
+   * MQTT5 user properties, the CRC as 8 hex digits. The "image" property is
+   * the key of the buffer, the receiver drops a chunk whose key and index it
+   * has seen already, as QoS 1 may deliver a chunk twice. At most
+   * MAX_CHUNKS_IN_FLIGHT chunks are waiting for the broker's acknowledgement
+   * at any time, so the MQTT outbox holds only those chunks instead of the
+   * whole buffer.
+   *
+   * The first chunk can also carry the header of the buffer as user
+   * properties, so the receiver needs no separate header message.
+   *
+   * An interrupted publish is resumed by publishing again from the first
+   * chunk the receiver doesn't hold, see HeaderAck::chunks.
+   *
+   * @note The buffer must stay valid until the function returns
+   *
+   * @param topic The topic to publish the chunks to
+   * @param key The dedupe key of the buffer, e.g. the image timestamp, at
+   * most KEY_SIZE - 1 characters
+   * @param data The buffer to publish
+   * @param len The length of the buffer
+   * @param chunk_size The maximum size of one chunk
+   * @param header The user properties of the first chunk, or nullptr
+   * @param header_count The number of header properties, at most
+   * MAX_HEADER_PROPERTIES
+   * @param first_chunk The index of the first chunk to publish, the chunks
+   * before it are skipped
+   *
+   * @return
+   * - ESP_OK: every chunk was published and acknowledged
+   *
+   * - ESP_FAIL: a chunk failed to publish or wasn't acknowledged in time
+   *
+   */
+  esp_err_t publish_chunked(const char *topic, const char *key,
+                            const char *data, uint32_t len,
+                            uint32_t chunk_size = IMAGE_CHUNK_SIZE,
+                            const esp_mqtt5_user_property_item_t *header =
+                                nullptr,
+                            size_t header_count = 0,
+                            uint32_t first_chunk = 0);
+
+  /**
+   * @brief Starts accepting the acknowledgment of the header with the given
+   * timestamp, before the header is published
+   *
+   * An acknowledgment which arrives before wait_for_header_ack() is called is
+   * kept, e.g. when the server answers while a thumbnail is still being
+   * published.
+   *
+   * @param expected_timestamp The expected timestamp for the acknowledgment
+   *
+   */
+  void expect_header_ack(const char *expected_timestamp);
 
   /**
    * @brief Waits for an acknowledgment message with a
    * specific timestamp, which will be sent upon receiving the header message
    *
+   * The acknowledgment is the timestamp, optionally followed by ';' separated
+   * options: "keyframe=<id>" is the id of the keyframe the server holds,
+   * "chunks=<n>" is the number of leading chunks of the image it holds from
+   * an interrupted upload, and "request=full", "request=skip" or
+   * "request=roi:<x>,<y>,<w>,<h>" is the part of the image it wants after a
+   * progressive thumbnail, e.g.
+   * "<timestamp>;keyframe=<id>;request=roi:0,0,640,480"
+   *
    * @note This function blocks until the acknowledgment message is received or
-   * the timeout is reached
+   * the timeout is reached. If expect_header_ack() wasn't called with the same
+   * timestamp, it is called first.
    *
    * @param expected_timestamp The expected timestamp for the acknowledgment
    * @param timeout The timeout in milliseconds
+   * @param ack Set to the options of the acknowledgment, the defaults if it
+   * has none
    * @return
    *     - true : if the acknowledgment with the expected timestamp is received
    *
    *     - false : if the acknowledgment is not received within the timeout
    *
    */
-  bool wait_for_header_ack(const char *expected_timestamp, uint32_t timeout);
+  bool wait_for_header_ack(const char *expected_timestamp, uint32_t timeout,
+                           HeaderAck *ack = nullptr);
+
+  /**
+   * @brief Drops a configuration message received before the health report,
+   * e.g. an answer of an earlier wake which the broker kept for the session
+   *
+   * @note A dropped new configuration is still saved and loaded
+   *
+   */
+  void expect_config();
 
   /**
    * @brief Waits for a new configuration message
@@ -82,8 +252,10 @@ public:
   bool wait_for_config(uint32_t timeout);
 
   /**
-   * @brief Publishes the logs remotely to the MQTT broker, and locally to the
-   * ESP Monitor
+   * @brief Prints the logs to the ESP Monitor, and queues them for the log
+   * shipper task, which publishes them remotely
+   *
+   * @note This function never blocks, a line is dropped if the queue is full
    *
    * @param fmt The format string for the log message
    * @param args The arguments for the format string
@@ -92,6 +264,42 @@ public:
    */
   static int remote_log_handler(const char *fmt, va_list args);
 
+  /**
+   * @brief Publishes the queued log lines and waits until the MQTT outbox is
+   * empty, the later lines are only printed locally
+   *
+   * @note This function is called before the MQTT client is destroyed
+   *
+   * @param timeout The timeout in milliseconds
+   *
+   */
+  static void flush_logs(uint32_t timeout = LOG_FLUSH_TIMEOUT_MS);
+
+  /**
+   * @brief Starts the log budget and the log counters of a new cycle
+   *
+   * @note A boot starts the first cycle, this is called before every light
+   * sleep cycle, which runs on the same client
+   *
+   */
+  static void begin_cycle();
+
+  /**
+   * @return The number of log lines which were not published in this cycle,
+   * because the queue was full or the byte budget was spent
+   *
+   */
+  static uint32_t get_dropped_log_lines() {
+    return _log_ring.dropped() - _log_ring_dropped + _log_lines_over_budget;
+  }
+
+  /**
+   * @return The time the logging tasks spent in remote_log_handler() in this
+   * cycle, in microseconds
+   *
+   */
+  static uint32_t get_log_hook_us() { return _log_hook_us.load(); }
+
   /**
    * @return The health report topic
    *
@@ -105,10 +313,16 @@ public:
   const char *get_image_topic() { return _image_topic; }
 
   /**
-   * @return Whether a new configuration has been received
+   * @brief Loads the configuration received since the last call
+   *
+   * @note The configuration arrives on the MQTT event task, which only saves
+   * it, so the tasks reading the Config never see it change under them. It
+   * is loaded here, from the camera task, while no capture runs.
+   *
+   * @return Whether a new configuration was loaded
    *
    */
-  bool get_new_config_received() { return _new_config_received; }
+  static bool apply_new_config();
 
 private:
   /**
@@ -132,12 +346,81 @@ private:
    *
    * @param topic The topic to subscribe to
    *
+   * @return The message id of the subscription, or a negative value on
+   * failure
+   *
+   */
+  static int subscribe(const char *topic);
+
+  /**
+   * @brief Subscribes to the header acknowledgement and config topics, unless
+   * the broker resumed a session which has them already
+   *
+   * @note This function is called when the client is connected
+   *
+   * @param session_present The session present flag of the CONNACK
+   *
+   */
+  static void handle_connected(bool session_present);
+
+  /**
+   * @brief Marks the session as subscribed in RTC memory and releases the
+   * ready semaphore once both subscriptions are acknowledged
+   *
+   * @param msg_id The id of the acknowledged subscription
+   *
+   */
+  static void handle_subscribed(int msg_id);
+
+  /**
+   * @return A hash of the broker, client id and subscriptions, the session of
+   * the previous wake is only reused if it has the same hash
+   *
+   */
+  static uint32_t session_fingerprint();
+
+  /**
+   * @brief Publishes one chunk of a chunked message with its user properties
+   *
+   * @param topic The topic to publish the chunk to
+   * @param key The dedupe key of the chunked message
+   * @param data The chunk data
+   * @param len The length of the chunk data
+   * @param index The index of the chunk
+   * @param count The total number of chunks
+   * @param header Additional user properties of the chunk, or nullptr
+   * @param header_count The number of additional user properties
+   *
+   * @return The message id of the chunk, or a negative value on failure
+   *
+   */
+  static int publish_chunk(const char *topic, const char *key,
+                           const char *data, uint32_t len,
+                           uint32_t index, uint32_t count,
+                           const esp_mqtt5_user_property_item_t *header,
+                           size_t header_count);
+
+  /**
+   * @brief Forgets the chunks waiting for an acknowledgement and restores the
+   * in-flight window
+   *
+   */
+  static void reset_inflight();
+
+  /**
+   * @brief Releases a slot of the in-flight window if the acknowledged message
+   * is one of the pending chunks
+   *
+   * @note This function is called when a message is acknowledged by the broker
+   *
+   * @param msg_id The id of the acknowledged message
+   *
    */
-  static void subscribe(const char *topic);
+  static void handle_published(int msg_id);
 
   /**
    * @brief Compares the received timestamp with the expected timestamp, if they
-   * match it releases the header acknowledge semaphore
+   * match it stores the options and releases the header acknowledge semaphore
    *
    * @note This function is called when a header acknowledgment message is
    * received
@@ -149,14 +432,68 @@ private:
   static void handle_header_ack_message(const char *ack_msg, uint32_t len);
 
   /**
-   * @brief Validate, save and load the new configuration
+   * @brief Routed message handler of the imageAckTopic
+   *
+   */
+  static void handle_image_ack(const TopicRouter::Message &message);
+
+  /**
+   * @brief Routed message handler of the configTopic, answers the waiting
+   * wait_for_config() or loads the new configuration
+   *
+   */
+  static void handle_config_message(const TopicRouter::Message &message);
+
+  /**
+   * @brief Parses the ';' separated options of a header acknowledgment
+   *
+   * @param options The options following the timestamp, modified in place
+   * @param ack The parsed options, unknown or invalid options are ignored
+   *
+   * @return
+   *     - true : if every option was valid
+   *
+   *     - false : if an option was invalid
+   *
+   */
+  static bool parse_header_ack_options(char *options, HeaderAck &ack);
+
+  /**
+   * @brief Publishes the queued log lines in batches of up to LOG_BATCH_SIZE
+   * bytes until a flush is requested, the task ends after the flush
+   *
+   * @param pvParameters Unused
+   *
+   */
+  static void log_shipper_task(void *pvParameters);
+
+  /**
+   * @brief Moves the queued log lines into batches and publishes them, the
+   * lines over the byte budget are dropped
+   *
+   */
+  static void ship_logs();
+
+  /**
+   * @brief Publishes a batch of log lines at the log QoS
+   *
+   * @param len The length of the batch in _log_batch
+   * @param lines The number of lines in the batch
+   *
+   */
+  static void publish_log_batch(uint32_t len, uint32_t lines);
+
+  /**
+   * @brief Validate and save the new configuration, it is loaded by
+   * apply_new_config()
    *
    * @note This function is called when a new configuration message is received
    *
    * @param doc The JSON document containing the new configuration
+   * @param hash The hash of the configuration message, see Config::hash()
    *
    */
-  static void handle_new_config(JsonDocument &doc);
+  static void handle_new_config(JsonDocument &doc, uint32_t hash);
 
   static esp_mqtt_client_config_t _config;
   static esp_mqtt_client_handle_t _client;
@@ -168,11 +505,39 @@ private:
   static char _image_topic[NAME_SIZE];
   static char _imageack_topic[NAME_SIZE];
   static char _log_topic[NAME_SIZE];
-  static int _qos;
+  static char _client_id[NAME_SIZE];
+  static uint32_t _session_fingerprint;
+  static bool _session_resumed;
+  static int _subscription_ids[2];
+  static SemaphoreHandle_t _ready_semaphore;
   static int _error_count;
-  static bool _new_config_received;
+  static std::string _pending_config; /*!< empty if none was received */
+  static SemaphoreHandle_t _pending_config_mutex;
   static char _expected_timestamp[TIMESTAMP_SIZE];
+  static HeaderAck _header_ack;
   static SemaphoreHandle_t _ack_header_semaphore;
   static SemaphoreHandle_t _config_semaphore;
+  static SemaphoreHandle_t _publish_mutex;
+  static SemaphoreHandle_t _inflight_semaphore;
+  static int _inflight_ids[MAX_CHUNKS_IN_FLIGHT];
+  static constexpr int EARLY_ACK_COUNT = 8;
+  static int _early_acks[EARLY_ACK_COUNT];
+  static int _early_ack_index;
+  static portMUX_TYPE _inflight_lock;
   static bool _connected;
+  static LogRing _log_ring;
+  static TopicRouter _router;
+  static TaskHandle_t _log_shipper_handle;
+  static SemaphoreHandle_t _log_flushed;
+  static std::atomic<bool> _log_flush_requested;
+  static char _log_batch[LOG_BATCH_SIZE];
+  static int _log_qos;
+  static uint32_t _log_budget;
+  // Per cycle, reset by begin_cycle() while the shipper may count
+  static std::atomic<uint32_t> _log_bytes_shipped;
+  static std::atomic<uint32_t> _log_lines_shipped;
+  static std::atomic<uint32_t> _log_batches;
+  static std::atomic<uint32_t> _log_lines_over_budget;
+  static std::atomic<uint32_t> _log_hook_us;
+  static uint32_t _log_ring_dropped; /*!< dropped before the cycle */
 };
\ No newline at end of file
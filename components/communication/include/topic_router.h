@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Dispatches received MQTT messages to handlers by topic
+ *
+ * The routes are added once and then built into three tables, which are
+ * searched in order: the exact topics, sorted for a binary search, the topic
+ * filters with the MQTT wildcards '+' and '#', in the order they were added,
+ * and the topic prefixes, longest first. A topic is never matched by a
+ * shorter topic it starts with.
+ *
+ * A message which arrives in one piece is passed to its handler straight
+ * from the client's buffer. A message which the client delivers in several
+ * fragments is copied into one reassembly buffer, allocated when the tables
+ * are built, and passed on when its last fragment arrives.
+ */
+class TopicRouter {
+public:
+  static constexpr size_t TOPIC_SIZE = 128;
+
+  /**
+   * @brief A received message, the data is only valid during the handler
+   */
+  struct Message {
+    std::string_view topic;
+    const char *data;
+    size_t len;
+  };
+
+  using Handler = void (*)(const Message &message);
+
+  enum class Match {
+    EXACT,  /*!< the topic equals the pattern */
+    FILTER, /*!< the topic matches the pattern with '+' and '#' wildcards */
+    PREFIX, /*!< the topic starts with the pattern */
+  };
+
+  TopicRouter() = default;
+
+  TopicRouter(const TopicRouter &) = delete;
+  TopicRouter &operator=(const TopicRouter &) = delete;
+
+  /**
+   * @brief Adds a route, before build()
+   *
+   * @param match How the pattern is matched
+   * @param pattern The topic, filter or prefix, it must outlive the router
+   * @param handler The handler of the matching messages
+   *
+   * @return false if the router is built already or the pattern is empty
+   */
+  bool add(Match match, const char *pattern, Handler handler);
+
+  /**
+   * @brief Sorts the tables and allocates the reassembly buffer, the routes
+   * can't be changed afterwards
+   *
+   * @param buffer_size The largest fragmented message which is reassembled
+   *
+   * @return false if the buffer couldn't be allocated
+   */
+  bool build(size_t buffer_size);
+
+  /**
+   * @return Whether build() succeeded
+   */
+  bool is_built() const { return _built; }
+
+  /**
+   * @brief Passes a message or a fragment of it to the handler of its topic
+   *
+   * @param topic The topic, only given with the first fragment
+   * @param topic_len The length of the topic
+   * @param data The data of the fragment
+   * @param data_len The length of the fragment
+   * @param offset The offset of the fragment in the message
+   * @param total_len The length of the whole message
+   *
+   * @return false if the message has no route, or it was dropped because it
+   * didn't fit in the reassembly buffer or a fragment was missing
+   */
+  bool dispatch(const char *topic, size_t topic_len, const char *data,
+                size_t data_len, size_t offset, size_t total_len);
+
+  /**
+   * @brief Finds the handler of the topic
+   *
+   * @return The handler, or nullptr if no route matches
+   */
+  Handler find(std::string_view topic) const;
+
+  /**
+   * @brief Whether the topic matches an MQTT topic filter
+   */
+  static bool matches_filter(std::string_view filter, std::string_view topic);
+
+  /**
+   * @return The number of messages which were dropped while reassembled
+   */
+  uint32_t dropped() const { return _dropped; }
+
+private:
+  struct Route {
+    std::string_view pattern;
+    Handler handler;
+  };
+
+  /**
+   * @brief Passes the message to the handler of its topic
+   */
+  bool route(std::string_view topic, const char *data, size_t len) const;
+
+  std::vector<Route> _exact;
+  std::vector<Route> _filters;
+  std::vector<Route> _prefixes;
+  bool _built = false;
+
+  std::unique_ptr<char[]> _buffer;
+  size_t _buffer_size = 0;
+  char _topic[TOPIC_SIZE] = {0};
+  size_t _topic_len = 0;
+  size_t _total_len = 0;
+  size_t _received = 0;
+  bool _reassembling = false;
+  uint32_t _dropped = 0;
+};
@@ -1,9 +1,22 @@
 #pragma once
 
 #include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
 #include "freertos/event_groups.h"
 #include <string>
 
+/**
+ * @brief The time of the phases of the last connect(), in milliseconds
+ */
+struct WifiTiming {
+  bool fast = false;       /*!< the cached access point was reached */
+  bool static_ip = false;  /*!< the cached lease was reused, without DHCP */
+  uint32_t scan_ms = 0;    /*!< the scan for the SSID, 0 on the fast path */
+  uint32_t connect_ms = 0; /*!< authentication, association and key exchange */
+  uint32_t ip_ms = 0;      /*!< DHCP, or setting the cached address */
+};
+
 /**
  * @brief Handles WiFi connection
  */
@@ -16,13 +29,43 @@ public:
 
   /**
    * @brief Connects to the WiFi
+   *
+   * The BSSID and channel of the last access point and the last DHCP lease
+   * are kept in RTC memory. If they are known, the cached access point is
+   * associated on its channel without a scan, and the cached address is set
+   * instead of running DHCP while the lease is younger than LEASE_REUSE_S.
+   * If that fails within FAST_CONNECT_TIMEOUT_MS, the cache is dropped and
+   * the SSID is scanned on all channels, and the address comes from DHCP.
+   *
+   * @return false if the access point wasn't reached within 15 seconds
+   */
+  bool connect();
+
+  /**
+   * @brief Drops the cached access point and lease, so the next connect()
+   * scans and runs DHCP, e.g. when the broker wasn't reachable with the
+   * cached address
    */
-  void connect();
+  static void forget_connection();
 
   /**
-   * @brief Syncs the time with a remote NTP server
+   * @return true if the station is associated and has an address
    */
-  void sync_time();
+  static bool is_connected();
+
+  /**
+   * @brief Switches the modem power save. The maximum keeps the association
+   * through a light sleep, waking up for every LISTEN_INTERVAL-th beacon,
+   * the minimum keeps the upload fast.
+   *
+   * @param max true for the maximum power save, false for the minimum
+   */
+  static void set_power_save(bool max);
+
+  /**
+   * @return The time of the phases of the last connect()
+   */
+  static const WifiTiming &get_timing() { return _timing; }
 
 private:
   /**
@@ -36,7 +79,51 @@ private:
   static void eventHandler(void *arg, esp_event_base_t event_base,
                            int32_t event_id, void *event_data);
 
+  /**
+   * @brief Associates the cached access point on its channel, and sets the
+   * cached address if the lease is recent
+   *
+   * @return false if the address wasn't set within FAST_CONNECT_TIMEOUT_MS
+   */
+  bool connect_fast(wifi_config_t &wifi_config);
+
+  /**
+   * @brief Scans for the SSID, associates the strongest access point and
+   * runs DHCP
+   *
+   * @return false if the address wasn't set within CONNECT_TIMEOUT_MS
+   */
+  bool connect_full(wifi_config_t &wifi_config);
+
+  /**
+   * @brief Starts the association and waits for the address
+   *
+   * @param timeout The timeout in milliseconds
+   * @param start The esp_timer time of the start of the connect phase
+   *
+   * @return false if the association failed or timed out
+   */
+  bool associate(wifi_config_t &wifi_config, uint32_t timeout, int64_t start);
+
+  /**
+   * @brief Caches the access point and the lease in RTC memory
+   */
+  void save_connection();
+
+  static constexpr uint32_t CONNECT_TIMEOUT_MS{15000};
+  static constexpr uint32_t FAST_CONNECT_TIMEOUT_MS{3000};
+  // Beacons the station sleeps through in the maximum modem power save
+  static constexpr uint16_t LISTEN_INTERVAL{3};
+  // The leases of common routers last 12 hours or more
+  static constexpr int64_t LEASE_REUSE_S{6 * 60 * 60};
+
   static EventGroupHandle_t _wifi_event_group;
   static const int WIFI_CONNECTED_BIT = BIT0;
+  static const int WIFI_ASSOCIATED_BIT = BIT1;
+  static const int WIFI_DISCONNECTED_BIT = BIT2;
   static bool _connected;
+  static esp_netif_t *_netif;
+  static WifiTiming _timing;
+  static int64_t _associated_us;
+  static int64_t _got_ip_us;
 };
\ No newline at end of file
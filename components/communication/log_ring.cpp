@@ -0,0 +1,61 @@
+#include "log_ring.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+LogRing::LogRing() {
+  for (size_t i = 0; i < SLOTS; i++) {
+    _slots[i].sequence.store(static_cast<uint32_t>(i),
+                             std::memory_order_relaxed);
+  }
+}
+
+bool LogRing::append(const char *fmt, va_list args) {
+  uint32_t position = _head.load(std::memory_order_relaxed);
+  Slot *slot = nullptr;
+  while (true) {
+    slot = &_slots[position & (SLOTS - 1)];
+    uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+    int32_t lag = static_cast<int32_t>(sequence - position);
+    if (lag == 0) {
+      // On failure position is reloaded with the current head
+      if (_head.compare_exchange_weak(position, position + 1,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (lag < 0) {
+      // The consumer hasn't read the line written SLOTS positions ago
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      position = _head.load(std::memory_order_relaxed);
+    }
+  }
+
+  int length = vsnprintf(slot->text, LINE_SIZE, fmt, args);
+  slot->length = static_cast<uint16_t>(
+      std::min(static_cast<size_t>(std::max(length, 0)), LINE_SIZE - 1));
+  slot->sequence.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+size_t LogRing::pop(char *line, size_t size) {
+  Slot &slot = _slots[_tail & (SLOTS - 1)];
+  if (slot.sequence.load(std::memory_order_acquire) != _tail + 1) {
+    return 0;
+  }
+  size_t length = std::min(static_cast<size_t>(slot.length), size);
+  memcpy(line, slot.text, length);
+  // The slot is free for the producer one lap ahead
+  slot.sequence.store(_tail + SLOTS, std::memory_order_release);
+  _tail++;
+  return length;
+}
+
+size_t LogRing::peek_length() const {
+  const Slot &slot = _slots[_tail & (SLOTS - 1)];
+  if (slot.sequence.load(std::memory_order_acquire) != _tail + 1) {
+    return 0;
+  }
+  return slot.length;
+}
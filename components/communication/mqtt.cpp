@@ -1,11 +1,39 @@
 #include "mqtt.h"
 #include "config.h"
 #include "error_handler.h"
+#include "esp_attr.h"
 #include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "rtc_budget.h"
 #include "storage.h"
+#include <algorithm>
 
 constexpr auto *TAG = "MQTT";
 
+/**
+ * @brief The session the broker keeps during deep sleep, kept in RTC memory
+ */
+struct SessionState {
+  uint32_t fingerprint; /*!< 0 if the session has no subscriptions */
+};
+RTC_SLOW_ATTR static SessionState s_session;
+static_assert(sizeof(s_session) <= rtc_budget::MQTT_SESSION,
+              "The session state doesn't fit into its RTC memory");
+
+namespace {
+
+// FNV-1a, the terminating zero separates the strings
+uint32_t hash_string(uint32_t hash, const char *text) {
+  do {
+    hash = (hash ^ static_cast<uint8_t>(*text)) * 16777619u;
+  } while (*text++ != '\0');
+  return hash;
+}
+
+} // namespace
+
 esp_mqtt_client_config_t MQTT::_config;
 esp_mqtt_client_handle_t MQTT::_client;
 char MQTT::_uri[NAME_SIZE] = {0};
@@ -16,19 +44,46 @@ char MQTT::_health_report_topic[NAME_SIZE] = {0};
 char MQTT::_imageack_topic[NAME_SIZE] = {0};
 char MQTT::_log_topic[NAME_SIZE] = {0};
 char MQTT::_image_topic[NAME_SIZE] = {0};
-bool MQTT::_new_config_received = false;
-int MQTT::_qos = 2;
+char MQTT::_client_id[NAME_SIZE] = {0};
+uint32_t MQTT::_session_fingerprint = 0;
+bool MQTT::_session_resumed = false;
+int MQTT::_subscription_ids[2] = {0};
+SemaphoreHandle_t MQTT::_ready_semaphore = xSemaphoreCreateBinary();
+std::string MQTT::_pending_config;
+SemaphoreHandle_t MQTT::_pending_config_mutex = xSemaphoreCreateMutex();
 int MQTT::_error_count = 0;
 char MQTT::_expected_timestamp[TIMESTAMP_SIZE];
+HeaderAck MQTT::_header_ack;
 SemaphoreHandle_t MQTT::_ack_header_semaphore = xSemaphoreCreateBinary();
 SemaphoreHandle_t MQTT::_config_semaphore = xSemaphoreCreateBinary();
+SemaphoreHandle_t MQTT::_publish_mutex = xSemaphoreCreateRecursiveMutex();
+SemaphoreHandle_t MQTT::_inflight_semaphore =
+    xSemaphoreCreateCounting(MAX_CHUNKS_IN_FLIGHT, MAX_CHUNKS_IN_FLIGHT);
+int MQTT::_inflight_ids[MAX_CHUNKS_IN_FLIGHT] = {0};
+int MQTT::_early_acks[EARLY_ACK_COUNT] = {0};
+int MQTT::_early_ack_index = 0;
+portMUX_TYPE MQTT::_inflight_lock = portMUX_INITIALIZER_UNLOCKED;
 bool MQTT::_connected = false;
+LogRing MQTT::_log_ring;
+TopicRouter MQTT::_router;
+TaskHandle_t MQTT::_log_shipper_handle = nullptr;
+SemaphoreHandle_t MQTT::_log_flushed = xSemaphoreCreateBinary();
+std::atomic<bool> MQTT::_log_flush_requested{false};
+char MQTT::_log_batch[LOG_BATCH_SIZE] = {0};
+int MQTT::_log_qos = 1;
+uint32_t MQTT::_log_budget = 0;
+std::atomic<uint32_t> MQTT::_log_bytes_shipped{0};
+std::atomic<uint32_t> MQTT::_log_lines_shipped{0};
+std::atomic<uint32_t> MQTT::_log_batches{0};
+std::atomic<uint32_t> MQTT::_log_lines_over_budget{0};
+std::atomic<uint32_t> MQTT::_log_hook_us{0};
+uint32_t MQTT::_log_ring_dropped = 0;
 
 MQTT::MQTT() {
   set_mqtt_deinit_callback([]() {
+    // Publishes the last lines before sleep, and disables the MQTT log handler
+    flush_logs();
     _connected = false;
-    // Disable the MQTT log handler
-    esp_log_set_vprintf(vprintf);
     esp_mqtt_client_destroy(_client);
   });
 
@@ -58,6 +113,13 @@ MQTT::MQTT() {
   }
   // -------------------------------------------------------------------------
 
+  // The broker finds the session of the previous wake by the client id
+  uint8_t mac[6] = {0};
+  esp_read_mac(mac, ESP_MAC_WIFI_STA);
+  snprintf(_client_id, sizeof(_client_id), "cam-%02x%02x%02x%02x%02x%02x",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  _session_fingerprint = session_fingerprint();
+
   _config = {
       .broker =
           {
@@ -67,27 +129,138 @@ MQTT::MQTT() {
                   },
           },
       .credentials = {.username = _username,
+                      .client_id = _client_id,
                       .authentication =
                           {
                               .password = _password,
                           }},
       .session =
           {
+              .disable_clean_session = true,
               .protocol_ver = MQTT_PROTOCOL_V_5,
           },
   };
 }
 
 int MQTT::remote_log_handler(const char *fmt, va_list args) {
+  int64_t start = esp_timer_get_time();
+  va_list remote_args;
+  va_copy(remote_args, args);
   // logs to the serial output
-  vprintf(fmt, args);
-  // assembles the remote log message
-  char logBuff[LOG_SIZE] = {0};
-  int size = vsnprintf(logBuff, LOG_SIZE, fmt, args);
-  esp_mqtt_client_publish(_client, _log_topic, logBuff, size, _qos, 0);
+  int size = vprintf(fmt, args);
+  // Never wait here: the publish happens in the shipper task, so a logging
+  // task isn't held up by the broker, and the MQTT task can log as well
+  if (_log_ring.append(fmt, remote_args) && _log_shipper_handle != nullptr) {
+    xTaskNotifyGive(_log_shipper_handle);
+  }
+  va_end(remote_args);
+  _log_hook_us.fetch_add(static_cast<uint32_t>(esp_timer_get_time() - start),
+                         std::memory_order_relaxed);
   return size;
 }
 
+void MQTT::log_shipper_task(void *pvParameters) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    // The log handler is already disabled when a flush is requested, so the
+    // drain below takes the last lines
+    bool flush = _log_flush_requested.load();
+    if (!flush) {
+      // Lets the lines of a burst gather into one batch
+      vTaskDelay(pdMS_TO_TICKS(LOG_LINGER_MS));
+    }
+    ship_logs();
+    if (flush) {
+      break;
+    }
+  }
+  // The client is destroyed after the flush
+  _log_shipper_handle = nullptr;
+  xSemaphoreGive(_log_flushed);
+  vTaskDelete(NULL);
+}
+
+void MQTT::ship_logs() {
+  uint32_t len = 0;
+  uint32_t lines = 0;
+  for (size_t length = _log_ring.peek_length(); length > 0;
+       length = _log_ring.peek_length()) {
+    if (_log_bytes_shipped + len + length > _log_budget) {
+      char discarded[LogRing::LINE_SIZE];
+      _log_ring.pop(discarded, sizeof(discarded));
+      _log_lines_over_budget++;
+      continue;
+    }
+    if (len + length > LOG_BATCH_SIZE) {
+      publish_log_batch(len, lines);
+      len = 0;
+      lines = 0;
+    }
+    len += _log_ring.pop(_log_batch + len, LOG_BATCH_SIZE - len);
+    lines++;
+  }
+  publish_log_batch(len, lines);
+}
+
+void MQTT::publish_log_batch(uint32_t len, uint32_t lines) {
+  if (len == 0) {
+    return;
+  }
+  xSemaphoreTakeRecursive(_publish_mutex, portMAX_DELAY);
+  int ret =
+      esp_mqtt_client_publish(_client, _log_topic, _log_batch, len, _log_qos, 0);
+  xSemaphoreGiveRecursive(_publish_mutex);
+  // The budget counts the attempts, so a broken link doesn't retry forever
+  _log_bytes_shipped += len;
+  if (ret >= 0) {
+    _log_lines_shipped += lines;
+    _log_batches++;
+  }
+}
+
+void MQTT::begin_cycle() {
+  LogShippingConfig log_shipping = Config::get_log_shipping();
+  _log_qos = log_shipping.qos;
+  _log_budget = log_shipping.budget;
+  _log_bytes_shipped = 0;
+  _log_lines_shipped = 0;
+  _log_batches = 0;
+  _log_lines_over_budget = 0;
+  _log_hook_us = 0;
+  _log_ring_dropped = _log_ring.dropped();
+}
+
+void MQTT::flush_logs(uint32_t timeout) {
+  if (_log_shipper_handle == nullptr) {
+    esp_log_set_vprintf(vprintf);
+    return;
+  }
+  ESP_LOGI(TAG,
+           "Logs: %lu lines in %lu batches, %lu dropped (%lu queue full, %lu "
+           "over budget), %lu us in the log hook",
+           _log_lines_shipped.load(), _log_batches.load(),
+           get_dropped_log_lines(), _log_ring.dropped() - _log_ring_dropped,
+           _log_lines_over_budget.load(), _log_hook_us.load());
+  // The later lines are printed locally only
+  esp_log_set_vprintf(vprintf);
+
+  int64_t deadline = esp_timer_get_time() + timeout * 1000LL;
+  _log_flush_requested = true;
+  xTaskNotifyGive(_log_shipper_handle);
+  bool flushed = xSemaphoreTake(_log_flushed, pdMS_TO_TICKS(timeout)) == pdTRUE;
+  // The QoS 1 and 2 batches stay in the outbox until the broker acknowledges
+  while (flushed && esp_mqtt_client_get_outbox_size(_client) > 0) {
+    if (esp_timer_get_time() >= deadline) {
+      flushed = false;
+      break;
+    }
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  if (!flushed) {
+    ESP_LOGW(TAG, "The logs were not flushed in %lu ms", timeout);
+  }
+}
+
 void MQTT::event_handler(void *handler_args, esp_event_base_t base,
                          int32_t event_id, void *event_data) {
   esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)event_data;
@@ -95,44 +268,31 @@ void MQTT::event_handler(void *handler_args, esp_event_base_t base,
   case MQTT_EVENT_CONNECTED:
     // Enable the MQTT log handler
     esp_log_set_vprintf(remote_log_handler);
-    // Subscribe to topics
-    subscribe(_imageack_topic);
-    subscribe(_config_topic);
+    handle_connected(event->session_present);
     break;
   case MQTT_EVENT_DISCONNECTED:
+    // wait_for_ready() waits for the reconnection
+    xSemaphoreTake(_ready_semaphore, 0);
     if (_connected) {
       esp_mqtt_client_reconnect(_client);
       vTaskDelay(pdMS_TO_TICKS(100));
     }
     break;
   case MQTT_EVENT_SUBSCRIBED:
+    handle_subscribed(event->msg_id);
     break;
   case MQTT_EVENT_UNSUBSCRIBED:
     break;
   case MQTT_EVENT_PUBLISHED:
+    handle_published(event->msg_id);
     break;
   case MQTT_EVENT_DATA:
-    if (strncmp(event->topic, _imageack_topic, event->topic_len) == 0) {
-      handle_header_ack_message(event->data, event->data_len);
-    }
-
-    if (strncmp(event->topic, _config_topic, event->topic_len) == 0) {
-      JsonDocument config;
-      DeserializationError error =
-          deserializeJson(config, event->data, event->data_len);
-      if (error) {
-        ESP_LOGE(TAG, "Error receiving the new config");
-        ESP_LOGE(TAG, "Error parsing JSON: %s", error.c_str());
-        return;
-      }
-
-      if (config.as<std::string>() == "config-ok") {
-        _new_config_received = false;
-        xSemaphoreGive(_config_semaphore);
-        ESP_LOGI(TAG, "Received config-ok message!");
-      } else {
-        handle_new_config(config);
-      }
+    if (!_router.dispatch(event->topic, event->topic_len, event->data,
+                          event->data_len, event->current_data_offset,
+                          event->total_data_len) &&
+        event->current_data_offset == 0) {
+      ESP_LOGW(TAG, "Dropped a message of %d bytes on %.*s",
+               event->total_data_len, event->topic_len, event->topic);
     }
     break;
   case MQTT_EVENT_ERROR:
@@ -151,7 +311,34 @@ void MQTT::event_handler(void *handler_args, esp_event_base_t base,
 }
 
 void MQTT::start() {
+  // The routes only depend on the static config
+  if (!_router.is_built()) {
+    _router.add(TopicRouter::Match::EXACT, _imageack_topic, handle_image_ack);
+    _router.add(TopicRouter::Match::EXACT, _config_topic,
+                handle_config_message);
+    if (!_router.build(MAX_FRAGMENTED_MESSAGE_SIZE)) {
+      ESP_LOGE(TAG, "Failed to allocate the message buffer");
+      restart();
+    }
+  }
+
+  LogShippingConfig log_shipping = Config::get_log_shipping();
+  _log_qos = log_shipping.qos;
+  _log_budget = log_shipping.budget;
+  if (_log_shipper_handle == nullptr &&
+      xTaskCreate(log_shipper_task, "log_shipper", 4096, NULL, 1,
+                  &_log_shipper_handle) != pdPASS) {
+    ESP_LOGE(TAG, "Failed to create log shipper task");
+    restart();
+  }
+
   _client = esp_mqtt_client_init(&_config);
+  esp_mqtt5_connection_property_config_t connect_property = {};
+  connect_property.session_expiry_interval = SESSION_EXPIRY_S;
+  if (esp_mqtt5_client_set_connect_property(_client, &connect_property) !=
+      ESP_OK) {
+    ESP_LOGW(TAG, "Failed to set the session expiry interval");
+  }
   esp_mqtt_client_register_event(_client, (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID,
                                  event_handler, NULL);
   if (esp_mqtt_client_start(_client) != ESP_OK) {
@@ -161,9 +348,12 @@ void MQTT::start() {
   _connected = true;
 }
 
-esp_err_t MQTT::publish(const char *topic, const char *data, uint32_t len) {
-  uint32_t ret =
-      esp_mqtt_client_publish(_client, topic, data, len, _qos, false);
+esp_err_t MQTT::publish(const char *topic, const char *data, uint32_t len,
+                         MessageKind kind) {
+  xSemaphoreTakeRecursive(_publish_mutex, portMAX_DELAY);
+  int ret =
+      esp_mqtt_client_publish(_client, topic, data, len, qos_for(kind), false);
+  xSemaphoreGiveRecursive(_publish_mutex);
   if (ret == -1 || ret == -2) {
     return ESP_FAIL;
   } else {
@@ -171,36 +361,334 @@ esp_err_t MQTT::publish(const char *topic, const char *data, uint32_t len) {
   }
 }
 
-void MQTT::subscribe(const char *topic) {
-  esp_mqtt_client_subscribe(_client, topic, _qos);
+esp_err_t MQTT::publish_chunked(const char *topic, const char *key,
+                                const char *data, uint32_t len,
+                                uint32_t chunk_size,
+                                const esp_mqtt5_user_property_item_t *header,
+                                size_t header_count, uint32_t first_chunk) {
+  if (chunk_size == 0) {
+    ESP_LOGE(TAG, "Invalid chunk size!");
+    return ESP_FAIL;
+  }
+  if (header_count > MAX_HEADER_PROPERTIES) {
+    ESP_LOGE(TAG, "Too many header properties!");
+    return ESP_FAIL;
+  }
+  if (strlen(key) >= KEY_SIZE) {
+    ESP_LOGE(TAG, "Chunk key %s is too long!", key);
+    return ESP_FAIL;
+  }
+  uint32_t count = (len + chunk_size - 1) / chunk_size;
+  // The chunks of an interrupted publish may never be acknowledged
+  reset_inflight();
+
+  for (uint32_t index = first_chunk; index < count; index++) {
+    // Wait for a free slot in the in-flight window
+    if (xSemaphoreTake(_inflight_semaphore,
+                       pdMS_TO_TICKS(CHUNK_PUBLISH_TIMEOUT_MS)) != pdTRUE) {
+      ESP_LOGE(TAG, "Chunk %lu/%lu was not acknowledged in time!", index,
+               count);
+      return ESP_FAIL;
+    }
+
+    uint32_t offset = index * chunk_size;
+    uint32_t size = std::min(chunk_size, len - offset);
+    int msg_id = publish_chunk(topic, key, data + offset, size, index, count,
+                               index == 0 ? header : nullptr,
+                               index == 0 ? header_count : 0);
+    if (msg_id < 0) {
+      xSemaphoreGive(_inflight_semaphore);
+      ESP_LOGE(TAG, "Failed to publish chunk %lu/%lu!", index, count);
+      return ESP_FAIL;
+    }
+  }
+
+  // Wait until every chunk is acknowledged, then restore the window
+  for (int i = 0; i < MAX_CHUNKS_IN_FLIGHT; i++) {
+    if (xSemaphoreTake(_inflight_semaphore,
+                       pdMS_TO_TICKS(CHUNK_PUBLISH_TIMEOUT_MS)) != pdTRUE) {
+      ESP_LOGE(TAG, "The last chunks were not acknowledged in time!");
+      for (int j = 0; j < i; j++) {
+        xSemaphoreGive(_inflight_semaphore);
+      }
+      return ESP_FAIL;
+    }
+  }
+  for (int i = 0; i < MAX_CHUNKS_IN_FLIGHT; i++) {
+    xSemaphoreGive(_inflight_semaphore);
+  }
+
+  if (first_chunk > 0) {
+    ESP_LOGI(TAG, "Published %lu bytes from chunk %lu/%lu", len, first_chunk,
+             count);
+  } else {
+    ESP_LOGI(TAG, "Published %lu bytes in %lu chunks", len, count);
+  }
+  return ESP_OK;
 }
 
-bool MQTT::wait_for_header_ack(const char *timestamp, uint32_t timeout) {
+int MQTT::publish_chunk(const char *topic, const char *key, const char *data,
+                        uint32_t len, uint32_t index, uint32_t count,
+                        const esp_mqtt5_user_property_item_t *header,
+                        size_t header_count) {
+  char index_str[11] = {0};
+  char count_str[11] = {0};
+  char crc_str[9] = {0};
+  snprintf(index_str, sizeof(index_str), "%lu", index);
+  snprintf(count_str, sizeof(count_str), "%lu", count);
+  snprintf(crc_str, sizeof(crc_str), "%08lx",
+           esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(data), len));
+  esp_mqtt5_user_property_item_t properties[4 + MAX_HEADER_PROPERTIES] = {
+      {"chunk", index_str},
+      {"chunks", count_str},
+      {"crc", crc_str},
+      {"image", key},
+  };
+  std::copy(header, header + header_count, properties + 4);
+
+  xSemaphoreTakeRecursive(_publish_mutex, portMAX_DELAY);
+  // The publish properties only apply to the next publish, the mutex keeps
+  // other publishers from taking them
+  esp_mqtt5_publish_property_config_t publish_property = {};
+  esp_mqtt5_client_set_user_property(&publish_property.user_property,
+                                     properties, 4 + header_count);
+  esp_mqtt5_client_set_publish_property(_client, &publish_property);
+  esp_mqtt5_client_delete_user_property(publish_property.user_property);
+
+  int msg_id = esp_mqtt_client_publish(
+      _client, topic, data, len, qos_for(MessageKind::IMAGE_CHUNK), false);
+  bool acknowledged = (msg_id == 0); // QoS 0 messages are never acknowledged
+  if (msg_id > 0) {
+    // The acknowledgement may have arrived before the id was registered
+    taskENTER_CRITICAL(&_inflight_lock);
+    for (int &id : _early_acks) {
+      if (id == msg_id) {
+        id = 0;
+        acknowledged = true;
+        break;
+      }
+    }
+    if (!acknowledged) {
+      for (int &id : _inflight_ids) {
+        if (id == 0) {
+          id = msg_id;
+          break;
+        }
+      }
+    }
+    taskEXIT_CRITICAL(&_inflight_lock);
+  }
+  xSemaphoreGiveRecursive(_publish_mutex);
+
+  if (acknowledged) {
+    xSemaphoreGive(_inflight_semaphore);
+  }
+  return msg_id;
+}
+
+void MQTT::handle_published(int msg_id) {
+  bool pending_chunk = false;
+  taskENTER_CRITICAL(&_inflight_lock);
+  for (int &id : _inflight_ids) {
+    if (id == msg_id) {
+      id = 0;
+      pending_chunk = true;
+      break;
+    }
+  }
+  if (!pending_chunk) {
+    _early_acks[_early_ack_index] = msg_id;
+    _early_ack_index = (_early_ack_index + 1) % EARLY_ACK_COUNT;
+  }
+  taskEXIT_CRITICAL(&_inflight_lock);
+
+  if (pending_chunk) {
+    xSemaphoreGive(_inflight_semaphore);
+  }
+}
+
+void MQTT::reset_inflight() {
+  taskENTER_CRITICAL(&_inflight_lock);
+  std::fill(std::begin(_inflight_ids), std::end(_inflight_ids), 0);
+  taskEXIT_CRITICAL(&_inflight_lock);
+  while (xSemaphoreTake(_inflight_semaphore, 0) == pdTRUE) {
+  }
+  for (int i = 0; i < MAX_CHUNKS_IN_FLIGHT; i++) {
+    xSemaphoreGive(_inflight_semaphore);
+  }
+}
+
+bool MQTT::wait_for_ready(uint32_t timeout) {
+  if (xSemaphoreTake(_ready_semaphore, pdMS_TO_TICKS(timeout)) != pdTRUE) {
+    return false;
+  }
+  // Later calls return at once
+  xSemaphoreGive(_ready_semaphore);
+  return true;
+}
+
+int MQTT::subscribe(const char *topic) {
+  return esp_mqtt_client_subscribe(_client, topic,
+                                   qos_for(MessageKind::CONTROL));
+}
+
+void MQTT::handle_connected(bool session_present) {
+  // The broker had the session of the previous wake, and it was subscribed
+  // to the same topics
+  if (session_present && s_session.fingerprint == _session_fingerprint) {
+    _session_resumed = true;
+    ESP_LOGI(TAG, "Resumed the MQTT session, not subscribing");
+    xSemaphoreGive(_ready_semaphore);
+    return;
+  }
+
+  s_session.fingerprint = 0;
+  _subscription_ids[0] = subscribe(_imageack_topic);
+  _subscription_ids[1] = subscribe(_config_topic);
+  if (_subscription_ids[0] < 0 || _subscription_ids[1] < 0) {
+    ESP_LOGE(TAG, "Failed to subscribe to the topics!");
+  }
+}
+
+void MQTT::handle_subscribed(int msg_id) {
+  bool pending = false;
+  for (int &id : _subscription_ids) {
+    if (id == msg_id) {
+      id = 0;
+    }
+    pending |= id != 0;
+  }
+  if (!pending) {
+    s_session.fingerprint = _session_fingerprint;
+    xSemaphoreGive(_ready_semaphore);
+  }
+}
+
+uint32_t MQTT::session_fingerprint() {
+  uint32_t hash = 2166136261u;
+  for (const char *text : {_uri, _username, _client_id, _imageack_topic,
+                           _config_topic}) {
+    hash = hash_string(hash, text);
+  }
+  hash = (hash ^ static_cast<uint32_t>(qos_for(MessageKind::CONTROL))) *
+         16777619u;
+  // 0 marks a session without subscriptions
+  return hash != 0 ? hash : 1;
+}
+
+void MQTT::expect_header_ack(const char *timestamp) {
   snprintf(_expected_timestamp, sizeof(_expected_timestamp), "%s", timestamp);
-  return xSemaphoreTake(_ack_header_semaphore, pdMS_TO_TICKS(timeout)) ==
-         pdTRUE;
+  _header_ack = HeaderAck();
+  // Drop a stale acknowledgement of an earlier header
+  xSemaphoreTake(_ack_header_semaphore, 0);
+}
+
+bool MQTT::wait_for_header_ack(const char *timestamp, uint32_t timeout,
+                               HeaderAck *ack) {
+  if (strcmp(_expected_timestamp, timestamp) != 0) {
+    expect_header_ack(timestamp);
+  }
+  bool received = xSemaphoreTake(_ack_header_semaphore,
+                                 pdMS_TO_TICKS(timeout)) == pdTRUE;
+  // A resent header has to be expected again
+  _expected_timestamp[0] = '\0';
+  if (ack != nullptr) {
+    *ack = _header_ack;
+  }
+  return received;
 }
 
 void MQTT::handle_header_ack_message(const char *ack_msg, uint32_t len) {
-  if (len > TIMESTAMP_SIZE) {
-    ESP_LOGE(TAG, "Received timestamp is too long!");
+  if (len >= ACK_SIZE) {
+    ESP_LOGE(TAG, "Received acknowledgement is too long!");
     return;
   }
-  char received_timestamp[TIMESTAMP_SIZE] = {0};
-  strncpy(received_timestamp, ack_msg, len);
+  char received[ACK_SIZE] = {0};
+  strncpy(received, ack_msg, len);
+
+  // "<timestamp>" or "<timestamp>;<option>;<option>..."
+  HeaderAck ack;
+  char *separator = strchr(received, ';');
+  if (separator != nullptr) {
+    *separator = '\0';
+    if (!parse_header_ack_options(separator + 1, ack)) {
+      ESP_LOGW(TAG, "Invalid option in acknowledgement of %s", received);
+    }
+  }
 
-  if (strcmp(received_timestamp, _expected_timestamp) == 0) {
+  if (strcmp(received, _expected_timestamp) == 0) {
+    _header_ack = ack;
     xSemaphoreGive(_ack_header_semaphore);
     ESP_LOGI(TAG, "Received matching acknowledgement timestamp: %s",
-             received_timestamp);
+             received);
   } else {
     ESP_LOGE(TAG, "Received non-matching timestamp!");
-    ESP_LOGE(TAG, "Received timestamp: %s", received_timestamp);
+    ESP_LOGE(TAG, "Received timestamp: %s", received);
     ESP_LOGE(TAG, "Expected timestamp: %s", _expected_timestamp);
   }
 }
 
-void MQTT::handle_new_config(JsonDocument &doc) {
+void MQTT::handle_image_ack(const TopicRouter::Message &message) {
+  handle_header_ack_message(message.data, message.len);
+}
+
+void MQTT::handle_config_message(const TopicRouter::Message &message) {
+  JsonDocument config;
+  DeserializationError error =
+      deserializeJson(config, message.data, message.len);
+  if (error) {
+    ESP_LOGE(TAG, "Error receiving the new config");
+    ESP_LOGE(TAG, "Error parsing JSON: %s", error.c_str());
+    return;
+  }
+
+  // The retained config is delivered again on every subscription, it is
+  // only loaded if it changed
+  uint32_t hash = Config::hash(message.data, message.len);
+  if (config.as<std::string>() == "config-ok") {
+    xSemaphoreGive(_config_semaphore);
+    ESP_LOGI(TAG, "Received config-ok message!");
+  } else if (hash == Config::get_hash()) {
+    xSemaphoreGive(_config_semaphore);
+    ESP_LOGI(TAG, "Received the current config %08lx", hash);
+  } else {
+    handle_new_config(config, hash);
+  }
+}
+
+bool MQTT::parse_header_ack_options(char *options, HeaderAck &ack) {
+  bool valid = true;
+  char *save = nullptr;
+  for (char *option = strtok_r(options, ";", &save); option != nullptr;
+       option = strtok_r(nullptr, ";", &save)) {
+    unsigned long keyframe_id = 0;
+    unsigned long chunks = 0;
+    unsigned int x = 0, y = 0, w = 0, h = 0;
+    if (sscanf(option, "keyframe=%lu", &keyframe_id) == 1) {
+      ack.keyframe_id = static_cast<uint32_t>(keyframe_id);
+    } else if (sscanf(option, "chunks=%lu", &chunks) == 1) {
+      ack.chunks = static_cast<uint32_t>(chunks);
+    } else if (strcmp(option, "request=full") == 0) {
+      ack.request = HeaderAck::Request::FULL;
+    } else if (strcmp(option, "request=skip") == 0) {
+      ack.request = HeaderAck::Request::SKIP;
+    } else if (sscanf(option, "request=roi:%u,%u,%u,%u", &x, &y, &w, &h) == 4 &&
+               w > 0 && h > 0 && x <= UINT16_MAX && y <= UINT16_MAX &&
+               w <= UINT16_MAX && h <= UINT16_MAX) {
+      ack.request = HeaderAck::Request::ROI;
+      ack.roi_x = static_cast<uint16_t>(x);
+      ack.roi_y = static_cast<uint16_t>(y);
+      ack.roi_width = static_cast<uint16_t>(w);
+      ack.roi_height = static_cast<uint16_t>(h);
+    } else {
+      ESP_LOGW(TAG, "Unknown acknowledgement option: %s", option);
+      valid = false;
+    }
+  }
+  return valid;
+}
+
+void MQTT::handle_new_config(JsonDocument &doc, uint32_t hash) {
   if (Config::validate(doc)) {
     std::string config;
     serializeJson(doc, config);
@@ -211,15 +699,38 @@ void MQTT::handle_new_config(JsonDocument &doc) {
       restart();
     }
 
-    Config::load_config(doc);
-    ESP_LOGI(TAG, "New config loaded!");
-    _new_config_received = true;
+    if (Config::save_hash(hash) != ESP_OK) {
+      ESP_LOGW(TAG, "Failed to save the config hash");
+    }
+    xSemaphoreTake(_pending_config_mutex, portMAX_DELAY);
+    _pending_config = std::move(config);
+    xSemaphoreGive(_pending_config_mutex);
+    ESP_LOGI(TAG, "New config %08lx received!", hash);
   } else {
     ESP_LOGE(TAG, "Invalid config received!");
   }
   xSemaphoreGive(_config_semaphore);
 }
 
+bool MQTT::apply_new_config() {
+  std::string config;
+  xSemaphoreTake(_pending_config_mutex, portMAX_DELAY);
+  config.swap(_pending_config);
+  xSemaphoreGive(_pending_config_mutex);
+  if (config.empty()) {
+    return false;
+  }
+
+  // Validated when it was received
+  JsonDocument doc;
+  deserializeJson(doc, config);
+  Config::load_config(doc);
+  ESP_LOGI(TAG, "New config %08lx loaded!", Config::get_hash());
+  return true;
+}
+
+void MQTT::expect_config() { xSemaphoreTake(_config_semaphore, 0); }
+
 bool MQTT::wait_for_config(uint32_t timeout) {
   return xSemaphoreTake(_config_semaphore, pdMS_TO_TICKS(timeout)) == pdTRUE;
 }
\ No newline at end of file
@@ -0,0 +1,66 @@
+#include "log_ring.h"
+#include "unity.h"
+#include <cstring>
+
+static bool append(LogRing &ring, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  bool appended = ring.append(fmt, args);
+  va_end(args);
+  return appended;
+}
+
+TEST_CASE("Log lines are taken in order", "[log_ring]") {
+  static LogRing ring;
+  char line[LogRing::LINE_SIZE];
+  TEST_ASSERT_EQUAL(0, ring.pop(line, sizeof(line)));
+
+  TEST_ASSERT_TRUE(append(ring, "I (%d) %s: first\n", 10, "MQTT"));
+  TEST_ASSERT_TRUE(append(ring, "I (%d) %s: second\n", 20, "MQTT"));
+  TEST_ASSERT_EQUAL(strlen("I (10) MQTT: first\n"), ring.peek_length());
+
+  size_t length = ring.pop(line, sizeof(line));
+  TEST_ASSERT_EQUAL_STRING_LEN("I (10) MQTT: first\n", line, length);
+  length = ring.pop(line, sizeof(line));
+  TEST_ASSERT_EQUAL_STRING_LEN("I (20) MQTT: second\n", line, length);
+  TEST_ASSERT_EQUAL(0, ring.pop(line, sizeof(line)));
+  TEST_ASSERT_EQUAL(0, ring.dropped());
+}
+
+TEST_CASE("Full log ring drops and counts lines", "[log_ring]") {
+  static LogRing ring;
+  char line[LogRing::LINE_SIZE];
+
+  // Several laps, so the slots are reused
+  for (int lap = 0; lap < 3; lap++) {
+    for (size_t i = 0; i < LogRing::SLOTS; i++) {
+      TEST_ASSERT_TRUE(append(ring, "line %u", static_cast<unsigned>(i)));
+    }
+    TEST_ASSERT_FALSE(append(ring, "one too many"));
+    TEST_ASSERT_EQUAL(lap + 1, ring.dropped());
+
+    for (size_t i = 0; i < LogRing::SLOTS; i++) {
+      char expected[16];
+      snprintf(expected, sizeof(expected), "line %u",
+               static_cast<unsigned>(i));
+      size_t length = ring.pop(line, sizeof(line));
+      TEST_ASSERT_EQUAL_STRING_LEN(expected, line, length);
+    }
+    TEST_ASSERT_EQUAL(0, ring.pop(line, sizeof(line)));
+  }
+}
+
+TEST_CASE("Long log lines are cut", "[log_ring]") {
+  static LogRing ring;
+  char long_line[LogRing::LINE_SIZE * 2];
+  memset(long_line, 'x', sizeof(long_line) - 1);
+  long_line[sizeof(long_line) - 1] = '\0';
+
+  TEST_ASSERT_TRUE(append(ring, "%s", long_line));
+  TEST_ASSERT_EQUAL(LogRing::LINE_SIZE - 1, ring.peek_length());
+
+  // A smaller buffer takes the start of the line
+  char line[16];
+  TEST_ASSERT_EQUAL(sizeof(line), ring.pop(line, sizeof(line)));
+  TEST_ASSERT_EQUAL(0, ring.peek_length());
+}
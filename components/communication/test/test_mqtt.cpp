@@ -1,3 +1,4 @@
+#include "config.h"
 #include "mqtt.h"
 #include "storage.h"
 #include "unity.h"
@@ -10,8 +11,27 @@ public:
     MQTT::handle_header_ack_message(ack_msg, len);
   }
 
-  static void call_handle_new_config(JsonDocument &doc) {
-    MQTT::handle_new_config(doc);
+  static bool call_parse_header_ack_options(char *options, HeaderAck &ack) {
+    return MQTT::parse_header_ack_options(options, ack);
+  }
+
+  static void call_handle_new_config(JsonDocument &doc, uint32_t hash = 1) {
+    MQTT::handle_new_config(doc, hash);
+  }
+
+  static void expect_subscriptions(int first_id, int second_id) {
+    xSemaphoreTake(MQTT::_ready_semaphore, 0);
+    MQTT::_subscription_ids[0] = first_id;
+    MQTT::_subscription_ids[1] = second_id;
+  }
+
+  static void call_handle_subscribed(int msg_id) {
+    MQTT::handle_subscribed(msg_id);
+  }
+
+  static void call_handle_connected(bool session_present) {
+    xSemaphoreTake(MQTT::_ready_semaphore, 0);
+    MQTT::handle_connected(session_present);
   }
 };
 
@@ -71,11 +91,57 @@ TEST_CASE("Non-matching header acknowledgement received", "[mqtt]") {
   test_mqtt = nullptr;
 }
 
+TEST_CASE("Header acknowledgement options are parsed", "[mqtt]") {
+  {
+    char options[] = "keyframe=3735928559;request=roi:64,32,640,480";
+    HeaderAck ack;
+    TEST_ASSERT_TRUE(MQTTTestHelper::call_parse_header_ack_options(options, ack));
+    TEST_ASSERT_EQUAL_UINT32(3735928559u, ack.keyframe_id);
+    TEST_ASSERT_TRUE(ack.request == HeaderAck::Request::ROI);
+    TEST_ASSERT_EQUAL_UINT16(64, ack.roi_x);
+    TEST_ASSERT_EQUAL_UINT16(32, ack.roi_y);
+    TEST_ASSERT_EQUAL_UINT16(640, ack.roi_width);
+    TEST_ASSERT_EQUAL_UINT16(480, ack.roi_height);
+  }
+
+  {
+    char options[] = "request=skip";
+    HeaderAck ack;
+    TEST_ASSERT_TRUE(MQTTTestHelper::call_parse_header_ack_options(options, ack));
+    TEST_ASSERT_EQUAL_UINT32(0, ack.keyframe_id);
+    TEST_ASSERT_EQUAL_UINT32(0, ack.chunks);
+    TEST_ASSERT_TRUE(ack.request == HeaderAck::Request::SKIP);
+  }
+
+  {
+    char options[] = "keyframe=7;chunks=42";
+    HeaderAck ack;
+    TEST_ASSERT_TRUE(MQTTTestHelper::call_parse_header_ack_options(options, ack));
+    TEST_ASSERT_EQUAL_UINT32(7, ack.keyframe_id);
+    TEST_ASSERT_EQUAL_UINT32(42, ack.chunks);
+  }
+
+  {
+    char options[] = "request=roi:0,0,0,10;bogus";
+    HeaderAck ack;
+    TEST_ASSERT_FALSE(
+        MQTTTestHelper::call_parse_header_ack_options(options, ack));
+    TEST_ASSERT_TRUE(ack.request == HeaderAck::Request::FULL);
+  }
+}
+
+TEST_CASE("Only control messages are published at QoS 2", "[mqtt]") {
+  TEST_ASSERT_EQUAL(2, qos_for(MessageKind::CONTROL));
+  TEST_ASSERT_EQUAL(1, qos_for(MessageKind::IMAGE_CHUNK));
+  TEST_ASSERT_EQUAL(1, qos_for(MessageKind::TELEMETRY));
+}
+
 TEST_CASE("Correct new configuration received and loaded", "[mqtt]") {
   test_mqtt = new MQTT();
 
   JsonDocument doc = test_config();
-  MQTTTestHelper::call_handle_new_config(doc);
+  MQTTTestHelper::call_handle_new_config(doc, 0x12345678);
+  TEST_ASSERT_EQUAL_HEX32(0x12345678, Config::get_hash());
 
   delete test_mqtt;
   test_mqtt = nullptr;
@@ -90,4 +156,25 @@ TEST_CASE("Incorrect new configuration received", "[mqtt]") {
 
   delete test_mqtt;
   test_mqtt = nullptr;
-}
\ No newline at end of file
+}
+TEST_CASE("Session is resumed after the subscriptions were acknowledged",
+          "[mqtt]") {
+  test_mqtt = new MQTT();
+
+  MQTTTestHelper::expect_subscriptions(5, 6);
+  MQTTTestHelper::call_handle_subscribed(5);
+  TEST_ASSERT_FALSE_MESSAGE(test_mqtt->wait_for_ready(0),
+                            "Ready before both subscriptions");
+  MQTTTestHelper::call_handle_subscribed(7);
+  TEST_ASSERT_FALSE(test_mqtt->wait_for_ready(0));
+  MQTTTestHelper::call_handle_subscribed(6);
+  TEST_ASSERT_TRUE(test_mqtt->wait_for_ready(0));
+
+  // The subscribed session is in RTC memory, so a present session is used
+  MQTTTestHelper::call_handle_connected(true);
+  TEST_ASSERT_TRUE(MQTT::get_session_resumed());
+  TEST_ASSERT_TRUE(test_mqtt->wait_for_ready(0));
+
+  delete test_mqtt;
+  test_mqtt = nullptr;
+}
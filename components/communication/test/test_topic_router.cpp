@@ -0,0 +1,90 @@
+#include "topic_router.h"
+#include "unity.h"
+#include <cstring>
+#include <string>
+
+static std::string s_routed;
+
+static void handle_ack(const TopicRouter::Message &message) {
+  s_routed = "ack:" + std::string(message.data, message.len);
+}
+
+static void handle_ack2(const TopicRouter::Message &message) {
+  s_routed = "ack2:" + std::string(message.data, message.len);
+}
+
+static void handle_command(const TopicRouter::Message &message) {
+  s_routed = "command:" + std::string(message.topic);
+}
+
+static void handle_any(const TopicRouter::Message &message) {
+  s_routed = "any:" + std::string(message.topic);
+}
+
+static bool dispatch(TopicRouter &router, const char *topic,
+                     const char *data) {
+  s_routed.clear();
+  return router.dispatch(topic, strlen(topic), data, strlen(data), 0,
+                         strlen(data));
+}
+
+TEST_CASE("Topics are routed by exact match first", "[topic_router]") {
+  static TopicRouter router;
+  TEST_ASSERT_TRUE(
+      router.add(TopicRouter::Match::EXACT, "cam/ack2", handle_ack2));
+  TEST_ASSERT_TRUE(router.add(TopicRouter::Match::EXACT, "cam/ack", handle_ack));
+  TEST_ASSERT_TRUE(
+      router.add(TopicRouter::Match::FILTER, "cam/+/command", handle_command));
+  TEST_ASSERT_TRUE(router.add(TopicRouter::Match::PREFIX, "cam/", handle_any));
+  TEST_ASSERT_TRUE(router.build(64));
+  TEST_ASSERT_FALSE(router.add(TopicRouter::Match::EXACT, "late", handle_ack));
+
+  // A topic is never taken for a shorter topic it starts with
+  TEST_ASSERT_TRUE(dispatch(router, "cam/ack", "1"));
+  TEST_ASSERT_EQUAL_STRING("ack:1", s_routed.c_str());
+  TEST_ASSERT_TRUE(dispatch(router, "cam/ack2", "2"));
+  TEST_ASSERT_EQUAL_STRING("ack2:2", s_routed.c_str());
+
+  TEST_ASSERT_TRUE(dispatch(router, "cam/7/command", ""));
+  TEST_ASSERT_EQUAL_STRING("command:cam/7/command", s_routed.c_str());
+  TEST_ASSERT_TRUE(dispatch(router, "cam/ack/3", ""));
+  TEST_ASSERT_EQUAL_STRING("any:cam/ack/3", s_routed.c_str());
+  TEST_ASSERT_FALSE(dispatch(router, "other", ""));
+  TEST_ASSERT_EQUAL_STRING("", s_routed.c_str());
+}
+
+TEST_CASE("Topic filters follow the MQTT wildcards", "[topic_router]") {
+  TEST_ASSERT_TRUE(TopicRouter::matches_filter("a/+/c", "a/b/c"));
+  TEST_ASSERT_TRUE(TopicRouter::matches_filter("a/+", "a/"));
+  TEST_ASSERT_FALSE(TopicRouter::matches_filter("a/+", "a/b/c"));
+  TEST_ASSERT_TRUE(TopicRouter::matches_filter("a/#", "a/b/c"));
+  TEST_ASSERT_TRUE(TopicRouter::matches_filter("a/#", "a"));
+  TEST_ASSERT_TRUE(TopicRouter::matches_filter("#", "a/b"));
+  TEST_ASSERT_FALSE(TopicRouter::matches_filter("#", "$SYS/uptime"));
+  TEST_ASSERT_FALSE(TopicRouter::matches_filter("a/b", "a/bc"));
+  TEST_ASSERT_FALSE(TopicRouter::matches_filter("a/b/c", "a/b"));
+}
+
+TEST_CASE("Fragmented messages are reassembled", "[topic_router]") {
+  static TopicRouter router;
+  router.add(TopicRouter::Match::EXACT, "cam/ack", handle_ack);
+  TEST_ASSERT_TRUE(router.build(8));
+
+  s_routed.clear();
+  TEST_ASSERT_TRUE(router.dispatch("cam/ack", 7, "abc", 3, 0, 7));
+  TEST_ASSERT_TRUE(router.dispatch(nullptr, 0, "def", 3, 3, 7));
+  TEST_ASSERT_EQUAL_STRING("", s_routed.c_str());
+  TEST_ASSERT_TRUE(router.dispatch(nullptr, 0, "g", 1, 6, 7));
+  TEST_ASSERT_EQUAL_STRING("ack:abcdefg", s_routed.c_str());
+
+  // A missing fragment drops the message
+  TEST_ASSERT_TRUE(router.dispatch("cam/ack", 7, "abc", 3, 0, 7));
+  TEST_ASSERT_FALSE(router.dispatch(nullptr, 0, "g", 1, 6, 7));
+  TEST_ASSERT_EQUAL(1, router.dropped());
+
+  // A message larger than the buffer is dropped with all its fragments
+  TEST_ASSERT_FALSE(router.dispatch("cam/ack", 7, "abcde", 5, 0, 10));
+  TEST_ASSERT_FALSE(router.dispatch(nullptr, 0, "fghij", 5, 5, 10));
+  TEST_ASSERT_EQUAL(2, router.dropped());
+  TEST_ASSERT_EQUAL_STRING("ack:abcdefg", s_routed.c_str());
+}
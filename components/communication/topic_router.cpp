@@ -0,0 +1,140 @@
+#include "topic_router.h"
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+bool TopicRouter::add(Match match, const char *pattern, Handler handler) {
+  if (_built || pattern == nullptr || pattern[0] == '\0') {
+    return false;
+  }
+  Route route = {pattern, handler};
+  switch (match) {
+  case Match::EXACT:
+    _exact.push_back(route);
+    break;
+  case Match::FILTER:
+    _filters.push_back(route);
+    break;
+  case Match::PREFIX:
+    _prefixes.push_back(route);
+    break;
+  }
+  return true;
+}
+
+bool TopicRouter::build(size_t buffer_size) {
+  std::sort(_exact.begin(), _exact.end(), [](const Route &a, const Route &b) {
+    return a.pattern < b.pattern;
+  });
+  // A longer prefix is more specific
+  std::stable_sort(_prefixes.begin(), _prefixes.end(),
+                   [](const Route &a, const Route &b) {
+                     return a.pattern.size() > b.pattern.size();
+                   });
+  _buffer.reset(new (std::nothrow) char[buffer_size]);
+  if (_buffer == nullptr) {
+    return false;
+  }
+  _buffer_size = buffer_size;
+  _built = true;
+  return true;
+}
+
+bool TopicRouter::dispatch(const char *topic, size_t topic_len,
+                           const char *data, size_t data_len, size_t offset,
+                           size_t total_len) {
+  // The common case, the handler reads the client's buffer
+  if (offset == 0 && data_len == total_len) {
+    _reassembling = false;
+    return route(std::string_view(topic, topic_len), data, data_len);
+  }
+
+  if (offset == 0) {
+    _reassembling = total_len <= _buffer_size && topic_len < TOPIC_SIZE;
+    if (!_reassembling) {
+      _dropped++;
+      return false;
+    }
+    memcpy(_topic, topic, topic_len);
+    _topic_len = topic_len;
+    _total_len = total_len;
+    _received = 0;
+  } else if (!_reassembling) {
+    // The rest of a dropped message
+    return false;
+  }
+
+  if (offset != _received || total_len != _total_len ||
+      data_len > _total_len - _received) {
+    _reassembling = false;
+    _dropped++;
+    return false;
+  }
+  memcpy(_buffer.get() + _received, data, data_len);
+  _received += data_len;
+  if (_received < _total_len) {
+    return true;
+  }
+  _reassembling = false;
+  return route(std::string_view(_topic, _topic_len), _buffer.get(),
+               _total_len);
+}
+
+TopicRouter::Handler TopicRouter::find(std::string_view topic) const {
+  auto exact = std::lower_bound(
+      _exact.begin(), _exact.end(), topic,
+      [](const Route &route, std::string_view t) { return route.pattern < t; });
+  if (exact != _exact.end() && exact->pattern == topic) {
+    return exact->handler;
+  }
+  for (const Route &route : _filters) {
+    if (matches_filter(route.pattern, topic)) {
+      return route.handler;
+    }
+  }
+  for (const Route &route : _prefixes) {
+    if (topic.substr(0, route.pattern.size()) == route.pattern) {
+      return route.handler;
+    }
+  }
+  return nullptr;
+}
+
+bool TopicRouter::matches_filter(std::string_view filter,
+                                 std::string_view topic) {
+  // Wildcards don't match topics starting with '$'
+  if (!topic.empty() && topic[0] == '$' && !filter.empty() &&
+      (filter[0] == '+' || filter[0] == '#')) {
+    return false;
+  }
+  while (true) {
+    size_t filter_end = filter.find('/');
+    size_t topic_end = topic.find('/');
+    std::string_view level = filter.substr(0, filter_end);
+    if (level == "#") {
+      return true;
+    }
+    if (level != "+" && level != topic.substr(0, topic_end)) {
+      return false;
+    }
+    if (filter_end == std::string_view::npos ||
+        topic_end == std::string_view::npos) {
+      // "a/#" also matches "a"
+      return filter_end == topic_end ||
+             (topic_end == std::string_view::npos &&
+              filter.substr(filter_end + 1) == "#");
+    }
+    filter.remove_prefix(filter_end + 1);
+    topic.remove_prefix(topic_end + 1);
+  }
+}
+
+bool TopicRouter::route(std::string_view topic, const char *data,
+                        size_t len) const {
+  Handler handler = find(topic);
+  if (handler == nullptr) {
+    return false;
+  }
+  handler({topic, data, len});
+  return true;
+}
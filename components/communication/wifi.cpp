@@ -1,17 +1,39 @@
 #include "wifi.h"
+#include "config.h"
 #include "error_handler.h"
+#include "esp_attr.h"
 #include "esp_log.h"
-#include "esp_netif_sntp.h"
-#include "esp_sntp.h"
-#include "esp_wifi.h"
+#include "esp_timer.h"
+#include "rtc_budget.h"
 #include "storage.h"
 #include "string.h"
 #include <cstring>
+#include <ctime>
 
 constexpr auto *TAG = "WiFi";
 
+/**
+ * @brief The last access point and DHCP lease, kept in RTC memory
+ */
+struct ConnectionCache {
+  bool valid;         /*!< false after a cold boot */
+  uint32_t ssid_hash; /*!< the cache is only used for the same SSID */
+  uint8_t bssid[6];
+  uint8_t channel;
+  esp_netif_ip_info_t ip_info;
+  esp_netif_dns_info_t dns;
+  int64_t leased_at; /*!< the time of the DHCP lease in seconds */
+};
+RTC_SLOW_ATTR static ConnectionCache s_cache;
+static_assert(sizeof(s_cache) <= rtc_budget::WIFI_CACHE,
+              "The connection cache doesn't fit into its RTC memory");
+
 EventGroupHandle_t Wifi::_wifi_event_group = nullptr;
 bool Wifi::_connected = false;
+esp_netif_t *Wifi::_netif = nullptr;
+WifiTiming Wifi::_timing;
+int64_t Wifi::_associated_us = 0;
+int64_t Wifi::_got_ip_us = 0;
 
 Wifi::Wifi() {
   esp_log_level_set("wifi_init", ESP_LOG_WARN);
@@ -27,7 +49,7 @@ Wifi::Wifi() {
 
   esp_netif_init();
   esp_event_loop_create_default();
-  esp_netif_create_default_wifi_sta();
+  _netif = esp_netif_create_default_wifi_sta();
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   if (esp_wifi_init(&cfg) != ESP_OK) {
     ESP_LOGE(TAG, "Failed to initialize the WiFi stack!");
@@ -40,7 +62,7 @@ Wifi::Wifi() {
                                       &Wifi::eventHandler, NULL, NULL);
 }
 
-void Wifi::connect() {
+bool Wifi::connect() {
   wifi_config_t wifi_config = {};
 
   // ------------------------ WiFi static config ------------------------------
@@ -58,57 +80,177 @@ void Wifi::connect() {
   strncpy((char *)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
   strncpy((char *)wifi_config.sta.password, password,
           sizeof(wifi_config.sta.password));
+  wifi_config.sta.listen_interval = LISTEN_INTERVAL;
   // ---------------------------------------------------------------------------
 
   esp_wifi_set_mode(WIFI_MODE_STA);
-  esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
   if (esp_wifi_start() != ESP_OK) {
     ESP_LOGE(TAG, "Failed to start WiFi station!");
     restart();
   }
 
-  ESP_LOGI(TAG, "Waiting for WiFi connection...");
-
-  EventBits_t bits =
-      xEventGroupWaitBits(_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE,
-                          pdFALSE, pdMS_TO_TICKS(15000));
+  _timing = {};
+  uint32_t ssid_hash = Config::hash(ssid, strlen(ssid));
+  if (s_cache.valid && s_cache.ssid_hash == ssid_hash) {
+    if (connect_fast(wifi_config)) {
+      _connected = true;
+      ESP_LOGI(TAG, "WiFi Connected to the cached access point!");
+      return true;
+    }
+    ESP_LOGW(TAG, "Cached access point not reached, scanning");
+    forget_connection();
+  }
 
-  if (bits & WIFI_CONNECTED_BIT) {
+  if (connect_full(wifi_config)) {
+    s_cache.ssid_hash = ssid_hash;
+    save_connection();
     _connected = true;
     ESP_LOGI(TAG, "WiFi Connected!");
+    return true;
+  }
+  ESP_LOGE(TAG, "WiFi couldn't connect!");
+  return false;
+}
+
+void Wifi::forget_connection() { s_cache.valid = false; }
+
+bool Wifi::is_connected() {
+  return _connected &&
+         (xEventGroupGetBits(_wifi_event_group) & WIFI_CONNECTED_BIT);
+}
+
+void Wifi::set_power_save(bool max) {
+  if (esp_wifi_set_ps(max ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM) !=
+      ESP_OK) {
+    ESP_LOGW(TAG, "Failed to set the power save mode");
+  }
+}
+
+bool Wifi::connect_fast(wifi_config_t &wifi_config) {
+  wifi_config.sta.bssid_set = true;
+  memcpy(wifi_config.sta.bssid, s_cache.bssid, sizeof(s_cache.bssid));
+  wifi_config.sta.channel = s_cache.channel;
+
+  // The wall clock runs on during deep sleep
+  bool static_ip = time(nullptr) - s_cache.leased_at < LEASE_REUSE_S;
+  if (static_ip) {
+    esp_netif_dhcpc_stop(_netif);
+    if (esp_netif_set_ip_info(_netif, &s_cache.ip_info) != ESP_OK ||
+        esp_netif_set_dns_info(_netif, ESP_NETIF_DNS_MAIN, &s_cache.dns) !=
+            ESP_OK) {
+      ESP_LOGW(TAG, "Failed to set the cached address");
+      esp_netif_dhcpc_start(_netif);
+      static_ip = false;
+    }
+  }
+
+  ESP_LOGI(TAG, "Connecting to the cached access point on channel %u...",
+           s_cache.channel);
+  if (!associate(wifi_config, FAST_CONNECT_TIMEOUT_MS,
+                 esp_timer_get_time())) {
+    esp_wifi_disconnect();
+    if (static_ip) {
+      esp_netif_dhcpc_start(_netif);
+    }
+    return false;
+  }
+  _timing.fast = true;
+  _timing.static_ip = static_ip;
+  if (!static_ip) {
+    // A new lease
+    save_connection();
+  }
+  return true;
+}
+
+bool Wifi::connect_full(wifi_config_t &wifi_config) {
+  int64_t start = esp_timer_get_time();
+  wifi_config.sta.bssid_set = false;
+  wifi_config.sta.channel = 0;
+
+  // The scan picks the strongest access point of the SSID, the association
+  // goes to it without scanning again
+  ESP_LOGI(TAG, "Scanning for %s...", wifi_config.sta.ssid);
+  wifi_scan_config_t scan_config = {};
+  scan_config.ssid = wifi_config.sta.ssid;
+  scan_config.show_hidden = true;
+  uint16_t count = 1;
+  wifi_ap_record_t record = {};
+  if (esp_wifi_scan_start(&scan_config, true) == ESP_OK &&
+      esp_wifi_scan_get_ap_records(&count, &record) == ESP_OK && count > 0) {
+    wifi_config.sta.bssid_set = true;
+    memcpy(wifi_config.sta.bssid, record.bssid, sizeof(record.bssid));
+    wifi_config.sta.channel = record.primary;
   } else {
-    ESP_LOGE(TAG, "WiFi couldn't connect!");
-    restart();
+    ESP_LOGW(TAG, "The scan didn't find the SSID");
+  }
+  int64_t scanned = esp_timer_get_time();
+  _timing.scan_ms = static_cast<uint32_t>((scanned - start) / 1000);
+
+  uint32_t elapsed = _timing.scan_ms;
+  if (elapsed >= CONNECT_TIMEOUT_MS) {
+    return false;
+  }
+  ESP_LOGI(TAG, "Waiting for WiFi connection...");
+  return associate(wifi_config, CONNECT_TIMEOUT_MS - elapsed, scanned);
+}
+
+bool Wifi::associate(wifi_config_t &wifi_config, uint32_t timeout,
+                     int64_t start) {
+  xEventGroupClearBits(_wifi_event_group, WIFI_CONNECTED_BIT |
+                                              WIFI_ASSOCIATED_BIT |
+                                              WIFI_DISCONNECTED_BIT);
+  esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+  if (esp_wifi_connect() != ESP_OK) {
+    return false;
   }
+
+  // A failed association ends the wait early
+  EventBits_t bits = xEventGroupWaitBits(
+      _wifi_event_group, WIFI_CONNECTED_BIT | WIFI_DISCONNECTED_BIT, pdFALSE,
+      pdFALSE, pdMS_TO_TICKS(timeout));
+  if (!(bits & WIFI_CONNECTED_BIT)) {
+    return false;
+  }
+  _timing.connect_ms = static_cast<uint32_t>((_associated_us - start) / 1000);
+  _timing.ip_ms = static_cast<uint32_t>((_got_ip_us - _associated_us) / 1000);
+  return true;
 }
 
-void Wifi::sync_time() {
-  ESP_LOGI(TAG, "Syncing time with NTP server...");
-  // Set timezone to Budapest
-  setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
-  tzset();
-  // Configure SNTP
-  esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG("pool.ntp.org");
-  esp_netif_sntp_init(&config);
-  if (esp_netif_sntp_sync_wait(pdMS_TO_TICKS(15000)) != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to configure NTP server!");
-    restart();
+void Wifi::save_connection() {
+  wifi_ap_record_t ap = {};
+  if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK ||
+      esp_netif_get_ip_info(_netif, &s_cache.ip_info) != ESP_OK ||
+      esp_netif_get_dns_info(_netif, ESP_NETIF_DNS_MAIN, &s_cache.dns) !=
+          ESP_OK) {
+    s_cache.valid = false;
+    return;
   }
+  memcpy(s_cache.bssid, ap.bssid, sizeof(s_cache.bssid));
+  s_cache.channel = ap.primary;
+  s_cache.leased_at = time(nullptr);
+  s_cache.valid = true;
 }
 
 void Wifi::eventHandler(void *arg, esp_event_base_t event_base,
                         int32_t event_id, void *event_data) {
-  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-    esp_wifi_connect();
+  // connect() starts the association, after the scan
+  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+    _associated_us = esp_timer_get_time();
+    xEventGroupSetBits(_wifi_event_group, WIFI_ASSOCIATED_BIT);
   } else if (event_base == WIFI_EVENT &&
              event_id == WIFI_EVENT_STA_DISCONNECTED && _connected) {
     ESP_LOGI(TAG, "Retry connecting to the AP");
     esp_wifi_connect();
     xEventGroupClearBits(_wifi_event_group, WIFI_CONNECTED_BIT);
     vTaskDelay(pdMS_TO_TICKS(100));
+  } else if (event_base == WIFI_EVENT &&
+             event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    xEventGroupSetBits(_wifi_event_group, WIFI_DISCONNECTED_BIT);
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
     ESP_LOGI(TAG, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
+    _got_ip_us = esp_timer_get_time();
     xEventGroupSetBits(_wifi_event_group, WIFI_CONNECTED_BIT);
   }
 }
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include "change_detector.h"
+#include "swar.h"
+#include <cstdlib>
+
+bool ChangeDetector::compute_signature(const uint8_t *src, uint16_t width,
+                                       uint16_t height, uint8_t *signature) {
+  // Whole words per block, the rest of the row is ignored. MAX_WIDTH keeps
+  // the 16-bit lanes of a block row from overflowing.
+  uint32_t block_width = (width / SIGNATURE_WIDTH) & ~3u;
+  uint32_t block_height = height / SIGNATURE_HEIGHT;
+  if (block_width == 0 || block_height == 0 || width > MAX_WIDTH) {
+    return false;
+  }
+  uint32_t sampled_rows = (block_height + ROW_STEP - 1) / ROW_STEP;
+  uint32_t count = sampled_rows * block_width;
+
+  uint32_t sums[SIGNATURE_WIDTH];
+  for (uint32_t by = 0; by < SIGNATURE_HEIGHT; by++) {
+    for (uint32_t bx = 0; bx < SIGNATURE_WIDTH; bx++) {
+      sums[bx] = 0;
+    }
+    for (uint32_t y = by * block_height; y < (by + 1) * block_height;
+         y += ROW_STEP) {
+      const uint8_t *row = src + static_cast<size_t>(y) * width;
+      for (uint32_t bx = 0; bx < SIGNATURE_WIDTH; bx++) {
+        const uint8_t *block = row + bx * block_width;
+        uint32_t lanes = 0;
+        for (uint32_t x = 0; x < block_width; x += 4) {
+          lanes += swar::pair_sum(swar::load(block + x));
+        }
+        sums[bx] += (lanes & 0xFFFF) + (lanes >> 16);
+      }
+    }
+    for (uint32_t bx = 0; bx < SIGNATURE_WIDTH; bx++) {
+      signature[by * SIGNATURE_WIDTH + bx] =
+          static_cast<uint8_t>((sums[bx] + count / 2) / count);
+    }
+  }
+  return true;
+}
+
+float ChangeDetector::score(const uint8_t *previous, const uint8_t *current,
+                            uint8_t tolerance) {
+  int32_t total = 0;
+  for (size_t i = 0; i < SIGNATURE_SIZE; i++) {
+    total += current[i] - previous[i];
+  }
+  // Global brightness difference, rounded to nearest
+  int32_t offset = (total + (total >= 0 ? 1 : -1) *
+                                static_cast<int32_t>(SIGNATURE_SIZE / 2)) /
+                   static_cast<int32_t>(SIGNATURE_SIZE);
+
+  uint32_t changed = 0;
+  for (size_t i = 0; i < SIGNATURE_SIZE; i++) {
+    if (abs(current[i] - previous[i] - offset) > tolerance) {
+      changed++;
+    }
+  }
+  return 100.0f * changed / SIGNATURE_SIZE;
+}
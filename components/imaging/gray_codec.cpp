@@ -0,0 +1,361 @@
+#include "gray_codec.h"
+#include "swar.h"
+#include <algorithm>
+#include <memory>
+
+namespace {
+
+constexpr uint32_t FILTER_BITS = 3;
+constexpr uint32_t PARAM_BITS = 3;
+constexpr uint8_t MAX_PARAM = 6;
+constexpr uint8_t ZERO_BLOCK = 7; // Rice parameter marking an all-zero block
+constexpr uint32_t ESCAPE = 12;   // unary length that switches to 8 raw bits
+constexpr uint32_t FILTER_COUNT = 4;
+constexpr char MAGIC[3] = {'S', 'G', 'C'};
+
+class BitWriter {
+public:
+  BitWriter(uint8_t *dst, size_t capacity)
+      : _dst(dst), _end(dst + capacity) {}
+
+  // bits must be at most 32
+  void put(uint32_t value, uint32_t bits) {
+    _acc = (_acc << bits) | value;
+    _bits += bits;
+    if (_bits >= 32) {
+      _bits -= 32;
+      write_word(static_cast<uint32_t>(_acc >> _bits));
+    }
+  }
+
+  // Flushes the remaining bits, and returns the end of the written data
+  uint8_t *finish() {
+    while (_bits > 0 && !_overflow) {
+      uint32_t bits = std::min<uint32_t>(_bits, 8);
+      if (_dst == _end) {
+        _overflow = true;
+        break;
+      }
+      *_dst++ = static_cast<uint8_t>((_acc >> (_bits - bits)) << (8 - bits));
+      _bits -= bits;
+    }
+    return _dst;
+  }
+
+  bool overflow() const { return _overflow; }
+
+private:
+  void write_word(uint32_t word) {
+    if (_end - _dst < 4) {
+      _overflow = true;
+      return;
+    }
+    _dst[0] = static_cast<uint8_t>(word >> 24);
+    _dst[1] = static_cast<uint8_t>(word >> 16);
+    _dst[2] = static_cast<uint8_t>(word >> 8);
+    _dst[3] = static_cast<uint8_t>(word);
+    _dst += 4;
+  }
+
+  uint8_t *_dst;
+  uint8_t *_end;
+  uint64_t _acc = 0;
+  uint32_t _bits = 0;
+  bool _overflow = false;
+};
+
+class BitReader {
+public:
+  BitReader(const uint8_t *src, size_t len) : _src(src), _end(src + len) {}
+
+  // bits must be at most 32
+  uint32_t get(uint32_t bits) {
+    if (bits == 0) {
+      return 0;
+    }
+    refill();
+    uint32_t value = static_cast<uint32_t>(_acc >> (64 - bits));
+    _acc <<= bits;
+    _bits -= bits;
+    return value;
+  }
+
+  // Counts the leading one bits, at most limit, and consumes the terminating
+  // zero if there is one
+  uint32_t get_unary(uint32_t limit) {
+    uint32_t count = 0;
+    while (count < limit && get(1) == 1) {
+      count++;
+    }
+    return count;
+  }
+
+  // True if more bits were consumed than the input had
+  bool overrun() const { return _padding > 8; }
+
+private:
+  void refill() {
+    while (_bits <= 56) {
+      uint64_t byte = 0;
+      if (_src < _end) {
+        byte = *_src++;
+      } else {
+        _padding++;
+      }
+      _acc |= byte << (56 - _bits);
+      _bits += 8;
+    }
+  }
+
+  const uint8_t *_src;
+  const uint8_t *_end;
+  uint64_t _acc = 0;
+  uint32_t _bits = 0;
+  uint32_t _padding = 0;
+};
+
+inline uint8_t predict(GrayCodec::Filter filter, uint8_t left, uint8_t up,
+                       uint8_t up_left) {
+  switch (filter) {
+  case GrayCodec::Filter::SUB:
+    return left;
+  case GrayCodec::Filter::UP:
+    return up;
+  case GrayCodec::Filter::AVG:
+    return static_cast<uint8_t>((left + up) >> 1);
+  case GrayCodec::Filter::MED:
+  default:
+    if (up_left >= std::max(left, up)) {
+      return std::min(left, up);
+    }
+    if (up_left <= std::min(left, up)) {
+      return std::max(left, up);
+    }
+    return static_cast<uint8_t>(left + up - up_left);
+  }
+}
+
+inline uint8_t zigzag(uint8_t residual) {
+  return static_cast<uint8_t>((residual << 1) ^
+                              (static_cast<int8_t>(residual) >> 7));
+}
+
+inline uint8_t unzigzag(uint8_t value) {
+  return static_cast<uint8_t>((value >> 1) ^ -(value & 1));
+}
+
+inline uint8_t residual_at(const uint8_t *cur, const uint8_t *up, uint16_t x,
+                           GrayCodec::Filter filter) {
+  uint8_t left = x > 0 ? cur[x - 1] : 0;
+  uint8_t up_left = x > 0 ? up[x - 1] : 0;
+  return zigzag(
+      static_cast<uint8_t>(cur[x] - predict(filter, left, up[x], up_left)));
+}
+
+// Rice parameter of a block: the smallest k with n * 2^k >= sum
+inline uint8_t rice_param(uint32_t sum, uint32_t n) {
+  if (sum == 0) {
+    return ZERO_BLOCK;
+  }
+  uint8_t k = 0;
+  while (k < MAX_PARAM && (n << k) < sum) {
+    k++;
+  }
+  return k;
+}
+
+} // namespace
+
+void GrayCodec::filter_row(const uint8_t *cur, const uint8_t *up,
+                           uint16_t width, Filter filter, uint8_t *out) {
+  uint16_t x = 0;
+  if (filter != Filter::MED) {
+    // The first pixel has no left neighbour, the word loop starts after it
+    for (; x < std::min<uint16_t>(width, 1); x++) {
+      out[x] = residual_at(cur, up, x, filter);
+    }
+    for (; x + 4 <= width; x += 4) {
+      uint32_t c = swar::load(cur + x);
+      uint32_t prediction;
+      switch (filter) {
+      case Filter::SUB:
+        prediction = swar::load(cur + x - 1);
+        break;
+      case Filter::UP:
+        prediction = swar::load(up + x);
+        break;
+      default:
+        prediction = swar::avg(swar::load(cur + x - 1), swar::load(up + x));
+        break;
+      }
+      swar::store(out + x, swar::zigzag(swar::sub(c, prediction)));
+    }
+  }
+  for (; x < width; x++) {
+    out[x] = residual_at(cur, up, x, filter);
+  }
+}
+
+GrayCodec::Filter GrayCodec::choose_filter(const uint8_t *cur,
+                                           const uint8_t *up, uint16_t width) {
+  uint32_t cost[FILTER_COUNT] = {0};
+
+  // Sample four pixels out of every sixteen
+  for (uint16_t x = 1; x + 4 <= width; x += 16) {
+    uint32_t c = swar::load(cur + x);
+    uint32_t left = swar::load(cur + x - 1);
+    uint32_t u = swar::load(up + x);
+    cost[0] += swar::sum(swar::zigzag(swar::sub(c, left)));
+    cost[1] += swar::sum(swar::zigzag(swar::sub(c, u)));
+    cost[2] += swar::sum(swar::zigzag(swar::sub(c, swar::avg(left, u))));
+    for (uint16_t i = x; i < x + 4; i++) {
+      cost[3] += residual_at(cur, up, i, Filter::MED);
+    }
+  }
+
+  uint32_t best = 0;
+  for (uint32_t i = 1; i < FILTER_COUNT; i++) {
+    if (cost[i] < cost[best]) {
+      best = i;
+    }
+  }
+  return static_cast<Filter>(best);
+}
+
+size_t GrayCodec::encode(const uint8_t *src, uint16_t width, uint16_t height,
+                         uint8_t *dst, size_t capacity, size_t stride) {
+  if (stride == 0) {
+    stride = width;
+  }
+  if (!src || !dst || width == 0 || height == 0 || width > MAX_WIDTH ||
+      stride < width || capacity < HEADER_SIZE) {
+    return 0;
+  }
+
+  dst[0] = MAGIC[0];
+  dst[1] = MAGIC[1];
+  dst[2] = MAGIC[2];
+  dst[3] = VERSION;
+  dst[4] = static_cast<uint8_t>(width);
+  dst[5] = static_cast<uint8_t>(width >> 8);
+  dst[6] = static_cast<uint8_t>(height);
+  dst[7] = static_cast<uint8_t>(height >> 8);
+
+  std::unique_ptr<uint8_t[]> zero_row(new uint8_t[width]());
+  std::unique_ptr<uint8_t[]> residuals(new uint8_t[width]);
+  BitWriter writer(dst + HEADER_SIZE, capacity - HEADER_SIZE);
+
+  for (uint32_t y = 0; y < height && !writer.overflow(); y++) {
+    const uint8_t *cur = src + y * stride;
+    const uint8_t *up = y > 0 ? cur - stride : zero_row.get();
+
+    Filter filter = choose_filter(cur, up, width);
+    writer.put(static_cast<uint32_t>(filter), FILTER_BITS);
+    filter_row(cur, up, width, filter, residuals.get());
+
+    for (uint32_t start = 0; start < width; start += BLOCK_SIZE) {
+      const uint8_t *block = residuals.get() + start;
+      uint32_t n = std::min<uint32_t>(BLOCK_SIZE, width - start);
+
+      uint32_t sum = 0;
+      uint32_t i = 0;
+      for (; i + 4 <= n; i += 4) {
+        sum += swar::sum(swar::load(block + i));
+      }
+      for (; i < n; i++) {
+        sum += block[i];
+      }
+
+      uint8_t k = rice_param(sum, n);
+      writer.put(k, PARAM_BITS);
+      if (k == ZERO_BLOCK) {
+        continue;
+      }
+
+      for (i = 0; i < n; i++) {
+        uint32_t value = block[i];
+        uint32_t q = value >> k;
+        if (q < ESCAPE) {
+          // q ones, a zero and the k low bits
+          uint32_t code = (((1u << q) - 1) << 1 << k) | (value & ((1u << k) - 1));
+          writer.put(code, q + 1 + k);
+        } else {
+          writer.put(((1u << ESCAPE) - 1) << 8 | value, ESCAPE + 8);
+        }
+      }
+    }
+  }
+
+  uint8_t *end = writer.finish();
+  if (writer.overflow()) {
+    return 0;
+  }
+  return static_cast<size_t>(end - dst);
+}
+
+bool GrayCodec::decode(const uint8_t *src, size_t len, uint8_t *dst,
+                       size_t capacity, uint16_t *width, uint16_t *height) {
+  if (!src || !dst || len < HEADER_SIZE || src[0] != MAGIC[0] ||
+      src[1] != MAGIC[1] || src[2] != MAGIC[2] || src[3] != VERSION) {
+    return false;
+  }
+
+  uint16_t w = static_cast<uint16_t>(src[4] | (src[5] << 8));
+  uint16_t h = static_cast<uint16_t>(src[6] | (src[7] << 8));
+  if (w == 0 || h == 0 || w > MAX_WIDTH ||
+      capacity < static_cast<size_t>(w) * h) {
+    return false;
+  }
+
+  std::unique_ptr<uint8_t[]> zero_row(new uint8_t[w]());
+  std::unique_ptr<uint8_t[]> residuals(new uint8_t[w]);
+  BitReader reader(src + HEADER_SIZE, len - HEADER_SIZE);
+
+  for (uint32_t y = 0; y < h; y++) {
+    uint8_t *cur = dst + y * w;
+    const uint8_t *up = y > 0 ? cur - w : zero_row.get();
+
+    uint32_t filter_id = reader.get(FILTER_BITS);
+    if (filter_id >= FILTER_COUNT) {
+      return false;
+    }
+    Filter filter = static_cast<Filter>(filter_id);
+
+    for (uint32_t start = 0; start < w; start += BLOCK_SIZE) {
+      uint8_t *block = residuals.get() + start;
+      uint32_t n = std::min<uint32_t>(BLOCK_SIZE, w - start);
+
+      uint32_t k = reader.get(PARAM_BITS);
+      if (k == ZERO_BLOCK) {
+        std::fill(block, block + n, 0);
+        continue;
+      }
+      if (k > MAX_PARAM) {
+        return false;
+      }
+      for (uint32_t i = 0; i < n; i++) {
+        uint32_t q = reader.get_unary(ESCAPE);
+        uint32_t value = q < ESCAPE ? (q << k) | reader.get(k) : reader.get(8);
+        if (value > 0xFF) {
+          return false;
+        }
+        block[i] = static_cast<uint8_t>(value);
+      }
+    }
+
+    for (uint16_t x = 0; x < w; x++) {
+      uint8_t left = x > 0 ? cur[x - 1] : 0;
+      uint8_t up_left = x > 0 ? up[x - 1] : 0;
+      cur[x] = static_cast<uint8_t>(predict(filter, left, up[x], up_left) +
+                                    unzigzag(residuals[x]));
+    }
+
+    if (reader.overrun()) {
+      return false;
+    }
+  }
+
+  *width = w;
+  *height = h;
+  return true;
+}
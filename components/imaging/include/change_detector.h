@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Detects whether the scene changed between two frames
+ *
+ * A frame is reduced to a signature of 40 x 25 block means (64 x 64 pixel
+ * blocks at 2560 x 1600), summed four pixels at a time in 32-bit words (see
+ * swar.h). Only every ROW_STEP-th row is sampled to save PSRAM bandwidth.
+ *
+ * Two signatures are compared after removing the difference of their global
+ * means, so a cloud or the sunrise doesn't count as a change. The score is
+ * the percentage of blocks which still differ by more than the tolerance.
+ */
+class ChangeDetector {
+public:
+  static constexpr uint16_t SIGNATURE_WIDTH = 40;
+  static constexpr uint16_t SIGNATURE_HEIGHT = 25;
+  static constexpr size_t SIGNATURE_SIZE = SIGNATURE_WIDTH * SIGNATURE_HEIGHT;
+  static constexpr uint16_t ROW_STEP = 4;
+  static constexpr uint16_t MAX_WIDTH = 4096;
+
+  /**
+   * @brief Computes the signature of a grayscale frame
+   *
+   * @param src The pixels, row by row
+   * @param width The width of the frame
+   * @param height The height of the frame
+   * @param signature The output, SIGNATURE_SIZE block means row by row
+   *
+   * @return false if the frame is too small or too wide, true otherwise
+   */
+  static bool compute_signature(const uint8_t *src, uint16_t width,
+                                uint16_t height, uint8_t *signature);
+
+  /**
+   * @brief Compares two signatures
+   *
+   * @param previous The signature of the previous frame
+   * @param current The signature of the current frame
+   * @param tolerance The largest difference of a block mean which is not a
+   * change, after the global brightness difference is removed
+   *
+   * @return The percentage of changed blocks, 0 - 100
+   */
+  static float score(const uint8_t *previous, const uint8_t *current,
+                     uint8_t tolerance);
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Lossless codec for 8-bit grayscale frames
+ *
+ * Every row is predicted with one of four filters (left, up, average of left
+ * and up, LOCO-I median), chosen per row by the smallest estimated cost. The
+ * residuals are zigzag mapped and Rice coded in blocks of 32 pixels with a
+ * per-block parameter, all-zero blocks cost 3 bits.
+ *
+ * The filters, the zigzag mapping and the block statistics run four pixels at
+ * a time in 32-bit words (see swar.h).
+ *
+ * Encoded layout, little-endian:
+ *
+ *    - "SGC" magic and the format version (4 bytes)
+ *
+ *    - width and height (2 + 2 bytes)
+ *
+ *    - bitstream, most significant bit first: per row a 3-bit filter id, then
+ *      per block a 3-bit Rice parameter and the Rice codes
+ */
+class GrayCodec {
+public:
+  /**
+   * @brief The name of the codec advertised in the image header
+   */
+  static constexpr const char *NAME = "sgc1";
+  static constexpr uint8_t VERSION = 1;
+  static constexpr uint32_t HEADER_SIZE = 8;
+  static constexpr uint32_t BLOCK_SIZE = 32;
+  static constexpr uint16_t MAX_WIDTH = 4096;
+
+  /**
+   * @brief Prediction filters
+   */
+  enum class Filter : uint8_t { SUB = 0, UP = 1, AVG = 2, MED = 3 };
+
+  /**
+   * @brief Encodes a grayscale frame
+   *
+   * @param src The pixels, row by row
+   * @param width The width of the frame
+   * @param height The height of the frame
+   * @param dst The output buffer
+   * @param capacity The size of the output buffer
+   * @param stride The distance of the rows in src, 0 if they are contiguous.
+   * Used to encode a tile of a larger frame.
+   *
+   * @return The size of the encoded frame, or 0 if it didn't fit into the
+   * output buffer or the dimensions are invalid
+   */
+  static size_t encode(const uint8_t *src, uint16_t width, uint16_t height,
+                       uint8_t *dst, size_t capacity, size_t stride = 0);
+
+  /**
+   * @brief Decodes a frame created by encode()
+   *
+   * @param src The encoded frame
+   * @param len The size of the encoded frame
+   * @param dst The output buffer for the pixels
+   * @param capacity The size of the output buffer
+   * @param width Set to the width of the frame
+   * @param height Set to the height of the frame
+   *
+   * @return
+   *    - true : if the frame was decoded
+   *
+   *    - false : if the data is corrupted or doesn't fit into the buffer
+   */
+  static bool decode(const uint8_t *src, size_t len, uint8_t *dst,
+                     size_t capacity, uint16_t *width, uint16_t *height);
+
+  /**
+   * @brief Computes the residuals of one row with the given filter
+   *
+   * @note Public, like choose_filter(), so gray_codec_bench can time the
+   * filters apart from the Rice coding.
+   *
+   * @param cur The row to filter
+   * @param up The previous row, all zeros for the first row
+   * @param width The width of the row
+   * @param filter The prediction filter
+   * @param out The residuals
+   */
+  static void filter_row(const uint8_t *cur, const uint8_t *up, uint16_t width,
+                         Filter filter, uint8_t *out);
+
+  /**
+   * @brief Estimates the coded size of a row for every filter on a subsample
+   * of the row, and returns the cheapest filter
+   */
+  static Filter choose_filter(const uint8_t *cur, const uint8_t *up,
+                              uint16_t width);
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @brief Word-parallel (SIMD within a register) helpers for 8-bit pixels
+ *
+ * Every function processes the four bytes of a 32-bit word independently,
+ * without carries crossing byte boundaries. The loads and stores go through
+ * memcpy, so the pointers don't need to be aligned.
+ */
+namespace swar {
+
+constexpr uint32_t HIGH_BITS = 0x80808080;
+constexpr uint32_t LOW_BITS = 0x01010101;
+
+/**
+ * @return The byte repeated in all four bytes
+ */
+inline uint32_t broadcast(uint8_t v) { return v * LOW_BITS; }
+
+/**
+ * @brief Loads four pixels
+ */
+inline uint32_t load(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/**
+ * @brief Stores four pixels
+ */
+inline void store(uint8_t *p, uint32_t v) { memcpy(p, &v, sizeof(v)); }
+
+/**
+ * @return The bytewise a - b modulo 256
+ */
+inline uint32_t sub(uint32_t a, uint32_t b) {
+  return ((a | HIGH_BITS) - (b & ~HIGH_BITS)) ^ ((a ^ ~b) & HIGH_BITS);
+}
+
+/**
+ * @return The bytewise a + b modulo 256
+ */
+inline uint32_t add(uint32_t a, uint32_t b) {
+  return ((a & ~HIGH_BITS) + (b & ~HIGH_BITS)) ^ ((a ^ b) & HIGH_BITS);
+}
+
+/**
+ * @return The bytewise floor((a + b) / 2)
+ */
+inline uint32_t avg(uint32_t a, uint32_t b) {
+  return (a & b) + (((a ^ b) & ~LOW_BITS) >> 1);
+}
+
+/**
+ * @return The bytewise zigzag mapping of signed residuals: 0, -1, 1, -2, ...
+ * become 0, 1, 2, 3, ...
+ */
+inline uint32_t zigzag(uint32_t v) {
+  uint32_t sign = (v >> 7) & LOW_BITS;
+  return ((v << 1) & ~LOW_BITS) ^ (sign * 0xFF);
+}
+
+/**
+ * @return 0x80 in the bytes where a < b, 0 elsewhere
+ */
+inline uint32_t less_than(uint32_t a, uint32_t b) {
+  // The borrow out of every byte of a - b
+  return ((~a & b) | (~(a ^ b) & sub(a, b))) & HIGH_BITS;
+}
+
+/**
+ * @return The sums of the byte pairs in two 16-bit lanes: bytes 0 + 1 in the
+ * low and bytes 2 + 3 in the high lane. The lanes can accumulate 128 words
+ * without overflow.
+ */
+inline uint32_t pair_sum(uint32_t v) {
+  return (v & 0x00FF00FF) + ((v >> 8) & 0x00FF00FF);
+}
+
+/**
+ * @return The sum of the four bytes
+ */
+inline uint32_t sum(uint32_t v) {
+  v = (v & 0x00FF00FF) + ((v >> 8) & 0x00FF00FF);
+  return (v & 0xFFFF) + (v >> 16);
+}
+
+} // namespace swar
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Downscales grayscale frames for the progressive upload
+ *
+ * Every thumbnail pixel is the mean of a scale x scale box of the frame,
+ * summed four pixels at a time in 32-bit words (see swar.h). The right and
+ * bottom edges which don't fill a whole box are dropped.
+ */
+class Thumbnail {
+public:
+  /**
+   * @return true if the scale is supported: 4, 8 or 16
+   */
+  static bool supported_scale(uint16_t scale) {
+    return scale == 4 || scale == 8 || scale == 16;
+  }
+
+  /**
+   * @brief Downscales a frame
+   *
+   * @param src The pixels, row by row
+   * @param width The width of the frame
+   * @param height The height of the frame
+   * @param scale The downscaling factor, see supported_scale()
+   * @param dst The output, (width / scale) x (height / scale) pixels
+   * @param capacity The size of the output buffer
+   *
+   * @return The size of the thumbnail, or 0 if the scale is not supported or
+   * the thumbnail doesn't fit into the output buffer
+   */
+  static size_t downscale(const uint8_t *src, uint16_t width, uint16_t height,
+                          uint16_t scale, uint8_t *dst, size_t capacity);
+};
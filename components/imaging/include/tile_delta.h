@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Tile-based delta frames against a keyframe
+ *
+ * The frame is split into 64 x 64 pixel tiles, and every tile has a
+ * fingerprint of FINGERPRINT_SIZE bytes:
+ *
+ *    - for tolerance 0, the CRC-16 of all its rows. Every change of up to
+ *      two neighbouring pixels is sent, a larger change is missed with a
+ *      chance of 1 in 65536 until the next keyframe.
+ *
+ *    - otherwise the means of its top and bottom 64 x 32 halves, summed four
+ *      pixels at a time in 32-bit words (see swar.h) on every second row. A
+ *      tile is sent when a mean differs from the keyframe's by more than the
+ *      tolerance. The reconstruction is lossy: changes within the tolerance,
+ *      changes on the skipped rows and changes which keep the means are not
+ *      sent.
+ *
+ * The fingerprints of a keyframe are only comparable with ones computed
+ * with the same tolerance.
+ *
+ * Every tile of a delta frame is compressed on its own with the GRAY codec,
+ * or stored raw if it doesn't shrink.
+ *
+ * Encoded layout, little-endian:
+ *
+ *    - "SGD" magic and the format version (4 bytes)
+ *
+ *    - width, height, tile size and tile count (4 x 2 bytes)
+ *
+ *    - the id of the keyframe the delta applies to (4 bytes)
+ *
+ *    - per tile: the tile index in row-major order (2 bytes), the size of the
+ *      GRAY codec stream, 0 for raw pixels (2 bytes), and the data
+ */
+class TileDelta {
+public:
+  /**
+   * @brief The name of the codec advertised in the image header
+   */
+  static constexpr const char *NAME = "sgd1";
+  static constexpr uint8_t VERSION = 1;
+  static constexpr uint16_t TILE_SIZE = 64;
+  static constexpr uint32_t TILE_PIXELS = TILE_SIZE * TILE_SIZE;
+  static constexpr uint32_t HEADER_SIZE = 16;
+  static constexpr uint32_t TILE_HEADER_SIZE = 4;
+  // Keeps the fingerprints of a keyframe in 2 KB of RTC memory
+  static constexpr uint32_t FINGERPRINT_SIZE = 2;
+  static constexpr uint32_t MAX_TILES = 1000; // 2560 x 1600
+  static constexpr uint16_t MAX_WIDTH = 4096;
+
+  /**
+   * @return true if the frame can be split into whole tiles, and has at most
+   * MAX_TILES tiles
+   */
+  static bool supported(uint16_t width, uint16_t height);
+
+  /**
+   * @return The number of tiles of the frame
+   */
+  static uint32_t tile_count(uint16_t width, uint16_t height) {
+    return static_cast<uint32_t>(width / TILE_SIZE) * (height / TILE_SIZE);
+  }
+
+  /**
+   * @brief Computes the fingerprints of every tile of a supported frame
+   *
+   * @param src The pixels, row by row
+   * @param width The width of the frame
+   * @param height The height of the frame
+   * @param tolerance The tolerance the fingerprints are compared with, 0
+   * hashes the tiles, otherwise the means of the halves are taken
+   * @param fingerprints The output, FINGERPRINT_SIZE bytes per tile
+   */
+  static void compute_fingerprints(const uint8_t *src, uint16_t width,
+                                   uint16_t height, uint8_t tolerance,
+                                   uint8_t *fingerprints);
+
+  /**
+   * @brief Collects the tiles which changed since the keyframe
+   *
+   * @param reference The fingerprints of the keyframe
+   * @param current The fingerprints of the current frame
+   * @param count The number of tiles
+   * @param tolerance The largest difference of a mean which is not
+   * a change, the tolerance the fingerprints were computed with
+   * @param indices The output, the indices of the changed tiles
+   *
+   * @return The number of changed tiles
+   */
+  static uint32_t changed_tiles(const uint8_t *reference,
+                                const uint8_t *current, uint32_t count,
+                                uint8_t tolerance, uint16_t *indices);
+
+  /**
+   * @brief Encodes the given tiles of a supported frame as a delta frame
+   *
+   * @param src The pixels, row by row
+   * @param width The width of the frame
+   * @param height The height of the frame
+   * @param keyframe_id The id of the keyframe the delta applies to
+   * @param indices The indices of the tiles to send
+   * @param count The number of tiles to send
+   * @param compress true to compress the tiles with the GRAY codec
+   * @param dst The output buffer
+   * @param capacity The size of the output buffer
+   *
+   * @return The size of the delta frame, or 0 if it didn't fit into the output
+   * buffer or the frame is not supported
+   */
+  static size_t encode(const uint8_t *src, uint16_t width, uint16_t height,
+                       uint32_t keyframe_id, const uint16_t *indices,
+                       uint32_t count, bool compress, uint8_t *dst,
+                       size_t capacity);
+
+  /**
+   * @brief Applies a delta frame created by encode() to its keyframe
+   *
+   * @param src The delta frame
+   * @param len The size of the delta frame
+   * @param frame The pixels of the keyframe, overwritten with the new frame
+   * @param width The width of the keyframe
+   * @param height The height of the keyframe
+   * @param keyframe_id Set to the id of the keyframe the delta applies to
+   *
+   * @return
+   *    - true : if the delta was applied
+   *
+   *    - false : if the data is corrupted or doesn't match the frame size
+   */
+  static bool apply(const uint8_t *src, size_t len, uint8_t *frame,
+                    uint16_t width, uint16_t height, uint32_t *keyframe_id);
+};
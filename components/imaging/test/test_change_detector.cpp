@@ -0,0 +1,63 @@
+#include "change_detector.h"
+#include "esp_heap_caps.h"
+#include "unity.h"
+#include <cstdlib>
+#include <cstring>
+
+constexpr uint16_t WIDTH = 2560;
+constexpr uint16_t HEIGHT = 1600;
+constexpr size_t FRAME_SIZE = WIDTH * HEIGHT;
+constexpr uint8_t TOLERANCE = 6;
+
+static uint8_t *test_frame() {
+  auto *frame =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  for (uint32_t y = 0; y < HEIGHT; y++) {
+    for (uint32_t x = 0; x < WIDTH; x++) {
+      frame[y * WIDTH + x] = static_cast<uint8_t>(x / 20 + y / 14 + rand() % 5);
+    }
+  }
+  return frame;
+}
+
+TEST_CASE("Change detector ignores brightness and noise", "[imaging]") {
+  uint8_t *frame = test_frame();
+  uint8_t previous[ChangeDetector::SIGNATURE_SIZE];
+  uint8_t current[ChangeDetector::SIGNATURE_SIZE];
+  TEST_ASSERT_TRUE(
+      ChangeDetector::compute_signature(frame, WIDTH, HEIGHT, previous));
+
+  // Uniformly brighter scene with fresh noise
+  for (size_t i = 0; i < FRAME_SIZE; i++) {
+    frame[i] = static_cast<uint8_t>(frame[i] + 8 + rand() % 3);
+  }
+  TEST_ASSERT_TRUE(
+      ChangeDetector::compute_signature(frame, WIDTH, HEIGHT, current));
+  TEST_ASSERT_EQUAL_FLOAT(0.0f,
+                          ChangeDetector::score(previous, current, TOLERANCE));
+
+  heap_caps_free(frame);
+}
+
+TEST_CASE("Change detector scores a new object", "[imaging]") {
+  uint8_t *frame = test_frame();
+  uint8_t previous[ChangeDetector::SIGNATURE_SIZE];
+  uint8_t current[ChangeDetector::SIGNATURE_SIZE];
+  TEST_ASSERT_TRUE(
+      ChangeDetector::compute_signature(frame, WIDTH, HEIGHT, previous));
+
+  // Dark 256 x 256 object covering 16 blocks
+  for (uint32_t y = 128; y < 384; y++) {
+    memset(frame + y * WIDTH + 512, 0, 256);
+  }
+  TEST_ASSERT_TRUE(
+      ChangeDetector::compute_signature(frame, WIDTH, HEIGHT, current));
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 1.6f,
+                           ChangeDetector::score(previous, current, TOLERANCE));
+
+  TEST_ASSERT_FALSE(
+      ChangeDetector::compute_signature(frame, 20, HEIGHT, current));
+
+  heap_caps_free(frame);
+}
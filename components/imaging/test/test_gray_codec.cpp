@@ -0,0 +1,85 @@
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "gray_codec.h"
+#include "unity.h"
+#include <cstdlib>
+#include <cstring>
+
+constexpr uint16_t WIDTH = 640;
+constexpr uint16_t HEIGHT = 480;
+constexpr size_t FRAME_SIZE = WIDTH * HEIGHT;
+
+static uint8_t *test_frame() {
+  auto *frame =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  // Smooth gradient with a little noise, like a real scene
+  for (uint32_t y = 0; y < HEIGHT; y++) {
+    for (uint32_t x = 0; x < WIDTH; x++) {
+      frame[y * WIDTH + x] =
+          static_cast<uint8_t>((x / 4 + y / 3 + (rand() % 5)) & 0xFF);
+    }
+  }
+  return frame;
+}
+
+TEST_CASE("Gray codec round trip is lossless", "[imaging]") {
+  uint8_t *frame = test_frame();
+  auto *encoded =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  auto *decoded =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(encoded);
+  TEST_ASSERT_NOT_NULL(decoded);
+
+  int64_t start = esp_timer_get_time();
+  size_t size = GrayCodec::encode(frame, WIDTH, HEIGHT, encoded, FRAME_SIZE);
+  int64_t encode_us = esp_timer_get_time() - start;
+  TEST_ASSERT_GREATER_THAN(0, size);
+  TEST_ASSERT_LESS_THAN(FRAME_SIZE, size);
+
+  uint16_t width = 0;
+  uint16_t height = 0;
+  start = esp_timer_get_time();
+  TEST_ASSERT_TRUE(GrayCodec::decode(encoded, size, decoded, FRAME_SIZE,
+                                     &width, &height));
+  int64_t decode_us = esp_timer_get_time() - start;
+  TEST_ASSERT_EQUAL(WIDTH, width);
+  TEST_ASSERT_EQUAL(HEIGHT, height);
+  TEST_ASSERT_EQUAL_MEMORY(frame, decoded, FRAME_SIZE);
+
+  ESP_LOGI("Gray codec test", "Ratio: %.2f, encode: %.2f MB/s, decode: %.2f MB/s",
+           static_cast<double>(FRAME_SIZE) / size,
+           static_cast<double>(FRAME_SIZE) / encode_us,
+           static_cast<double>(FRAME_SIZE) / decode_us);
+
+  heap_caps_free(frame);
+  heap_caps_free(encoded);
+  heap_caps_free(decoded);
+}
+
+TEST_CASE("Gray codec rejects too small buffers and corrupted data",
+          "[imaging]") {
+  uint8_t *frame = test_frame();
+  auto *encoded =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(encoded);
+
+  TEST_ASSERT_EQUAL(0, GrayCodec::encode(frame, WIDTH, HEIGHT, encoded, 1000));
+
+  size_t size = GrayCodec::encode(frame, WIDTH, HEIGHT, encoded, FRAME_SIZE);
+  TEST_ASSERT_GREATER_THAN(0, size);
+  uint16_t width = 0;
+  uint16_t height = 0;
+  // Truncated data
+  TEST_ASSERT_FALSE(GrayCodec::decode(encoded, size / 2, frame, FRAME_SIZE,
+                                      &width, &height));
+  // Wrong magic
+  encoded[0] = 'X';
+  TEST_ASSERT_FALSE(GrayCodec::decode(encoded, size, frame, FRAME_SIZE, &width,
+                                      &height));
+
+  heap_caps_free(frame);
+  heap_caps_free(encoded);
+}
@@ -0,0 +1,33 @@
+#include "esp_heap_caps.h"
+#include "thumbnail.h"
+#include "unity.h"
+
+constexpr uint16_t WIDTH = 640;
+constexpr uint16_t HEIGHT = 480;
+constexpr size_t FRAME_SIZE = WIDTH * HEIGHT;
+
+TEST_CASE("Thumbnail is the box mean of the frame", "[imaging]") {
+  auto *frame =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  for (uint32_t y = 0; y < HEIGHT; y++) {
+    for (uint32_t x = 0; x < WIDTH; x++) {
+      // Alternating 100 / 180 columns, the rows get brighter
+      frame[y * WIDTH + x] = static_cast<uint8_t>((x % 2 ? 180 : 100) + y / 8);
+    }
+  }
+
+  uint8_t thumbnail[80 * 60];
+  TEST_ASSERT_EQUAL(80 * 60, Thumbnail::downscale(frame, WIDTH, HEIGHT, 8,
+                                                  thumbnail,
+                                                  sizeof(thumbnail)));
+  TEST_ASSERT_EQUAL_UINT8(140, thumbnail[0]);
+  TEST_ASSERT_EQUAL_UINT8(140 + 59, thumbnail[80 * 59 + 79]);
+
+  TEST_ASSERT_EQUAL(0, Thumbnail::downscale(frame, WIDTH, HEIGHT, 3, thumbnail,
+                                            sizeof(thumbnail)));
+  TEST_ASSERT_EQUAL(0, Thumbnail::downscale(frame, WIDTH, HEIGHT, 4, thumbnail,
+                                            sizeof(thumbnail)));
+
+  heap_caps_free(frame);
+}
@@ -0,0 +1,115 @@
+#include "esp_heap_caps.h"
+#include "tile_delta.h"
+#include "unity.h"
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+
+constexpr uint16_t WIDTH = 640;
+constexpr uint16_t HEIGHT = 448;
+constexpr size_t FRAME_SIZE = WIDTH * HEIGHT;
+constexpr uint32_t TILES = WIDTH / 64 * (HEIGHT / 64);
+
+static uint8_t *test_frame() {
+  auto *frame =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  for (uint32_t y = 0; y < HEIGHT; y++) {
+    for (uint32_t x = 0; x < WIDTH; x++) {
+      frame[y * WIDTH + x] = static_cast<uint8_t>(x / 4 + y / 3 + rand() % 5);
+    }
+  }
+  return frame;
+}
+
+TEST_CASE("Tile delta rebuilds the frame from its keyframe", "[imaging]") {
+  uint8_t *keyframe = test_frame();
+  auto *frame =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  auto *encoded =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  TEST_ASSERT_NOT_NULL(encoded);
+  TEST_ASSERT_TRUE(TileDelta::supported(WIDTH, HEIGHT));
+  TEST_ASSERT_FALSE(TileDelta::supported(WIDTH, 480));
+
+  // An object covering 2 x 2 tiles
+  memcpy(frame, keyframe, FRAME_SIZE);
+  for (uint32_t y = 100; y < 160; y++) {
+    memset(frame + y * WIDTH + 200, 0, 60);
+  }
+
+  uint8_t reference[TILES * TileDelta::FINGERPRINT_SIZE];
+  uint8_t current[TILES * TileDelta::FINGERPRINT_SIZE];
+  uint16_t indices[TILES];
+  TileDelta::compute_fingerprints(keyframe, WIDTH, HEIGHT, 0, reference);
+  TileDelta::compute_fingerprints(frame, WIDTH, HEIGHT, 0, current);
+  uint32_t count =
+      TileDelta::changed_tiles(reference, current, TILES, 0, indices);
+  TEST_ASSERT_EQUAL_UINT32(4, count);
+
+  for (bool compress : {false, true}) {
+    size_t size = TileDelta::encode(frame, WIDTH, HEIGHT, 42, indices, count,
+                                    compress, encoded, FRAME_SIZE);
+    TEST_ASSERT_GREATER_THAN(0, size);
+    TEST_ASSERT_LESS_OR_EQUAL(TileDelta::HEADER_SIZE +
+                                  count * (TileDelta::TILE_HEADER_SIZE +
+                                           TileDelta::TILE_PIXELS),
+                              size);
+
+    uint8_t *rebuilt = test_frame();
+    memcpy(rebuilt, keyframe, FRAME_SIZE);
+    uint32_t keyframe_id = 0;
+    TEST_ASSERT_TRUE(TileDelta::apply(encoded, size, rebuilt, WIDTH, HEIGHT,
+                                      &keyframe_id));
+    TEST_ASSERT_EQUAL_UINT32(42, keyframe_id);
+    TEST_ASSERT_EQUAL_MEMORY(frame, rebuilt, FRAME_SIZE);
+    // Truncated data
+    TEST_ASSERT_FALSE(TileDelta::apply(encoded, size - 1, rebuilt, WIDTH,
+                                       HEIGHT, &keyframe_id));
+    heap_caps_free(rebuilt);
+  }
+
+  heap_caps_free(keyframe);
+  heap_caps_free(frame);
+  heap_caps_free(encoded);
+}
+
+TEST_CASE("Tile delta sends every change at tolerance 0", "[imaging]") {
+  uint8_t *keyframe = test_frame();
+  auto *frame =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+
+  // Odd rows of the first tile only, and two pixels of the second tile which
+  // keep its means
+  memcpy(frame, keyframe, FRAME_SIZE);
+  for (uint32_t y = 1; y < 64; y += 2) {
+    memset(frame + y * WIDTH, 0, 64);
+  }
+  frame[64] = keyframe[64] + 1;
+  frame[65] = keyframe[65] - 1;
+  if (keyframe[64] == 255 || keyframe[65] == 0) {
+    frame[64] = keyframe[64] - 1;
+    frame[65] = keyframe[65] + 1;
+  }
+
+  uint8_t reference[TILES * TileDelta::FINGERPRINT_SIZE];
+  uint8_t current[TILES * TileDelta::FINGERPRINT_SIZE];
+  uint16_t indices[TILES];
+  TileDelta::compute_fingerprints(keyframe, WIDTH, HEIGHT, 0, reference);
+  TileDelta::compute_fingerprints(frame, WIDTH, HEIGHT, 0, current);
+  TEST_ASSERT_EQUAL_UINT32(
+      2, TileDelta::changed_tiles(reference, current, TILES, 0, indices));
+  TEST_ASSERT_EQUAL_UINT16(0, indices[0]);
+  TEST_ASSERT_EQUAL_UINT16(1, indices[1]);
+
+  // The means only see every second row, the tolerance is lossy
+  TileDelta::compute_fingerprints(keyframe, WIDTH, HEIGHT, 2, reference);
+  TileDelta::compute_fingerprints(frame, WIDTH, HEIGHT, 2, current);
+  TEST_ASSERT_EQUAL_UINT32(
+      0, TileDelta::changed_tiles(reference, current, TILES, 2, indices));
+
+  heap_caps_free(keyframe);
+  heap_caps_free(frame);
+}
@@ -0,0 +1,35 @@
+#include "thumbnail.h"
+#include "swar.h"
+
+size_t Thumbnail::downscale(const uint8_t *src, uint16_t width,
+                            uint16_t height, uint16_t scale, uint8_t *dst,
+                            size_t capacity) {
+  if (!src || !dst || !supported_scale(scale)) {
+    return 0;
+  }
+  uint32_t thumbnail_width = width / scale;
+  uint32_t thumbnail_height = height / scale;
+  size_t size = static_cast<size_t>(thumbnail_width) * thumbnail_height;
+  if (size == 0 || size > capacity) {
+    return 0;
+  }
+
+  // At most 16 rows of 4 words, the 16-bit lanes can't overflow
+  const uint32_t count = scale * scale;
+  for (uint32_t ty = 0; ty < thumbnail_height; ty++) {
+    const uint8_t *rows = src + static_cast<size_t>(ty) * scale * width;
+    for (uint32_t tx = 0; tx < thumbnail_width; tx++) {
+      const uint8_t *box = rows + tx * scale;
+      uint32_t lanes = 0;
+      for (uint32_t y = 0; y < scale; y++) {
+        const uint8_t *row = box + static_cast<size_t>(y) * width;
+        for (uint32_t x = 0; x < scale; x += 4) {
+          lanes += swar::pair_sum(swar::load(row + x));
+        }
+      }
+      dst[ty * thumbnail_width + tx] = static_cast<uint8_t>(
+          ((lanes & 0xFFFF) + (lanes >> 16) + count / 2) / count);
+    }
+  }
+  return size;
+}
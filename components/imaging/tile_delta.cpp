@@ -0,0 +1,207 @@
+#include "tile_delta.h"
+#include "esp_rom_crc.h"
+#include "gray_codec.h"
+#include "swar.h"
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+namespace {
+
+constexpr char MAGIC[3] = {'S', 'G', 'D'};
+constexpr uint16_t QUADRANT_SIZE = TileDelta::TILE_SIZE / 2;
+constexpr uint16_t ROW_STEP = 2;
+
+void put_u16(uint8_t *dst, uint16_t value) {
+  dst[0] = static_cast<uint8_t>(value);
+  dst[1] = static_cast<uint8_t>(value >> 8);
+}
+
+void put_u32(uint8_t *dst, uint32_t value) {
+  put_u16(dst, static_cast<uint16_t>(value));
+  put_u16(dst + 2, static_cast<uint16_t>(value >> 16));
+}
+
+uint16_t get_u16(const uint8_t *src) {
+  return static_cast<uint16_t>(src[0] | (src[1] << 8));
+}
+
+uint32_t get_u32(const uint8_t *src) {
+  return get_u16(src) | (static_cast<uint32_t>(get_u16(src + 2)) << 16);
+}
+
+// Offset of the top left pixel of a tile in the frame
+size_t tile_offset(uint16_t width, uint32_t tile) {
+  uint32_t columns = width / TileDelta::TILE_SIZE;
+  return static_cast<size_t>(tile / columns) * TileDelta::TILE_SIZE * width +
+         (tile % columns) * TileDelta::TILE_SIZE;
+}
+
+// Sum of a quadrant, sampling every ROW_STEP-th row
+uint32_t quadrant_sum(const uint8_t *src, uint16_t width) {
+  // The 16-bit lanes of a quadrant don't overflow, the ones of a half would
+  uint32_t lanes = 0;
+  for (uint16_t y = 0; y < QUADRANT_SIZE; y += ROW_STEP) {
+    const uint8_t *row = src + static_cast<size_t>(y) * width;
+    for (uint16_t x = 0; x < QUADRANT_SIZE; x += 4) {
+      lanes += swar::pair_sum(swar::load(row + x));
+    }
+  }
+  return (lanes & 0xFFFF) + (lanes >> 16);
+}
+
+// Mean of a half tile, the two quadrants side by side
+uint8_t half_mean(const uint8_t *src, uint16_t width) {
+  constexpr uint32_t count = QUADRANT_SIZE * QUADRANT_SIZE * 2 / ROW_STEP;
+  uint32_t sum = quadrant_sum(src, width) +
+                 quadrant_sum(src + QUADRANT_SIZE, width);
+  return static_cast<uint8_t>((sum + count / 2) / count);
+}
+
+// CRC-16 of every row of a tile
+uint16_t tile_hash(const uint8_t *src, uint16_t width) {
+  uint16_t crc = 0;
+  for (uint16_t y = 0; y < TileDelta::TILE_SIZE; y++) {
+    crc = esp_rom_crc16_le(crc, src + static_cast<size_t>(y) * width,
+                           TileDelta::TILE_SIZE);
+  }
+  return crc;
+}
+
+} // namespace
+
+bool TileDelta::supported(uint16_t width, uint16_t height) {
+  return width > 0 && height > 0 && width <= MAX_WIDTH &&
+         width % TILE_SIZE == 0 && height % TILE_SIZE == 0 &&
+         tile_count(width, height) <= MAX_TILES;
+}
+
+void TileDelta::compute_fingerprints(const uint8_t *src, uint16_t width,
+                                     uint16_t height, uint8_t tolerance,
+                                     uint8_t *fingerprints) {
+  uint32_t count = tile_count(width, height);
+  for (uint32_t tile = 0; tile < count; tile++) {
+    const uint8_t *origin = src + tile_offset(width, tile);
+    uint8_t *fingerprint = fingerprints + tile * FINGERPRINT_SIZE;
+    if (tolerance == 0) {
+      put_u16(fingerprint, tile_hash(origin, width));
+      continue;
+    }
+    const size_t down = static_cast<size_t>(QUADRANT_SIZE) * width;
+    fingerprint[0] = half_mean(origin, width);
+    fingerprint[1] = half_mean(origin + down, width);
+  }
+}
+
+uint32_t TileDelta::changed_tiles(const uint8_t *reference,
+                                  const uint8_t *current, uint32_t count,
+                                  uint8_t tolerance, uint16_t *indices) {
+  uint32_t changed = 0;
+  for (uint32_t tile = 0; tile < count; tile++) {
+    for (uint32_t i = tile * FINGERPRINT_SIZE;
+         i < (tile + 1) * FINGERPRINT_SIZE; i++) {
+      if (abs(current[i] - reference[i]) > tolerance) {
+        indices[changed++] = static_cast<uint16_t>(tile);
+        break;
+      }
+    }
+  }
+  return changed;
+}
+
+size_t TileDelta::encode(const uint8_t *src, uint16_t width, uint16_t height,
+                         uint32_t keyframe_id, const uint16_t *indices,
+                         uint32_t count, bool compress, uint8_t *dst,
+                         size_t capacity) {
+  if (!src || !dst || !supported(width, height) || capacity < HEADER_SIZE) {
+    return 0;
+  }
+
+  dst[0] = MAGIC[0];
+  dst[1] = MAGIC[1];
+  dst[2] = MAGIC[2];
+  dst[3] = VERSION;
+  put_u16(dst + 4, width);
+  put_u16(dst + 6, height);
+  put_u16(dst + 8, TILE_SIZE);
+  put_u16(dst + 10, static_cast<uint16_t>(count));
+  put_u32(dst + 12, keyframe_id);
+
+  size_t pos = HEADER_SIZE;
+  for (uint32_t i = 0; i < count; i++) {
+    if (capacity - pos < TILE_HEADER_SIZE + TILE_PIXELS) {
+      return 0;
+    }
+    uint16_t tile = indices[i];
+    const uint8_t *origin = src + tile_offset(width, tile);
+    uint8_t *data = dst + pos + TILE_HEADER_SIZE;
+
+    // Tiles that don't shrink are stored raw
+    size_t size = compress ? GrayCodec::encode(origin, TILE_SIZE, TILE_SIZE,
+                                               data, TILE_PIXELS - 1, width)
+                           : 0;
+    if (size == 0) {
+      for (uint16_t y = 0; y < TILE_SIZE; y++) {
+        memcpy(data + y * TILE_SIZE, origin + static_cast<size_t>(y) * width,
+               TILE_SIZE);
+      }
+    }
+    put_u16(dst + pos, tile);
+    put_u16(dst + pos + 2, static_cast<uint16_t>(size));
+    pos += TILE_HEADER_SIZE + (size > 0 ? size : TILE_PIXELS);
+  }
+  return pos;
+}
+
+bool TileDelta::apply(const uint8_t *src, size_t len, uint8_t *frame,
+                      uint16_t width, uint16_t height, uint32_t *keyframe_id) {
+  if (!src || !frame || len < HEADER_SIZE || src[0] != MAGIC[0] ||
+      src[1] != MAGIC[1] || src[2] != MAGIC[2] || src[3] != VERSION ||
+      get_u16(src + 4) != width || get_u16(src + 6) != height ||
+      get_u16(src + 8) != TILE_SIZE || !supported(width, height)) {
+    return false;
+  }
+
+  uint32_t count = get_u16(src + 10);
+  std::unique_ptr<uint8_t[]> pixels(new uint8_t[TILE_PIXELS]);
+  size_t pos = HEADER_SIZE;
+  for (uint32_t i = 0; i < count; i++) {
+    if (len - pos < TILE_HEADER_SIZE) {
+      return false;
+    }
+    uint16_t tile = get_u16(src + pos);
+    uint16_t size = get_u16(src + pos + 2);
+    pos += TILE_HEADER_SIZE;
+    if (tile >= tile_count(width, height)) {
+      return false;
+    }
+
+    const uint8_t *data = src + pos;
+    if (size == 0) {
+      if (len - pos < TILE_PIXELS) {
+        return false;
+      }
+      pos += TILE_PIXELS;
+    } else {
+      uint16_t tile_width = 0;
+      uint16_t tile_height = 0;
+      if (len - pos < size ||
+          !GrayCodec::decode(data, size, pixels.get(), TILE_PIXELS,
+                             &tile_width, &tile_height) ||
+          tile_width != TILE_SIZE || tile_height != TILE_SIZE) {
+        return false;
+      }
+      data = pixels.get();
+      pos += size;
+    }
+
+    uint8_t *origin = frame + tile_offset(width, tile);
+    for (uint16_t y = 0; y < TILE_SIZE; y++) {
+      memcpy(origin + static_cast<size_t>(y) * width, data + y * TILE_SIZE,
+             TILE_SIZE);
+    }
+  }
+
+  *keyframe_id = get_u32(src + 12);
+  return true;
+}
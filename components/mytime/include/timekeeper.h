@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief The RTC clock model, kept in RTC memory through deep sleep
+ */
+struct ClockModel {
+  bool synced;              /*!< the clock was set by NTP since the cold boot */
+  int64_t synced_at_us;     /*!< UTC time of the last NTP sync */
+  int64_t corrected_at_us;  /*!< UTC time of the last drift correction */
+  int32_t drift_ppb;        /*!< the RTC runs fast by this rate, if positive */
+  uint32_t uncertainty_ppb; /*!< the expected error of the drift rate */
+  uint16_t samples;         /*!< the syncs the drift was measured at */
+};
+
+/**
+ * @brief Keeps the UTC time between NTP syncs
+ *
+ * The RTC keeps the time through deep sleep, but its slow clock drifts by
+ * hundreds of ppm. At every NTP sync the offset of the clock is measured,
+ * and the drift rate is estimated from the offset and the time since the
+ * previous sync, together with its uncertainty. After each wake the clock is
+ * corrected by the estimated drift, and the error of the clock is predicted
+ * from the uncertainty and the time since the last sync.
+ *
+ * NTP is only waited for when the predicted error exceeds the bound, or the
+ * clock was never synced, otherwise the sync can run in the background while
+ * the device is online.
+ */
+class Timekeeper {
+public:
+  /**
+   * @brief Corrects the clock by the estimated drift since the last
+   * correction, called once after the wake before the time is read
+   */
+  static void begin();
+
+  /**
+   * @brief Whether the predicted error of the clock exceeds the bound
+   *
+   * @param max_error_ms The bound in milliseconds
+   *
+   * @return true if the clock was never synced, or its error may exceed the
+   * bound
+   */
+  static bool needs_sync(uint32_t max_error_ms);
+
+  /**
+   * @brief Syncs the clock with NTP and waits for the result
+   *
+   * @param timeout_ms The time to wait for the NTP server
+   *
+   * @return false if the server didn't answer in time
+   */
+  static bool sync(uint32_t timeout_ms);
+
+  /**
+   * @brief Starts the NTP sync without waiting, the clock model is updated
+   * when the server answers
+   */
+  static void start_sync();
+
+  /**
+   * @return The predicted error of the clock in milliseconds, or UINT32_MAX
+   * if it was never synced
+   */
+  static uint32_t get_error_ms();
+
+  /**
+   * @return The clock model
+   */
+  static const ClockModel &get_model();
+
+  /**
+   * @brief The error of the clock predicted by the model
+   *
+   * @param model The clock model
+   * @param now_us The UTC time in microseconds
+   *
+   * @return The predicted error in milliseconds, UINT32_MAX if the clock was
+   * never synced
+   */
+  static uint32_t predict_error_ms(const ClockModel &model, int64_t now_us);
+
+  /**
+   * @brief The correction of the drift since the last correction
+   *
+   * @param model The clock model
+   * @param now_us The UTC time read from the RTC in microseconds
+   *
+   * @return The microseconds to add to the clock
+   */
+  static int64_t drift_correction_us(const ClockModel &model, int64_t now_us);
+
+  /**
+   * @brief Updates the drift rate and its uncertainty with an NTP sync
+   *
+   * @param model The clock model
+   * @param ntp_us The UTC time from NTP in microseconds
+   * @param offset_us The NTP time minus the time of the clock before the sync
+   */
+  static void update(ClockModel &model, int64_t ntp_us, int64_t offset_us);
+
+  /**
+   * @brief The error of the NTP time itself, from the network delay
+   */
+  static constexpr uint32_t SYNC_ERROR_MS{50};
+
+  /**
+   * @brief The drift uncertainty before it was measured, the internal RC
+   * oscillator of the RTC drifts this much with the temperature
+   */
+  static constexpr uint32_t DEFAULT_UNCERTAINTY_PPB{1000000};
+
+  /**
+   * @brief The drift is known better than this only with a crystal
+   */
+  static constexpr uint32_t MIN_UNCERTAINTY_PPB{5000};
+
+  /**
+   * @brief Syncs closer than this are not used to measure the drift, the NTP
+   * error would dominate the measured rate
+   */
+  static constexpr int64_t MIN_DRIFT_INTERVAL_S{10 * 60};
+
+private:
+  /**
+   * @brief Measures the offset of the clock when SNTP sets it
+   */
+  static void on_sync(struct timeval *tv);
+};
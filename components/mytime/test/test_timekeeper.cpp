@@ -0,0 +1,62 @@
+#include "timekeeper.h"
+#include "unity.h"
+
+constexpr int64_t HOUR_US = 3600LL * 1000000;
+
+TEST_CASE("The clock error is unknown before the first sync", "[timekeeper]") {
+  ClockModel model = {};
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX,
+                           Timekeeper::predict_error_ms(model, HOUR_US));
+  TEST_ASSERT_EQUAL_INT64(0, Timekeeper::drift_correction_us(model, HOUR_US));
+
+  Timekeeper::update(model, HOUR_US, 0);
+  TEST_ASSERT_TRUE(model.synced);
+  TEST_ASSERT_EQUAL_UINT16(0, model.samples);
+  TEST_ASSERT_EQUAL_UINT32(Timekeeper::SYNC_ERROR_MS,
+                           Timekeeper::predict_error_ms(model, HOUR_US));
+  // 1000 ppm for an hour
+  TEST_ASSERT_EQUAL_UINT32(Timekeeper::SYNC_ERROR_MS + 3600,
+                           Timekeeper::predict_error_ms(model, 2 * HOUR_US));
+}
+
+TEST_CASE("The drift is measured between syncs", "[timekeeper]") {
+  ClockModel model = {};
+  Timekeeper::update(model, 0, 0);
+
+  // The RTC ran 200 ppm fast for an hour
+  Timekeeper::update(model, HOUR_US, -720000);
+  TEST_ASSERT_EQUAL_UINT16(1, model.samples);
+  TEST_ASSERT_INT32_WITHIN(1, 200000, model.drift_ppb);
+  TEST_ASSERT_EQUAL_INT64(-720000,
+                          Timekeeper::drift_correction_us(model, 2 * HOUR_US));
+
+  // The corrected clock is off by the NTP error only, so the uncertainty
+  // shrinks
+  uint32_t uncertainty = model.uncertainty_ppb;
+  Timekeeper::update(model, 2 * HOUR_US, 1000);
+  TEST_ASSERT_LESS_THAN_UINT32(uncertainty, model.uncertainty_ppb);
+  TEST_ASSERT_INT32_WITHIN(1000, 200000, model.drift_ppb);
+
+  for (int64_t hour = 3; hour < 20; hour++) {
+    Timekeeper::update(model, hour * HOUR_US, 0);
+  }
+  TEST_ASSERT_EQUAL_UINT32(Timekeeper::MIN_UNCERTAINTY_PPB,
+                           model.uncertainty_ppb);
+}
+
+TEST_CASE("Close syncs and clock jumps keep the drift", "[timekeeper]") {
+  ClockModel model = {};
+  Timekeeper::update(model, 0, 0);
+  Timekeeper::update(model, HOUR_US, -720000);
+  int32_t drift = model.drift_ppb;
+
+  // Too close to the previous sync to measure
+  Timekeeper::update(model, HOUR_US + 60 * 1000000LL, -50000);
+  TEST_ASSERT_EQUAL_INT32(drift, model.drift_ppb);
+  TEST_ASSERT_EQUAL_INT64(HOUR_US + 60 * 1000000LL, model.synced_at_us);
+
+  // An offset of an hour is a set clock, not a drift
+  Timekeeper::update(model, 3 * HOUR_US, HOUR_US);
+  TEST_ASSERT_EQUAL_INT32(drift, model.drift_ppb);
+  TEST_ASSERT_EQUAL_UINT16(1, model.samples);
+}
@@ -0,0 +1,165 @@
+#include "timekeeper.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_netif_sntp.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "rtc_budget.h"
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <sys/time.h>
+
+constexpr auto *TAG = "Timekeeper";
+
+RTC_SLOW_ATTR static ClockModel s_model;
+static_assert(sizeof(s_model) <= rtc_budget::CLOCK,
+              "The clock model doesn't fit into its RTC memory");
+
+// The clock and esp_timer at the last correction, esp_timer runs from the
+// crystal while awake
+static int64_t s_reference_us = 0;
+static int64_t s_reference_timer_us = 0;
+static bool s_begun = false;
+static bool s_sntp_started = false;
+static portMUX_TYPE s_model_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static int64_t read_clock_us() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+void Timekeeper::begin() {
+  if (s_begun) {
+    return;
+  }
+  // Set timezone to Budapest
+  setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+  tzset();
+
+  int64_t now_us = read_clock_us();
+  int64_t correction_us = drift_correction_us(s_model, now_us);
+  if (correction_us != 0) {
+    now_us += correction_us;
+    struct timeval tv = {.tv_sec = static_cast<time_t>(now_us / 1000000),
+                         .tv_usec = static_cast<suseconds_t>(now_us % 1000000)};
+    settimeofday(&tv, nullptr);
+  }
+  if (s_model.synced) {
+    s_model.corrected_at_us = now_us;
+  }
+  s_reference_us = now_us;
+  s_reference_timer_us = esp_timer_get_time();
+  s_begun = true;
+  ESP_LOGI(TAG, "Clock corrected by %lld us, error %lu ms", correction_us,
+           get_error_ms());
+}
+
+bool Timekeeper::needs_sync(uint32_t max_error_ms) {
+  return get_error_ms() > max_error_ms;
+}
+
+bool Timekeeper::sync(uint32_t timeout_ms) {
+  ESP_LOGI(TAG, "Syncing time with NTP server...");
+  start_sync();
+  return esp_netif_sntp_sync_wait(pdMS_TO_TICKS(timeout_ms)) == ESP_OK;
+}
+
+void Timekeeper::start_sync() {
+  if (s_sntp_started) {
+    return;
+  }
+  begin();
+  esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG("pool.ntp.org");
+  config.sync_cb = on_sync;
+  if (esp_netif_sntp_init(&config) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to start SNTP!");
+    return;
+  }
+  s_sntp_started = true;
+}
+
+uint32_t Timekeeper::get_error_ms() {
+  taskENTER_CRITICAL(&s_model_mux);
+  ClockModel model = s_model;
+  taskEXIT_CRITICAL(&s_model_mux);
+  return predict_error_ms(model, read_clock_us());
+}
+
+const ClockModel &Timekeeper::get_model() { return s_model; }
+
+void Timekeeper::on_sync(struct timeval *tv) {
+  // SNTP has set the clock already, the clock before the sync is the one at
+  // the last correction moved on by esp_timer
+  int64_t ntp_us = static_cast<int64_t>(tv->tv_sec) * 1000000 + tv->tv_usec;
+  int64_t offset_us =
+      ntp_us - (s_reference_us + esp_timer_get_time() - s_reference_timer_us);
+  s_reference_us = ntp_us;
+  s_reference_timer_us = esp_timer_get_time();
+
+  taskENTER_CRITICAL(&s_model_mux);
+  ClockModel model = s_model;
+  taskEXIT_CRITICAL(&s_model_mux);
+  update(model, ntp_us, offset_us);
+  taskENTER_CRITICAL(&s_model_mux);
+  s_model = model;
+  taskEXIT_CRITICAL(&s_model_mux);
+
+  ESP_LOGI(TAG, "Clock synced, offset %lld us, drift %ld ppb +- %lu ppb",
+           offset_us, model.drift_ppb, model.uncertainty_ppb);
+}
+
+uint32_t Timekeeper::predict_error_ms(const ClockModel &model,
+                                      int64_t now_us) {
+  if (!model.synced) {
+    return UINT32_MAX;
+  }
+  int64_t since_s = (now_us - model.synced_at_us) / 1000000;
+  if (since_s < 0) {
+    since_s = 0;
+  }
+  int64_t error_ms = SYNC_ERROR_MS + since_s * model.uncertainty_ppb / 1000000;
+  return error_ms < UINT32_MAX ? static_cast<uint32_t>(error_ms) : UINT32_MAX;
+}
+
+int64_t Timekeeper::drift_correction_us(const ClockModel &model,
+                                        int64_t now_us) {
+  if (!model.synced || model.samples == 0) {
+    return 0;
+  }
+  // In milliseconds, so the product doesn't overflow in weeks of sleep
+  int64_t elapsed_ms = (now_us - model.corrected_at_us) / 1000;
+  return -elapsed_ms * model.drift_ppb / 1000000;
+}
+
+void Timekeeper::update(ClockModel &model, int64_t ntp_us, int64_t offset_us) {
+  int64_t elapsed_us = ntp_us - model.synced_at_us;
+  if (model.synced && elapsed_us >= MIN_DRIFT_INTERVAL_S * 1000000) {
+    // The clock was corrected by the estimated drift, so the offset is the
+    // error of the estimate
+    double residual_ppb = -1e9 * static_cast<double>(offset_us) / elapsed_us;
+    if (std::fabs(residual_ppb) < 1e8) {
+      // The first measurement replaces the guess, the later ones are
+      // averaged, so the rate follows the temperature
+      double gain = model.samples == 0 ? 1.0 : model.samples == 1 ? 0.5 : 0.25;
+      model.drift_ppb += static_cast<int32_t>(gain * residual_ppb);
+      double uncertainty =
+          (model.uncertainty_ppb + 2.0 * std::fabs(residual_ppb)) / 2;
+      model.uncertainty_ppb =
+          uncertainty > MIN_UNCERTAINTY_PPB
+              ? static_cast<uint32_t>(std::fmin(uncertainty, 1e8))
+              : MIN_UNCERTAINTY_PPB;
+      if (model.samples < UINT16_MAX) {
+        model.samples++;
+      }
+    } else {
+      ESP_LOGW(TAG, "Clock jumped by %lld us, the drift is kept", offset_us);
+    }
+  } else if (!model.synced) {
+    model.uncertainty_ppb = DEFAULT_UNCERTAINTY_PPB;
+  }
+  model.synced = true;
+  model.synced_at_us = ntp_us;
+  model.corrected_at_us = ntp_us;
+}
@@ -0,0 +1,172 @@
+#include "adaptive_threshold.h"
+#include "swar.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+namespace {
+
+int32_t clamp(int32_t value, int32_t size) {
+  return std::min(std::max(value, 0), size - 1);
+}
+
+// The source row y while row current is binarised: the rows above it are
+// already overwritten, and kept in the ring
+const uint8_t *source_row(const uint8_t *pixels, const uint8_t *ring,
+                          uint16_t width, uint16_t height, uint16_t ring_rows,
+                          int32_t y, int32_t current) {
+  y = clamp(y, height);
+  if (y < current) {
+    return ring + static_cast<size_t>(y & (ring_rows - 1)) * width;
+  }
+  return pixels + static_cast<size_t>(y) * width;
+}
+
+// Dark below 15/16 of the mean
+uint8_t binarise_pixel(uint8_t pixel, uint8_t mean) {
+  return pixel < mean - (mean >> 4) ? AdaptiveThreshold::DARK
+                                    : AdaptiveThreshold::LIGHT;
+}
+
+} // namespace
+
+void AdaptiveThreshold::update_columns(uint16_t *columns, const uint8_t *add,
+                                       const uint8_t *sub, uint16_t width) {
+  constexpr uint32_t EVEN_BYTES = 0x00FF00FF;
+  uint16_t x = 0;
+  for (; x + 4 <= width; x += 4) {
+    uint32_t added = swar::load(add + x);
+    uint32_t subtracted = swar::load(sub + x);
+    uint32_t lanes[2];
+    memcpy(lanes, columns + x, sizeof(lanes));
+    // A lane never goes negative, so adding first keeps the borrows out of
+    // the neighbouring lane
+    lanes[0] = lanes[0] + (added & EVEN_BYTES) - (subtracted & EVEN_BYTES);
+    lanes[1] = lanes[1] + ((added >> 8) & EVEN_BYTES) -
+               ((subtracted >> 8) & EVEN_BYTES);
+    memcpy(columns + x, lanes, sizeof(lanes));
+  }
+  for (; x < width; x++) {
+    columns[x] += add[x] - sub[x];
+  }
+}
+
+void AdaptiveThreshold::binarise(uint8_t *pixels, uint16_t width,
+                                 uint16_t height) {
+  if (!pixels || width == 0 || height == 0) {
+    return;
+  }
+
+  uint16_t groups_end = width & ~3;
+  std::unique_ptr<uint16_t[]> columns(new uint16_t[width]());
+  std::unique_ptr<uint8_t[]> means(new uint8_t[width]);
+  std::unique_ptr<uint8_t[]> zero_row(new uint8_t[width]());
+  std::unique_ptr<uint8_t[]> ring(new uint8_t[RING_ROWS * width]);
+  auto column = [&](int32_t x) {
+    return columns[column_slot(static_cast<uint16_t>(clamp(x, width)),
+                               groups_end)];
+  };
+
+  for (int32_t y = -WINDOW_HEIGHT / 2; y < WINDOW_HEIGHT / 2; y++) {
+    update_columns(columns.get(),
+                   pixels + static_cast<size_t>(clamp(y, height)) * width,
+                   zero_row.get(), width);
+  }
+
+  for (int32_t y = 0; y < height; y++) {
+    if (y > 0) {
+      update_columns(columns.get(),
+                     source_row(pixels, ring.get(), width, height, RING_ROWS,
+                                y + WINDOW_HEIGHT / 2 - 1, y),
+                     source_row(pixels, ring.get(), width, height, RING_ROWS,
+                                y - WINDOW_HEIGHT / 2 - 1, y),
+                     width);
+    }
+
+    uint32_t sum = 0;
+    for (int32_t x = -WINDOW_WIDTH / 2; x < WINDOW_WIDTH / 2; x++) {
+      sum += column(x);
+    }
+    // Away from the edges the columns entering and leaving the box are in the
+    // same slot of their groups, which are read in slot order
+    int32_t inner_begin = std::min<int32_t>(WINDOW_WIDTH / 2, width);
+    int32_t inner_end = std::max<int32_t>(groups_end - WINDOW_WIDTH / 2,
+                                          inner_begin);
+    int32_t x = 0;
+    for (; x < inner_begin; x++) {
+      means[x] = static_cast<uint8_t>(sum >> AREA_SHIFT);
+      sum += column(x + WINDOW_WIDTH / 2) - column(x - WINDOW_WIDTH / 2);
+    }
+    for (; x < inner_end; x += 4) {
+      const uint16_t *entering = columns.get() + x + WINDOW_WIDTH / 2;
+      const uint16_t *leaving = columns.get() + x - WINDOW_WIDTH / 2;
+      means[x] = static_cast<uint8_t>(sum >> AREA_SHIFT);
+      sum += entering[0] - leaving[0];
+      means[x + 1] = static_cast<uint8_t>(sum >> AREA_SHIFT);
+      sum += entering[2] - leaving[2];
+      means[x + 2] = static_cast<uint8_t>(sum >> AREA_SHIFT);
+      sum += entering[1] - leaving[1];
+      means[x + 3] = static_cast<uint8_t>(sum >> AREA_SHIFT);
+      sum += entering[3] - leaving[3];
+    }
+    for (; x < width; x++) {
+      means[x] = static_cast<uint8_t>(sum >> AREA_SHIFT);
+      sum += column(x + WINDOW_WIDTH / 2) - column(x - WINDOW_WIDTH / 2);
+    }
+
+    uint8_t *row = pixels + static_cast<size_t>(y) * width;
+    memcpy(ring.get() + static_cast<size_t>(y & (RING_ROWS - 1)) * width, row,
+           width);
+    for (x = 0; x + 4 <= width; x += 4) {
+      uint32_t mean = swar::load(means.get() + x);
+      uint32_t threshold = swar::sub(mean, (mean >> 4) & 0x0F0F0F0F);
+      uint32_t dark = swar::less_than(swar::load(row + x), threshold);
+      swar::store(row + x, ~((dark >> 7) * 0xFF));
+    }
+    for (; x < width; x++) {
+      row[x] = binarise_pixel(row[x], means[x]);
+    }
+  }
+}
+
+void AdaptiveThreshold::binarise_reference(uint8_t *pixels, uint16_t width,
+                                           uint16_t height) {
+  if (!pixels || width == 0 || height == 0) {
+    return;
+  }
+
+  std::unique_ptr<uint16_t[]> columns(new uint16_t[width]());
+  std::unique_ptr<uint8_t[]> ring(new uint8_t[RING_ROWS * width]);
+
+  for (int32_t y = -WINDOW_HEIGHT / 2; y < WINDOW_HEIGHT / 2; y++) {
+    const uint8_t *row = pixels + static_cast<size_t>(clamp(y, height)) * width;
+    for (uint16_t x = 0; x < width; x++) {
+      columns[x] += row[x];
+    }
+  }
+
+  for (int32_t y = 0; y < height; y++) {
+    if (y > 0) {
+      const uint8_t *add = source_row(pixels, ring.get(), width, height,
+                                      RING_ROWS, y + WINDOW_HEIGHT / 2 - 1, y);
+      const uint8_t *sub = source_row(pixels, ring.get(), width, height,
+                                      RING_ROWS, y - WINDOW_HEIGHT / 2 - 1, y);
+      for (uint16_t x = 0; x < width; x++) {
+        columns[x] += add[x] - sub[x];
+      }
+    }
+
+    uint32_t sum = 0;
+    for (int32_t x = -WINDOW_WIDTH / 2; x < WINDOW_WIDTH / 2; x++) {
+      sum += columns[clamp(x, width)];
+    }
+    uint8_t *row = pixels + static_cast<size_t>(y) * width;
+    memcpy(ring.get() + static_cast<size_t>(y & (RING_ROWS - 1)) * width, row,
+           width);
+    for (int32_t x = 0; x < width; x++) {
+      row[x] = binarise_pixel(row[x], static_cast<uint8_t>(sum >> AREA_SHIFT));
+      sum += columns[clamp(x + WINDOW_WIDTH / 2, width)] -
+             columns[clamp(x - WINDOW_WIDTH / 2, width)];
+    }
+  }
+}
@@ -0,0 +1,211 @@
+#include "finder_scan.h"
+#include "swar.h"
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+
+void FinderScan::row_thresholds(const uint8_t *row, uint16_t width,
+                                uint8_t *thresholds) {
+  // The window sum of the first pixel, with the row's edges repeated
+  constexpr int32_t HALF = WINDOW / 2;
+  int32_t last = width - 1;
+  uint32_t sum = HALF * row[0];
+  for (int32_t x = 0; x < HALF; x++) {
+    sum += row[std::min(x, last)];
+  }
+  auto threshold = [](uint32_t sum) {
+    return static_cast<uint8_t>((sum * 15) >> (WINDOW_SHIFT + 4));
+  };
+  int32_t x = 0;
+  // The repeated first pixel leaves the window
+  for (; x < std::min<int32_t>(HALF, width); x++) {
+    thresholds[x] = threshold(sum);
+    sum += row[std::min(x + HALF, last)] - row[0];
+  }
+  for (; x + HALF <= last; x++) {
+    thresholds[x] = threshold(sum);
+    sum += row[x + HALF] - row[x - HALF];
+  }
+  // The repeated last pixel enters it
+  for (; x < width; x++) {
+    thresholds[x] = threshold(sum);
+    sum += row[last] - row[std::max(x - HALF, 0)];
+  }
+}
+
+size_t FinderScan::run_lengths(const uint8_t *row, const uint8_t *thresholds,
+                               uint16_t width, size_t max_runs,
+                               uint16_t *runs, bool *first_dark) {
+  bool dark = row[0] < thresholds[0];
+  *first_dark = dark;
+  size_t count = 0;
+  uint16_t length = 0;
+  uint16_t x = 0;
+
+  while (x < width) {
+    // Whole words of the current colour extend the run without a branch per
+    // pixel
+    if (x + 4 <= width) {
+      uint32_t mask =
+          swar::less_than(swar::load(row + x), swar::load(thresholds + x));
+      if (mask == (dark ? swar::HIGH_BITS : 0)) {
+        length += 4;
+        x += 4;
+        continue;
+      }
+    }
+    if ((row[x] < thresholds[x]) != dark) {
+      runs[count++] = length;
+      if (count > max_runs) {
+        return count;
+      }
+      length = 0;
+      dark = !dark;
+    }
+    length++;
+    x++;
+  }
+  runs[count++] = length;
+  return count;
+}
+
+bool FinderScan::is_finder(const uint16_t *runs) {
+  uint32_t total = 0;
+  for (int i = 0; i < 5; i++) {
+    total += runs[i];
+  }
+  if (total < 7u * MIN_MODULE) {
+    return false;
+  }
+  // Every run may be off by half a module, the centre by one and a half
+  for (int i = 0; i < 5; i++) {
+    int32_t modules = i == 2 ? 3 : 1;
+    int32_t error = 7 * runs[i] - modules * static_cast<int32_t>(total);
+    if (2 * std::abs(error) >= modules * static_cast<int32_t>(total)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t FinderScan::add_candidate(Finder *finders, size_t count, uint16_t x,
+                                 uint16_t y, uint16_t size) {
+  // The centres of one pattern are within a module horizontally, and within
+  // the three centre modules vertically
+  for (size_t i = 0; i < count; i++) {
+    Finder &finder = finders[i];
+    if (std::abs(finder.x() - x) < size / 4 &&
+        std::abs(finder.y() - y) < size / 2) {
+      finder.sum_x += x;
+      finder.sum_y += y;
+      finder.hits++;
+      finder.size = std::max(finder.size, size);
+      return count;
+    }
+  }
+  if (count == MAX_FINDERS) {
+    // Texture fills the slots with candidates of a single row long before
+    // the rows of a code are reached, the one with the fewest hits and the
+    // furthest behind the scan line makes room. The patterns crossed by
+    // enough rows are kept.
+    Finder *weakest = std::min_element(
+        finders, finders + count, [](const Finder &l, const Finder &r) {
+          return l.hits != r.hits ? l.hits < r.hits : l.y() < r.y();
+        });
+    if (weakest->hits >= MIN_HITS) {
+      return count;
+    }
+    *weakest = Finder{x, y, 1, size};
+    return count;
+  }
+  finders[count] = Finder{x, y, 1, size};
+  return count + 1;
+}
+
+void FinderScan::code_region(const Finder *finders, uint16_t width,
+                             uint16_t height, Region *region) {
+  // The corner pattern is opposite the longest side of the triangle
+  auto distance = [&](int a, int b) {
+    int32_t dx = finders[a].x() - finders[b].x();
+    int32_t dy = finders[a].y() - finders[b].y();
+    return dx * dx + dy * dy;
+  };
+  int32_t sides[3] = {distance(1, 2), distance(0, 2), distance(0, 1)};
+  int corner = static_cast<int>(std::max_element(sides, sides + 3) - sides);
+  const Finder &a = finders[(corner + 1) % 3];
+  const Finder &b = finders[(corner + 2) % 3];
+
+  int32_t xs[4] = {finders[corner].x(), a.x(), b.x(),
+                   a.x() + b.x() - finders[corner].x()};
+  int32_t ys[4] = {finders[corner].y(), a.y(), b.y(),
+                   a.y() + b.y() - finders[corner].y()};
+  int32_t margin =
+      std::max({finders[0].size, finders[1].size, finders[2].size});
+
+  int32_t left = std::max<int32_t>(0, *std::min_element(xs, xs + 4) - margin);
+  int32_t top = std::max<int32_t>(0, *std::min_element(ys, ys + 4) - margin);
+  int32_t right =
+      std::min<int32_t>(width, *std::max_element(xs, xs + 4) + margin + 1);
+  int32_t bottom =
+      std::min<int32_t>(height, *std::max_element(ys, ys + 4) + margin + 1);
+  if (right <= left || bottom <= top) {
+    return;
+  }
+  *region = Region{static_cast<uint16_t>(left), static_cast<uint16_t>(top),
+                   static_cast<uint16_t>(right - left),
+                   static_cast<uint16_t>(bottom - top)};
+}
+
+uint32_t FinderScan::scan(const uint8_t *pixels, uint16_t width,
+                          uint16_t height, Region *region) {
+  *region = Region{0, 0, width, height};
+  if (!pixels || width < 4 || height == 0) {
+    return 0;
+  }
+
+  std::unique_ptr<uint16_t[]> runs(new uint16_t[width + 1]);
+  std::unique_ptr<uint8_t[]> thresholds(new uint8_t[width]);
+  size_t max_runs = std::max<size_t>(width / MIN_MEAN_RUN, 5);
+  Finder finders[MAX_FINDERS];
+  size_t count = 0;
+
+  for (uint16_t y = ROW_STEP / 2; y < height; y += ROW_STEP) {
+    const uint8_t *row = pixels + static_cast<size_t>(y) * width;
+    row_thresholds(row, width, thresholds.get());
+
+    bool first_dark = false;
+    size_t run_count = run_lengths(row, thresholds.get(), width, max_runs,
+                                   runs.get(), &first_dark);
+    if (run_count > max_runs) {
+      // Too busy to tell, quirc gets the whole frame
+      return BUSY;
+    }
+    uint16_t start = 0;
+    for (size_t i = 0; i + 5 <= run_count; i++) {
+      // The dark runs are the even ones if the row starts dark
+      bool dark = (i % 2 == 0) == first_dark;
+      if (dark && is_finder(runs.get() + i)) {
+        uint16_t size = runs[i] + runs[i + 1] + runs[i + 2] + runs[i + 3] +
+                        runs[i + 4];
+        count = add_candidate(finders, count, start + size / 2, y, size);
+      }
+      start += runs[i];
+    }
+  }
+
+  // A single matching row is more likely texture than a pattern
+  count = static_cast<size_t>(
+      std::remove_if(finders, finders + count,
+                     [](const Finder &f) { return f.hits < MIN_HITS; }) -
+      finders);
+  if (count < MIN_FINDERS) {
+    return static_cast<uint32_t>(count);
+  }
+  // Noise may add patterns, the code's are crossed by the most rows
+  std::partial_sort(finders, finders + 3, finders + count,
+                    [](const Finder &l, const Finder &r) {
+                      return l.hits > r.hits;
+                    });
+  code_region(finders, width, height, region);
+  return static_cast<uint32_t>(count);
+}
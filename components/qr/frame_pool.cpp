@@ -0,0 +1,43 @@
+#include "frame_pool.h"
+
+FramePool::Frame *FramePool::wrap(void *owner, uint8_t *data, uint16_t width,
+                                  uint16_t height) {
+  for (size_t i = 0; i < CAPACITY; i++) {
+    bool expected = false;
+    if (!_claimed[i].compare_exchange_strong(expected, true,
+                                             std::memory_order_acquire)) {
+      continue;
+    }
+    Frame &frame = _frames[i];
+    frame.owner = owner;
+    frame.data = data;
+    frame.width = width;
+    frame.height = height;
+    frame.refs.store(1, std::memory_order_release);
+    return &frame;
+  }
+  return nullptr;
+}
+
+void FramePool::retain(Frame *frame) {
+  frame->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void FramePool::release(Frame *frame) {
+  if (frame->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  void *owner = frame->owner;
+  frame->owner = nullptr;
+  frame->data = nullptr;
+  _claimed[frame - _frames].store(false, std::memory_order_release);
+  _return_fn(owner);
+}
+
+size_t FramePool::in_use() const {
+  size_t count = 0;
+  for (const auto &claimed : _claimed) {
+    count += claimed.load(std::memory_order_acquire) ? 1 : 0;
+  }
+  return count;
+}
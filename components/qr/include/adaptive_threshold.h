@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief Binarises the QR frames for quirc against the local mean brightness
+ *
+ * A pixel is dark if it is below 15/16 of the mean of the WINDOW_WIDTH x
+ * WINDOW_HEIGHT box centred on it, with the rows and columns outside the
+ * frame replaced by the nearest edge. The box mean is a running sum over
+ * the columns of the frame, which are themselves running sums over the rows,
+ * so the cost per pixel doesn't depend on the size of the box.
+ *
+ * The frame is overwritten with 0 for the dark and 255 for the light pixels,
+ * which quirc's own global threshold passes through unchanged. quirc_end()
+ * still computes that threshold and rewrites every pixel, so this is an
+ * extra pass: it costs time and buys codes under uneven light, which a single
+ * global threshold loses.
+ */
+class AdaptiveThreshold {
+public:
+  static constexpr uint16_t WINDOW_WIDTH = 64;
+  static constexpr uint16_t WINDOW_HEIGHT = 16;
+  static constexpr uint8_t DARK = 0;
+  static constexpr uint8_t LIGHT = 255;
+
+  /**
+   * @brief Binarises a frame in place, four pixels at a time (see swar.h)
+   *
+   * @param pixels The GRAY pixels, row by row
+   * @param width The width of the frame
+   * @param height The height of the frame
+   */
+  static void binarise(uint8_t *pixels, uint16_t width, uint16_t height);
+
+  /**
+   * @brief Binarises a frame in place pixel by pixel
+   *
+   * The output is the same as binarise(), it is the reference for the tests
+   * and the benchmark.
+   */
+  static void binarise_reference(uint8_t *pixels, uint16_t width,
+                                 uint16_t height);
+
+  /**
+   * @brief Adds the add row to the column sums and subtracts the sub row, in
+   * the word order of column_slot()
+   *
+   * @note Public so adaptive_threshold_bench can time the column pass on its
+   * own.
+   */
+  static void update_columns(uint16_t *columns, const uint8_t *add,
+                             const uint8_t *sub, uint16_t width);
+
+private:
+
+  /**
+   * @brief The index of a column in the column sums of binarise()
+   *
+   * Each group of four columns is stored as two 16-bit lane pairs, the even
+   * columns before the odd ones, so the sums are updated a pixel word at a
+   * time. The columns past the last whole group keep their index.
+   */
+  static uint16_t column_slot(uint16_t x, uint16_t groups_end) {
+    return x < groups_end ? (x & ~3) | ((x & 1) << 1) | ((x >> 1) & 1) : x;
+  }
+
+  static constexpr uint32_t AREA_SHIFT = 10; /*!< log2 of the box area */
+  static constexpr uint16_t RING_ROWS = 16;  /*!< overwritten source rows */
+
+  static_assert(WINDOW_WIDTH * WINDOW_HEIGHT == 1u << AREA_SHIFT,
+                "The box mean is a shift");
+  static_assert(RING_ROWS > WINDOW_HEIGHT / 2 &&
+                    (RING_ROWS & (RING_ROWS - 1)) == 0,
+                "The ring holds the rows leaving the box");
+};
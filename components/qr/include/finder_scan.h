@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Cheap prefilter in front of quirc, which looks for QR finder
+ * patterns
+ *
+ * Every ROW_STEP-th row is binarised against 15/16 of the mean of the WINDOW
+ * pixels around each pixel, so uneven light doesn't merge the runs, and
+ * scanned four pixels at a time (see swar.h) for the dark-light-dark-light-
+ * dark runs of a finder pattern in the 1:1:3:1:1 ratio. The candidates are
+ * grouped into finder patterns, and the centre of a pattern with modules of
+ * at least MIN_MODULE pixels is crossed by at least MIN_HITS sampled rows, so
+ * a frame with fewer than three such patterns holds no decodable code.
+ *
+ * A row with more runs than one per MIN_MEAN_RUN pixels ends the scan: the
+ * frame is noise or texture finer than the patterns, which would cost more
+ * to scan than it saves, and it is left to quirc instead of being rejected.
+ */
+class FinderScan {
+public:
+  static constexpr uint16_t ROW_STEP = 2;
+  static constexpr uint16_t MIN_MODULE = 2;
+  static constexpr uint16_t MIN_HITS = 3 * MIN_MODULE / ROW_STEP;
+  static constexpr uint32_t MIN_FINDERS = 3;
+  static constexpr size_t MAX_FINDERS = 16;
+  static constexpr uint16_t MIN_MEAN_RUN = 2 * MIN_MODULE;
+  static constexpr uint16_t WINDOW = 64;
+  static constexpr uint32_t BUSY = UINT32_MAX; /*!< see scan() */
+
+  /**
+   * @brief The part of the frame the candidates were found in
+   */
+  struct Region {
+    uint16_t x = 0;
+    uint16_t y = 0;
+    uint16_t width = 0;
+    uint16_t height = 0;
+  };
+
+  /**
+   * @brief Scans a frame for finder pattern candidates
+   *
+   * @param pixels The GRAY pixels, row by row
+   * @param width The width of the frame
+   * @param height The height of the frame
+   * @param region Set to the bounding box of the code, widened by a pattern
+   * on every side, or to the whole frame if less than MIN_FINDERS patterns
+   * were found. The corner without a pattern is completed from the three
+   * patterns found on the most rows, so rotated codes fit as well.
+   *
+   * @return The number of finder patterns, the frame can be skipped if it is
+   * less than MIN_FINDERS. BUSY if a row was too busy to scan, the region is
+   * the whole frame then.
+   */
+  static uint32_t scan(const uint8_t *pixels, uint16_t width, uint16_t height,
+                       Region *region);
+
+  /**
+   * @brief Sets the threshold of every pixel of a row to 15/16 of the mean
+   * of the WINDOW pixels centred on it, with the row's edges repeated
+   *
+   * @note Public, like run_lengths(), so finder_scan_bench can time the two
+   * passes of a row on their own.
+   */
+  static void row_thresholds(const uint8_t *row, uint16_t width,
+                             uint8_t *thresholds);
+
+  /**
+   * @brief Splits a row into runs of pixels below and above their thresholds
+   *
+   * @return The number of runs, the first one is light if first_dark is
+   * false. The split stops once there are more than max_runs.
+   */
+  static size_t run_lengths(const uint8_t *row, const uint8_t *thresholds,
+                            uint16_t width, size_t max_runs, uint16_t *runs,
+                            bool *first_dark);
+
+private:
+  static constexpr uint16_t WINDOW_SHIFT = 6; /*!< log2 of WINDOW */
+  static_assert(WINDOW == 1u << WINDOW_SHIFT, "The window mean is a shift");
+
+  /**
+   * @return true if the five runs are in the 1:1:3:1:1 ratio
+   */
+  static bool is_finder(const uint16_t *runs);
+
+  /**
+   * @brief The candidates of one finder pattern
+   */
+  struct Finder {
+    uint32_t sum_x = 0;
+    uint32_t sum_y = 0;
+    uint16_t hits = 0;
+    uint16_t size = 0; /*!< the widest candidate */
+    int32_t x() const { return static_cast<int32_t>(sum_x / hits); }
+    int32_t y() const { return static_cast<int32_t>(sum_y / hits); }
+  };
+
+  /**
+   * @brief Adds a candidate to the finder pattern it belongs to, or starts a
+   * new one
+   *
+   * If all MAX_FINDERS slots are taken, the new pattern replaces the one
+   * with the fewest hits, the oldest of them, unless every pattern has
+   * MIN_HITS already.
+   *
+   * @return The number of finder patterns
+   */
+  static size_t add_candidate(Finder *finders, size_t count, uint16_t x,
+                              uint16_t y, uint16_t size);
+
+  /**
+   * @brief Sets the region to the code spanned by the three finder patterns,
+   * widened by a pattern on every side
+   */
+  static void code_region(const Finder *finders, uint16_t width,
+                          uint16_t height, Region *region);
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Hands camera frames from the capture loop to the decoders without
+ * copying them
+ *
+ * A frame stays with the camera driver's frame buffer it was captured into.
+ * Every holder of a frame owns a reference, and the frame buffer is given back
+ * to the driver when the last reference is released, so a decoder never reads
+ * a buffer the driver is already refilling.
+ */
+class FramePool {
+public:
+  static constexpr size_t CAPACITY = 4;
+
+  /**
+   * @brief Gives a frame buffer back to its owner, e.g. esp_camera_fb_return()
+   */
+  using ReturnFn = void (*)(void *owner);
+
+  /**
+   * @brief A frame of the pool
+   */
+  struct Frame {
+    void *owner = nullptr;   /*!< the driver's handle, e.g. camera_fb_t */
+    uint8_t *data = nullptr; /*!< the pixels, writable by the holder */
+    uint16_t width = 0;
+    uint16_t height = 0;
+    std::atomic<uint32_t> refs{0};
+  };
+
+  /**
+   * @param return_fn Called with the owner when a frame is released for the
+   * last time
+   */
+  explicit FramePool(ReturnFn return_fn) : _return_fn(return_fn) {}
+
+  FramePool(const FramePool &) = delete;
+  FramePool &operator=(const FramePool &) = delete;
+
+  /**
+   * @brief Wraps a captured frame buffer, the caller holds the only reference
+   *
+   * @param owner The driver's handle of the frame buffer
+   * @param data The pixels of the frame
+   * @param width The width of the frame
+   * @param height The height of the frame
+   *
+   * @return The frame, or nullptr if every slot is in use. The frame buffer is
+   * not returned to the owner in that case.
+   */
+  Frame *wrap(void *owner, uint8_t *data, uint16_t width, uint16_t height);
+
+  /**
+   * @brief Adds a reference to a frame, e.g. before passing it to a queue
+   */
+  static void retain(Frame *frame);
+
+  /**
+   * @brief Drops a reference to a frame, the last one returns the frame buffer
+   * to its owner and frees the slot
+   */
+  void release(Frame *frame);
+
+  /**
+   * @return The number of frames which are still referenced
+   */
+  size_t in_use() const;
+
+private:
+  ReturnFn _return_fn;
+  Frame _frames[CAPACITY];
+  // A slot is claimed by the capture loop before its references are set
+  std::atomic<bool> _claimed[CAPACITY] = {};
+};
@@ -1,8 +1,16 @@
 #pragma once
 
-#include "esp_camera.h"
 #include "quirc.h"
 #include <memory>
+#include <string>
+
+/**
+ * @brief The optional stages of QRDecoder::decode_frame() in front of quirc
+ */
+struct QRDecodeStages {
+  bool finder_scan = false;        /*!< skip the frames FinderScan rejects */
+  bool adaptive_threshold = false; /*!< binarise with AdaptiveThreshold */
+};
 
 /**
  * @brief Handles the QR decoding
@@ -21,8 +29,15 @@ public:
    * @param height
    * Height of the camera frame.
    *
+   * @param stages
+   * The stages run before quirc. The finder scan is off until its recall is
+   * checked on captured frames (see manual_tests/host_bench/
+   * finder_scan_bench.cpp). The adaptive threshold is off as well: it runs
+   * on top of quirc's own threshold, so it slows down every frame, and only
+   * pays off for codes under uneven light.
+   *
    */
-  QRDecoder(int width, int height);
+  QRDecoder(int width, int height, QRDecodeStages stages = {});
 
   // Delete copy constructor and assignment because of unique_ptr
   QRDecoder(const QRDecoder &) = delete;
@@ -32,12 +47,26 @@ public:
    * @brief
    * Function to decode the QR code from the camera frame.
    *
-   * The function extracts the camera frame buffer and decodes the QR code using
-   * the quirc library. The function returns true if the QR code is decoded
-   * successfully, otherwise false.
+   * With the finder scan stage, frames without three finder pattern
+   * candidates are rejected by the FinderScan prefilter, and otherwise the
+   * rows of the candidates' region are moved to the start of the frame
+   * buffer. The frame buffer is used as the image plane of the quirc
+   * library, so it isn't copied, and with the adaptive threshold stage
+   * AdaptiveThreshold binarises it in place: the pixels are overwritten.
+   * quirc_end() still runs its own global threshold over the pixels.
+   * The decoded payload is kept until save_decoded_data() is called, so when
+   * several decoders run in parallel only one of them saves it.
+   * The function returns true if the QR code is decoded successfully,
+   * otherwise false.
+   *
+   * @param pixels
+   * The GRAY pixels of the camera frame buffer, overwritten.
    *
-   * @param frame
-   * Camera frame buffer.
+   * @param width
+   * Width of the camera frame.
+   *
+   * @param height
+   * Height of the camera frame.
    *
    * @return
    *  - True if the QR code is decoded successfully
@@ -45,26 +74,31 @@ public:
    *  - False if the QR code is not decoded
    *
    */
-  bool decode_frame(const camera_fb_t *frame);
+  bool decode_frame(uint8_t *pixels, int width, int height);
+
+  /**
+   * @brief
+   * The payload of the last decoded QR code, empty if none was decoded.
+   */
+  const std::string &get_payload() const { return _payload; }
 
-private:
   /**
    * @brief
    * Function to save the decoded data to the storage.
    *
-   * The function saves the decoded data to the NVS using the Storage class.
-   *
-   * @param data
-   * Decoded data.
-   *
-   * @param length
-   * Length of the decoded data.
+   * The function saves the payload of the last decoded QR code to the NVS
+   * using the Storage class.
    *
    */
-  void save_decoded_data(const char *data, uint32_t length);
+  void save_decoded_data();
 
+private:
   struct QuircDeleter {
     void operator()(quirc *q) { quirc_destroy(q); }
   };
   std::unique_ptr<quirc, QuircDeleter> _qr;
+  int _width;
+  int _height;
+  QRDecodeStages _stages;
+  std::string _payload;
 };
\ No newline at end of file
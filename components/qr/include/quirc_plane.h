@@ -0,0 +1,47 @@
+#pragma once
+
+#include "quirc.h"
+#include <cstdint>
+
+/**
+ * @brief Lets quirc work on a frame buffer instead of its own image buffer
+ *
+ * quirc only offers the image buffer allocated by quirc_resize() through
+ * quirc_begin(), which would need a copy of every frame. This class is the
+ * only place that reaches into struct quirc (quirc_internal.h) to swap the
+ * buffer. It is written against the quirc version pinned in
+ * idf_component.yml, which thresholds the image in place
+ * (QUIRC_PIXEL_ALIAS_IMAGE), so the plane is the only buffer quirc needs.
+ */
+class QuircPlane {
+public:
+  /**
+   * @brief Frees the image buffer of quirc_resize(), which is never read
+   * when the frames are attached
+   *
+   * The flood fill stack of quirc_resize() is kept, so planes up to the size
+   * quirc was resized to can be attached. quirc_begin() returns nullptr
+   * until one is.
+   */
+  static void release_buffer(quirc *q);
+
+  /**
+   * @brief Points quirc at the plane until the object is destroyed
+   *
+   * @param q The quirc object, its buffer released with release_buffer()
+   * @param plane The GRAY pixels, row by row, overwritten by quirc_end()
+   * @param width The width of the plane
+   * @param height The height of the plane, at most the height quirc was
+   * resized to
+   */
+  QuircPlane(quirc *q, uint8_t *plane, int width, int height);
+  ~QuircPlane();
+
+  QuircPlane(const QuircPlane &) = delete;
+  QuircPlane &operator=(const QuircPlane &) = delete;
+
+private:
+  quirc *_q;
+  int _width;
+  int _height;
+};
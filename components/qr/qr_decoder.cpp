@@ -1,12 +1,16 @@
 #include "qr_decoder.h"
+#include "adaptive_threshold.h"
 #include "error_handler.h"
 #include "esp_log.h"
+#include "finder_scan.h"
+#include "quirc_plane.h"
 #include "storage.h"
 #include <cstring>
 
 constexpr auto *TAG = "QRDecoder";
 
-QRDecoder::QRDecoder(int width, int height) {
+QRDecoder::QRDecoder(int width, int height, QRDecodeStages stages)
+    : _width(width), _height(height), _stages(stages) {
   _qr.reset(quirc_new());
   if (!_qr) {
     ESP_LOGE(TAG, "Failed to create QR code detector");
@@ -17,30 +21,65 @@ QRDecoder::QRDecoder(int width, int height) {
     ESP_LOGE(TAG, "Failed to allocate QR buffer");
     restart();
   }
-  ESP_LOGI(TAG, "QR decoder initialized with buffer %dx%d", width, height);
+  // The frames are attached instead, only the flood fill stack is kept
+  QuircPlane::release_buffer(_qr.get());
+  ESP_LOGI(TAG, "QR decoder initialized for frames of %dx%d", width, height);
 }
 
+namespace {
+
+/**
+ * @brief Moves the rows of the region to the start of the frame, so the
+ * region is a plane of its own
+ */
+void compact_region(uint8_t *pixels, int width,
+                    const FinderScan::Region &region) {
+  for (uint16_t row = 0; row < region.height; row++) {
+    // The destination never overtakes the source
+    memmove(pixels + static_cast<size_t>(row) * region.width,
+            pixels + static_cast<size_t>(region.y + row) * width + region.x,
+            region.width);
+  }
+}
+
+} // namespace
+
 // See: https://github.com/dlbeer/quirc#library-use
-bool QRDecoder::decode_frame(const camera_fb_t *frame) {
-  if (!frame) {
+bool QRDecoder::decode_frame(uint8_t *pixels, int width, int height) {
+  if (!pixels) {
     ESP_LOGE(TAG, "Frame is NULL");
     return false;
   }
 
-  int width, height;
-  uint8_t *qr_buf = quirc_begin(_qr.get(), &width, &height);
-  if (!qr_buf) {
-    ESP_LOGE(TAG, "Failed to get quirc buffer");
+  if (width != _width || height != _height) {
+    ESP_LOGE(TAG, "Frame size mismatch: expected %dx%d, got %dx%d", _width,
+             _height, width, height);
     return false;
   }
 
-  if (frame->width != width || frame->height != height) {
-    ESP_LOGE(TAG, "Frame size mismatch: expected %dx%d, got %dx%d", width,
-             height, frame->width, frame->height);
-    quirc_end(_qr.get());
-    return false;
+  // Most frames hold no code, they are rejected before quirc sees them
+  FinderScan::Region region{0, 0, static_cast<uint16_t>(width),
+                            static_cast<uint16_t>(height)};
+  if (_stages.finder_scan) {
+    uint32_t finders = FinderScan::scan(pixels, region.width, region.height,
+                                        &region);
+    if (finders < FinderScan::MIN_FINDERS) {
+      return false;
+    }
+    if (region.width != width || region.height != height) {
+      compact_region(pixels, width, region);
+    }
+  }
+
+  // The frame buffer is binarised in place instead of copied, and the code
+  // cells are read from it by quirc_extract(). The adaptive threshold is a
+  // pass on top of quirc_end(), which still computes its Otsu threshold over
+  // the plane and rewrites every pixel, it only pays off under uneven light.
+  if (_stages.adaptive_threshold) {
+    AdaptiveThreshold::binarise(pixels, region.width, region.height);
   }
-  memcpy(qr_buf, frame->buf, frame->width * frame->height);
+  QuircPlane plane(_qr.get(), pixels, region.width, region.height);
+  quirc_begin(_qr.get(), nullptr, nullptr);
   quirc_end(_qr.get());
 
   int count = quirc_count(_qr.get());
@@ -55,8 +94,8 @@ bool QRDecoder::decode_frame(const camera_fb_t *frame) {
     if (quirc_decode(&code, &data) == 0) {
       ESP_LOGI(TAG, "Decoded QR Code");
       ESP_LOGI(TAG, "Payload: %s", data.payload);
-      save_decoded_data(reinterpret_cast<const char *>(data.payload),
-                        data.payload_len);
+      _payload.assign(reinterpret_cast<const char *>(data.payload),
+                      data.payload_len);
       return true;
     } else {
       ESP_LOGE(TAG, "Failed to decode QR code");
@@ -65,13 +104,13 @@ bool QRDecoder::decode_frame(const camera_fb_t *frame) {
   return false;
 }
 
-void QRDecoder::save_decoded_data(const char *data, uint32_t length) {
-  if (!data || length == 0) {
+void QRDecoder::save_decoded_data() {
+  if (_payload.empty()) {
     ESP_LOGE(TAG, "Decoded data is NULL");
     restart();
   }
 
-  std::string qr_data(data, length);
+  const std::string &qr_data = _payload;
   // Find positions of delimiters
   size_t first_delim = qr_data.find('|');
   size_t second_delim = qr_data.find('|', first_delim + 1);
@@ -0,0 +1,29 @@
+#include "quirc_plane.h"
+#include "quirc_internal.h"
+#include <cstdlib>
+
+static_assert(QUIRC_PIXEL_ALIAS_IMAGE,
+              "quirc has to threshold the plane in place, check the pinned "
+              "version and QUIRC_MAX_REGIONS");
+
+void QuircPlane::release_buffer(quirc *q) {
+  // quirc_destroy() frees the pointer as well
+  free(q->image);
+  q->image = nullptr;
+  q->pixels = nullptr;
+}
+
+QuircPlane::QuircPlane(quirc *q, uint8_t *plane, int width, int height)
+    : _q(q), _width(q->w), _height(q->h) {
+  q->image = plane;
+  q->pixels = reinterpret_cast<quirc_pixel_t *>(plane);
+  q->w = width;
+  q->h = height;
+}
+
+QuircPlane::~QuircPlane() {
+  _q->image = nullptr;
+  _q->pixels = nullptr;
+  _q->w = _width;
+  _q->h = _height;
+}
@@ -0,0 +1,97 @@
+#include "adaptive_threshold.h"
+#include "esp_heap_caps.h"
+#include "unity.h"
+#include <algorithm>
+#include <cstring>
+
+constexpr uint16_t WIDTH = 640;
+constexpr uint16_t HEIGHT = 480;
+
+static void fill_noise(uint8_t *frame, size_t size, uint32_t seed) {
+  for (size_t i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    frame[i] = static_cast<uint8_t>(seed >> 16);
+  }
+}
+
+// Noise over a gradient, so the mean varies across the frame
+static void fill_gradient(uint8_t *frame, uint16_t width, uint16_t height) {
+  fill_noise(frame, width * height, 3);
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      frame[y * width + x] = static_cast<uint8_t>(
+          (frame[y * width + x] >> 2) + (x + y) * 191 / (width + height));
+    }
+  }
+}
+
+// The definition: the box sum of every pixel, with the edges repeated
+static void binarise_box(const uint8_t *frame, uint16_t width, uint16_t height,
+                         uint8_t *out) {
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      uint32_t sum = 0;
+      for (int j = -AdaptiveThreshold::WINDOW_HEIGHT / 2;
+           j < AdaptiveThreshold::WINDOW_HEIGHT / 2; j++) {
+        int row = std::min(std::max(y + j, 0), height - 1);
+        for (int i = -AdaptiveThreshold::WINDOW_WIDTH / 2;
+             i < AdaptiveThreshold::WINDOW_WIDTH / 2; i++) {
+          int column = std::min(std::max(x + i, 0), width - 1);
+          sum += frame[row * width + column];
+        }
+      }
+      uint8_t mean = static_cast<uint8_t>(
+          sum / (AdaptiveThreshold::WINDOW_WIDTH *
+                 AdaptiveThreshold::WINDOW_HEIGHT));
+      out[y * width + x] = frame[y * width + x] < mean - mean / 16
+                               ? AdaptiveThreshold::DARK
+                               : AdaptiveThreshold::LIGHT;
+    }
+  }
+}
+
+TEST_CASE("Adaptive threshold matches the box mean definition", "[qr]") {
+  // Whole and partial pixel words, and frames smaller than the box
+  const uint16_t sizes[][2] = {{96, 40}, {37, 23}, {5, 3}, {130, 17}};
+  for (const auto &size : sizes) {
+    size_t pixels = size[0] * size[1];
+    uint8_t *frame = new uint8_t[pixels];
+    uint8_t *expected = new uint8_t[pixels];
+    uint8_t *reference = new uint8_t[pixels];
+    fill_noise(frame, pixels, size[0]);
+    binarise_box(frame, size[0], size[1], expected);
+
+    memcpy(reference, frame, pixels);
+    AdaptiveThreshold::binarise_reference(reference, size[0], size[1]);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, reference, pixels);
+
+    AdaptiveThreshold::binarise(frame, size[0], size[1]);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, frame, pixels);
+
+    delete[] frame;
+    delete[] expected;
+    delete[] reference;
+  }
+}
+
+TEST_CASE("Adaptive threshold is bit-exact with the reference", "[qr]") {
+  auto *frame = static_cast<uint8_t *>(
+      heap_caps_malloc(WIDTH * HEIGHT, MALLOC_CAP_SPIRAM));
+  auto *reference = static_cast<uint8_t *>(
+      heap_caps_malloc(WIDTH * HEIGHT, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  TEST_ASSERT_NOT_NULL(reference);
+
+  // The full frame, and a region of the width FinderScan may leave
+  const uint16_t sizes[][2] = {{WIDTH, HEIGHT}, {203, 151}};
+  for (const auto &size : sizes) {
+    fill_gradient(frame, size[0], size[1]);
+    memcpy(reference, frame, size[0] * size[1]);
+    AdaptiveThreshold::binarise_reference(reference, size[0], size[1]);
+    AdaptiveThreshold::binarise(frame, size[0], size[1]);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(reference, frame, size[0] * size[1]);
+  }
+
+  heap_caps_free(frame);
+  heap_caps_free(reference);
+}
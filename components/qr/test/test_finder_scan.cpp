@@ -0,0 +1,161 @@
+#include "esp_heap_caps.h"
+#include "finder_scan.h"
+#include "unity.h"
+#include <cstring>
+
+constexpr uint16_t WIDTH = 640;
+constexpr uint16_t HEIGHT = 480;
+constexpr int MODULE = 6;
+constexpr int MODULES = 25;
+constexpr int CODE_X = 150;
+constexpr int CODE_Y = 100;
+
+static void fill_module(uint8_t *frame, int x, int y, uint8_t value) {
+  for (int j = 0; j < MODULE; j++) {
+    memset(frame + (CODE_Y + y * MODULE + j) * WIDTH + CODE_X + x * MODULE,
+           value, MODULE);
+  }
+}
+
+// A version 2 sized code: random modules, three finder patterns with their
+// light separators
+static void draw_code(uint8_t *frame) {
+  uint32_t seed = 1;
+  for (int y = 0; y < MODULES; y++) {
+    for (int x = 0; x < MODULES; x++) {
+      seed = seed * 1103515245 + 12345;
+      fill_module(frame, x, y, (seed >> 16) & 1 ? 20 : 230);
+    }
+  }
+  const int origins[3][2] = {{0, 0}, {MODULES - 7, 0}, {0, MODULES - 7}};
+  for (const auto &origin : origins) {
+    for (int y = -1; y < 8; y++) {
+      for (int x = -1; x < 8; x++) {
+        int mx = origin[0] + x;
+        int my = origin[1] + y;
+        if (mx < 0 || my < 0 || mx >= MODULES || my >= MODULES) {
+          continue;
+        }
+        bool ring = x == 0 || x == 6 || y == 0 || y == 6;
+        bool centre = x >= 2 && x <= 4 && y >= 2 && y <= 4;
+        bool inside = x >= 0 && x <= 6 && y >= 0 && y <= 6;
+        fill_module(frame, mx, my, inside && (ring || centre) ? 20 : 230);
+      }
+    }
+  }
+}
+
+TEST_CASE("Finder scan finds the code region", "[qr]") {
+  auto *frame = static_cast<uint8_t *>(
+      heap_caps_malloc(WIDTH * HEIGHT, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  memset(frame, 200, WIDTH * HEIGHT);
+  draw_code(frame);
+
+  FinderScan::Region region;
+  TEST_ASSERT_GREATER_OR_EQUAL(FinderScan::MIN_FINDERS,
+                               FinderScan::scan(frame, WIDTH, HEIGHT, &region));
+  // The region holds the whole code, but not much more
+  TEST_ASSERT_LESS_OR_EQUAL(CODE_X, region.x);
+  TEST_ASSERT_LESS_OR_EQUAL(CODE_Y, region.y);
+  TEST_ASSERT_GREATER_OR_EQUAL(CODE_X + MODULES * MODULE,
+                               region.x + region.width);
+  TEST_ASSERT_GREATER_OR_EQUAL(CODE_Y + MODULES * MODULE,
+                               region.y + region.height);
+  TEST_ASSERT_LESS_THAN(WIDTH * HEIGHT / 4, region.width * region.height);
+
+  heap_caps_free(frame);
+}
+
+// 1:1:3:1:1 runs on a single row, which texture produces all over a frame
+static void draw_decoys(uint8_t *frame, int count) {
+  constexpr int DECOY_MODULE = 4;
+  const int runs[5] = {1, 1, 3, 1, 1};
+  for (int i = 0; i < count; i++) {
+    uint8_t *row = frame + (1 + 4 * i) * WIDTH + 20 + 24 * i;
+    bool dark = true;
+    for (int run : runs) {
+      memset(row, dark ? 20 : 200, run * DECOY_MODULE);
+      row += run * DECOY_MODULE;
+      dark = !dark;
+    }
+  }
+}
+
+TEST_CASE("Finder scan finds the code under textured rows", "[qr]") {
+  auto *frame = static_cast<uint8_t *>(
+      heap_caps_malloc(WIDTH * HEIGHT, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  memset(frame, 200, WIDTH * HEIGHT);
+  // More single row candidates than MAX_FINDERS, all above the code
+  draw_decoys(frame, 24);
+  draw_code(frame);
+
+  FinderScan::Region region;
+  TEST_ASSERT_GREATER_OR_EQUAL(FinderScan::MIN_FINDERS,
+                               FinderScan::scan(frame, WIDTH, HEIGHT, &region));
+  TEST_ASSERT_LESS_OR_EQUAL(CODE_X, region.x);
+  TEST_ASSERT_LESS_OR_EQUAL(CODE_Y, region.y);
+  TEST_ASSERT_GREATER_OR_EQUAL(CODE_X + MODULES * MODULE,
+                               region.x + region.width);
+  TEST_ASSERT_GREATER_OR_EQUAL(CODE_Y + MODULES * MODULE,
+                               region.y + region.height);
+
+  heap_caps_free(frame);
+}
+
+TEST_CASE("Finder scan finds the code under uneven light", "[qr]") {
+  auto *frame = static_cast<uint8_t *>(
+      heap_caps_malloc(WIDTH * HEIGHT, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  memset(frame, 200, WIDTH * HEIGHT);
+  draw_code(frame);
+  // Dim on the left, the light modules there are darker than the mean of
+  // the row
+  for (uint32_t y = 0; y < HEIGHT; y++) {
+    for (uint32_t x = 0; x < WIDTH; x++) {
+      uint8_t &pixel = frame[y * WIDTH + x];
+      pixel = static_cast<uint8_t>(pixel * (16 + x * 240 / WIDTH) / 256);
+    }
+  }
+
+  FinderScan::Region region;
+  uint32_t finders = FinderScan::scan(frame, WIDTH, HEIGHT, &region);
+  TEST_ASSERT_GREATER_OR_EQUAL(FinderScan::MIN_FINDERS, finders);
+  TEST_ASSERT_NOT_EQUAL(FinderScan::BUSY, finders);
+  TEST_ASSERT_LESS_OR_EQUAL(CODE_X, region.x);
+  TEST_ASSERT_GREATER_OR_EQUAL(CODE_X + MODULES * MODULE,
+                               region.x + region.width);
+
+  heap_caps_free(frame);
+}
+
+TEST_CASE("Finder scan rejects frames without a code", "[qr]") {
+  auto *frame = static_cast<uint8_t *>(
+      heap_caps_malloc(WIDTH * HEIGHT, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  FinderScan::Region region;
+
+  uint32_t seed = 7;
+  for (uint32_t i = 0; i < WIDTH * HEIGHT; i++) {
+    seed = seed * 1103515245 + 12345;
+    frame[i] = static_cast<uint8_t>(seed >> 16);
+  }
+  // Noise isn't rejected, the scan gives up on it after a row
+  TEST_ASSERT_EQUAL_UINT32(FinderScan::BUSY,
+                           FinderScan::scan(frame, WIDTH, HEIGHT, &region));
+  TEST_ASSERT_EQUAL_UINT16(WIDTH, region.width);
+  TEST_ASSERT_EQUAL_UINT16(HEIGHT, region.height);
+
+  for (uint32_t y = 0; y < HEIGHT; y++) {
+    for (uint32_t x = 0; x < WIDTH; x++) {
+      frame[y * WIDTH + x] = static_cast<uint8_t>((x + y) / 5);
+    }
+  }
+  TEST_ASSERT_LESS_THAN(FinderScan::MIN_FINDERS,
+                        FinderScan::scan(frame, WIDTH, HEIGHT, &region));
+  TEST_ASSERT_EQUAL_UINT16(WIDTH, region.width);
+  TEST_ASSERT_EQUAL_UINT16(HEIGHT, region.height);
+
+  heap_caps_free(frame);
+}
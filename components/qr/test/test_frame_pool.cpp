@@ -0,0 +1,57 @@
+#include "frame_pool.h"
+#include "unity.h"
+
+static int returned_owners = 0;
+static void *last_owner = nullptr;
+
+static void count_return(void *owner) {
+  returned_owners++;
+  last_owner = owner;
+}
+
+TEST_CASE("Frame is returned after the last release", "[qr]") {
+  returned_owners = 0;
+  FramePool pool(count_return);
+  uint8_t pixels[16] = {0};
+  int owner = 0;
+
+  FramePool::Frame *frame = pool.wrap(&owner, pixels, 4, 4);
+  TEST_ASSERT_NOT_NULL(frame);
+  TEST_ASSERT_EQUAL_PTR(pixels, frame->data);
+  TEST_ASSERT_EQUAL(1, pool.in_use());
+
+  FramePool::retain(frame);
+  pool.release(frame);
+  TEST_ASSERT_EQUAL_MESSAGE(0, returned_owners,
+                            "A referenced frame must not be returned");
+
+  pool.release(frame);
+  TEST_ASSERT_EQUAL(1, returned_owners);
+  TEST_ASSERT_EQUAL_PTR(&owner, last_owner);
+  TEST_ASSERT_EQUAL(0, pool.in_use());
+}
+
+TEST_CASE("Full frame pool rejects frames", "[qr]") {
+  returned_owners = 0;
+  FramePool pool(count_return);
+  uint8_t pixels[16] = {0};
+  int owners[FramePool::CAPACITY + 1] = {0};
+  FramePool::Frame *frames[FramePool::CAPACITY] = {nullptr};
+
+  for (size_t i = 0; i < FramePool::CAPACITY; i++) {
+    frames[i] = pool.wrap(&owners[i], pixels, 4, 4);
+    TEST_ASSERT_NOT_NULL(frames[i]);
+  }
+  TEST_ASSERT_NULL(pool.wrap(&owners[FramePool::CAPACITY], pixels, 4, 4));
+
+  // A released slot is reused
+  pool.release(frames[1]);
+  FramePool::Frame *frame = pool.wrap(&owners[FramePool::CAPACITY], pixels, 4, 4);
+  TEST_ASSERT_EQUAL_PTR(frames[1], frame);
+
+  for (size_t i = 0; i < FramePool::CAPACITY; i++) {
+    pool.release(frames[i]);
+  }
+  TEST_ASSERT_EQUAL(FramePool::CAPACITY + 1, returned_owners);
+  TEST_ASSERT_EQUAL(0, pool.in_use());
+}
@@ -0,0 +1,151 @@
+#include "adaptive_threshold.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "qr_decoder.h"
+#include "unity.h"
+#include <algorithm>
+#include <cstring>
+
+constexpr uint16_t WIDTH = 640;
+constexpr uint16_t HEIGHT = 480;
+constexpr size_t FRAME_SIZE = WIDTH * HEIGHT;
+constexpr int MODULE = 6;
+constexpr int MODULES = 29;
+constexpr int CODE_X = 40;
+constexpr int CODE_Y = 120;
+constexpr int SHADOW_END = 300;
+
+constexpr auto *PAYLOAD = "sentinel|hunter22|mqtt://192.168.1.10";
+
+// PAYLOAD as a version 3-M code, mask 2
+static const char *const CODE[MODULES] = {
+    "#######..#....#..#.#..#######",
+    "#.....#..##....####...#.....#",
+    "#.###.#.####...#..#.#.#.###.#",
+    "#.###.#.####...####.#.#.###.#",
+    "#.###.#.##...#...####.#.###.#",
+    "#.....#.#.######.#....#.....#",
+    "#######.#.#.#.#.#.#.#.#######",
+    "........##...#..#...#........",
+    "#.#####...#...#..##.#.#####..",
+    "...#.....#.##....####.####..#",
+    ".###.##.#......###..#........",
+    "#.###..#.##.#.##.....#.#.#.##",
+    "#...#.##..###..####.#.....#.#",
+    "#.#.......#####....######.###",
+    "....#.#.#..#.###..#.#..###...",
+    "..###..#..##.#..#...#..###...",
+    "##..#.#..####.#..###...#..#..",
+    "###..#.#.#..#....#.##.#######",
+    "#.##..#.###.#..#..#..#..#.#..",
+    "#.#..#.###....##....###..#..#",
+    "#.##..#.#..#....#########.##.",
+    "........##..###....##...##..#",
+    "#######...##.###.####.#.##...",
+    "#.....#.#.##.#..#.###...##...",
+    "#.###.#.#####.#####.#####.#..",
+    "#.###.#.#..#.....##.##...####",
+    "#.###.#.##.#.#####....###..#.",
+    "#.....#....###.#..####..##.#.",
+    "#######.#.#...#####..###.##..",
+};
+
+// The code on a white page, in a shadow which covers the left of the frame
+// and lifts over 128 columns. The light modules in the shadow are darker
+// than the dark ones would be in the light, so no global threshold keeps
+// the code.
+static void draw_frame(uint8_t *frame) {
+  memset(frame, 230, FRAME_SIZE);
+  for (int my = 0; my < MODULES; my++) {
+    for (int mx = 0; mx < MODULES; mx++) {
+      for (int j = 0; j < MODULE; j++) {
+        memset(frame + (CODE_Y + my * MODULE + j) * WIDTH + CODE_X +
+                   mx * MODULE,
+               CODE[my][mx] == '#' ? 20 : 230, MODULE);
+      }
+    }
+  }
+  for (int32_t y = 0; y < HEIGHT; y++) {
+    for (int32_t x = 0; x < WIDTH; x++) {
+      int32_t light =
+          std::clamp<int32_t>(38 + (x - SHADOW_END) * 218 / 128, 38, 256);
+      uint8_t &pixel = frame[y * WIDTH + x];
+      pixel = static_cast<uint8_t>(pixel * light / 256);
+    }
+  }
+}
+
+static bool decode(QRDecoder &decoder, const uint8_t *frame, uint8_t *work,
+                   int64_t *elapsed_us) {
+  memcpy(work, frame, FRAME_SIZE);
+  int64_t start = esp_timer_get_time();
+  bool decoded = decoder.decode_frame(work, WIDTH, HEIGHT);
+  *elapsed_us = esp_timer_get_time() - start;
+  return decoded;
+}
+
+TEST_CASE("Adaptive threshold keeps a code in the shadow", "[qr]") {
+  auto *frame =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  auto *reference =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  TEST_ASSERT_NOT_NULL(reference);
+  draw_frame(frame);
+  memcpy(reference, frame, FRAME_SIZE);
+
+  AdaptiveThreshold::binarise(frame, WIDTH, HEIGHT);
+  AdaptiveThreshold::binarise_reference(reference, WIDTH, HEIGHT);
+  TEST_ASSERT_EQUAL_MEMORY(reference, frame, FRAME_SIZE);
+  for (int my = 0; my < MODULES; my++) {
+    for (int mx = 0; mx < MODULES; mx++) {
+      uint8_t centre = frame[(CODE_Y + my * MODULE + MODULE / 2) * WIDTH +
+                             CODE_X + mx * MODULE + MODULE / 2];
+      TEST_ASSERT_EQUAL_UINT8(CODE[my][mx] == '#' ? AdaptiveThreshold::DARK
+                                                   : AdaptiveThreshold::LIGHT,
+                              centre);
+    }
+  }
+
+  heap_caps_free(frame);
+  heap_caps_free(reference);
+}
+
+TEST_CASE("QR decoder reads a code in the shadow only with the adaptive "
+          "threshold",
+          "[qr]") {
+  auto *frame =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  auto *work =
+      static_cast<uint8_t *>(heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(frame);
+  TEST_ASSERT_NOT_NULL(work);
+  draw_frame(frame);
+
+  // quirc's Otsu threshold falls between the shadow and the light, the
+  // whole code is dark
+  QRDecoder global(WIDTH, HEIGHT);
+  int64_t global_us = 0;
+  TEST_ASSERT_FALSE(decode(global, frame, work, &global_us));
+
+  QRDecoder adaptive(WIDTH, HEIGHT, {.adaptive_threshold = true});
+  int64_t adaptive_us = 0;
+  TEST_ASSERT_TRUE(decode(adaptive, frame, work, &adaptive_us));
+  TEST_ASSERT_EQUAL_STRING(PAYLOAD, adaptive.get_payload().c_str());
+
+  // The finder scan finds the code in the shadow as well
+  QRDecoder scanned(WIDTH, HEIGHT,
+                    {.finder_scan = true, .adaptive_threshold = true});
+  int64_t scanned_us = 0;
+  TEST_ASSERT_TRUE(decode(scanned, frame, work, &scanned_us));
+  TEST_ASSERT_EQUAL_STRING(PAYLOAD, scanned.get_payload().c_str());
+
+  ESP_LOGI("QR decoder test",
+           "decode_frame: %lld us with quirc's threshold only, %lld us with "
+           "the adaptive threshold, %lld us with the finder scan as well",
+           global_us, adaptive_us, scanned_us);
+
+  heap_caps_free(frame);
+  heap_caps_free(work);
+}
@@ -0,0 +1,45 @@
+#include "esp_heap_caps.h"
+#include "quirc_plane.h"
+#include "unity.h"
+#include <cstring>
+
+constexpr int WIDTH = 640;
+constexpr int HEIGHT = 480;
+constexpr int PLANE_WIDTH = 200;
+constexpr int PLANE_HEIGHT = 100;
+
+TEST_CASE("quirc works on an attached plane", "[qr]") {
+  quirc *q = quirc_new();
+  TEST_ASSERT_NOT_NULL(q);
+  TEST_ASSERT_EQUAL(0, quirc_resize(q, WIDTH, HEIGHT));
+  QuircPlane::release_buffer(q);
+
+  int width = 0;
+  int height = 0;
+  TEST_ASSERT_NULL(quirc_begin(q, &width, &height));
+  TEST_ASSERT_EQUAL(WIDTH, width);
+  TEST_ASSERT_EQUAL(HEIGHT, height);
+
+  auto *plane = static_cast<uint8_t *>(
+      heap_caps_malloc(PLANE_WIDTH * PLANE_HEIGHT, MALLOC_CAP_SPIRAM));
+  TEST_ASSERT_NOT_NULL(plane);
+  memset(plane, 255, PLANE_WIDTH * PLANE_HEIGHT);
+  {
+    QuircPlane attached(q, plane, PLANE_WIDTH, PLANE_HEIGHT);
+    TEST_ASSERT_EQUAL_PTR(plane, quirc_begin(q, &width, &height));
+    TEST_ASSERT_EQUAL(PLANE_WIDTH, width);
+    TEST_ASSERT_EQUAL(PLANE_HEIGHT, height);
+    quirc_end(q);
+    TEST_ASSERT_EQUAL(0, quirc_count(q));
+    // quirc thresholded the plane in place, white is 0
+    TEST_ASSERT_EQUAL_UINT8(0, plane[0]);
+    TEST_ASSERT_EQUAL_UINT8(0, plane[PLANE_WIDTH * PLANE_HEIGHT - 1]);
+  }
+
+  // Detached, quirc neither has nor frees a buffer
+  TEST_ASSERT_NULL(quirc_begin(q, &width, &height));
+  TEST_ASSERT_EQUAL(WIDTH, width);
+  TEST_ASSERT_EQUAL(HEIGHT, height);
+  quirc_destroy(q);
+  heap_caps_free(plane);
+}
@@ -4,17 +4,45 @@
 #include "event_manager.h"
 #include "freertos/FreeRTOS.h"
 #include "mysleep.h"
+#include "schedule_index.h"
 #include "storage.h"
+#include <cstdio>
+#include <cstdlib>
 #include <regex>
+#include <sys/time.h>
 
 constexpr auto *TAG = "Config";
+constexpr ChangeDetectionConfig DEFAULT_CHANGE_DETECTION = {
+    .enabled = false, .threshold = 0.3f, .tolerance = 6, .max_skips = 10};
+constexpr DeltaConfig DEFAULT_DELTA = {
+    .enabled = false, .keyframe_interval = 10, .tolerance = 2};
+constexpr ProgressiveConfig DEFAULT_PROGRESSIVE = {.enabled = false,
+                                                   .scale = 8};
+constexpr LogShippingConfig DEFAULT_LOG_SHIPPING = {.qos = 1,
+                                                    .budget = 8 * 1024};
+constexpr OneShotConfig DEFAULT_ONE_SHOT = {.enabled = false,
+                                            .ack_timeout_ms = 2000};
+constexpr TimeSyncConfig DEFAULT_TIME_SYNC = {.max_error_ms = 1000};
+constexpr SleepPolicyConfig DEFAULT_SLEEP_POLICY = {
+    .crossover_s = -1, .deep_sleep_ua = 8000, .light_sleep_ua = 15000};
 
 std::vector<TimingConfig> Config::_timing;
-std::vector<TimingConfig>::iterator Config::_active = Config::_timing.end();
+ScheduleIndex Config::_index;
+int32_t Config::_active = -1;
 char Config::_uuid[40] = {0};
+ChangeDetectionConfig Config::_change_detection = DEFAULT_CHANGE_DETECTION;
+DeltaConfig Config::_delta = DEFAULT_DELTA;
+ProgressiveConfig Config::_progressive = DEFAULT_PROGRESSIVE;
+LogShippingConfig Config::_log_shipping = DEFAULT_LOG_SHIPPING;
+OneShotConfig Config::_one_shot = DEFAULT_ONE_SHOT;
+TimeSyncConfig Config::_time_sync = DEFAULT_TIME_SYNC;
+SleepPolicyConfig Config::_sleep_policy = DEFAULT_SLEEP_POLICY;
+bool Config::_retained_config = false;
+uint32_t Config::_hash = 0;
 
 void Config::load_config(JsonDocument &doc) {
   _timing.clear();
+  _active = -1;
 
   if (strlcpy(_uuid, doc["configId"], sizeof(_uuid)) == 0) {
     ESP_LOGE(TAG, "UUID not found in config!");
@@ -34,6 +62,70 @@ void Config::load_config(JsonDocument &doc) {
     }
     _timing.push_back(tc);
   }
+  compile_schedule();
+
+  _change_detection = DEFAULT_CHANGE_DETECTION;
+  JsonObject change_detection = doc["changeDetection"];
+  if (!change_detection.isNull()) {
+    _change_detection.enabled = true;
+    _change_detection.threshold =
+        change_detection["threshold"] | DEFAULT_CHANGE_DETECTION.threshold;
+    _change_detection.tolerance =
+        change_detection["tolerance"] | DEFAULT_CHANGE_DETECTION.tolerance;
+    _change_detection.max_skips =
+        change_detection["maxSkips"] | DEFAULT_CHANGE_DETECTION.max_skips;
+  }
+
+  _delta = DEFAULT_DELTA;
+  JsonObject delta = doc["delta"];
+  if (!delta.isNull()) {
+    _delta.enabled = true;
+    _delta.keyframe_interval =
+        delta["keyframeInterval"] | DEFAULT_DELTA.keyframe_interval;
+    _delta.tolerance = delta["tolerance"] | DEFAULT_DELTA.tolerance;
+  }
+
+  _progressive = DEFAULT_PROGRESSIVE;
+  JsonObject progressive = doc["progressive"];
+  if (!progressive.isNull()) {
+    _progressive.enabled = true;
+    _progressive.scale = progressive["scale"] | DEFAULT_PROGRESSIVE.scale;
+  }
+
+  _log_shipping = DEFAULT_LOG_SHIPPING;
+  JsonObject log_shipping = doc["logShipping"];
+  if (!log_shipping.isNull()) {
+    _log_shipping.qos = log_shipping["qos"] | DEFAULT_LOG_SHIPPING.qos;
+    _log_shipping.budget = log_shipping["budget"] | DEFAULT_LOG_SHIPPING.budget;
+  }
+
+  _one_shot = DEFAULT_ONE_SHOT;
+  JsonObject one_shot = doc["oneShot"];
+  if (!one_shot.isNull()) {
+    _one_shot.enabled = true;
+    _one_shot.ack_timeout_ms =
+        one_shot["ackTimeout"] | DEFAULT_ONE_SHOT.ack_timeout_ms;
+  }
+
+  _time_sync = DEFAULT_TIME_SYNC;
+  JsonObject time_sync = doc["timeSync"];
+  if (!time_sync.isNull()) {
+    _time_sync.max_error_ms =
+        time_sync["maxError"] | DEFAULT_TIME_SYNC.max_error_ms;
+  }
+
+  _sleep_policy = DEFAULT_SLEEP_POLICY;
+  JsonObject sleep_policy = doc["sleepPolicy"];
+  if (!sleep_policy.isNull()) {
+    _sleep_policy.crossover_s =
+        sleep_policy["crossover"] | DEFAULT_SLEEP_POLICY.crossover_s;
+    _sleep_policy.deep_sleep_ua =
+        sleep_policy["deepSleepCurrent"] | DEFAULT_SLEEP_POLICY.deep_sleep_ua;
+    _sleep_policy.light_sleep_ua =
+        sleep_policy["lightSleepCurrent"] | DEFAULT_SLEEP_POLICY.light_sleep_ua;
+  }
+
+  _retained_config = doc["retainedConfig"] | false;
 }
 
 void Config::load_from_storage() {
@@ -43,6 +135,7 @@ void Config::load_from_storage() {
     ESP_LOGE(TAG, "Error (%s) reading dynamic config from storage!",
              esp_err_to_name(err));
     _timing.push_back(get_active_config());
+    compile_schedule();
     return;
   }
 
@@ -55,6 +148,9 @@ void Config::load_from_storage() {
 
   if (Config::validate(doc)) {
     Config::load_config(doc);
+    char hash[9] = {0};
+    Storage::read_or_default("config_hash", hash, sizeof(hash), "0");
+    _hash = strtoul(hash, nullptr, 16);
   } else {
     ESP_LOGE(TAG, "Invalid config found in NVS!");
     restart();
@@ -62,31 +158,81 @@ void Config::load_from_storage() {
 }
 
 int32_t Config::set_active_config() {
-  char timestamp[9] = {0};
-  Time::get_time(timestamp, sizeof(timestamp));
-  Time now(timestamp);
-
-  for (auto it = _timing.begin(); it != _timing.end(); ++it) {
-    if (now >= it->start && now <= it->end) {
-      _active = it;
-      ESP_LOGI(TAG, "Active: %02d:%02d:%02d - %02d:%02d:%02d, period: %lld",
-               it->start.get_hours(), it->start.get_minutes(),
-               it->start.get_seconds(), it->end.get_hours(),
-               it->end.get_minutes(), it->end.get_seconds(), it->period);
-      if (it->period == -1) {
-        ESP_LOGW(TAG, "Device is going to sleep");
-        ESP_LOGW(TAG, "Device will wake up at %02d:%02d:%02d",
-                 it->end.get_hours(), it->end.get_minutes(),
-                 it->end.get_seconds());
-        vTaskDelay(pdMS_TO_TICKS(3000));
-        PUBLISH(EventType::SLEEP_UNTIL_NEXT_TIMING);
-        return -1;
-      }
-    }
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  uint32_t now_s = static_cast<uint32_t>(tv.tv_sec % SECONDS_PER_DAY);
+
+  const ScheduleInterval &interval = _index.lookup(now_s);
+  _active = interval.timing;
+  if (_active == -1) {
+    ESP_LOGW(TAG, "No timing at this time, default period: %lld",
+             get_default_active_config().period);
+    return 0;
+  }
+  const TimingConfig &tc = _timing[_active];
+  ESP_LOGI(TAG, "Active: %02d:%02d:%02d - %02d:%02d:%02d, period: %lld",
+           tc.start.get_hours(), tc.start.get_minutes(),
+           tc.start.get_seconds(), tc.end.get_hours(), tc.end.get_minutes(),
+           tc.end.get_seconds(), tc.period);
+  if (interval.period == -1) {
+    uint32_t wake_s = (now_s + _index.next_transition_s(now_s)) %
+                      SECONDS_PER_DAY;
+    ESP_LOGW(TAG, "Device is going to sleep");
+    ESP_LOGW(TAG, "Device will wake up at %02lu:%02lu:%02lu", wake_s / 3600,
+             wake_s / 60 % 60, wake_s % 60);
+    vTaskDelay(pdMS_TO_TICKS(3000));
+    PUBLISH(EventType::SLEEP_UNTIL_NEXT_TIMING);
+    return -1;
   }
   return 0;
 }
 
+int64_t Config::get_next_transition_us() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  uint32_t now_s = static_cast<uint32_t>(tv.tv_sec % SECONDS_PER_DAY);
+  return static_cast<int64_t>(_index.next_transition_s(now_s)) * 1000000 -
+         tv.tv_usec;
+}
+
+uint32_t Config::hash(const char *data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+  }
+  return hash;
+}
+
+esp_err_t Config::save_hash(uint32_t hash) {
+  char text[9] = {0};
+  snprintf(text, sizeof(text), "%08lx", hash);
+  esp_err_t err = Storage::write("config_hash", text);
+  if (err == ESP_OK) {
+    _hash = hash;
+  }
+  return err;
+}
+
+void Config::compile_schedule() {
+  std::vector<ScheduleWindow> windows;
+  windows.reserve(_timing.size());
+  for (const TimingConfig &tc : _timing) {
+    windows.push_back({.start_s = static_cast<uint32_t>(tc.start.toSeconds()),
+                       .end_s = static_cast<uint32_t>(tc.end.toSeconds()),
+                       .period = static_cast<int32_t>(tc.period)});
+  }
+  _index.compile(windows);
+  ESP_LOGI(TAG, "Schedule: %u timings, %u intervals", _timing.size(),
+           _index.get_intervals().size());
+
+  // Without the full schedule the application decides every wake
+  WakeSchedule schedule;
+  if (!_index.to_wake_schedule(schedule)) {
+    ESP_LOGW(TAG, "Too many sleeping intervals for the wake stub");
+  }
+  set_wake_schedule(schedule);
+}
+
 TimingConfig Config::get_default_active_config() {
   TimingConfig tc;
   tc.period = 40;
@@ -96,8 +242,8 @@ TimingConfig Config::get_default_active_config() {
 }
 
 TimingConfig Config::get_active_config() {
-  if (!_timing.empty() && _active != _timing.end()) {
-    return *_active;
+  if (_active != -1) {
+    return _timing[_active];
   } else {
     ESP_LOGE(TAG, "No active config found!");
     ESP_LOGE(TAG, "Setting default config,"
@@ -108,8 +254,8 @@ TimingConfig Config::get_active_config() {
 }
 
 int64_t Config::get_period() {
-  if (_active != _timing.end()) {
-    return _active->period;
+  if (_active != -1) {
+    return _timing[_active].period;
   } else {
     ESP_LOGE(TAG, "No active config found!");
     ESP_LOGE(TAG, "Returning default period: 40");
@@ -164,5 +310,150 @@ bool Config::validate(JsonDocument &doc) {
     }
   }
 
+  JsonVariant change_detection = doc["changeDetection"];
+  if (!change_detection.isNull()) {
+    if (!change_detection.is<JsonObject>()) {
+      ESP_LOGE(TAG, "Change detection is not an object");
+      return false;
+    }
+    JsonVariant threshold = change_detection["threshold"];
+    if (!threshold.isNull() &&
+        (!threshold.is<float>() || threshold.as<float>() < 0)) {
+      ESP_LOGE(TAG, "Change detection threshold is invalid");
+      return false;
+    }
+    JsonVariant tolerance = change_detection["tolerance"];
+    if (!tolerance.isNull() &&
+        (!tolerance.is<int>() || tolerance.as<int>() < 0 ||
+         tolerance.as<int>() > 255)) {
+      ESP_LOGE(TAG, "Change detection tolerance is invalid");
+      return false;
+    }
+    JsonVariant max_skips = change_detection["maxSkips"];
+    if (!max_skips.isNull() &&
+        (!max_skips.is<int>() || max_skips.as<int>() < 0 ||
+         max_skips.as<int>() > UINT16_MAX)) {
+      ESP_LOGE(TAG, "Change detection maxSkips is invalid");
+      return false;
+    }
+  }
+
+  JsonVariant delta = doc["delta"];
+  if (!delta.isNull()) {
+    if (!delta.is<JsonObject>()) {
+      ESP_LOGE(TAG, "Delta is not an object");
+      return false;
+    }
+    JsonVariant interval = delta["keyframeInterval"];
+    if (!interval.isNull() &&
+        (!interval.is<int>() || interval.as<int>() < 1 ||
+         interval.as<int>() > UINT16_MAX)) {
+      ESP_LOGE(TAG, "Delta keyframeInterval is invalid");
+      return false;
+    }
+    JsonVariant tolerance = delta["tolerance"];
+    if (!tolerance.isNull() &&
+        (!tolerance.is<int>() || tolerance.as<int>() < 0 ||
+         tolerance.as<int>() > 255)) {
+      ESP_LOGE(TAG, "Delta tolerance is invalid");
+      return false;
+    }
+  }
+
+  JsonVariant progressive = doc["progressive"];
+  if (!progressive.isNull()) {
+    if (!progressive.is<JsonObject>()) {
+      ESP_LOGE(TAG, "Progressive is not an object");
+      return false;
+    }
+    JsonVariant scale = progressive["scale"];
+    if (!scale.isNull() &&
+        (!scale.is<int>() || (scale.as<int>() != 4 && scale.as<int>() != 8 &&
+                              scale.as<int>() != 16))) {
+      ESP_LOGE(TAG, "Progressive scale is invalid, expected 4, 8 or 16");
+      return false;
+    }
+  }
+
+  JsonVariant log_shipping = doc["logShipping"];
+  if (!log_shipping.isNull()) {
+    if (!log_shipping.is<JsonObject>()) {
+      ESP_LOGE(TAG, "Log shipping is not an object");
+      return false;
+    }
+    JsonVariant qos = log_shipping["qos"];
+    if (!qos.isNull() &&
+        (!qos.is<int>() || qos.as<int>() < 0 || qos.as<int>() > 2)) {
+      ESP_LOGE(TAG, "Log shipping QoS is invalid, expected 0, 1 or 2");
+      return false;
+    }
+    JsonVariant budget = log_shipping["budget"];
+    if (!budget.isNull() && !budget.is<uint32_t>()) {
+      ESP_LOGE(TAG, "Log shipping budget is invalid");
+      return false;
+    }
+  }
+
+  JsonVariant one_shot = doc["oneShot"];
+  if (!one_shot.isNull()) {
+    if (!one_shot.is<JsonObject>()) {
+      ESP_LOGE(TAG, "One-shot is not an object");
+      return false;
+    }
+    JsonVariant ack_timeout = one_shot["ackTimeout"];
+    if (!ack_timeout.isNull() &&
+        (!ack_timeout.is<int>() || ack_timeout.as<int>() < 0 ||
+         ack_timeout.as<int>() > 60000)) {
+      ESP_LOGE(TAG, "One-shot ackTimeout is invalid, expected 0-60000 ms");
+      return false;
+    }
+  }
+
+  JsonVariant time_sync = doc["timeSync"];
+  if (!time_sync.isNull()) {
+    if (!time_sync.is<JsonObject>()) {
+      ESP_LOGE(TAG, "Time sync is not an object");
+      return false;
+    }
+    JsonVariant max_error = time_sync["maxError"];
+    if (!max_error.isNull() &&
+        (!max_error.is<int>() || max_error.as<int>() < 1 ||
+         max_error.as<int>() > 3600000)) {
+      ESP_LOGE(TAG, "Time sync maxError is invalid, expected 1-3600000 ms");
+      return false;
+    }
+  }
+
+  JsonVariant sleep_policy = doc["sleepPolicy"];
+  if (!sleep_policy.isNull()) {
+    if (!sleep_policy.is<JsonObject>()) {
+      ESP_LOGE(TAG, "Sleep policy is not an object");
+      return false;
+    }
+    JsonVariant crossover = sleep_policy["crossover"];
+    if (!crossover.isNull() &&
+        (!crossover.is<int>() || crossover.as<int>() < -1 ||
+         crossover.as<int>() > 86400)) {
+      ESP_LOGE(TAG, "Sleep policy crossover is invalid, expected -1-86400 s");
+      return false;
+    }
+    for (const char *key : {"deepSleepCurrent", "lightSleepCurrent"}) {
+      JsonVariant current = sleep_policy[key];
+      if (!current.isNull() &&
+          (!current.is<int>() || current.as<int>() < 0 ||
+           current.as<int>() > 1000000)) {
+        ESP_LOGE(TAG, "Sleep policy %s is invalid, expected 0-1000000 uA",
+                 key);
+        return false;
+      }
+    }
+  }
+
+  JsonVariant retained_config = doc["retainedConfig"];
+  if (!retained_config.isNull() && !retained_config.is<bool>()) {
+    ESP_LOGE(TAG, "retainedConfig is not a boolean");
+    return false;
+  }
+
   return true;
 }
\ No newline at end of file
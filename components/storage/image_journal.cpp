@@ -0,0 +1,262 @@
+#include "image_journal.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "rtc_budget.h"
+#include <algorithm>
+#include <cstddef>
+
+constexpr auto *TAG = "Image journal";
+
+namespace {
+
+constexpr uint32_t RECORD_MAGIC = 0x4c4e524a; // "JRNL"
+constexpr uint32_t UNWRITTEN = 0xffffffff;    // erased flash
+constexpr uint32_t COMMITTED = 0x00c0ffee;
+constexpr uint32_t CONSUMED = 0x00000000;
+
+/**
+ * @brief The start of every record, at a sector boundary
+ *
+ * The markers read UNWRITTEN until they are programmed, after the rest of
+ * the record.
+ */
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t header_size;
+  uint32_t data_size;
+  uint32_t crc;        /*!< of the image header and the data */
+  uint32_t header_crc; /*!< of the fields above */
+  uint32_t committed;
+  uint32_t consumed;
+};
+static_assert(sizeof(RecordHeader) == 32);
+
+uint32_t header_crc(const RecordHeader &header) {
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&header),
+                          offsetof(RecordHeader, header_crc));
+}
+
+/**
+ * @return The size of the record rounded up to whole sectors
+ */
+uint64_t record_span(uint64_t header_size, uint64_t data_size) {
+  uint64_t size = sizeof(RecordHeader) + header_size + data_size;
+  return (size + ImageJournal::SECTOR_SIZE - 1) /
+         ImageJournal::SECTOR_SIZE * ImageJournal::SECTOR_SIZE;
+}
+
+} // namespace
+
+/**
+ * @brief The number of records of the journal, kept in RTC memory
+ */
+struct RecordHint {
+  bool valid; /*!< false after a cold boot */
+  uint32_t records;
+};
+RTC_SLOW_ATTR static RecordHint s_hint;
+static_assert(sizeof(s_hint) <= rtc_budget::JOURNAL,
+              "The record hint doesn't fit into its RTC memory");
+
+esp_err_t ImageJournal::mount() {
+  if (_partition != nullptr) {
+    return ESP_OK;
+  }
+  const esp_partition_t *partition = esp_partition_find_first(
+      ESP_PARTITION_TYPE_DATA, PARTITION_SUBTYPE, PARTITION_LABEL);
+  if (partition == nullptr) {
+    ESP_LOGE(TAG, "No journal partition!");
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  // The records follow each other from the start of the partition, so the
+  // scan jumps over the data of every record it finds
+  uint32_t newest = 0;
+  for (uint32_t offset = 0; offset < partition->size;) {
+    RecordHeader header;
+    esp_err_t err =
+        esp_partition_read(partition, offset, &header, sizeof(header));
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Error (%s) reading the journal!", esp_err_to_name(err));
+      return err;
+    }
+    uint64_t span = record_span(header.header_size, header.data_size);
+    if (header.magic != RECORD_MAGIC ||
+        header.header_crc != header_crc(header) ||
+        offset + span > partition->size) {
+      offset += SECTOR_SIZE;
+      continue;
+    }
+
+    // A torn record is skipped, but the next record goes after it
+    if (header.sequence >= newest) {
+      newest = header.sequence;
+      _head = offset + static_cast<uint32_t>(span);
+    }
+    if (header.committed == COMMITTED && header.consumed != CONSUMED) {
+      _records.push_back({header.sequence, offset, header.header_size,
+                          header.data_size});
+    }
+    offset += static_cast<uint32_t>(span);
+  }
+
+  std::sort(_records.begin(), _records.end(),
+            [](const Record &a, const Record &b) {
+              return a.sequence < b.sequence;
+            });
+  _next_sequence = newest + 1;
+  _partition = partition;
+  update_hint();
+  ESP_LOGI(TAG, "Mounted with %u records, next at 0x%lx", _records.size(),
+           _head);
+  return ESP_OK;
+}
+
+esp_err_t ImageJournal::append(const char *header, size_t header_size,
+                               const uint8_t *data, size_t data_size) {
+  if (_partition == nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  uint64_t span = record_span(header_size, data_size);
+  if (header_size > MAX_HEADER_SIZE || span > _partition->size) {
+    ESP_LOGE(TAG, "Record of %u bytes doesn't fit in the journal!",
+             header_size + data_size);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  uint32_t offset = _head + span > _partition->size ? 0 : _head;
+  uint32_t end = offset + static_cast<uint32_t>(span);
+
+  // Erasing the first sector wipes the header of an overwritten record
+  drop_overlapping(offset, end);
+  esp_err_t err = esp_partition_erase_range(_partition, offset, end - offset);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Error (%s) erasing the journal!", esp_err_to_name(err));
+    return err;
+  }
+
+  RecordHeader record = {RECORD_MAGIC,
+                         _next_sequence,
+                         static_cast<uint32_t>(header_size),
+                         static_cast<uint32_t>(data_size),
+                         0,
+                         0,
+                         UNWRITTEN,
+                         UNWRITTEN};
+  record.crc = esp_rom_crc32_le(
+      esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(header),
+                       header_size),
+      data, data_size);
+  record.header_crc = header_crc(record);
+
+  // The record is committed last, a power loss before leaves a torn record
+  uint32_t header_offset = offset + sizeof(RecordHeader);
+  err = esp_partition_write(_partition, offset, &record, sizeof(record));
+  if (err == ESP_OK) {
+    err = esp_partition_write(_partition, header_offset, header, header_size);
+  }
+  if (err == ESP_OK) {
+    err = esp_partition_write(_partition, header_offset + header_size, data,
+                              data_size);
+  }
+  if (err == ESP_OK) {
+    err = write_marker(offset + offsetof(RecordHeader, committed), COMMITTED);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Error (%s) writing the journal!", esp_err_to_name(err));
+    return err;
+  }
+
+  _records.push_back({record.sequence, offset, record.header_size,
+                      record.data_size});
+  _head = end;
+  _next_sequence++;
+  update_hint();
+  ESP_LOGI(TAG, "Appended record %lu of %u bytes at 0x%lx", record.sequence,
+           header_size + data_size, offset);
+  return ESP_OK;
+}
+
+esp_err_t ImageJournal::map(const Record &record, const char **header,
+                            const uint8_t **data,
+                            esp_partition_mmap_handle_t *handle) {
+  if (_partition == nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  size_t size = sizeof(RecordHeader) + record.header_size + record.data_size;
+  const void *mapped = nullptr;
+  esp_err_t err = esp_partition_mmap(_partition, record.offset, size,
+                                     ESP_PARTITION_MMAP_DATA, &mapped, handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Error (%s) mapping record %lu!", esp_err_to_name(err),
+             record.sequence);
+    return err;
+  }
+
+  // The header and the data follow each other, one pass checks both
+  const auto *start = static_cast<const uint8_t *>(mapped);
+  const auto *stored = reinterpret_cast<const RecordHeader *>(start);
+  const uint8_t *payload = start + sizeof(RecordHeader);
+  if (esp_rom_crc32_le(0, payload, record.header_size + record.data_size) !=
+      stored->crc) {
+    ESP_LOGE(TAG, "Record %lu is corrupt!", record.sequence);
+    esp_partition_munmap(*handle);
+    return ESP_ERR_INVALID_CRC;
+  }
+  *header = reinterpret_cast<const char *>(payload);
+  *data = payload + record.header_size;
+  return ESP_OK;
+}
+
+void ImageJournal::unmap(esp_partition_mmap_handle_t handle) {
+  esp_partition_munmap(handle);
+}
+
+esp_err_t ImageJournal::consume(const Record &record) {
+  if (_partition == nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  esp_err_t err = write_marker(
+      record.offset + offsetof(RecordHeader, consumed), CONSUMED);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Error (%s) consuming record %lu!", esp_err_to_name(err),
+             record.sequence);
+    return err;
+  }
+  _records.erase(std::remove_if(_records.begin(), _records.end(),
+                                [&record](const Record &r) {
+                                  return r.sequence == record.sequence;
+                                }),
+                 _records.end());
+  update_hint();
+  return ESP_OK;
+}
+
+bool ImageJournal::may_have_records() {
+  return !s_hint.valid || s_hint.records > 0;
+}
+
+void ImageJournal::drop_overlapping(uint32_t start, uint32_t end) {
+  auto overwritten = [this, start, end](const Record &r) {
+    uint32_t r_end = r.offset + static_cast<uint32_t>(
+                                    record_span(r.header_size, r.data_size));
+    if (r.offset < end && start < r_end) {
+      ESP_LOGW(TAG, "Dropping record %lu, the journal is full", r.sequence);
+      _dropped++;
+      return true;
+    }
+    return false;
+  };
+  _records.erase(std::remove_if(_records.begin(), _records.end(), overwritten),
+                 _records.end());
+}
+
+esp_err_t ImageJournal::write_marker(uint32_t offset, uint32_t marker) {
+  return esp_partition_write(_partition, offset, &marker, sizeof(marker));
+}
+
+void ImageJournal::update_hint() {
+  s_hint.valid = true;
+  s_hint.records = static_cast<uint32_t>(_records.size());
+}
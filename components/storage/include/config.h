@@ -1,9 +1,12 @@
 #pragma once
 
+#include "esp_err.h"
 #include "json_converters.h"
 #include "mytime.h"
 #include <vector>
 
+class ScheduleIndex;
+
 /**
  * @brief Structure to hold timing configuration.
  */
@@ -13,6 +16,65 @@ typedef struct {
   Time end;       /*!< HH:MM:SS */
 } TimingConfig;
 
+/**
+ * @brief Structure to hold the change detection configuration.
+ */
+typedef struct {
+  bool enabled;       /*!< true if the "changeDetection" object is present */
+  float threshold;    /*!< uploads with a lower diff score are skipped, % */
+  uint8_t tolerance;  /*!< block mean difference which is not a change */
+  uint16_t max_skips; /*!< skipped uploads in a row before a forced one */
+} ChangeDetectionConfig;
+
+/**
+ * @brief Structure to hold the delta frame configuration.
+ */
+typedef struct {
+  bool enabled;               /*!< true if the "delta" object is present */
+  uint16_t keyframe_interval; /*!< a keyframe is sent every N wakes */
+  uint8_t tolerance;          /*!< mean difference of a same tile half */
+} DeltaConfig;
+
+/**
+ * @brief Structure to hold the progressive upload configuration.
+ */
+typedef struct {
+  bool enabled;   /*!< true if the "progressive" object is present */
+  uint16_t scale; /*!< the thumbnail is 1/scale of the image: 4, 8 or 16 */
+} ProgressiveConfig;
+
+/**
+ * @brief Structure to hold the remote log configuration.
+ */
+typedef struct {
+  uint8_t qos;     /*!< QoS of the log batches: 0, 1 or 2 */
+  uint32_t budget; /*!< log bytes published per wake, the rest is dropped */
+} LogShippingConfig;
+
+/**
+ * @brief Structure to hold the one-shot upload configuration.
+ */
+typedef struct {
+  bool enabled;            /*!< true if the "oneShot" object is present */
+  uint32_t ack_timeout_ms; /*!< wait for the acknowledgement after the image */
+} OneShotConfig;
+
+/**
+ * @brief Structure to hold the time sync configuration.
+ */
+typedef struct {
+  uint32_t max_error_ms; /*!< NTP is waited for above this clock error */
+} TimeSyncConfig;
+
+/**
+ * @brief Structure to hold the sleep policy configuration.
+ */
+typedef struct {
+  int32_t crossover_s;     /*!< light sleep below it, -1 calibrates it */
+  uint32_t deep_sleep_ua;  /*!< the current of the device in deep sleep */
+  uint32_t light_sleep_ua; /*!< the current of the device in light sleep */
+} SleepPolicyConfig;
+
 /**
  * @brief Manages configuration settings.
  */
@@ -52,6 +114,18 @@ public:
    *
    *   - The start and end times are in the format HH:MM:SS
    *
+   *   - The optional change detection threshold is a non-negative number,
+   *     the tolerance is 0 - 255 and the maximum skips is not negative
+   *
+   *   - The optional delta keyframe interval is positive and the tolerance is
+   *     0 - 255
+   *
+   *   - The optional progressive thumbnail scale is 4, 8 or 16
+   *
+   *   - The optional log shipping QoS is 0 - 2 and the budget is not negative
+   *
+   *   - The optional time sync maximum error is 1 - 3600000 ms
+   *
    *
    * @param config The new configuration as a string
    *
@@ -83,6 +157,16 @@ public:
    */
   static int32_t set_active_config();
 
+  /**
+   * @brief Gets the time until the next transition of the schedule
+   *
+   * @note In a sleeping window, the transition is the end of the sleep
+   *
+   * @return The time in microseconds until the start of the next window or
+   * gap of the schedule
+   */
+  static int64_t get_next_transition_us();
+
   /**
    * @brief Gets the UUID
    *
@@ -99,10 +183,131 @@ public:
    */
   static int64_t get_period();
 
+  /**
+   * @brief Gets the change detection configuration
+   *
+   * @return
+   *    - The change detection configuration, disabled if it is missing from
+   *      the dynamic configuration
+   */
+  static ChangeDetectionConfig get_change_detection() {
+    return _change_detection;
+  }
+
+  /**
+   * @brief Gets the delta frame configuration
+   *
+   * @return
+   *    - The delta frame configuration, disabled if it is missing from the
+   *      dynamic configuration
+   */
+  static DeltaConfig get_delta() { return _delta; }
+
+  /**
+   * @brief Gets the progressive upload configuration
+   *
+   * @return
+   *    - The progressive upload configuration, disabled if it is missing from
+   *      the dynamic configuration
+   */
+  static ProgressiveConfig get_progressive() { return _progressive; }
+
+  /**
+   * @brief Gets the remote log configuration
+   *
+   * @return
+   *    - The remote log configuration, the defaults if it is missing from the
+   *      dynamic configuration
+   */
+  static LogShippingConfig get_log_shipping() { return _log_shipping; }
+
+  /**
+   * @brief Gets the one-shot upload configuration
+   *
+   * @return
+   *    - The one-shot upload configuration, disabled if it is missing from the
+   *      dynamic configuration
+   */
+  static OneShotConfig get_one_shot() { return _one_shot; }
+
+  /**
+   * @brief Gets the time sync configuration
+   *
+   * @return
+   *    - The time sync configuration, the defaults if it is missing from the
+   *      dynamic configuration
+   */
+  static TimeSyncConfig get_time_sync() { return _time_sync; }
+
+  /**
+   * @brief Gets the sleep policy configuration
+   *
+   * @return
+   *    - The sleep policy configuration, the defaults if it is missing from
+   *      the dynamic configuration
+   */
+  static SleepPolicyConfig get_sleep_policy() { return _sleep_policy; }
+
+  /**
+   * @brief Gets whether the server keeps the config as a retained message
+   *
+   * @return
+   *    - true if "retainedConfig" is true in the dynamic configuration, the
+   *      device doesn't wait for the answer of the health report then
+   */
+  static bool get_retained_config() { return _retained_config; }
+
+  /**
+   * @brief Hashes a config message with 32-bit FNV-1a
+   *
+   * @param data The config message as received
+   * @param len The length of the message
+   *
+   * @return The hash of the message
+   */
+  static uint32_t hash(const char *data, size_t len);
+
+  /**
+   * @brief Gets the hash of the config message the dynamic configuration was
+   * loaded from
+   *
+   * @return The hash, 0 if it is unknown
+   */
+  static uint32_t get_hash() { return _hash; }
+
+  /**
+   * @brief Saves the hash of the config message of the dynamic configuration
+   *
+   * @param hash The hash of the config message
+   *
+   * @return
+   *    - ESP_OK on success
+   *
+   *    - ESP_FAIL if it couldn't be saved
+   */
+  static esp_err_t save_hash(uint32_t hash);
+
 private:
   static std::vector<TimingConfig> _timing; /*!< list of operational hours */
-  static std::vector<TimingConfig>::iterator _active;
+  static ScheduleIndex _index; /*!< compiled operational hours */
+  static int32_t _active;      /*!< index of the active timing, -1 if none */
   static char _uuid[40]; /*! config UUID */
+  static ChangeDetectionConfig _change_detection;
+  static DeltaConfig _delta;
+  static ProgressiveConfig _progressive;
+  static LogShippingConfig _log_shipping;
+  static OneShotConfig _one_shot;
+  static TimeSyncConfig _time_sync;
+  static SleepPolicyConfig _sleep_policy;
+  static bool _retained_config;
+  static uint32_t _hash; /*!< hash of the received config message */
+
+  /**
+   * @brief Compiles the timings into the schedule index, and into the
+   * schedule of the deep sleep wake stub, which skips the boot in the
+   * sleeping windows
+   */
+  static void compile_schedule();
 
   /**
    * @brief Gets the default active configuration
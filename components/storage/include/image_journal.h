@@ -0,0 +1,155 @@
+#pragma once
+
+#include "esp_err.h"
+#include "esp_partition.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Store-and-forward journal of the images which couldn't be uploaded
+ *
+ * The records are appended to the "journal" data partition like a log. A
+ * record starts at a sector boundary with a fixed-size record header,
+ * followed by the image header message and the image data. Its sectors are
+ * erased before it is written, and it is committed by programming a marker
+ * word of the record header last, so a record torn by a power loss is never
+ * drained. At the end of the partition the journal wraps to its start, and
+ * drops the oldest records it overwrites.
+ *
+ * There is no index on flash: mount() scans the record headers at the sector
+ * boundaries. A drained record is marked consumed in place. The records are
+ * read through a memory mapping, so they are published straight from flash.
+ */
+class ImageJournal {
+public:
+  static constexpr const char *PARTITION_LABEL = "journal";
+  static constexpr esp_partition_subtype_t PARTITION_SUBTYPE =
+      static_cast<esp_partition_subtype_t>(0x40); /*!< partitions.csv */
+  static constexpr uint32_t SECTOR_SIZE = 4096;
+  static constexpr size_t MAX_HEADER_SIZE = 512;
+
+  /**
+   * @brief A committed record which wasn't consumed yet
+   */
+  struct Record {
+    uint32_t sequence; /*!< increases with every appended record */
+    uint32_t offset;   /*!< of the record in the partition */
+    uint32_t header_size;
+    uint32_t data_size;
+  };
+
+  ImageJournal() = default;
+
+  ImageJournal(const ImageJournal &) = delete;
+  ImageJournal &operator=(const ImageJournal &) = delete;
+
+  /**
+   * @brief Finds the partition and recovers the records from flash, does
+   * nothing if the journal is mounted already
+   *
+   * @return
+   *     - ESP_OK on success
+   *
+   *     - ESP_ERR_NOT_FOUND if there is no journal partition
+   *
+   *     - the error of the flash read otherwise
+   */
+  esp_err_t mount();
+
+  /**
+   * @brief Appends a record, dropping the oldest records it overwrites
+   *
+   * @param header The image header message
+   * @param header_size The size of the header, at most MAX_HEADER_SIZE
+   * @param data The image data
+   * @param data_size The size of the data
+   *
+   * @return
+   *     - ESP_OK when the record is committed
+   *
+   *     - ESP_ERR_INVALID_STATE if the journal isn't mounted
+   *
+   *     - ESP_ERR_INVALID_SIZE if the record doesn't fit in the partition
+   *
+   *     - the error of the flash erase or write otherwise
+   */
+  esp_err_t append(const char *header, size_t header_size, const uint8_t *data,
+                   size_t data_size);
+
+  /**
+   * @brief Maps the record into the data address space and checks its CRC
+   *
+   * @param record One of records()
+   * @param header The image header, it isn't terminated
+   * @param data The image data
+   * @param handle The handle to pass to unmap() when the record is not
+   * needed anymore
+   *
+   * @return
+   *     - ESP_OK on success
+   *
+   *     - ESP_ERR_INVALID_CRC if the record is corrupt, it is unmapped
+   *
+   *     - the error of the mapping otherwise
+   */
+  esp_err_t map(const Record &record, const char **header,
+                const uint8_t **data, esp_partition_mmap_handle_t *handle);
+
+  /**
+   * @brief Releases the mapping of a record
+   */
+  static void unmap(esp_partition_mmap_handle_t handle);
+
+  /**
+   * @brief Marks the record consumed, so it isn't drained again
+   *
+   * @return ESP_OK on success, the error of the flash write otherwise
+   */
+  esp_err_t consume(const Record &record);
+
+  /**
+   * @return The committed records which weren't consumed, oldest first
+   */
+  const std::vector<Record> &records() const { return _records; }
+
+  /**
+   * @return The offset where the next record is written
+   */
+  uint32_t head() const { return _head; }
+
+  /**
+   * @return The number of records overwritten before they were consumed
+   */
+  uint32_t dropped() const { return _dropped; }
+
+  /**
+   * @brief Whether there may be records to drain, without scanning the flash
+   *
+   * The number of records is kept in RTC memory across deep sleep. After a
+   * cold boot it is unknown, and the journal has to be mounted to tell.
+   */
+  static bool may_have_records();
+
+private:
+  /**
+   * @brief Removes the records overlapping [start, end) from records()
+   */
+  void drop_overlapping(uint32_t start, uint32_t end);
+
+  /**
+   * @brief Writes a marker word of the record header at the given offset
+   */
+  esp_err_t write_marker(uint32_t offset, uint32_t marker);
+
+  /**
+   * @brief Remembers the number of records in RTC memory
+   */
+  void update_hint();
+
+  const esp_partition_t *_partition = nullptr;
+  std::vector<Record> _records;
+  uint32_t _head = 0;
+  uint32_t _next_sequence = 1;
+  uint32_t _dropped = 0;
+};
@@ -50,6 +50,24 @@ public:
    */
   static esp_err_t read(const std::string &key, char *value, uint32_t len);
 
+  /**
+   * @brief Reads an optional value from the NVS storage
+   *
+   * @note If the key does not exist, the default value is copied to the buffer
+   * and no error is logged
+   *
+   * @param key The key to read
+   * @param value The buffer to store the read value
+   * @param len The length of the buffer
+   * @param default_value The value used when the key does not exist
+   * @return
+   *     - ESP_OK on success, or if the default value was used
+   *
+   *     - ESP_FAIL on error
+   */
+  static esp_err_t read_or_default(const std::string &key, char *value,
+                                   uint32_t len, const char *default_value);
+
   /**
    * @brief Reads the error_count value from the NVS storage
    *
@@ -3,6 +3,7 @@
 #include "esp_system.h"
 #include "nvs.h"
 #include "nvs_handle.hpp"
+#include <cstring>
 #include <nvs_flash.h>
 
 constexpr auto *TAG = "Storage";
@@ -87,6 +88,30 @@ esp_err_t Storage::read(const std::string &key, char *value, uint32_t len) {
   return err;
 }
 
+esp_err_t Storage::read_or_default(const std::string &key, char *value,
+                                   uint32_t len, const char *default_value) {
+  esp_err_t err;
+  std::unique_ptr<nvs::NVSHandle> handle =
+      nvs::open_nvs_handle("storage", NVS_READONLY, &err);
+  if (err == ESP_OK) {
+    err = handle->get_string(key.c_str(), value, len);
+  }
+
+  switch (err) {
+  case ESP_OK:
+    break;
+  case ESP_ERR_NVS_NOT_FOUND:
+    strlcpy(value, default_value, len);
+    err = ESP_OK;
+    break;
+  default:
+    ESP_LOGE(TAG, "Error (%s) reading %s!", esp_err_to_name(err), key.c_str());
+    strlcpy(value, default_value, len);
+  }
+
+  return err;
+}
+
 esp_err_t Storage::read_error_count(uint32_t *value) {
   esp_err_t err;
   std::unique_ptr<nvs::NVSHandle> handle =
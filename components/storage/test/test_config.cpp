@@ -93,6 +93,248 @@ TEST_CASE("Validate incorrect config", "[config]") {
   }
 }
 
+TEST_CASE("Validate change detection config", "[config]") {
+  {
+    JsonDocument doc = deserialize_config();
+    doc["changeDetection"]["threshold"] = 0.5;
+    doc["changeDetection"]["tolerance"] = 8;
+    doc["changeDetection"]["maxSkips"] = 5;
+    TEST_ASSERT_TRUE(Config::validate(doc));
+    Config::load_config(doc);
+    ChangeDetectionConfig config = Config::get_change_detection();
+    TEST_ASSERT_TRUE(config.enabled);
+    TEST_ASSERT_EQUAL_FLOAT(0.5f, config.threshold);
+    TEST_ASSERT_EQUAL_UINT8(8, config.tolerance);
+    TEST_ASSERT_EQUAL_UINT16(5, config.max_skips);
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    Config::load_config(doc);
+    TEST_ASSERT_FALSE_MESSAGE(Config::get_change_detection().enabled,
+                              "Missing change detection should disable it");
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["changeDetection"]["threshold"] = -1;
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "Negative threshold should fail validation");
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["changeDetection"]["tolerance"] = 300;
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "Too large tolerance should fail validation");
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["changeDetection"] = 1;
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "Non-object change detection should fail");
+  }
+}
+
+TEST_CASE("Validate delta config", "[config]") {
+  {
+    JsonDocument doc = deserialize_config();
+    doc["delta"]["keyframeInterval"] = 5;
+    TEST_ASSERT_TRUE(Config::validate(doc));
+    Config::load_config(doc);
+    DeltaConfig config = Config::get_delta();
+    TEST_ASSERT_TRUE(config.enabled);
+    TEST_ASSERT_EQUAL_UINT16(5, config.keyframe_interval);
+    TEST_ASSERT_EQUAL_UINT8(2, config.tolerance);
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["delta"]["keyframeInterval"] = 0;
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "Zero keyframe interval should fail validation");
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["delta"]["tolerance"] = -1;
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "Negative tolerance should fail validation");
+  }
+}
+
+TEST_CASE("Validate progressive config", "[config]") {
+  {
+    JsonDocument doc = deserialize_config();
+    doc["progressive"]["scale"] = 16;
+    TEST_ASSERT_TRUE(Config::validate(doc));
+    Config::load_config(doc);
+    TEST_ASSERT_TRUE(Config::get_progressive().enabled);
+    TEST_ASSERT_EQUAL_UINT16(16, Config::get_progressive().scale);
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["progressive"]["scale"] = 3;
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "Unsupported scale should fail validation");
+  }
+}
+
+TEST_CASE("Validate log shipping config", "[config]") {
+  {
+    JsonDocument doc = deserialize_config();
+    Config::load_config(doc);
+    TEST_ASSERT_EQUAL_UINT8(1, Config::get_log_shipping().qos);
+    TEST_ASSERT_EQUAL_UINT32(8 * 1024, Config::get_log_shipping().budget);
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["logShipping"]["qos"] = 0;
+    doc["logShipping"]["budget"] = 2048;
+    TEST_ASSERT_TRUE(Config::validate(doc));
+    Config::load_config(doc);
+    TEST_ASSERT_EQUAL_UINT8(0, Config::get_log_shipping().qos);
+    TEST_ASSERT_EQUAL_UINT32(2048, Config::get_log_shipping().budget);
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["logShipping"]["qos"] = 3;
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "QoS 3 should fail validation");
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["logShipping"]["budget"] = -1;
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "Negative budget should fail validation");
+  }
+}
+
+TEST_CASE("Validate one-shot config", "[config]") {
+  {
+    JsonDocument doc = deserialize_config();
+    Config::load_config(doc);
+    TEST_ASSERT_FALSE_MESSAGE(Config::get_one_shot().enabled,
+                              "Missing one-shot should disable it");
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["oneShot"]["ackTimeout"] = 500;
+    TEST_ASSERT_TRUE(Config::validate(doc));
+    Config::load_config(doc);
+    TEST_ASSERT_TRUE(Config::get_one_shot().enabled);
+    TEST_ASSERT_EQUAL_UINT32(500, Config::get_one_shot().ack_timeout_ms);
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["oneShot"].to<JsonObject>();
+    TEST_ASSERT_TRUE(Config::validate(doc));
+    Config::load_config(doc);
+    TEST_ASSERT_TRUE(Config::get_one_shot().enabled);
+    TEST_ASSERT_EQUAL_UINT32(2000, Config::get_one_shot().ack_timeout_ms);
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["oneShot"]["ackTimeout"] = -1;
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "Negative ackTimeout should fail validation");
+  }
+}
+
+TEST_CASE("Validate time sync config", "[config]") {
+  {
+    JsonDocument doc = deserialize_config();
+    Config::load_config(doc);
+    TEST_ASSERT_EQUAL_UINT32(1000, Config::get_time_sync().max_error_ms);
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["timeSync"]["maxError"] = 250;
+    TEST_ASSERT_TRUE(Config::validate(doc));
+    Config::load_config(doc);
+    TEST_ASSERT_EQUAL_UINT32(250, Config::get_time_sync().max_error_ms);
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["timeSync"]["maxError"] = 0;
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "Zero maxError should fail validation");
+  }
+}
+
+TEST_CASE("Validate sleep policy config", "[config]") {
+  {
+    JsonDocument doc = deserialize_config();
+    Config::load_config(doc);
+    TEST_ASSERT_EQUAL_INT32(-1, Config::get_sleep_policy().crossover_s);
+    TEST_ASSERT_EQUAL_UINT32(8000, Config::get_sleep_policy().deep_sleep_ua);
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["sleepPolicy"]["crossover"] = 60;
+    doc["sleepPolicy"]["lightSleepCurrent"] = 12000;
+    TEST_ASSERT_TRUE(Config::validate(doc));
+    Config::load_config(doc);
+    TEST_ASSERT_EQUAL_INT32(60, Config::get_sleep_policy().crossover_s);
+    TEST_ASSERT_EQUAL_UINT32(12000, Config::get_sleep_policy().light_sleep_ua);
+    TEST_ASSERT_EQUAL_UINT32(8000, Config::get_sleep_policy().deep_sleep_ua);
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["sleepPolicy"]["crossover"] = -2;
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "Negative crossover should fail validation");
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["sleepPolicy"]["deepSleepCurrent"] = "8 mA";
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "String current should fail validation");
+  }
+}
+
+TEST_CASE("Validate retained config", "[config]") {
+  {
+    JsonDocument doc = deserialize_config();
+    doc["retainedConfig"] = true;
+    TEST_ASSERT_TRUE(Config::validate(doc));
+    Config::load_config(doc);
+    TEST_ASSERT_TRUE(Config::get_retained_config());
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    Config::load_config(doc);
+    TEST_ASSERT_FALSE(Config::get_retained_config());
+  }
+
+  {
+    JsonDocument doc = deserialize_config();
+    doc["retainedConfig"] = "yes";
+    TEST_ASSERT_FALSE_MESSAGE(Config::validate(doc),
+                              "Non-boolean retainedConfig should fail");
+  }
+}
+
+TEST_CASE("Config messages are hashed with FNV-1a", "[config]") {
+  TEST_ASSERT_EQUAL_HEX32(0x811c9dc5, Config::hash("", 0));
+  TEST_ASSERT_EQUAL_HEX32(0xe40c292c, Config::hash("a", 1));
+  TEST_ASSERT_EQUAL_HEX32(0xbf9cf968, Config::hash("foobar", 6));
+}
+
 TEST_CASE("Set correct active config", "[config]") {
   JsonDocument doc = deserialize_config();
   TEST_ASSERT(Config::validate(doc));
@@ -0,0 +1,84 @@
+#include "image_journal.h"
+#include "unity.h"
+#include <cstring>
+#include <vector>
+
+static std::vector<uint8_t> make_data(size_t size, uint8_t seed) {
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = static_cast<uint8_t>(seed + i * 7);
+  }
+  return data;
+}
+
+static void check_record(ImageJournal &journal,
+                         const ImageJournal::Record &record,
+                         const char *expected_header,
+                         const std::vector<uint8_t> &expected_data) {
+  const char *header = nullptr;
+  const uint8_t *data = nullptr;
+  esp_partition_mmap_handle_t handle;
+  TEST_ASSERT_EQUAL(ESP_OK, journal.map(record, &header, &data, &handle));
+  TEST_ASSERT_EQUAL(strlen(expected_header), record.header_size);
+  TEST_ASSERT_EQUAL_STRING_LEN(expected_header, header, record.header_size);
+  TEST_ASSERT_EQUAL(expected_data.size(), record.data_size);
+  TEST_ASSERT_EQUAL_MEMORY(expected_data.data(), data, expected_data.size());
+  ImageJournal::unmap(handle);
+}
+
+TEST_CASE("Journaled images survive a remount", "[image_journal]") {
+  ImageJournal journal;
+  esp_err_t err = journal.mount();
+  if (err == ESP_ERR_NOT_FOUND) {
+    TEST_IGNORE_MESSAGE("No journal partition in the partition table");
+  }
+  TEST_ASSERT_EQUAL(ESP_OK, err);
+  // Drain what an earlier run left
+  while (!journal.records().empty()) {
+    TEST_ASSERT_EQUAL(ESP_OK, journal.consume(journal.records().front()));
+  }
+
+  const char *first_header = R"({"timestamp":"first","size":5000})";
+  const char *second_header = R"({"timestamp":"second","size":100})";
+  std::vector<uint8_t> first = make_data(5000, 1);
+  std::vector<uint8_t> second = make_data(100, 2);
+  TEST_ASSERT_EQUAL(ESP_OK, journal.append(first_header, strlen(first_header),
+                                           first.data(), first.size()));
+  TEST_ASSERT_EQUAL(ESP_OK,
+                    journal.append(second_header, strlen(second_header),
+                                   second.data(), second.size()));
+  TEST_ASSERT_TRUE(ImageJournal::may_have_records());
+
+  ImageJournal remounted;
+  TEST_ASSERT_EQUAL(ESP_OK, remounted.mount());
+  TEST_ASSERT_EQUAL(2, remounted.records().size());
+  check_record(remounted, remounted.records()[0], first_header, first);
+  check_record(remounted, remounted.records()[1], second_header, second);
+
+  // Consumed records are not drained again, the next record goes after them
+  TEST_ASSERT_EQUAL(ESP_OK, remounted.consume(remounted.records()[0]));
+  TEST_ASSERT_EQUAL(ESP_OK, remounted.consume(remounted.records()[0]));
+  TEST_ASSERT_FALSE(ImageJournal::may_have_records());
+
+  ImageJournal drained;
+  TEST_ASSERT_EQUAL(ESP_OK, drained.mount());
+  TEST_ASSERT_EQUAL(0, drained.records().size());
+  TEST_ASSERT_EQUAL(remounted.head(), drained.head());
+}
+
+TEST_CASE("Too large records are refused", "[image_journal]") {
+  ImageJournal journal;
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE,
+                    journal.append("{}", 2, nullptr, 0));
+  esp_err_t err = journal.mount();
+  if (err == ESP_ERR_NOT_FOUND) {
+    TEST_IGNORE_MESSAGE("No journal partition in the partition table");
+  }
+  TEST_ASSERT_EQUAL(ESP_OK, err);
+
+  char header[ImageJournal::MAX_HEADER_SIZE + 1];
+  memset(header, ' ', sizeof(header));
+  uint8_t data[1] = {0};
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE,
+                    journal.append(header, sizeof(header), data, 0));
+}
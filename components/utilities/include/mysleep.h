@@ -1,6 +1,8 @@
 #pragma once
 
 #include "mytime.h"
+#include "sleep_policy.h"
+#include "wake_schedule.h"
 
 constexpr uint64_t BOOT_TIME_US = 1000000;    // ~1s for boot
 constexpr uint64_t SHUTDOWN_TIME_US = 100000; // ~100ms for entering sleep
@@ -9,22 +11,101 @@ constexpr uint64_t WAKEUP_DELAY_US =
 constexpr uint64_t FLASH_READY_DELAY_US =
     2000; // CONFIG_ESP_SLEEP_WAIT_FLASH_READY_EXTRA_DELAY
 
+// The end of the light sleep to the next cycle, the timer and the scheduler
+constexpr uint64_t LIGHT_WAKE_TIME_US = 1000;
+
+// The wake overhead model starts from these after a cold boot
 constexpr uint64_t OVERHEAD =
     BOOT_TIME_US + SHUTDOWN_TIME_US + WAKEUP_DELAY_US + FLASH_READY_DELAY_US;
 
+/**
+ * @brief The measured overheads of the sleep cycle, kept in RTC memory
+ *
+ * Every timer wake measures the time from the wake-up timer to app_main,
+ * and every sleep the time from the computation of the sleep time to the
+ * start of the deep sleep. Both are averaged with a weight of 1/4 for the
+ * new sample, and their sum is subtracted from the sleep time instead of a
+ * constant. A light sleep only pays the latency of the timer.
+ */
+typedef struct {
+  uint32_t wake_us;        /*!< the timer wake-up to app_main, average */
+  uint32_t entry_us;       /*!< the sleep time computation to deep sleep */
+  uint32_t light_wake_us;  /*!< the overshoot of the light sleep, average */
+  SleepMode mode;          /*!< the sleep this cycle woke up from */
+  bool measured;           /*!< this wake was timed, the period is known */
+  uint32_t period_us;      /*!< start to start of the last cycle */
+  int32_t period_error_us; /*!< the achieved minus the target period */
+} WakeTiming;
+
+/**
+ * @brief Measures the wake-up latency and the period of the last cycle
+ *
+ * @note Called first in app_main, before the clock is corrected or synced.
+ */
+void record_wake();
+
+/**
+ * @brief Gets the measured overheads of the sleep cycle
+ *
+ * @return The wake timing
+ */
+const WakeTiming &get_wake_timing();
+
+/**
+ * @brief Gets the overhead of the sleep cycle which isn't spent awake in the
+ * app, subtracted from the sleep time
+ *
+ * @return The average wake-up and sleep entry latency in microseconds
+ */
+uint64_t get_wake_overhead_us();
+
+/**
+ * @brief Gets the time since the start of the cycle: app_main, or the end of
+ * the last light sleep
+ *
+ * @return The time in microseconds
+ */
+uint64_t get_awake_time_us();
+
+/**
+ * @brief Adds a sample to an exponentially weighted average
+ *
+ * @param average The average so far
+ * @param sample The new sample, weighted 1/4
+ *
+ * @return The new average
+ */
+constexpr uint32_t update_average(uint32_t average, uint32_t sample) {
+  return static_cast<uint32_t>(average + (static_cast<int64_t>(sample) -
+                                          static_cast<int64_t>(average)) /
+                                             4);
+}
+
+/**
+ * @brief Caches the schedule in RTC memory for the deep sleep wake stub
+ *
+ * After a timer wake the stub decides with schedule_sleep_s() whether the
+ * application runs, and otherwise goes back to sleep without booting it.
+ *
+ * @param schedule The compiled schedule, a count of 0 disables the stub
+ */
+void set_wake_schedule(const WakeSchedule &schedule);
+
 /**
  * @defgroup sleep_by_time Time-based sleep function
  * @{
  */
 
 /**
- * @brief Puts the device to sleep until the specified time.
+ * @brief Puts the device to sleep until the next timing of the schedule.
  *
- * @param wake_up The time to wake up at in HH:MM:SS format.
+ * @param wait_us The time until the next timing in microseconds, see
+ * Config::get_next_transition_us(). app_main runs at this time if the wake
+ * overhead model holds, also past midnight.
  *
  * @note This function does not return.
  */
-void mysleep(Time wake_up);
+void sleep_until_next_timing(int64_t wait_us);
 /** @} */
 
 /**
@@ -33,15 +114,42 @@ void mysleep(Time wake_up);
  */
 
 /**
- * @brief Puts the device to sleep until the next period.
+ * @brief Puts the device to sleep until the next period, or until the next
+ * timing of the schedule if it comes first.
  *
- * @param period The active period from the static config in seconds.
+ * @param period The active period from the static config in seconds, the
+ * time from app_main to the next app_main.
+ * @param transition_us The time until the next timing in microseconds.
  *
  * @note This function does not return.
  */
-void mysleep(uint64_t period);
+void mysleep(uint64_t period, int64_t transition_us = INT64_MAX);
 /** @} */
 
+/**
+ * @brief Waits for the next period in automatic light sleep
+ *
+ * The CPU sleeps whenever no task runs, while the WiFi keeps the
+ * association in modem power save and the MQTT session stays open. The
+ * button wakes the CPU, and the wait ends at the start of the next period,
+ * where the next cycle starts without a boot.
+ *
+ * @param period The active period from the static config in seconds, the
+ * time from the start of the cycle to the start of the next one.
+ * @param transition_us The time until the next timing in microseconds, the
+ * wait ends there if it comes first.
+ *
+ * @note Needs CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE,
+ * otherwise the CPU idles awake.
+ */
+void light_sleep(uint64_t period, int64_t transition_us = INT64_MAX);
+
+/**
+ * @brief Keeps the CPU awake again after light_sleep(), e.g. when the wait
+ * was interrupted by the button
+ */
+void end_light_sleep();
+
 /**
  * @brief Puts the device to sleep until the button is pressed again.
  *
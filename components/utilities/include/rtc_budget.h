@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+
+/**
+ * @brief The RTC slow memory every component keeps across deep sleep
+ *
+ * The ESP32-S3 has 8 KB of RTC slow memory for the RTC_SLOW_ATTR and
+ * RTC_DATA_ATTR variables of ESP-IDF and the application. Every component
+ * checks the size of its state against its share with a static_assert, and
+ * the shares are checked against the memory left to the application, so a
+ * state which grows fails the build instead of crowding out IDF's own RTC
+ * data. The linker only reports the overflow of the whole segment.
+ */
+namespace rtc_budget {
+
+constexpr size_t SLOW_MEMORY = 8192;
+// ESP-IDF's own RTC data and headroom
+constexpr size_t RESERVED = 2048;
+
+constexpr size_t SLEEP = 320;             /*!< mysleep.cpp, sleep_policy.cpp */
+constexpr size_t CLOCK = 64;              /*!< timekeeper.cpp */
+constexpr size_t JOURNAL = 16;            /*!< image_journal.cpp */
+constexpr size_t MQTT_SESSION = 16;       /*!< mqtt.cpp */
+constexpr size_t WIFI_CACHE = 96;         /*!< wifi.cpp */
+constexpr size_t CHANGE_DETECTION = 1024; /*!< camera_app.cpp */
+constexpr size_t DELTA = 2048;            /*!< camera_app.cpp */
+
+static_assert(SLEEP + CLOCK + JOURNAL + MQTT_SESSION + WIFI_CACHE +
+                      CHANGE_DETECTION + DELTA <=
+                  SLOW_MEMORY - RESERVED,
+              "The RTC state doesn't fit into the RTC slow memory");
+
+} // namespace rtc_budget
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "wake_schedule.h"
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief An interval of the compiled schedule, it lasts until the start of
+ * the next one
+ */
+typedef struct {
+  uint32_t start_s; /*!< the first second of the UTC day */
+  int32_t period;   /*!< -1 if the device sleeps, 0 in a gap */
+  int32_t timing;   /*!< the index of the winning timing, -1 in a gap */
+} ScheduleInterval;
+
+/**
+ * @brief The timings of the dynamic configuration, compiled into a sorted
+ * table of intervals which don't overlap and cover the UTC day
+ *
+ * Overlapping timings are resolved like the linear scan of the config did:
+ * a sleeping timing wins, otherwise the last active timing of the config. A
+ * timing which ends before it starts wraps around midnight. The seconds no
+ * timing covers are gaps of the schedule, where the application runs with
+ * the default period.
+ *
+ * Neighbouring intervals of the same timing, and neighbouring sleeping
+ * intervals, are merged, so every start of an interval is a transition.
+ */
+class ScheduleIndex {
+public:
+  /**
+   * @brief Compiles the timings, in O(n log n) of their number
+   *
+   * @param windows The timings in the order of the config
+   */
+  void compile(const std::vector<ScheduleWindow> &windows);
+
+  /**
+   * @brief Finds the interval which contains the time, in O(log n)
+   *
+   * @param now_s The second of the UTC day
+   *
+   * @return The interval, a gap if nothing was compiled
+   */
+  const ScheduleInterval &lookup(uint32_t now_s) const;
+
+  /**
+   * @brief The time until the next transition, in O(log n): the start of
+   * the next interval, or the end of the sleep in a sleeping interval, also
+   * past midnight
+   *
+   * @param now_s The second of the UTC day
+   *
+   * @return The seconds until the transition, SECONDS_PER_DAY if the
+   * schedule is the same all day
+   */
+  uint32_t next_transition_s(uint32_t now_s) const;
+
+  /**
+   * @brief Fills the schedule of the deep sleep wake stub with the sleeping
+   * intervals
+   *
+   * @param schedule The schedule, empty if it doesn't fit
+   *
+   * @return false if there are more than MAX_SCHEDULE_WINDOWS sleeping
+   * intervals
+   */
+  bool to_wake_schedule(WakeSchedule &schedule) const;
+
+  /**
+   * @return The compiled intervals, sorted by their start
+   */
+  const std::vector<ScheduleInterval> &get_intervals() const {
+    return _intervals;
+  }
+
+private:
+  /**
+   * @brief Whether the application sees no transition between the two
+   */
+  static bool same_state(const ScheduleInterval &a, const ScheduleInterval &b);
+
+  std::vector<ScheduleInterval> _intervals;
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief How the device waits for the next period
+ */
+enum class SleepMode : uint8_t {
+  DEEP,  /*!< deep sleep, the next period boots and connects again */
+  LIGHT, /*!< automatic light sleep, WiFi and MQTT stay connected */
+};
+
+/**
+ * @brief The measured cost of a cycle in each mode, kept in RTC memory
+ */
+struct SleepModel {
+  uint32_t deep_active_ms;  /*!< awake time of a deep sleep cycle */
+  uint32_t light_active_ms; /*!< awake time of a light sleep cycle */
+  uint32_t active_ua;       /*!< battery current while awake */
+  bool deep_measured;       /*!< a deep sleep cycle was measured */
+  bool light_measured;      /*!< a light sleep cycle was measured */
+};
+
+/**
+ * @brief Decides between deep and light sleep from the energy of a cycle
+ *
+ * A cycle of period P in either mode costs the active current for its awake
+ * time, and the sleep current of the mode for the rest of the period. A deep
+ * sleep cycle is awake longer, it boots and connects to WiFi, NTP and MQTT
+ * again, but sleeps at a lower current. Light sleep costs less below the
+ * crossover period
+ *
+ *    P* = ((I_act - I_deep) t_deep - (I_act - I_light) t_light)
+ *         / (I_light - I_deep)
+ *
+ * The awake times and the active current are measured every cycle and
+ * averaged with a weight of 1/4 for the new sample. The sleep currents can't
+ * be measured while the CPU sleeps, they come from the configuration. Until
+ * a light sleep cycle is measured, its awake time is estimated from the deep
+ * sleep cycle minus the wake-up and the network bring-up.
+ */
+class SleepPolicy {
+public:
+  /**
+   * @brief Adds a measured cycle to the model
+   *
+   * @param mode The mode the cycle woke up from
+   * @param active_ms The awake time of the cycle, with the wake-up latency
+   * @param saved_ms The part of a deep sleep cycle light sleep saves: the
+   * wake-up latency and the network bring-up, ignored for light sleep
+   */
+  static void record_cycle(SleepMode mode, uint32_t active_ms,
+                           uint32_t saved_ms);
+
+  /**
+   * @brief Adds a measurement of the battery current while awake
+   *
+   * @param current_ma The battery current in milliamps, negative while
+   * discharging. A charging battery doesn't tell the load, it is ignored.
+   */
+  static void record_current(int32_t current_ma);
+
+  /**
+   * @brief The calibrated crossover period
+   *
+   * @param deep_sleep_ua The current in deep sleep in microamps
+   * @param light_sleep_ua The current in light sleep in microamps
+   *
+   * @return The period in seconds below which light sleep costs less
+   */
+  static uint32_t get_crossover_s(uint32_t deep_sleep_ua,
+                                  uint32_t light_sleep_ua);
+
+  /**
+   * @return The model of the cycles
+   */
+  static const SleepModel &get_model();
+
+  /**
+   * @brief The period at which both modes cost the same energy
+   *
+   * @param model The model of the cycles
+   * @param deep_sleep_ua The current in deep sleep in microamps
+   * @param light_sleep_ua The current in light sleep in microamps
+   *
+   * @return The crossover period in seconds, 0 if deep sleep always costs
+   * less, UINT32_MAX if light sleep always does
+   */
+  static uint32_t crossover_s(const SleepModel &model, uint32_t deep_sleep_ua,
+                              uint32_t light_sleep_ua);
+
+  /**
+   * @brief Updates the model with a measured cycle
+   *
+   * @param model The model of the cycles
+   * @param mode The mode the cycle woke up from
+   * @param active_ms The awake time of the cycle
+   * @param saved_ms The part of a deep sleep cycle light sleep saves
+   */
+  static void update(SleepModel &model, SleepMode mode, uint32_t active_ms,
+                     uint32_t saved_ms);
+
+  /**
+   * @brief The awake time of a deep sleep cycle before it was measured, a
+   * second of boot, the network bring-up, the capture and the upload
+   */
+  static constexpr uint32_t DEFAULT_DEEP_ACTIVE_MS{6000};
+
+  /**
+   * @brief The battery current while awake before it was measured, see the
+   * current draw of the Sleep component
+   */
+  static constexpr uint32_t DEFAULT_ACTIVE_UA{420000};
+
+  /**
+   * @brief The estimated awake time of a light sleep cycle is at least
+   * this, the capture and the upload remain
+   */
+  static constexpr uint32_t MIN_LIGHT_ACTIVE_MS{500};
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+
+constexpr uint32_t SECONDS_PER_DAY = 24 * 60 * 60;
+constexpr uint8_t MAX_SCHEDULE_WINDOWS = 16;
+// Shorter sleeps are not worth it, the application runs instead
+constexpr uint32_t MIN_STUB_SLEEP_S = 2;
+
+/**
+ * @brief A timing of the dynamic configuration, in seconds of the UTC day
+ */
+typedef struct {
+  uint32_t start_s;
+  uint32_t end_s;  /*!< the last second of the window */
+  int32_t period; /*!< -1 if the device sleeps through the window */
+} ScheduleWindow;
+
+/**
+ * @brief The timings of the dynamic configuration, compiled for the deep
+ * sleep wake stub
+ */
+typedef struct {
+  uint8_t count; /*!< 0 if there is no schedule, the application decides */
+  ScheduleWindow windows[MAX_SCHEDULE_WINDOWS];
+} WakeSchedule;
+
+/**
+ * @brief Decides whether a wake at the given time needs the application
+ *
+ * The windows are matched like Config::set_active_config() does: a sleeping
+ * window which contains the time wins, otherwise the application runs. The
+ * sleep goes on through the following sleeping windows, also past midnight,
+ * to the first second of an active window or of a gap in the schedule.
+ *
+ * @note Runs in the wake stub from RTC fast memory, so it only does 32-bit
+ * arithmetic and calls nothing.
+ *
+ * @param schedule The compiled schedule
+ * @param now_s The second of the UTC day
+ *
+ * @return The seconds to sleep, 0 if the application runs
+ */
+uint32_t schedule_sleep_s(const WakeSchedule &schedule, uint32_t now_s);
@@ -1,48 +1,255 @@
 #include "mysleep.h"
 #include "driver/rtc_io.h"
+#include "esp_attr.h"
 #include "esp_log.h"
+#include "esp_pm.h"
 #include "esp_sleep.h"
 #include "esp_timer.h"
+#include "esp_wake_stub.h"
 #include "freertos/FreeRTOS.h"
 #include "led.h"
+#include "rtc_budget.h"
+#include "soc/rtc.h"
+#include <algorithm>
+#include <sys/time.h>
 
 constexpr auto *TAG = "Sleep";
 
-void mysleep(Time wake_up) {
-  char timestamp[9] = {0};
-  Time::get_time(timestamp, sizeof(timestamp));
-  Time now(timestamp);
+// Longer wake-ups are not a timer wake of a healthy boot
+constexpr int64_t MAX_WAKE_US = 10000000;
+// Shorter timed deep sleeps are not worth the wake-up
+constexpr int64_t MIN_SLEEP_US = 500000;
+// The CPU runs from the crystal between the light sleeps, the WiFi needs it
+constexpr int LIGHT_SLEEP_MIN_FREQ_MHZ = 40;
 
+/**
+ * @brief The last timed sleep, measured at the next wake
+ */
+typedef struct {
+  bool valid;
+  int64_t entry_us;  /*!< the RTC clock when the deep sleep started */
+  int64_t sleep_us;  /*!< the time of the wake-up timer */
+  int64_t awake_us;  /*!< app_main to the start of the deep sleep */
+  int64_t target_us; /*!< the target app_main to app_main time */
+} SleepRecord;
+
+RTC_SLOW_ATTR static SleepRecord s_sleep;
+RTC_SLOW_ATTR static WakeTiming s_timing;
+RTC_SLOW_ATTR static bool s_timing_valid;
+// The start of the cycle, app_main or the end of the last light sleep
+static int64_t s_app_main_us = 0;
+
+RTC_DATA_ATTR static WakeSchedule s_schedule;
+// The RTC time and the second of the UTC day when the deep sleep started
+RTC_DATA_ATTR static uint64_t s_stub_rtc_us;
+RTC_DATA_ATTR static uint32_t s_stub_day_s;
+// With the SleepModel of sleep_policy.cpp
+static_assert(sizeof(s_sleep) + sizeof(s_timing) + sizeof(s_timing_valid) +
+                      sizeof(s_schedule) + sizeof(s_stub_rtc_us) +
+                      sizeof(s_stub_day_s) + sizeof(SleepModel) <=
+                  rtc_budget::SLEEP,
+              "The sleep state doesn't fit into its RTC memory");
+
+// The RTC clock, which runs through the deep sleep
+static int64_t rtc_clock_us() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+void record_wake() {
+  s_app_main_us = esp_timer_get_time();
+  int64_t now_us = rtc_clock_us();
+  if (!s_timing_valid) {
+    s_timing.wake_us = BOOT_TIME_US + WAKEUP_DELAY_US + FLASH_READY_DELAY_US;
+    s_timing.entry_us = SHUTDOWN_TIME_US;
+    s_timing.light_wake_us = LIGHT_WAKE_TIME_US;
+    s_timing_valid = true;
+  }
+
+  s_timing.mode = SleepMode::DEEP;
+  s_timing.measured = false;
+  if (s_sleep.valid &&
+      esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER) {
+    int64_t wake_us = now_us - s_sleep.entry_us - s_sleep.sleep_us;
+    if (wake_us >= 0 && wake_us < MAX_WAKE_US) {
+      s_timing.wake_us =
+          update_average(s_timing.wake_us, static_cast<uint32_t>(wake_us));
+      int64_t period_us = s_sleep.awake_us + now_us - s_sleep.entry_us;
+      s_timing.period_us = static_cast<uint32_t>(period_us);
+      s_timing.period_error_us =
+          static_cast<int32_t>(period_us - s_sleep.target_us);
+      s_timing.measured = true;
+      ESP_LOGI(TAG, "Woke up in %lld us, period error %ld us", wake_us,
+               s_timing.period_error_us);
+    }
+  }
+  s_sleep.valid = false;
+}
+
+const WakeTiming &get_wake_timing() { return s_timing; }
+
+void set_wake_schedule(const WakeSchedule &schedule) { s_schedule = schedule; }
+
+/**
+ * @brief Runs from RTC fast memory before the bootloader, and sleeps again
+ * without booting the application while the schedule sleeps
+ */
+static RTC_IRAM_ATTR void schedule_wake_stub() {
+  if ((esp_wake_stub_get_wakeup_cause() & RTC_TIMER_TRIG_EN) &&
+      s_schedule.count > 0) {
+    uint64_t elapsed_us = esp_wake_stub_get_rtc_time_us() - s_stub_rtc_us;
+    // In 64 us units 32 bits cover 76 hours and a second is 15625 units, so
+    // no 64-bit division is needed
+    if (elapsed_us < (1ULL << 38)) {
+      uint32_t elapsed_s = static_cast<uint32_t>(elapsed_us >> 6) / 15625;
+      uint32_t now_s = (s_stub_day_s + elapsed_s) % SECONDS_PER_DAY;
+      uint32_t sleep_s = schedule_sleep_s(s_schedule, now_s);
+      if (sleep_s > 0) {
+        // The next wake isn't the end of the measured cycle
+        s_sleep.valid = false;
+        esp_wake_stub_set_wakeup_time(static_cast<uint64_t>(sleep_s) *
+                                      1000000);
+        esp_wake_stub_sleep(&schedule_wake_stub);
+      }
+    }
+  }
+  esp_default_wake_deep_sleep();
+}
+
+uint64_t get_wake_overhead_us() {
+  if (!s_timing_valid) {
+    return OVERHEAD;
+  }
+  return s_timing.wake_us + s_timing.entry_us;
+}
+
+uint64_t get_awake_time_us() { return esp_timer_get_time() - s_app_main_us; }
+
+/**
+ * @brief Starts the timed deep sleep and records it for the next wake
+ *
+ * @param sleep_time_us The time of the wake-up timer
+ * @param target_us The target app_main to app_main time
+ * @param computed_us The esp_timer time the sleep time was computed at
+ */
+static void timed_deep_sleep(int64_t sleep_time_us, int64_t target_us,
+                             int64_t computed_us) {
+  isolate_gpio();
+  esp_sleep_enable_timer_wakeup(sleep_time_us);
+  configure_button_wake_up();
+
+  int64_t entry_timer_us = esp_timer_get_time();
+  s_timing.entry_us = update_average(
+      s_timing.entry_us, static_cast<uint32_t>(entry_timer_us - computed_us));
+  s_sleep.entry_us = rtc_clock_us();
+  s_sleep.sleep_us = sleep_time_us;
+  s_sleep.awake_us = entry_timer_us - s_app_main_us;
+  s_sleep.target_us = target_us;
+  s_sleep.valid = true;
+
+  s_stub_rtc_us = esp_wake_stub_get_rtc_time_us();
+  s_stub_day_s = static_cast<uint32_t>(s_sleep.entry_us / 1000000 %
+                                       SECONDS_PER_DAY);
+  esp_set_deep_sleep_wake_stub(&schedule_wake_stub);
+  esp_deep_sleep_start();
+}
+
+void sleep_until_next_timing(int64_t wait_us) {
+  int64_t computed_us = esp_timer_get_time();
   int64_t sleep_time_us =
-      wake_up.toSeconds() * 1000000 - now.toSeconds() * 1000000 - OVERHEAD;
-  if (sleep_time_us < 500000) {
+      wait_us - static_cast<int64_t>(get_wake_overhead_us());
+  if (sleep_time_us < MIN_SLEEP_US) {
     ESP_LOGE(TAG, "Invalid sleep time: %lld us", sleep_time_us);
     esp_restart();
   } else {
-    isolate_gpio();
-    esp_sleep_enable_timer_wakeup(sleep_time_us);
-    configure_button_wake_up();
-    esp_deep_sleep_start();
+    ESP_LOGW(TAG, "Deep sleep %lld seconds until the next timing",
+             sleep_time_us / 1000000);
+    timed_deep_sleep(sleep_time_us, computed_us - s_app_main_us + wait_us,
+                     computed_us);
   }
 }
 
-void mysleep(uint64_t period) {
-  uint64_t elapsed_time = esp_timer_get_time();
-  int64_t sleep_time_us = period * 1000000 - elapsed_time - OVERHEAD;
+void mysleep(uint64_t period, int64_t transition_us) {
+  int64_t computed_us = esp_timer_get_time();
+  int64_t elapsed_time = computed_us - s_app_main_us;
+  int64_t overhead_us = static_cast<int64_t>(get_wake_overhead_us());
+  int64_t target_us = static_cast<int64_t>(period) * 1000000;
+  int64_t transition_wait_us =
+      std::max(transition_us, overhead_us + MIN_SLEEP_US);
+  if (transition_wait_us < target_us - elapsed_time) {
+    // Wakes at the next timing, a moment late if it is too close
+    target_us = elapsed_time + transition_wait_us;
+  }
+  int64_t sleep_time_us = target_us - elapsed_time - overhead_us;
 
-  if (sleep_time_us < 500000) {
+  if (sleep_time_us < MIN_SLEEP_US) {
     ESP_LOGE(TAG, "Invalid sleep time: %lld us", sleep_time_us);
     esp_restart();
   } else {
     ESP_LOGW(TAG, "Deep sleep %lld seconds", sleep_time_us / 1000000);
-    isolate_gpio();
-    esp_sleep_enable_timer_wakeup(sleep_time_us);
-    configure_button_wake_up();
-    esp_deep_sleep_start();
+    timed_deep_sleep(sleep_time_us, target_us, computed_us);
+  }
+}
+
+void light_sleep(uint64_t period, int64_t transition_us) {
+  int64_t computed_us = esp_timer_get_time();
+  int64_t elapsed_us = computed_us - s_app_main_us;
+  int64_t target_us = static_cast<int64_t>(period) * 1000000;
+  if (transition_us < target_us - elapsed_us) {
+    // The next cycle starts at the next timing
+    target_us = elapsed_us + std::max<int64_t>(transition_us, 0);
   }
+  int64_t sleep_time_us =
+      target_us - elapsed_us - static_cast<int64_t>(s_timing.light_wake_us);
+  if (sleep_time_us < 0) {
+    // The cycle overran the period, the next one starts at once
+    sleep_time_us = 0;
+  }
+
+  // The clock only scales down while waiting, the capture and the upload
+  // run at full speed
+  esp_pm_config_t pm_config = {.max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+                               .min_freq_mhz = LIGHT_SLEEP_MIN_FREQ_MHZ,
+                               .light_sleep_enable = true};
+  if (esp_pm_configure(&pm_config) != ESP_OK) {
+    ESP_LOGW(TAG, "Automatic light sleep is not available, idling awake");
+  }
+  // The edge interrupt of the button can't wake the CPU, the level can
+  gpio_wakeup_enable(GPIO_NUM_21, GPIO_INTR_LOW_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+
+  ESP_LOGW(TAG, "Light sleep %lld ms", sleep_time_us / 1000);
+  vTaskDelay(pdMS_TO_TICKS(sleep_time_us / 1000));
+  end_light_sleep();
+
+  int64_t now_us = esp_timer_get_time();
+  int64_t wake_us = now_us - computed_us - sleep_time_us;
+  if (wake_us >= 0 && wake_us < MAX_WAKE_US) {
+    s_timing.light_wake_us =
+        update_average(s_timing.light_wake_us, static_cast<uint32_t>(wake_us));
+  }
+  int64_t period_us = now_us - s_app_main_us;
+  s_timing.mode = SleepMode::LIGHT;
+  s_timing.period_us = static_cast<uint32_t>(period_us);
+  s_timing.period_error_us = static_cast<int32_t>(period_us - target_us);
+  s_timing.measured = true;
+  s_app_main_us = now_us;
+}
+
+void end_light_sleep() {
+  esp_pm_config_t pm_config = {.max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+                               .min_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+                               .light_sleep_enable = false};
+  esp_pm_configure(&pm_config);
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_GPIO);
+  gpio_wakeup_disable(GPIO_NUM_21);
+  // The button task follows the edges
+  gpio_set_intr_type(GPIO_NUM_21, GPIO_INTR_ANYEDGE);
 }
 
 void button_press_sleep() {
+  s_sleep.valid = false;
   isolate_gpio();
 
   esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
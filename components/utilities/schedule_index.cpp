@@ -0,0 +1,134 @@
+#include "schedule_index.h"
+#include <algorithm>
+#include <set>
+
+namespace {
+
+// A timing starts or stops covering the seconds from this one on
+struct Edge {
+  uint32_t at_s;
+  bool opens;
+  int32_t timing;
+};
+
+const ScheduleInterval GAP_ALL_DAY = {.start_s = 0, .period = 0, .timing = -1};
+
+} // namespace
+
+void ScheduleIndex::compile(const std::vector<ScheduleWindow> &windows) {
+  std::vector<Edge> edges;
+  edges.reserve(windows.size() * 4);
+  for (size_t i = 0; i < windows.size(); i++) {
+    const ScheduleWindow &window = windows[i];
+    int32_t timing = static_cast<int32_t>(i);
+    uint32_t end_s = std::min(window.end_s, SECONDS_PER_DAY - 1) + 1;
+    if (window.start_s >= SECONDS_PER_DAY) {
+      continue;
+    }
+    if (window.start_s < end_s) {
+      edges.push_back({window.start_s, true, timing});
+      edges.push_back({end_s, false, timing});
+    } else {
+      // Wraps around midnight
+      edges.push_back({window.start_s, true, timing});
+      edges.push_back({SECONDS_PER_DAY, false, timing});
+      edges.push_back({0, true, timing});
+      edges.push_back({end_s, false, timing});
+    }
+  }
+  std::sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) {
+    return a.at_s < b.at_s;
+  });
+
+  // The open timings, the last one in the config wins
+  std::set<int32_t> sleeping;
+  std::set<int32_t> active;
+  _intervals.clear();
+  size_t next = 0;
+  uint32_t at_s = 0;
+  while (at_s < SECONDS_PER_DAY) {
+    for (; next < edges.size() && edges[next].at_s == at_s; next++) {
+      const Edge &edge = edges[next];
+      std::set<int32_t> &open =
+          windows[edge.timing].period == -1 ? sleeping : active;
+      if (edge.opens) {
+        open.insert(edge.timing);
+      } else {
+        open.erase(edge.timing);
+      }
+    }
+
+    ScheduleInterval interval = GAP_ALL_DAY;
+    interval.start_s = at_s;
+    if (!sleeping.empty()) {
+      interval.timing = *sleeping.rbegin();
+      interval.period = -1;
+    } else if (!active.empty()) {
+      interval.timing = *active.rbegin();
+      interval.period = windows[interval.timing].period;
+    }
+    if (_intervals.empty() || !same_state(_intervals.back(), interval)) {
+      _intervals.push_back(interval);
+    }
+    at_s = next < edges.size() ? edges[next].at_s : SECONDS_PER_DAY;
+  }
+}
+
+const ScheduleInterval &ScheduleIndex::lookup(uint32_t now_s) const {
+  if (_intervals.empty()) {
+    return GAP_ALL_DAY;
+  }
+  auto it = std::upper_bound(
+      _intervals.begin(), _intervals.end(), now_s % SECONDS_PER_DAY,
+      [](uint32_t s, const ScheduleInterval &interval) {
+        return s < interval.start_s;
+      });
+  // The first interval starts at midnight
+  return *(it - 1);
+}
+
+uint32_t ScheduleIndex::next_transition_s(uint32_t now_s) const {
+  if (_intervals.size() < 2) {
+    return SECONDS_PER_DAY;
+  }
+  now_s %= SECONDS_PER_DAY;
+  size_t i = &lookup(now_s) - _intervals.data();
+  size_t next = i + 1;
+  uint32_t day_s = 0;
+  if (next == _intervals.size()) {
+    // The last and the first interval are only split by midnight
+    next = 0;
+    day_s = SECONDS_PER_DAY;
+    if (same_state(_intervals[i], _intervals[0])) {
+      next = 1;
+    }
+  }
+  return _intervals[next].start_s + day_s - now_s;
+}
+
+bool ScheduleIndex::to_wake_schedule(WakeSchedule &schedule) const {
+  schedule = {};
+  for (size_t i = 0; i < _intervals.size(); i++) {
+    const ScheduleInterval &interval = _intervals[i];
+    if (interval.period != -1) {
+      continue;
+    }
+    if (schedule.count == MAX_SCHEDULE_WINDOWS) {
+      schedule = {};
+      return false;
+    }
+    uint32_t end_s = i + 1 < _intervals.size() ? _intervals[i + 1].start_s
+                                                : SECONDS_PER_DAY;
+    schedule.windows[schedule.count++] = {
+        .start_s = interval.start_s, .end_s = end_s - 1, .period = -1};
+  }
+  return true;
+}
+
+bool ScheduleIndex::same_state(const ScheduleInterval &a,
+                               const ScheduleInterval &b) {
+  if (a.period == -1 || b.period == -1) {
+    return a.period == b.period;
+  }
+  return a.timing == b.timing;
+}
@@ -0,0 +1,77 @@
+#include "sleep_policy.h"
+#include "esp_attr.h"
+#include "mysleep.h"
+
+RTC_SLOW_ATTR static SleepModel s_model;
+
+void SleepPolicy::record_cycle(SleepMode mode, uint32_t active_ms,
+                               uint32_t saved_ms) {
+  update(s_model, mode, active_ms, saved_ms);
+}
+
+void SleepPolicy::record_current(int32_t current_ma) {
+  if (current_ma >= 0) {
+    return;
+  }
+  uint32_t sample = static_cast<uint32_t>(-current_ma) * 1000;
+  s_model.active_ua = s_model.active_ua == 0
+                          ? sample
+                          : update_average(s_model.active_ua, sample);
+}
+
+uint32_t SleepPolicy::get_crossover_s(uint32_t deep_sleep_ua,
+                                      uint32_t light_sleep_ua) {
+  return crossover_s(s_model, deep_sleep_ua, light_sleep_ua);
+}
+
+const SleepModel &SleepPolicy::get_model() { return s_model; }
+
+uint32_t SleepPolicy::crossover_s(const SleepModel &model,
+                                  uint32_t deep_sleep_ua,
+                                  uint32_t light_sleep_ua) {
+  int64_t active_ua = model.active_ua > 0 ? model.active_ua : DEFAULT_ACTIVE_UA;
+  int64_t deep_ms =
+      model.deep_measured ? model.deep_active_ms : DEFAULT_DEEP_ACTIVE_MS;
+  // Without a measurement both modes are awake as long, so the crossover
+  // stays short until the first deep sleep cycle is measured
+  int64_t light_ms = model.light_active_ms > 0 ? model.light_active_ms
+                                               : deep_ms;
+
+  // In microamp milliseconds, a few hundred mA for seconds fits easily
+  int64_t saved = (active_ua - deep_sleep_ua) * deep_ms -
+                  (active_ua - light_sleep_ua) * light_ms;
+  if (saved <= 0) {
+    return 0;
+  }
+  if (light_sleep_ua <= deep_sleep_ua) {
+    return UINT32_MAX;
+  }
+  int64_t crossover =
+      saved / (static_cast<int64_t>(light_sleep_ua) - deep_sleep_ua) / 1000;
+  return crossover < UINT32_MAX ? static_cast<uint32_t>(crossover)
+                                : UINT32_MAX;
+}
+
+void SleepPolicy::update(SleepModel &model, SleepMode mode,
+                         uint32_t active_ms, uint32_t saved_ms) {
+  if (mode == SleepMode::LIGHT) {
+    model.light_active_ms = model.light_measured
+                                ? update_average(model.light_active_ms,
+                                                 active_ms)
+                                : active_ms;
+    model.light_measured = true;
+    return;
+  }
+
+  model.deep_active_ms = model.deep_measured
+                             ? update_average(model.deep_active_ms, active_ms)
+                             : active_ms;
+  model.deep_measured = true;
+  if (!model.light_measured) {
+    uint32_t estimate = model.deep_active_ms > saved_ms
+                            ? model.deep_active_ms - saved_ms
+                            : 0;
+    model.light_active_ms =
+        estimate > MIN_LIGHT_ACTIVE_MS ? estimate : MIN_LIGHT_ACTIVE_MS;
+  }
+}
@@ -5,6 +5,19 @@
 
 void trigger_mysleep() { mysleep(3000000); }
 
+TEST_CASE("Wake overheads are averaged", "[mysleep]") {
+  TEST_ASSERT_EQUAL_UINT32(1000000, update_average(1000000, 1000000));
+  TEST_ASSERT_EQUAL_UINT32(850000, update_average(1000000, 400000));
+  TEST_ASSERT_EQUAL_UINT32(1150000, update_average(1000000, 1600000));
+
+  // A step converges within a few dozen wakes
+  uint32_t average = 1000000;
+  for (int i = 0; i < 40; i++) {
+    average = update_average(average, 300000);
+  }
+  TEST_ASSERT_UINT32_WITHIN(1000, 300000, average);
+}
+
 void check_deepsleep_reset_reason() {
   esp_sleep_wakeup_cause_t wakeup = esp_sleep_get_wakeup_cause();
   esp_reset_reason_t reset = esp_reset_reason();
@@ -0,0 +1,63 @@
+#include "schedule_index.h"
+#include "unity.h"
+
+static constexpr uint32_t at(uint32_t hours, uint32_t minutes) {
+  return hours * 3600 + minutes * 60;
+}
+
+TEST_CASE("Overlapping timings are compiled into intervals",
+          "[schedule_index]") {
+  ScheduleIndex index;
+  index.compile({{.start_s = at(6, 0), .end_s = at(12, 0) - 1, .period = 30},
+                 {.start_s = at(8, 0), .end_s = at(10, 0) - 1, .period = 60},
+                 {.start_s = at(9, 0), .end_s = at(9, 30) - 1, .period = -1},
+                 {.start_s = at(11, 0), .end_s = at(11, 30) - 1, .period = 20}});
+
+  // gap, 30, 60, sleep, 60, 30, 20, 30, gap
+  TEST_ASSERT_EQUAL(9, index.get_intervals().size());
+  TEST_ASSERT_EQUAL_INT32(-1, index.lookup(at(5, 59)).timing);
+  TEST_ASSERT_EQUAL_INT32(0, index.lookup(at(6, 0)).timing);
+  // The last active timing of the config wins, a sleeping one always
+  TEST_ASSERT_EQUAL_INT32(60, index.lookup(at(8, 0)).period);
+  TEST_ASSERT_EQUAL_INT32(-1, index.lookup(at(9, 15)).period);
+  TEST_ASSERT_EQUAL_INT32(60, index.lookup(at(9, 30)).period);
+  TEST_ASSERT_EQUAL_INT32(20, index.lookup(at(11, 0)).period);
+  TEST_ASSERT_EQUAL_INT32(30, index.lookup(at(11, 30)).period);
+  TEST_ASSERT_EQUAL_INT32(-1, index.lookup(at(12, 0)).timing);
+
+  TEST_ASSERT_EQUAL_UINT32(3600, index.next_transition_s(at(7, 0)));
+  TEST_ASSERT_EQUAL_UINT32(1, index.next_transition_s(at(9, 30) - 1));
+  // Past midnight
+  TEST_ASSERT_EQUAL_UINT32(at(18, 0), index.next_transition_s(at(12, 0)));
+}
+
+TEST_CASE("Timings wrap around midnight", "[schedule_index]") {
+  ScheduleIndex index;
+  index.compile({{.start_s = at(22, 0), .end_s = at(6, 0) - 1, .period = -1},
+                 {.start_s = at(6, 0), .end_s = at(22, 0) - 1, .period = 30}});
+
+  TEST_ASSERT_EQUAL_INT32(-1, index.lookup(at(23, 0)).period);
+  TEST_ASSERT_EQUAL_INT32(-1, index.lookup(at(1, 0)).period);
+  TEST_ASSERT_EQUAL_INT32(30, index.lookup(at(6, 0)).period);
+
+  // The sleep goes on through midnight to the next timing
+  TEST_ASSERT_EQUAL_UINT32(at(7, 0), index.next_transition_s(at(23, 0)));
+  TEST_ASSERT_EQUAL_UINT32(at(5, 0), index.next_transition_s(at(1, 0)));
+  TEST_ASSERT_EQUAL_UINT32(at(1, 0), index.next_transition_s(at(21, 0)));
+
+  WakeSchedule schedule;
+  TEST_ASSERT_TRUE(index.to_wake_schedule(schedule));
+  TEST_ASSERT_EQUAL_UINT8(2, schedule.count);
+  TEST_ASSERT_EQUAL_UINT32(at(7, 0), schedule_sleep_s(schedule, at(23, 0)));
+}
+
+TEST_CASE("A schedule without transitions", "[schedule_index]") {
+  ScheduleIndex index;
+  TEST_ASSERT_EQUAL_INT32(-1, index.lookup(at(12, 0)).timing);
+  TEST_ASSERT_EQUAL_UINT32(SECONDS_PER_DAY, index.next_transition_s(0));
+
+  index.compile({{.start_s = 0, .end_s = SECONDS_PER_DAY - 1, .period = 40}});
+  TEST_ASSERT_EQUAL(1, index.get_intervals().size());
+  TEST_ASSERT_EQUAL_UINT32(SECONDS_PER_DAY,
+                           index.next_transition_s(at(12, 0)));
+}
@@ -0,0 +1,60 @@
+#include "sleep_policy.h"
+#include "unity.h"
+
+TEST_CASE("The crossover follows the energy of the cycles", "[sleep_policy]") {
+  // 420 mA awake, 6 s per deep sleep cycle and 3 s per light sleep cycle,
+  // 8 mA in deep sleep and 15 mA in light sleep:
+  // ((420 - 8) * 6 - (420 - 15) * 3) / (15 - 8) = 179.57 s
+  SleepModel model = {.deep_active_ms = 6000,
+                      .light_active_ms = 3000,
+                      .active_ua = 420000,
+                      .deep_measured = true,
+                      .light_measured = true};
+  TEST_ASSERT_EQUAL_UINT32(179, SleepPolicy::crossover_s(model, 8000, 15000));
+
+  // A cheaper light sleep moves the crossover up
+  TEST_ASSERT_GREATER_THAN_UINT32(
+      179, SleepPolicy::crossover_s(model, 8000, 12000));
+
+  // Light sleep awake longer than deep sleep never pays off
+  model.light_active_ms = 7000;
+  TEST_ASSERT_EQUAL_UINT32(0, SleepPolicy::crossover_s(model, 8000, 15000));
+
+  // Light sleep as cheap as deep sleep always does
+  model.light_active_ms = 3000;
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX,
+                           SleepPolicy::crossover_s(model, 8000, 8000));
+}
+
+TEST_CASE("The light sleep cycle is estimated until measured",
+          "[sleep_policy]") {
+  SleepModel model = {};
+  // Without a measurement both modes are awake as long, deep sleep wins
+  // above a period of the awake time
+  TEST_ASSERT_EQUAL_UINT32(SleepPolicy::DEFAULT_DEEP_ACTIVE_MS / 1000,
+                           SleepPolicy::crossover_s(model, 8000, 15000));
+
+  // 5 s awake, of which 3 s were the wake-up and the network bring-up
+  SleepPolicy::update(model, SleepMode::DEEP, 5000, 3000);
+  TEST_ASSERT_TRUE(model.deep_measured);
+  TEST_ASSERT_FALSE(model.light_measured);
+  TEST_ASSERT_EQUAL_UINT32(5000, model.deep_active_ms);
+  TEST_ASSERT_EQUAL_UINT32(2000, model.light_active_ms);
+
+  // The estimate is never below the capture and the upload
+  SleepPolicy::update(model, SleepMode::DEEP, 5000, 10000);
+  TEST_ASSERT_EQUAL_UINT32(SleepPolicy::MIN_LIGHT_ACTIVE_MS,
+                           model.light_active_ms);
+
+  // The first measurement replaces the estimate, the later ones are averaged
+  SleepPolicy::update(model, SleepMode::LIGHT, 2400, 0);
+  TEST_ASSERT_TRUE(model.light_measured);
+  TEST_ASSERT_EQUAL_UINT32(2400, model.light_active_ms);
+  SleepPolicy::update(model, SleepMode::LIGHT, 2000, 0);
+  TEST_ASSERT_EQUAL_UINT32(2300, model.light_active_ms);
+
+  // A measured light sleep cycle isn't estimated from deep sleep any more
+  SleepPolicy::update(model, SleepMode::DEEP, 9000, 1000);
+  TEST_ASSERT_EQUAL_UINT32(6000, model.deep_active_ms);
+  TEST_ASSERT_EQUAL_UINT32(2300, model.light_active_ms);
+}
@@ -0,0 +1,36 @@
+#include "wake_schedule.h"
+#include "esp_attr.h"
+
+/**
+ * @brief Finds the sleeping window which contains the time
+ *
+ * @return The window, nullptr if the application runs at this time
+ */
+static RTC_IRAM_ATTR const ScheduleWindow *
+find_sleeping_window(const WakeSchedule &schedule, uint32_t now_s) {
+  for (uint8_t i = 0; i < schedule.count; i++) {
+    const ScheduleWindow &window = schedule.windows[i];
+    if (window.period == -1 && now_s >= window.start_s &&
+        now_s <= window.end_s) {
+      return &window;
+    }
+  }
+  return nullptr;
+}
+
+RTC_IRAM_ATTR uint32_t schedule_sleep_s(const WakeSchedule &schedule,
+                                        uint32_t now_s) {
+  uint32_t sleep_s = 0;
+  uint32_t time_s = now_s;
+  // Every step leaves a window, so the loop ends even if the whole day is
+  // asleep
+  for (uint8_t step = 0; step <= schedule.count; step++) {
+    const ScheduleWindow *window = find_sleeping_window(schedule, time_s);
+    if (window == nullptr) {
+      break;
+    }
+    sleep_s += window->end_s + 1 - time_s;
+    time_s = (window->end_s + 1) % SECONDS_PER_DAY;
+  }
+  return sleep_s >= MIN_STUB_SLEEP_S ? sleep_s : 0;
+}
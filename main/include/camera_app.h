@@ -5,14 +5,21 @@
 #include "camera_app.h"
 #include "config.h"
 #include "error_handler.h"
+#include "esp_heap_caps.h"
 #include "event_manager.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "image_journal.h"
 #include "mqtt.h"
 #include "mytime.h"
 #include "sensors.h"
+#include "sleep_policy.h"
 #include "storage.h"
 #include "wifi.h"
 #include <ArduinoJson.h>
+#include <array>
 #include <atomic>
+#include <memory>
 
 /**
  * @brief
@@ -20,6 +27,20 @@
  * camera application. It initializes and
  * runs the camera application.
  *
+ * The wake cycle is pipelined: the capture task brings up the camera, takes
+ * and compresses the image on the APP CPU, while the camera task connects to
+ * WiFi, syncs the time and starts MQTT on the PRO CPU. The two join before
+ * the image header is published.
+ *
+ * When the WiFi or the broker can't be reached, the image is stored in the
+ * flash journal instead of being lost, and the journal is drained after the
+ * next successful upload.
+ *
+ * Below the crossover period of the sleep policy the device doesn't reboot
+ * between the periods: the camera is powered down, the CPU waits in
+ * automatic light sleep with the WiFi in modem power save and the MQTT
+ * session open, and the next cycle runs in the same task.
+ *
  */
 class CameraApp {
 public:
@@ -76,12 +97,45 @@ private:
    *
    */
   static void camera_task(void *pvParameters);
+  /**
+   *
+   * @brief
+   * Captures and compresses the image, and signals when it finishes.
+   *
+   * @param pvParameters
+   * CameraApp instance
+   *
+   */
+  static void capture_task(void *pvParameters);
+
+  /**
+   * @brief Phases of the wake cycle, reported in milliseconds since the start
+   * of the cycle
+   */
+  enum class Phase {
+    SENSORS_READ,
+    CAMERA_STARTED,
+    IMAGE_TAKEN,
+    IMAGE_COMPRESSED,
+    WIFI_CONNECTED,
+    TIME_SYNCED,
+    MQTT_STARTED,
+    CONFIG_HANDLED,
+    CAPTURE_JOINED,
+    IMAGE_SENT,
+    COUNT
+  };
 
   /**
    * @brief Initializes all components needed for the camera application
    * @return true if initialization was successful, false otherwise
    */
   bool initialize();
+  /**
+   * @brief Connects to the WiFi, syncs the time if needed and starts MQTT
+   * @return true if the broker is reachable, false otherwise
+   */
+  bool connect();
   /**
    *
    * @brief Handles configuration updates and health reporting
@@ -89,17 +143,150 @@ private:
    */
   bool handle_config_update();
   /**
-   * @brief Captures an image and sends it to the MQTT broker
-   * @return true if image was captured and sent successfully, false otherwise
+   * @brief Loads a configuration received since the last call, unless a
+   * capture still reads the current one
+   * @return true if a new configuration was loaded, false otherwise
+   */
+  bool apply_new_config();
+  /**
+   * @brief Sends the captured image to the MQTT broker
+   * @return true if image was sent successfully, false otherwise
+   */
+  bool upload_image();
+  /**
+   * @brief Sends the image header, waits for the acknowledgement and sends
+   * the image, or the keyframe if the server doesn't hold the delta's one
+   * @return true if image was sent successfully, false otherwise
+   */
+  bool send_full_exchange(const char *timestamp);
+  /**
+   * @brief Sends the image header and waits for its acknowledgement
+   * @return true if the acknowledgement was received, false otherwise
+   */
+  bool exchange_header(const char *timestamp, HeaderAck *ack);
+  /**
+   * @brief
+   * Sends the image from the given chunk. If the upload is interrupted, waits
+   * for the client to reconnect, sends the header again and resumes from the
+   * first chunk the server doesn't hold, up to RESUME_ATTEMPTS times.
+   *
+   * @return true if image was sent successfully, false otherwise
+   */
+  bool send_resumable_image(const char *timestamp, uint32_t first_chunk);
+  /**
+   * @brief
+   * Sends the image header with the thumbnail, and then only the part of the
+   * image the server asks for in the acknowledgement: the full image, a
+   * region of it, or nothing.
+   *
+   * @return true if the requested part was sent successfully, false otherwise
+   */
+  bool send_progressive_exchange(const char *timestamp);
+  /**
+   * @brief
+   * Sends the image with its header in the user properties of the first
+   * chunk, without waiting for the acknowledgement first. The
+   * acknowledgement which follows the image tells whether the server holds
+   * the keyframe, if it doesn't the next wake sends a keyframe.
+   *
+   * @return true if the image was sent successfully, false otherwise
+   */
+  bool send_one_shot_exchange(const char *timestamp);
+  /**
+   * @brief
+   * Stores the prepared image and its header in the flash journal, as a
+   * standalone frame: a delta is turned into a keyframe, and the keyframe
+   * isn't announced, so the server doesn't hold it for later deltas.
+   *
+   */
+  void journal_image(const char *timestamp);
+  /**
+   * @brief
+   * Uploads the journaled images oldest-first, straight from the memory
+   * mapped flash, until the journal is empty, an upload fails or the drain
+   * budget of the wake is spent. Each image follows its acknowledged header,
+   * from the first chunk the server doesn't hold, so an image interrupted in
+   * an earlier wake is resumed.
+   *
+   */
+  void drain_journal();
+  /**
+   * @brief Starts the capture task on the APP CPU
+   */
+  void start_capture();
+  /**
+   * @brief
+   * Starts the camera, takes the image, decides whether the scene changed and
+   * compresses it. Runs in the capture task, parallel to the network
+   * bring-up.
+   *
+   */
+  void capture();
+  /**
+   * @brief
+   * Compares the signature of the captured image to the previous wake's
+   * signature, and decides whether the upload can be skipped.
+   *
+   * The signature and the number of skipped uploads in a row are kept in RTC
+   * memory across deep sleep. After a cold boot, or when the change detection
+   * is disabled, the image is always uploaded.
+   *
+   */
+  void detect_change();
+  /**
+   * @brief
+   * Downscales the captured GRAY image to the thumbnail of the progressive
+   * upload, and compresses it if the codec is enabled.
+   *
+   */
+  void make_thumbnail();
+  /**
+   * @brief Waits until the capture task finished
+   * @return true if the image was captured successfully, false otherwise
    */
-  bool capture_and_send_image();
+  bool wait_for_capture();
+  /**
+   * @brief Records the time of the given phase of the wake cycle
+   */
+  void mark_phase(Phase phase);
+  /**
+   * @brief Adds the awake time of the finished cycle to the sleep policy
+   */
+  void record_cycle();
+  /**
+   * @brief
+   * Decides how to wait for the next period: in light sleep if the cycle
+   * finished online and the period is below the crossover, otherwise in
+   * deep sleep.
+   *
+   */
+  SleepMode choose_sleep_mode();
+  /**
+   * @return The crossover period of the sleep policy in seconds, the fixed
+   * one of the dynamic configuration or the calibrated one
+   */
+  uint32_t get_crossover_s();
+  /**
+   * @brief
+   * Powers the camera down, and waits for the next period in light sleep
+   * with the WiFi in modem power save.
+   *
+   */
+  void light_sleep_until_next_period();
 
   /**
    * @brief
-   * Publishes the JSON document to the given MQTT topic.
+   * Publishes the document to the given MQTT topic.
    *
+   * The document is serialised into a buffer on the stack, as JSON or as the
+   * MessagePack format selected by the messageFormat of the static
+   * configuration.
+   *
+   * @return ESP_FAIL if the message doesn't fit in MESSAGE_SIZE bytes or
+   * wasn't published
    */
-  esp_err_t send_json(JsonDocument &doc, const char *topic);
+  esp_err_t send_message(JsonDocument &doc, const char *topic,
+                         MessageKind kind = MessageKind::CONTROL);
   /**
    * @brief
    * Assemble and send the health report to the MQTT broker.
@@ -114,16 +301,126 @@ private:
    * Assemble and send the image header to the MQTT broker.
    *
    * The image header contains the timestamp, the image size and the camera
-   * color mode.
+   * color mode. In delta mode it also contains the frame type and the
+   * keyframe id. In the progressive upload the part names the requested part
+   * of the image which follows.
+   *
+   */
+  esp_err_t send_image_header(const char *timestamp,
+                              const char *part = nullptr);
+  /**
+   * @brief
+   * Fills the image header document, see send_image_header().
+   *
+   */
+  void build_image_header(JsonDocument &doc, const char *timestamp,
+                          const char *part);
+  /**
+   * @brief
+   * Assemble and send the header of a progressive upload, followed by the
+   * thumbnail.
+   *
+   * The header contains the timestamp, the camera color mode, the image size
+   * in pixels, and the size, codec and dimensions of the thumbnail.
+   *
+   */
+  esp_err_t send_thumbnail(const char *timestamp);
+  /**
+   * @brief
+   * Send the requested region of the image, preceded by its part header.
+   *
+   * The region is clipped to the image, and compressed with the lossless
+   * codec if it is enabled.
    *
    */
-  esp_err_t send_image_header(const char *timestamp);
+  esp_err_t send_region(const char *timestamp, const HeaderAck &ack);
   /**
    * @brief
-   * Send the image to the MQTT broker.
+   * Send the image to the MQTT broker in fixed-size chunks, from the given
+   * chunk. The timestamp is the dedupe key of the chunks.
    *
    */
-  esp_err_t send_image();
+  esp_err_t send_image(const char *timestamp, uint32_t first_chunk = 0);
+  /**
+   * @brief
+   * Send the image in fixed-size chunks, the first of which carries the image
+   * header as MQTT5 user properties.
+   *
+   */
+  esp_err_t send_self_describing_image(const char *timestamp);
+  /**
+   * @brief
+   * Publishes the data in fixed-size chunks, with the fields of the header
+   * document in the user properties of the first chunk. Its timestamp is the
+   * dedupe key of the chunks.
+   *
+   */
+  esp_err_t publish_with_header(const JsonDocument &header, const char *data,
+                                uint32_t size);
+  /**
+   * @brief
+   * Compresses the captured GRAY image with the lossless codec.
+   *
+   * The compressed image is kept in PSRAM until the next capture. If the
+   * codec is disabled, the camera is in COLOR mode, or the image doesn't
+   * shrink, the raw frame buffer is sent instead.
+   *
+   * @return
+   * true if the image will be sent compressed, false otherwise.
+   *
+   */
+  bool compress_image();
+  /**
+   * @brief
+   * Prepares the image to send: a delta frame against the keyframe the
+   * server holds, if the delta mode is enabled and the scene allows it, or a
+   * keyframe otherwise.
+   *
+   */
+  void prepare_payload();
+  /**
+   * @brief
+   * Encodes the tiles which changed since the keyframe as a delta frame.
+   *
+   * @return
+   * true if a delta frame was encoded, false if a keyframe is needed.
+   *
+   */
+  bool encode_delta();
+  /**
+   * @brief
+   * Prepares the captured image as a new keyframe with a new keyframe id.
+   *
+   */
+  void make_keyframe();
+  /**
+   * @brief
+   * Remembers the sent keyframe in RTC memory, or counts the sent delta
+   * frame. Called after the image was published.
+   *
+   */
+  void commit_delta_state();
+  /**
+   * @brief
+   * Allocates the buffer of the encoded image in PSRAM on first use.
+   *
+   * @return
+   * true if the buffer is available, false otherwise.
+   *
+   */
+  bool allocate_encoded();
+  /**
+   * @return The data of the image to send: the compressed or the raw image.
+   */
+  const char *get_payload_data();
+  /**
+   * @return The size of the image to send.
+   */
+  uint32_t get_payload_size();
+  /**
+   * @return The codec of the image to send, advertised in the image header.
+   */
+  const char *get_payload_codec();
   /**
    * @brief
    * Calculates the maximum time to wait for receiving an acknowledgement.
@@ -134,11 +431,58 @@ private:
    */
   uint32_t calculate_max_wait();
 
+  static constexpr BaseType_t NETWORK_CORE{0}; // the WiFi task is pinned here
+  static constexpr BaseType_t CAPTURE_CORE{1};
+  static constexpr uint32_t CAPTURE_TIMEOUT_MS{10000};
+  static constexpr uint32_t MQTT_READY_TIMEOUT_MS{5000};
+  static constexpr uint32_t NTP_TIMEOUT_MS{15000};
+  static constexpr uint32_t JOURNAL_DRAIN_BUDGET_MS{10000};
+  static constexpr int RESUME_ATTEMPTS{3};
+  static constexpr EventBits_t CAPTURE_DONE_BIT{BIT0};
+  static constexpr size_t MESSAGE_SIZE{512};
+  static constexpr uint8_t MSGPACK_VERSION{1}; // first byte of the message
+  static constexpr size_t HEADER_VALUE_SIZE{12}; // a uint32_t fits
+  static constexpr const char *PHASE_NAMES[] = {
+      "sensors",    "cameraStarted", "imageTaken", "imageCompressed",
+      "wifi",       "timeSynced",    "mqtt",       "config",
+      "captureJoined", "imageSent"};
+  static_assert(sizeof(PHASE_NAMES) / sizeof(PHASE_NAMES[0]) ==
+                static_cast<size_t>(Phase::COUNT));
+
+  struct PsramDeleter {
+    void operator()(uint8_t *p) { heap_caps_free(p); }
+  };
+
   std::atomic<bool> _stopped_from_other_task{false};
   TaskHandle_t _camera_task_handle = nullptr;
+  TaskHandle_t _capture_task_handle = nullptr;
+  EventGroupHandle_t _capture_event_group = nullptr;
+  esp_err_t _capture_result = ESP_FAIL;
+  JsonDocument _sensor_readings;
+  int16_t _current_after_cam_start = 0;
+  bool _skip_upload = false;
+  float _diff_score = -1;
+  std::array<int32_t, static_cast<size_t>(Phase::COUNT)> _phase_ms{};
+  bool _link_up = false; /*!< the broker is reachable */
+  bool _cycle_done = false; /*!< the cycle finished online */
+  uint32_t _cycles = 0;     /*!< cycles of this boot before this one */
   Camera _cam;
   Wifi _wifi;
   MQTT _mqtt;
   Config _config;
   Sensors _sensors;
+  ImageJournal _journal;
+  bool _compression_enabled = true;
+  bool _msgpack_enabled = false;
+  std::unique_ptr<uint8_t, PsramDeleter> _encoded;
+  size_t _encoded_size = 0;
+  bool _delta_frame = false;
+  uint32_t _keyframe_id = 0;
+  uint32_t _changed_tiles = 0;
+  std::unique_ptr<uint8_t[]> _fingerprints;
+  std::unique_ptr<uint8_t, PsramDeleter> _thumbnail;
+  const uint8_t *_thumbnail_data = nullptr;
+  size_t _thumbnail_size = 0;
+  uint16_t _thumbnail_scale = 0;
+  const char *_thumbnail_codec = "raw";
 };
\ No newline at end of file
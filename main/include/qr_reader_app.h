@@ -1,9 +1,12 @@
 #pragma once
 #include "camera.h"
+#include "frame_pool.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "qr_decoder.h"
 #include "wifi.h"
 #include <ArduinoJson.h>
+#include <array>
 #include <atomic>
 #include <memory>
 
@@ -90,9 +93,13 @@ private:
    * @brief
    * Task function to decode the QR code.
    *
-   * The task receives the camera frame buffer from the queue and decodes the QR
-   * code using the QRDecoder class. The task runs until the QR code is decoded
-   * or a shutdown is requested.
+   * One task runs on each core, with its own QRDecoder, and they take the
+   * camera frames from a shared queue. The QR code is decoded straight in the
+   * camera frame buffer, and every frame is released to the frame pool after
+   * decoding, which returns the frame buffer to the camera driver. The tasks
+   * run until one of them decodes the QR code or a shutdown is requested; the
+   * first one to decode it saves the payload, and the others stop after their
+   * current frame.
    *
    * @param arg
    * TaskContext object.
@@ -104,11 +111,14 @@ private:
    * @brief
    * Function to get the WiFi and server information from the QR code.
    *
-   * The function starts the QR code decoding task, and starts taking pictures,
-   * which will be sent for decoding. It runs until the QR code is decoded or a
-   * shutdown is requested.
+   * The function starts the QR code decoding tasks, and starts taking pictures,
+   * which are wrapped in the frame pool and sent for decoding without a copy.
+   * A new picture is taken as soon as a decoder is free to take it, there is
+   * no fixed frame rate. It runs until the QR code is decoded or a shutdown is
+   * requested, and logs the captured and decoded frames per second and the
+   * time to the first decode.
    *
-   * The clean up of the QR code decoding task is done by this function.
+   * The clean up of the QR code decoding tasks is done by this function.
    *
    */
   void get_qr_code();
@@ -136,32 +146,58 @@ private:
    */
   void save_static_config(const JsonDocument &doc);
 
+  /**
+   * @brief
+   * Returns a frame buffer to the camera driver, called by the frame pool
+   * when the last reference to a frame is released.
+   *
+   * @param owner
+   * The camera_fb_t of the frame.
+   *
+   */
+  static void return_frame_buffer(void *owner);
+
   /**
    * @brief Structure to pass the task context to the QR code decoder task
    * function
    *
    * The structure contains the QRDecoder object, the queue handle to receive
-   * the camera frame buffer, and the flag to indicate if the QR code is
-   * decoded.
+   * the camera frames, the frame pool to release them to, the flag to
+   * indicate if the QR code is decoded, the counter of decoded frames and the
+   * semaphore given when the task stops.
    *
    * @param decoder QRDecoder object
-   * @param queue Queue handle to receive the camera frame buffer
+   * @param queue Queue handle to receive the camera frames
+   * @param pool Frame pool the received frames are released to
    * @param decoded Flag to indicate if the QR code is decoded
+   * @param frames_decoded Counter of the frames the decoders finished
+   * @param stopped Semaphore given when the task stops
    *
    */
   struct TaskContext {
     QRDecoder decoder;
     QueueHandle_t queue;
+    FramePool &pool;
     std::atomic<bool> &decoded;
+    std::atomic<uint32_t> &frames_decoded;
+    SemaphoreHandle_t stopped;
     explicit TaskContext(int width, int height, QueueHandle_t q,
-                         std::atomic<bool> &dec)
-        : decoder(width, height), queue(q), decoded(dec) {}
+                         FramePool &p, std::atomic<bool> &dec,
+                         std::atomic<uint32_t> &frames, SemaphoreHandle_t s)
+        : decoder(width, height), queue(q), pool(p), decoded(dec),
+          frames_decoded(frames), stopped(s) {}
   };
 
+  static constexpr size_t DECODER_COUNT{2}; // one per core
+  // How long the loops wait before checking whether the code was decoded
+  static constexpr uint32_t POLL_MS{200};
+
   Camera _cam;
   Wifi _wifi;
+  FramePool _frame_pool{return_frame_buffer};
 
   static std::atomic<bool> _qr_code_decoded;
-  TaskHandle_t _decode_task_handle = nullptr;
+  std::atomic<uint32_t> _frames_decoded{0};
+  std::array<TaskHandle_t, DECODER_COUNT> _decode_task_handles{};
   TaskHandle_t _qr_app_task_handle = nullptr;
 };
\ No newline at end of file
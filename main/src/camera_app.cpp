@@ -1,12 +1,21 @@
 #include "camera_app.h"
+#include "change_detector.h"
+#include "esp_attr.h"
 #include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "gray_codec.h"
 #include "led.h"
 #include "mysleep.h"
 #include "mytime.h"
+#include "rtc_budget.h"
+#include "thumbnail.h"
+#include "tile_delta.h"
+#include "timekeeper.h"
 #include <ArduinoJson.h>
 #include <esp_log.h>
+#include <cstring>
+#include <esp_random.h>
 #include <esp_system.h>
 #include <sys/param.h>
 
@@ -16,11 +25,48 @@
 
 constexpr auto *TAG = "Camera app";
 
-CameraApp::CameraApp() : _cam(false) {}
+/**
+ * @brief Change detection state of the previous wake, kept in RTC memory
+ */
+struct ChangeDetectionState {
+  uint16_t skipped; /*!< uploads skipped in a row */
+  uint8_t signature[ChangeDetector::SIGNATURE_SIZE];
+};
+RTC_SLOW_ATTR static ChangeDetectionState s_change_detection;
+static_assert(sizeof(s_change_detection) <= rtc_budget::CHANGE_DETECTION,
+              "The change detection state doesn't fit into its RTC memory");
+
+/**
+ * @brief The keyframe the server holds, kept in RTC memory
+ */
+struct DeltaState {
+  uint32_t keyframe_id; /*!< 0 if no keyframe was sent since cold boot */
+  uint16_t deltas;      /*!< delta frames sent since the keyframe */
+  uint16_t tiles;       /*!< number of tiles of the keyframe */
+  uint8_t tolerance;    /*!< the fingerprints were computed with */
+  uint8_t fingerprints[TileDelta::MAX_TILES * TileDelta::FINGERPRINT_SIZE];
+};
+RTC_SLOW_ATTR static DeltaState s_delta;
+static_assert(sizeof(s_delta) <= rtc_budget::DELTA,
+              "The keyframe state doesn't fit into its RTC memory");
+
+CameraApp::CameraApp() : _cam(false) {
+  char image_codec[10] = {0};
+  Storage::read_or_default("imageCodec", image_codec, sizeof(image_codec),
+                           "LOSSLESS");
+  _compression_enabled = strcmp(image_codec, "RAW") != 0;
+
+  char message_format[10] = {0};
+  Storage::read_or_default("messageFormat", message_format,
+                           sizeof(message_format), "JSON");
+  _msgpack_enabled = strcmp(message_format, "MSGPACK") == 0;
+}
 
 void CameraApp::start() {
-  auto res = xTaskCreate(camera_task, "camera_task", 8192, this, 5,
-                         &_camera_task_handle);
+  // The network runs next to the WiFi task, the capture task gets the other
+  // core
+  auto res = xTaskCreatePinnedToCore(camera_task, "camera_task", 8192, this, 5,
+                                     &_camera_task_handle, NETWORK_CORE);
   if (res != pdPASS) {
     ESP_LOGE(TAG, "Failed to create camera task");
     restart();
@@ -30,6 +76,11 @@ void CameraApp::start() {
 void CameraApp::stop() {
   // signal to the camera task that it was stopped from another task
   _stopped_from_other_task = true;
+  if (_capture_task_handle != nullptr) {
+    vTaskSuspend(_capture_task_handle);
+    vTaskDelete(_capture_task_handle);
+    _capture_task_handle = nullptr;
+  }
   if (_camera_task_handle != nullptr) {
     eTaskState taskState = eTaskGetState(_camera_task_handle);
     if (taskState != eDeleted && taskState != eInvalid) {
@@ -43,22 +94,52 @@ void CameraApp::stop() {
   } else {
     ESP_LOGW(TAG, "Camera task handle is null");
   }
+  // The camera task may have been waiting for the next period
+  end_light_sleep();
 }
 
 void CameraApp::camera_task(void *pvParameters) {
   CameraApp *app = static_cast<CameraApp *>(pvParameters);
 
-  app->run();
+  // Below the crossover period the next cycle runs in this task after a
+  // light sleep, otherwise the device deep sleeps and boots again
+  while (true) {
+    app->run();
+    if (app->_stopped_from_other_task) {
+      break;
+    }
 
-  if (app->_stopped_from_other_task == false) {
-    ESP_LOGI(TAG, "Camera task finished");
-    PUBLISH(EventType::SLEEP_UNTIL_NEXT_PERIOD);
+    // A config which arrived after the health report is loaded before the
+    // sleep is chosen. Outside of the working hours it puts the device to
+    // sleep until the next timing.
+    bool sleeping = app->apply_new_config() &&
+                    app->_config.set_active_config() == -1;
+    if (sleeping) {
+      break;
+    }
+    if (app->choose_sleep_mode() == SleepMode::DEEP) {
+      ESP_LOGI(TAG, "Camera task finished");
+      PUBLISH(EventType::SLEEP_UNTIL_NEXT_PERIOD);
+      break;
+    }
+    app->light_sleep_until_next_period();
   }
   while (1) {
     vTaskDelay(portMAX_DELAY);
   }
 }
 
+void CameraApp::capture_task(void *pvParameters) {
+  CameraApp *app = static_cast<CameraApp *>(pvParameters);
+
+  app->capture();
+
+  xEventGroupSetBits(app->_capture_event_group, CAPTURE_DONE_BIT);
+  while (1) {
+    vTaskDelay(portMAX_DELAY);
+  }
+}
+
 // ***************************   Main logic   *************************** //
 
 void CameraApp::run() {
@@ -66,27 +147,94 @@ void CameraApp::run() {
     return;
   }
 
-  if (!handle_config_update()) {
+  // The health report carries the skip decision, so the capture is joined
+  // before it
+  bool captured = wait_for_capture();
+
+  bool config_handled = _link_up && handle_config_update();
+  if (!_link_up) {
+    // The image of this period waits in the journal until the broker is back
+    if (captured && !_skip_upload) {
+      char timestamp[TIMESTAMP_SIZE] = {0};
+      Time::get_date(timestamp, sizeof(timestamp));
+      journal_image(timestamp);
+    }
+    return;
+  }
+  if (!config_handled) {
     return;
   }
 
-  if (!capture_and_send_image()) {
+  if (!captured) {
+    ESP_LOGE(TAG, "Failed to capture image!");
     return;
   }
+
+  if (_skip_upload) {
+    ESP_LOGI(TAG, "Scene unchanged, skipping image upload");
+  } else if (!upload_image()) {
+    return;
+  }
+
+  // The link is up anyway, so the clock is synced before its error reaches
+  // the bound and the next wake has to wait for NTP
+  if (Timekeeper::needs_sync(Config::get_time_sync().max_error_ms / 2)) {
+    Timekeeper::start_sync();
+  }
+
+  drain_journal();
+  _cycle_done = true;
+  record_cycle();
 }
 // ********************************************************************* //
 
 // ***************************   Helper functions   ******************** //
 
 bool CameraApp::initialize() {
-  _sensors.init();
-  _wifi.connect();
-  _wifi.sync_time();
-  _mqtt.start();
-  vTaskDelay(500 / portTICK_RATE_MS); // wait for the MQTT client to start
-  //_sensors.init(); // TODO: put it back after mqtt.start
-  _config.load_from_storage();
-  Led::set_pattern(Led::Pattern::MQTT_CONNECTED_BLINK);
+  // The state of the previous cycle of this boot
+  _cycle_done = false;
+  _capture_result = ESP_FAIL;
+  _skip_upload = false;
+  _diff_score = -1;
+  _phase_ms = {};
+  _encoded_size = 0;
+  _fingerprints.reset();
+  _thumbnail_size = 0;
+  if (_cycles > 0) {
+    // The log budget is per cycle, as if the device had booted
+    MQTT::begin_cycle();
+  }
+
+  // The RTC drifted during the sleep, the clock is corrected before any
+  // timestamp is taken
+  Timekeeper::begin();
+  // The sensors share the I2C bus with the camera, so they are read before
+  // the capture task takes it over
+  if (_cycles == 0) {
+    _sensors.init();
+  }
+  _sensors.read_sensors(_sensor_readings);
+  mark_phase(Phase::SENSORS_READ);
+  // The capture task needs the change detection thresholds, a config
+  // received in an earlier cycle or during the light sleep is loaded before
+  // it starts
+  if (_cycles == 0) {
+    _config.load_from_storage();
+  } else {
+    apply_new_config();
+  }
+
+  start_capture();
+
+  // Without the WiFi or the broker the wake goes on offline, the image is
+  // journaled. After a light sleep both are still up, or reconnect by
+  // themselves.
+  _link_up = _cycles == 0 ? connect()
+                          : _mqtt.wait_for_ready(MQTT_READY_TIMEOUT_MS);
+  if (_link_up) {
+    mark_phase(Phase::MQTT_STARTED);
+    Led::set_pattern(Led::Pattern::MQTT_CONNECTED_BLINK);
+  }
 
   if (_config.set_active_config() == -1) {
     ESP_LOGE(TAG, "Failed to set active configuration");
@@ -96,73 +244,403 @@ bool CameraApp::initialize() {
   return true;
 }
 
+bool CameraApp::connect() {
+  bool link_up = _wifi.connect();
+  if (link_up) {
+    mark_phase(Phase::WIFI_CONNECTED);
+    // The RTC keeps the time through the sleep, NTP is only waited for when
+    // the clock may be off by more than the bound
+    if (Timekeeper::needs_sync(Config::get_time_sync().max_error_ms) &&
+        !Timekeeper::sync(NTP_TIMEOUT_MS)) {
+      if (!Timekeeper::get_model().synced) {
+        ESP_LOGE(TAG, "Failed to sync time with NTP server!");
+        restart();
+      }
+      ESP_LOGW(TAG, "NTP server is unreachable, clock error %lu ms",
+               Timekeeper::get_error_ms());
+    }
+    mark_phase(Phase::TIME_SYNCED);
+    _mqtt.start();
+    // A resumed session is ready without subscribing again
+    link_up = _mqtt.wait_for_ready(MQTT_READY_TIMEOUT_MS);
+    if (!link_up) {
+      ESP_LOGE(TAG, "MQTT broker is unreachable!");
+      // The cached address may belong to another device by now
+      Wifi::forget_connection();
+    }
+  }
+  return link_up;
+}
+
 bool CameraApp::handle_config_update() {
+  // The retained config is delivered right after the subscription, or kept
+  // by the resumed session, so it isn't dropped
+  bool retained = Config::get_retained_config();
+  if (!retained) {
+    _mqtt.expect_config();
+  }
   if (send_health_report() != ESP_OK) {
     ESP_LOGE(TAG, "Failed to publish health report!");
+    _link_up = false;
     return false;
   }
 
-  if (!_mqtt.wait_for_config(calculate_max_wait())) {
+  // With a retained config the answer isn't waited for: a config which
+  // arrives later is saved when it arrives, and loaded by the camera task
+  // before the sleep is chosen
+  if (!_mqtt.wait_for_config(retained ? 0 : calculate_max_wait()) &&
+      !retained) {
     ESP_LOGE(TAG, "Failed to receive new config or config-ok!");
+    _link_up = false;
     return false;
   }
 
   // Process new configuration if received
-  if (_mqtt.get_new_config_received()) {
+  if (apply_new_config()) {
     vTaskDelay(100 / portTICK_RATE_MS);
     if (_config.set_active_config() == -1) {
       return false;
     }
   }
 
+  mark_phase(Phase::CONFIG_HANDLED);
   return true;
 }
 
-bool CameraApp::capture_and_send_image() {
-  // TODO: remove this
-  _sensors.enable_ADC();
+bool CameraApp::apply_new_config() {
+  // A capture which outlasted its timeout still reads the config, the new
+  // one waits for the next call
+  if (_capture_event_group != nullptr &&
+      (xEventGroupGetBits(_capture_event_group) & CAPTURE_DONE_BIT) == 0) {
+    return false;
+  }
+  return _mqtt.apply_new_config();
+}
 
-  _cam.start();
-  _cam.take_image();
+bool CameraApp::upload_image() {
   char timestamp[TIMESTAMP_SIZE] = {0};
   Time::get_date(timestamp, sizeof(timestamp));
 
+  // The progressive upload needs the acknowledgement of the thumbnail
+  bool sent = false;
+  if (_thumbnail_size > 0) {
+    sent = send_progressive_exchange(timestamp);
+  } else if (Config::get_one_shot().enabled) {
+    sent = send_one_shot_exchange(timestamp);
+  } else {
+    sent = send_full_exchange(timestamp);
+  }
+  if (!sent) {
+    journal_image(timestamp);
+    return false;
+  }
+  mark_phase(Phase::IMAGE_SENT);
+
+  // TODO: remove this
+  int32_t elapsed_time = static_cast<int32_t>(get_awake_time_us() / 1000);
+
+  JsonDocument doc;
+  doc["current"] = _current_after_cam_start;
+  doc["uptime"] = elapsed_time;
+  JsonObject phases = doc["phases"].to<JsonObject>();
+  for (size_t i = 0; i < _phase_ms.size(); i++) {
+    phases[PHASE_NAMES[i]] = _phase_ms[i];
+  }
+  doc["logsDropped"] = MQTT::get_dropped_log_lines();
+  doc["logHookUs"] = MQTT::get_log_hook_us();
+  doc["mqttResumed"] = MQTT::get_session_resumed();
+
+  if (send_message(doc, "battery_current", MessageKind::TELEMETRY) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to publish battery current after camera start!");
+    return false;
+  }
+
+  return true;
+}
+
+bool CameraApp::send_full_exchange(const char *timestamp) {
+  HeaderAck ack;
+  if (!exchange_header(timestamp, &ack)) {
+    return false;
+  }
+
+  // The delta is useless if the server doesn't hold its keyframe
+  if (_delta_frame && ack.keyframe_id != _keyframe_id) {
+    ESP_LOGW(TAG, "Server holds keyframe %lu instead of %lu, sending keyframe",
+             ack.keyframe_id, _keyframe_id);
+    make_keyframe();
+    if (!exchange_header(timestamp, &ack)) {
+      return false;
+    }
+  }
+
+  if (!send_resumable_image(timestamp, ack.chunks)) {
+    ESP_LOGE(TAG, "Failed to publish image!");
+    return false;
+  }
+  commit_delta_state();
+  return true;
+}
+
+bool CameraApp::exchange_header(const char *timestamp, HeaderAck *ack) {
+  _mqtt.expect_header_ack(timestamp);
   if (send_image_header(timestamp) != ESP_OK) {
     ESP_LOGE(TAG, "Failed to publish image header!");
     return false;
   }
+  if (!_mqtt.wait_for_header_ack(timestamp, calculate_max_wait(), ack)) {
+    ESP_LOGE(TAG, "No matching timestamp received, skipping image publish!");
+    return false;
+  }
+  return true;
+}
 
-  if (!_mqtt.wait_for_header_ack(timestamp, calculate_max_wait())) {
+bool CameraApp::send_resumable_image(const char *timestamp,
+                                     uint32_t first_chunk) {
+  // The frame stays in PSRAM, only the chunks the server misses are sent
+  // again
+  for (int attempt = 0;; attempt++) {
+    if (send_image(timestamp, first_chunk) == ESP_OK) {
+      return true;
+    }
+    if (attempt == RESUME_ATTEMPTS) {
+      return false;
+    }
+    if (!_mqtt.wait_for_ready(calculate_max_wait())) {
+      ESP_LOGE(TAG, "MQTT client didn't reconnect!");
+      return false;
+    }
+    HeaderAck ack;
+    if (!exchange_header(timestamp, &ack)) {
+      return false;
+    }
+    first_chunk = ack.chunks;
+    ESP_LOGW(TAG, "Resuming the image upload from chunk %lu", first_chunk);
+  }
+}
+
+bool CameraApp::send_progressive_exchange(const char *timestamp) {
+  // The server may answer before the last thumbnail chunk is acknowledged
+  _mqtt.expect_header_ack(timestamp);
+  if (send_thumbnail(timestamp) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to publish thumbnail!");
+    return false;
+  }
+
+  HeaderAck ack;
+  if (!_mqtt.wait_for_header_ack(timestamp, calculate_max_wait(), &ack)) {
     ESP_LOGE(TAG, "No matching timestamp received, skipping image publish!");
     return false;
   }
 
-  if (send_image() != ESP_OK) {
+  switch (ack.request) {
+  case HeaderAck::Request::SKIP:
+    ESP_LOGI(TAG, "Server skipped the image after the thumbnail");
+    return true;
+  case HeaderAck::Request::ROI:
+    if (send_region(timestamp, ack) != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to publish image region!");
+      return false;
+    }
+    return true;
+  case HeaderAck::Request::FULL:
+  default:
+    break;
+  }
+
+  // The thumbnail header already carried the acknowledgement, so a missing
+  // keyframe is sent without another round trip
+  if (_delta_frame && ack.keyframe_id != _keyframe_id) {
+    ESP_LOGW(TAG, "Server holds keyframe %lu instead of %lu, sending keyframe",
+             ack.keyframe_id, _keyframe_id);
+    make_keyframe();
+  }
+  if (send_image_header(timestamp, "full") != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to publish image header!");
+    return false;
+  }
+  if (send_image(timestamp) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to publish image!");
+    return false;
+  }
+  commit_delta_state();
+  return true;
+}
+
+bool CameraApp::send_one_shot_exchange(const char *timestamp) {
+  // The acknowledgement arrives after the image, it may come before the last
+  // chunk is acknowledged
+  _mqtt.expect_header_ack(timestamp);
+  if (send_self_describing_image(timestamp) != ESP_OK) {
     ESP_LOGE(TAG, "Failed to publish image!");
     return false;
   }
+  commit_delta_state();
+
+  HeaderAck ack;
+  if (!_mqtt.wait_for_header_ack(timestamp,
+                                 Config::get_one_shot().ack_timeout_ms, &ack)) {
+    ESP_LOGW(TAG, "The image was not acknowledged in time");
+    return true;
+  }
+  // The server couldn't apply the delta, or lost the keyframe
+  if (_fingerprints && ack.keyframe_id != _keyframe_id) {
+    ESP_LOGW(TAG, "Server holds keyframe %lu instead of %lu, next wake sends a "
+                  "keyframe",
+             ack.keyframe_id, _keyframe_id);
+    s_delta.keyframe_id = 0;
+  }
+  return true;
+}
+
+void CameraApp::start_capture() {
+  // The capture task of the previous cycle waits for its deletion
+  if (_capture_task_handle != nullptr) {
+    vTaskDelete(_capture_task_handle);
+    _capture_task_handle = nullptr;
+  }
+  if (_capture_event_group != nullptr) {
+    vEventGroupDelete(_capture_event_group);
+  }
+  _capture_event_group = xEventGroupCreate();
+  if (_capture_event_group == nullptr) {
+    ESP_LOGE(TAG, "Failed to create capture event group");
+    restart();
+  }
 
+  auto res = xTaskCreatePinnedToCore(capture_task, "capture_task", 6144, this,
+                                     5, &_capture_task_handle, CAPTURE_CORE);
+  if (res != pdPASS) {
+    ESP_LOGE(TAG, "Failed to create capture task");
+    restart();
+  }
+}
+
+void CameraApp::capture() {
   // TODO: remove this
-  _sensors.reset_i2c_and_bq();
+  _sensors.enable_ADC();
+
+  _cam.start();
+  mark_phase(Phase::CAMERA_STARTED);
+  _capture_result = _cam.take_image();
+  if (_capture_result != ESP_OK) {
+    return;
+  }
+  mark_phase(Phase::IMAGE_TAKEN);
 
   // TODO: remove this
-  int16_t current = 0;
-  if (_sensors.read_battery_after_cam_start(&current) != ESP_OK) {
+  _sensors.reset_i2c_and_bq();
+  if (_sensors.read_battery_after_cam_start(&_current_after_cam_start) !=
+      ESP_OK) {
     ESP_LOGE(TAG, "Failed to read battery after camera start!");
-    return false;
+  } else {
+    SleepPolicy::record_current(_current_after_cam_start);
   }
-  int32_t elapsed_time = static_cast<int32_t>(esp_timer_get_time() / 1000);
 
-  JsonDocument doc;
-  doc["current"] = current;
-  doc["uptime"] = elapsed_time;
+  detect_change();
+  if (!_skip_upload) {
+    prepare_payload();
+    make_thumbnail();
+  }
+  mark_phase(Phase::IMAGE_COMPRESSED);
+}
 
-  if (send_json(doc, "battery_current") != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to publish battery current after camera start!");
-    return false;
+void CameraApp::detect_change() {
+  ChangeDetectionConfig config = Config::get_change_detection();
+  bool previous_valid =
+      _cycles > 0 || esp_reset_reason() == ESP_RST_DEEPSLEEP;
+  uint8_t signature[ChangeDetector::SIGNATURE_SIZE];
+
+  int64_t start = esp_timer_get_time();
+  if (!config.enabled || strcmp(_cam.get_camera_mode(), "GRAY") != 0 ||
+      !ChangeDetector::compute_signature(
+          reinterpret_cast<const uint8_t *>(_cam.get_image_data()),
+          _cam.get_width(), _cam.get_height(), signature)) {
+    s_change_detection.skipped = 0;
+    return;
   }
+  int64_t elapsed = esp_timer_get_time() - start;
 
-  return true;
+  if (previous_valid) {
+    _diff_score = ChangeDetector::score(s_change_detection.signature,
+                                        signature, config.tolerance);
+    _skip_upload = _diff_score < config.threshold &&
+                   s_change_detection.skipped < config.max_skips;
+    ESP_LOGI(TAG,
+             "Diff score: %.2f%%, threshold: %.2f%%, skipped: %u, signature "
+             "in %lld us",
+             _diff_score, config.threshold, s_change_detection.skipped,
+             elapsed);
+  }
+
+  s_change_detection.skipped =
+      _skip_upload ? s_change_detection.skipped + 1 : 0;
+  memcpy(s_change_detection.signature, signature, sizeof(signature));
+}
+
+void CameraApp::make_thumbnail() {
+  _thumbnail_size = 0;
+  ProgressiveConfig config = Config::get_progressive();
+  if (!config.enabled || strcmp(_cam.get_camera_mode(), "GRAY") != 0 ||
+      !Thumbnail::supported_scale(config.scale)) {
+    return;
+  }
+
+  uint16_t width = static_cast<uint16_t>(_cam.get_width() / config.scale);
+  uint16_t height = static_cast<uint16_t>(_cam.get_height() / config.scale);
+  size_t pixels = static_cast<size_t>(width) * height;
+  if (pixels == 0) {
+    return;
+  }
+
+  // The raw thumbnail, followed by room for the compressed one
+  _thumbnail.reset(
+      static_cast<uint8_t *>(heap_caps_malloc(2 * pixels, MALLOC_CAP_SPIRAM)));
+  if (!_thumbnail) {
+    ESP_LOGW(TAG, "Not enough PSRAM for the thumbnail, sending full image");
+    return;
+  }
+
+  int64_t start = esp_timer_get_time();
+  _thumbnail_size = Thumbnail::downscale(
+      reinterpret_cast<const uint8_t *>(_cam.get_image_data()),
+      static_cast<uint16_t>(_cam.get_width()),
+      static_cast<uint16_t>(_cam.get_height()), config.scale,
+      _thumbnail.get(), pixels);
+  int64_t downscaled = esp_timer_get_time();
+  _thumbnail_data = _thumbnail.get();
+  _thumbnail_scale = config.scale;
+  _thumbnail_codec = "raw";
+
+  if (_thumbnail_size > 0 && _compression_enabled) {
+    size_t encoded_size =
+        GrayCodec::encode(_thumbnail.get(), width, height,
+                          _thumbnail.get() + pixels, pixels);
+    if (encoded_size > 0) {
+      _thumbnail_data = _thumbnail.get() + pixels;
+      _thumbnail_size = encoded_size;
+      _thumbnail_codec = GrayCodec::NAME;
+    }
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+  ESP_LOGI(TAG, "Thumbnail %ux%u, %u bytes in %lld ms, downscaled in %lld us",
+           width, height, _thumbnail_size, elapsed / 1000,
+           downscaled - start);
+}
+
+bool CameraApp::wait_for_capture() {
+  EventBits_t bits =
+      xEventGroupWaitBits(_capture_event_group, CAPTURE_DONE_BIT, pdFALSE,
+                          pdFALSE, pdMS_TO_TICKS(CAPTURE_TIMEOUT_MS));
+  mark_phase(Phase::CAPTURE_JOINED);
+  return (bits & CAPTURE_DONE_BIT) && _capture_result == ESP_OK;
+}
+
+void CameraApp::mark_phase(Phase phase) {
+  int32_t now = static_cast<int32_t>(get_awake_time_us() / 1000);
+  _phase_ms[static_cast<size_t>(phase)] = now;
+  ESP_LOGI(TAG, "Phase %s at %ld ms", PHASE_NAMES[static_cast<size_t>(phase)],
+           now);
 }
 
 esp_err_t CameraApp::send_health_report() {
@@ -173,39 +651,193 @@ esp_err_t CameraApp::send_health_report() {
   // create health report json
   doc["timestamp"] = timestamp;
   doc["configId"] = _config.get_uuid();
+  char config_hash[9] = {0};
+  snprintf(config_hash, sizeof(config_hash), "%08lx", Config::get_hash());
+  doc["configHash"] = config_hash;
   doc["period"] = _config.get_period();
-  _sensors.read_sensors(doc);
+  for (JsonPair reading : _sensor_readings.as<JsonObject>()) {
+    doc[reading.key()] = reading.value();
+  }
+  doc["skipped"] = _skip_upload;
+  doc["clockErrorMs"] = Timekeeper::get_error_ms();
+  const WakeTiming &wake = get_wake_timing();
+  JsonObject sleep_report = doc["sleep"].to<JsonObject>();
+  if (wake.measured) {
+    sleep_report["periodMs"] = wake.period_us / 1000;
+    sleep_report["errorMs"] = wake.period_error_us / 1000;
+  }
+  sleep_report["wakeMs"] = wake.wake_us / 1000;
+  sleep_report["entryMs"] = wake.entry_us / 1000;
+  sleep_report["mode"] = wake.mode == SleepMode::LIGHT ? "light" : "deep";
+  sleep_report["crossoverS"] = get_crossover_s();
+  if (_diff_score >= 0) {
+    doc["diffScore"] = _diff_score;
+  }
+  const WifiTiming &wifi = Wifi::get_timing();
+  JsonObject wifi_report = doc["wifi"].to<JsonObject>();
+  wifi_report["fast"] = wifi.fast;
+  wifi_report["staticIp"] = wifi.static_ip;
+  wifi_report["scanMs"] = wifi.scan_ms;
+  wifi_report["connectMs"] = wifi.connect_ms;
+  wifi_report["ipMs"] = wifi.ip_ms;
 
   // TODO: remove this
   // Get runtime so far in seconds for avg power consumption calculation
-  int32_t elapsed_time = static_cast<int32_t>(esp_timer_get_time() / 1000);
+  int32_t elapsed_time = static_cast<int32_t>(get_awake_time_us() / 1000);
   doc["uptime"] = elapsed_time;
 
-  return send_json(doc, _mqtt.get_health_report_topic());
+  return send_message(doc, _mqtt.get_health_report_topic());
 }
 
-esp_err_t CameraApp::send_image_header(const char *timestamp) {
+esp_err_t CameraApp::send_image_header(const char *timestamp,
+                                       const char *part) {
   JsonDocument doc;
+  build_image_header(doc, timestamp, part);
+  return send_message(doc, _mqtt.get_image_topic());
+}
 
+void CameraApp::build_image_header(JsonDocument &doc, const char *timestamp,
+                                   const char *part) {
   // create image header json
   doc["timestamp"] = timestamp;
-  doc["size"] = _cam.get_image_size();
+  if (part != nullptr) {
+    doc["part"] = part;
+  }
+  doc["size"] = get_payload_size();
   doc["mode"] = _cam.get_camera_mode();
+  doc["codec"] = get_payload_codec();
+  if (Config::get_delta().enabled) {
+    doc["frame"] = _delta_frame ? "delta" : "key";
+    doc["keyframe"] = _keyframe_id;
+    if (_delta_frame) {
+      doc["tiles"] = _changed_tiles;
+    }
+  }
+  doc["width"] = _cam.get_width();
+  doc["height"] = _cam.get_height();
+}
+
+esp_err_t CameraApp::send_thumbnail(const char *timestamp) {
+  JsonDocument doc;
+
+  // create progressive header json
+  doc["timestamp"] = timestamp;
+  doc["size"] = _thumbnail_size;
+  doc["mode"] = _cam.get_camera_mode();
+  doc["codec"] = _thumbnail_codec;
+  doc["progressive"] = true;
   doc["width"] = _cam.get_width();
   doc["height"] = _cam.get_height();
+  JsonObject thumbnail = doc["thumbnail"].to<JsonObject>();
+  thumbnail["width"] = _cam.get_width() / _thumbnail_scale;
+  thumbnail["height"] = _cam.get_height() / _thumbnail_scale;
+  thumbnail["scale"] = _thumbnail_scale;
+
+  if (send_message(doc, _mqtt.get_image_topic()) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  // The parts of the image have keys of their own
+  char key[KEY_SIZE];
+  snprintf(key, sizeof(key), "%s/thumbnail", timestamp);
+  return _mqtt.publish_chunked(_mqtt.get_image_topic(), key,
+                               reinterpret_cast<const char *>(_thumbnail_data),
+                               _thumbnail_size);
+}
+
+esp_err_t CameraApp::send_region(const char *timestamp, const HeaderAck &ack) {
+  uint16_t image_width = static_cast<uint16_t>(_cam.get_width());
+  uint16_t image_height = static_cast<uint16_t>(_cam.get_height());
+  if (ack.roi_x >= image_width || ack.roi_y >= image_height) {
+    ESP_LOGE(TAG, "Requested region is outside of the image");
+    return ESP_FAIL;
+  }
+  uint16_t x = ack.roi_x;
+  uint16_t y = ack.roi_y;
+  uint16_t width = MIN(ack.roi_width, image_width - x);
+  uint16_t height = MIN(ack.roi_height, image_height - y);
+
+  // The region is encoded straight from the frame buffer into the encoded
+  // image buffer, the prepared full image is not needed anymore
+  if (!allocate_encoded()) {
+    return ESP_FAIL;
+  }
+  const auto *image = reinterpret_cast<const uint8_t *>(_cam.get_image_data());
+  const uint8_t *origin = image + static_cast<size_t>(y) * image_width + x;
+  size_t capacity = _cam.get_image_size();
+  size_t size = 0;
+  const char *codec = GrayCodec::NAME;
+  if (_compression_enabled) {
+    size = GrayCodec::encode(origin, width, height, _encoded.get(), capacity,
+                             image_width);
+  }
+  if (size == 0) {
+    codec = "raw";
+    for (uint16_t row = 0; row < height; row++) {
+      memcpy(_encoded.get() + static_cast<size_t>(row) * width,
+             origin + static_cast<size_t>(row) * image_width, width);
+    }
+    size = static_cast<size_t>(width) * height;
+  }
+  _encoded_size = 0;
 
-  return send_json(doc, _mqtt.get_image_topic());
+  JsonDocument doc;
+  doc["timestamp"] = timestamp;
+  doc["part"] = "roi";
+  doc["size"] = size;
+  doc["mode"] = _cam.get_camera_mode();
+  doc["codec"] = codec;
+  JsonArray roi = doc["roi"].to<JsonArray>();
+  roi.add(x);
+  roi.add(y);
+  roi.add(width);
+  roi.add(height);
+  if (send_message(doc, _mqtt.get_image_topic()) != ESP_OK) {
+    return ESP_FAIL;
+  }
+
+  ESP_LOGI(TAG, "Sending region %u,%u %ux%u, %u bytes", x, y, width, height,
+           size);
+  char key[KEY_SIZE];
+  snprintf(key, sizeof(key), "%s/roi", timestamp);
+  return _mqtt.publish_chunked(_mqtt.get_image_topic(), key,
+                               reinterpret_cast<const char *>(_encoded.get()),
+                               size);
 }
 
-esp_err_t CameraApp::send_json(JsonDocument &doc, const char *topic) {
-  std::string json;
-  serializeJson(doc, json);
-  return _mqtt.publish(topic, json.c_str(), json.size());
+esp_err_t CameraApp::send_message(JsonDocument &doc, const char *topic,
+                                  MessageKind kind) {
+  char message[MESSAGE_SIZE];
+  size_t size = 0;
+  if (_msgpack_enabled) {
+    // The version byte tells the receiver how to decode the rest, a JSON
+    // message starts with '{'
+    if (measureMsgPack(doc) > sizeof(message) - 1) {
+      ESP_LOGE(TAG, "Message to %s doesn't fit in %u bytes", topic,
+               sizeof(message));
+      return ESP_FAIL;
+    }
+    message[0] = static_cast<char>(MSGPACK_VERSION);
+    size = 1 + serializeMsgPack(doc, message + 1, sizeof(message) - 1);
+  } else {
+    // serializeJson() writes a null terminator, without room for it the
+    // message is cut short by a character
+    if (measureJson(doc) >= sizeof(message)) {
+      ESP_LOGE(TAG, "Message to %s doesn't fit in %u bytes", topic,
+               sizeof(message));
+      return ESP_FAIL;
+    }
+    size = serializeJson(doc, message, sizeof(message));
+  }
+  return _mqtt.publish(topic, message, size, kind);
 }
 
-esp_err_t CameraApp::send_image() {
-  if (_mqtt.publish(_mqtt.get_image_topic(), _cam.get_image_data(),
-                    _cam.get_image_size()) != ESP_OK) {
+esp_err_t CameraApp::send_image(const char *timestamp, uint32_t first_chunk) {
+  // The frame is streamed from PSRAM in chunks, so it is never duplicated in
+  // the MQTT outbox
+  if (_mqtt.publish_chunked(_mqtt.get_image_topic(), timestamp,
+                            get_payload_data(), get_payload_size(),
+                            IMAGE_CHUNK_SIZE, nullptr, 0,
+                            first_chunk) != ESP_OK) {
     ESP_LOGE(TAG, "Failed to publish image!");
     return ESP_FAIL;
   } else {
@@ -214,10 +846,330 @@ esp_err_t CameraApp::send_image() {
   }
 }
 
+esp_err_t CameraApp::send_self_describing_image(const char *timestamp) {
+  JsonDocument doc;
+  build_image_header(doc, timestamp, nullptr);
+  if (publish_with_header(doc, get_payload_data(), get_payload_size()) !=
+      ESP_OK) {
+    return ESP_FAIL;
+  }
+  ESP_LOGI(TAG, "Image published with its header!");
+  return ESP_OK;
+}
+
+esp_err_t CameraApp::publish_with_header(const JsonDocument &header,
+                                         const char *data, uint32_t size) {
+  // The keys and string values stay in the document, the numbers are
+  // formatted into values
+  esp_mqtt5_user_property_item_t properties[MAX_HEADER_PROPERTIES];
+  char values[MAX_HEADER_PROPERTIES][HEADER_VALUE_SIZE];
+  size_t count = 0;
+  for (JsonPairConst field : header.as<JsonObjectConst>()) {
+    if (count == MAX_HEADER_PROPERTIES) {
+      ESP_LOGE(TAG, "Image header has too many fields!");
+      return ESP_FAIL;
+    }
+    properties[count].key = field.key().c_str();
+    if (field.value().is<const char *>()) {
+      properties[count].value = field.value().as<const char *>();
+    } else {
+      if (measureJson(field.value()) >= HEADER_VALUE_SIZE) {
+        ESP_LOGE(TAG, "Image header field %s is too long!",
+                 field.key().c_str());
+        return ESP_FAIL;
+      }
+      serializeJson(field.value(), values[count], HEADER_VALUE_SIZE);
+      properties[count].value = values[count];
+    }
+    count++;
+  }
+
+  return _mqtt.publish_chunked(_mqtt.get_image_topic(),
+                               header["timestamp"] | "", data, size,
+                               IMAGE_CHUNK_SIZE, properties, count);
+}
+
+void CameraApp::journal_image(const char *timestamp) {
+  if (_journal.mount() != ESP_OK) {
+    return;
+  }
+  // The server may hold another keyframe by the time the journal is drained
+  if (_delta_frame) {
+    make_keyframe();
+  }
+  JsonDocument doc;
+  build_image_header(doc, timestamp, nullptr);
+  doc.remove("frame");
+  doc.remove("keyframe");
+
+  // A header cut short would only fail to parse when the journal is drained
+  char header[ImageJournal::MAX_HEADER_SIZE];
+  if (measureJson(doc) >= sizeof(header)) {
+    ESP_LOGE(TAG, "Image header doesn't fit in %u bytes, not journaled!",
+             sizeof(header));
+    return;
+  }
+  size_t header_size = serializeJson(doc, header, sizeof(header));
+  if (_journal.append(header, header_size,
+                      reinterpret_cast<const uint8_t *>(get_payload_data()),
+                      get_payload_size()) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to journal the image!");
+    return;
+  }
+  ESP_LOGI(TAG, "Image journaled, %u images are waiting",
+           _journal.records().size());
+}
+
+void CameraApp::drain_journal() {
+  // The journal is only scanned after a cold boot or when it has records
+  if (!ImageJournal::may_have_records() || _journal.mount() != ESP_OK) {
+    return;
+  }
+  // The drain mustn't delay the next wake
+  uint32_t budget = MIN(JOURNAL_DRAIN_BUDGET_MS, calculate_max_wait());
+  int64_t deadline = esp_timer_get_time() + static_cast<int64_t>(budget) * 1000;
+  size_t drained = 0;
+  while (!_journal.records().empty() && esp_timer_get_time() < deadline) {
+    ImageJournal::Record record = _journal.records().front();
+    const char *header = nullptr;
+    const uint8_t *data = nullptr;
+    esp_partition_mmap_handle_t handle;
+    esp_err_t err = _journal.map(record, &header, &data, &handle);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_CRC) {
+      break;
+    }
+
+    // A corrupt record would hold up the ones behind it
+    JsonDocument doc;
+    if (err == ESP_OK &&
+        deserializeJson(doc, header, record.header_size) !=
+            DeserializationError::Ok) {
+      ESP_LOGE(TAG, "Journaled image header is invalid!");
+      ImageJournal::unmap(handle);
+      err = ESP_ERR_INVALID_CRC;
+    }
+    if (err == ESP_OK) {
+      // The acknowledgement tells where an image interrupted in an earlier
+      // wake resumes
+      doc["journaled"] = true;
+      char timestamp[TIMESTAMP_SIZE] = {0};
+      strlcpy(timestamp, doc["timestamp"] | "", sizeof(timestamp));
+      int64_t remaining_ms = (deadline - esp_timer_get_time()) / 1000;
+      uint32_t timeout = MIN(static_cast<uint32_t>(MAX(remaining_ms, 0)),
+                             calculate_max_wait());
+      HeaderAck ack;
+      _mqtt.expect_header_ack(timestamp);
+      if (send_message(doc, _mqtt.get_image_topic()) != ESP_OK ||
+          !_mqtt.wait_for_header_ack(timestamp, timeout, &ack)) {
+        ESP_LOGE(TAG, "Journaled image header wasn't acknowledged!");
+        ImageJournal::unmap(handle);
+        break;
+      }
+      err = _mqtt.publish_chunked(_mqtt.get_image_topic(), timestamp,
+                                  reinterpret_cast<const char *>(data),
+                                  record.data_size, IMAGE_CHUNK_SIZE, nullptr,
+                                  0, ack.chunks);
+      ImageJournal::unmap(handle);
+      if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to publish journaled image!");
+        break;
+      }
+      drained++;
+    }
+    if (_journal.consume(record) != ESP_OK) {
+      break;
+    }
+  }
+  ESP_LOGI(TAG, "Drained %u journaled images, %u left", drained,
+           _journal.records().size());
+}
+
+void CameraApp::prepare_payload() {
+  if (!encode_delta()) {
+    make_keyframe();
+  }
+}
+
+bool CameraApp::encode_delta() {
+  DeltaConfig config = Config::get_delta();
+  uint16_t width = static_cast<uint16_t>(_cam.get_width());
+  uint16_t height = static_cast<uint16_t>(_cam.get_height());
+  if (!config.enabled || strcmp(_cam.get_camera_mode(), "GRAY") != 0 ||
+      !TileDelta::supported(width, height)) {
+    return false;
+  }
+
+  const auto *image = reinterpret_cast<const uint8_t *>(_cam.get_image_data());
+  uint32_t tiles = TileDelta::tile_count(width, height);
+  _fingerprints.reset(new uint8_t[tiles * TileDelta::FINGERPRINT_SIZE]);
+  TileDelta::compute_fingerprints(image, width, height, config.tolerance,
+                                  _fingerprints.get());
+
+  if (s_delta.keyframe_id == 0 || s_delta.tiles != tiles ||
+      s_delta.tolerance != config.tolerance ||
+      s_delta.deltas + 1 >= config.keyframe_interval) {
+    return false;
+  }
+
+  std::unique_ptr<uint16_t[]> indices(new uint16_t[tiles]);
+  _changed_tiles =
+      TileDelta::changed_tiles(s_delta.fingerprints, _fingerprints.get(),
+                               tiles, config.tolerance, indices.get());
+  // A delta of most of the frame isn't worth the risk of a lost keyframe
+  if (_changed_tiles > tiles / 2 || !allocate_encoded()) {
+    return false;
+  }
+
+  int64_t start = esp_timer_get_time();
+  _encoded_size = TileDelta::encode(
+      image, width, height, s_delta.keyframe_id, indices.get(), _changed_tiles,
+      _compression_enabled, _encoded.get(), _cam.get_image_size());
+  int64_t elapsed = esp_timer_get_time() - start;
+  if (_encoded_size == 0) {
+    return false;
+  }
+
+  _delta_frame = true;
+  _keyframe_id = s_delta.keyframe_id;
+  ESP_LOGI(TAG, "Delta frame: %lu/%lu tiles, %u bytes in %lld ms",
+           _changed_tiles, tiles, _encoded_size, elapsed / 1000);
+  return true;
+}
+
+void CameraApp::make_keyframe() {
+  _delta_frame = false;
+  _changed_tiles = 0;
+  do {
+    _keyframe_id = esp_random();
+  } while (_keyframe_id == 0 || _keyframe_id == s_delta.keyframe_id);
+  compress_image();
+}
+
+void CameraApp::commit_delta_state() {
+  if (!_fingerprints) {
+    return;
+  }
+  if (_delta_frame) {
+    s_delta.deltas++;
+    return;
+  }
+  s_delta.keyframe_id = _keyframe_id;
+  s_delta.deltas = 0;
+  s_delta.tiles = static_cast<uint16_t>(
+      TileDelta::tile_count(_cam.get_width(), _cam.get_height()));
+  s_delta.tolerance = Config::get_delta().tolerance;
+  memcpy(s_delta.fingerprints, _fingerprints.get(),
+         s_delta.tiles * TileDelta::FINGERPRINT_SIZE);
+}
+
+bool CameraApp::allocate_encoded() {
+  if (!_encoded) {
+    _encoded.reset(static_cast<uint8_t *>(
+        heap_caps_malloc(_cam.get_image_size(), MALLOC_CAP_SPIRAM)));
+    if (!_encoded) {
+      ESP_LOGW(TAG, "Not enough PSRAM for compression, sending raw image");
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CameraApp::compress_image() {
+  _encoded_size = 0;
+  if (!_compression_enabled || strcmp(_cam.get_camera_mode(), "GRAY") != 0) {
+    return false;
+  }
+
+  // Only worth sending compressed if it is smaller than the raw frame
+  size_t capacity = _cam.get_image_size();
+  if (!allocate_encoded()) {
+    return false;
+  }
+
+  int64_t start = esp_timer_get_time();
+  _encoded_size = GrayCodec::encode(
+      reinterpret_cast<const uint8_t *>(_cam.get_image_data()),
+      _cam.get_width(), _cam.get_height(), _encoded.get(), capacity);
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  if (_encoded_size == 0) {
+    ESP_LOGW(TAG, "Image doesn't compress, sending raw image");
+    return false;
+  }
+  ESP_LOGI(TAG, "Image compressed %lu -> %u bytes in %lld ms",
+           _cam.get_image_size(), _encoded_size, elapsed / 1000);
+  return true;
+}
+
+const char *CameraApp::get_payload_data() {
+  return _encoded_size > 0 ? reinterpret_cast<const char *>(_encoded.get())
+                           : _cam.get_image_data();
+}
+
+uint32_t CameraApp::get_payload_size() {
+  return _encoded_size > 0 ? static_cast<uint32_t>(_encoded_size)
+                           : _cam.get_image_size();
+}
+
+const char *CameraApp::get_payload_codec() {
+  if (_delta_frame) {
+    return TileDelta::NAME;
+  }
+  return _encoded_size > 0 ? GrayCodec::NAME : "raw";
+}
+
+void CameraApp::record_cycle() {
+  const WakeTiming &wake = get_wake_timing();
+  uint32_t awake_ms = static_cast<uint32_t>(get_awake_time_us() / 1000);
+  if (wake.mode == SleepMode::LIGHT) {
+    SleepPolicy::record_cycle(SleepMode::LIGHT,
+                              awake_ms + wake.light_wake_us / 1000, 0);
+  } else if (wake.measured) {
+    // A light sleep cycle would save the boot and the network bring-up, the
+    // capture runs next to the bring-up anyway
+    uint32_t overhead_ms = static_cast<uint32_t>(get_wake_overhead_us() / 1000);
+    int32_t network_ms =
+        _phase_ms[static_cast<size_t>(Phase::MQTT_STARTED)] -
+        _phase_ms[static_cast<size_t>(Phase::SENSORS_READ)];
+    SleepPolicy::record_cycle(SleepMode::DEEP, awake_ms + overhead_ms,
+                              overhead_ms + MAX(network_ms, 0));
+  }
+}
+
+SleepMode CameraApp::choose_sleep_mode() {
+  if (!_cycle_done || !Wifi::is_connected()) {
+    return SleepMode::DEEP;
+  }
+  uint32_t crossover_s = get_crossover_s();
+  int64_t period = _config.get_period();
+  ESP_LOGI(TAG, "Period %lld s, light sleep below %lu s", period, crossover_s);
+  return period < crossover_s ? SleepMode::LIGHT : SleepMode::DEEP;
+}
+
+uint32_t CameraApp::get_crossover_s() {
+  SleepPolicyConfig policy = Config::get_sleep_policy();
+  if (policy.crossover_s >= 0) {
+    return static_cast<uint32_t>(policy.crossover_s);
+  }
+  return SleepPolicy::get_crossover_s(policy.deep_sleep_ua,
+                                      policy.light_sleep_ua);
+}
+
+void CameraApp::light_sleep_until_next_period() {
+  _cam.power_down();
+  Led::set_pattern(Led::Pattern::OFF);
+  Wifi::set_power_save(true);
+  _cycles++;
+  light_sleep(static_cast<uint64_t>(_config.get_period()),
+              _config.get_next_transition_us());
+  Wifi::set_power_save(false);
+}
+
 uint32_t CameraApp::calculate_max_wait() {
-  int32_t elapsed_time = static_cast<int32_t>(esp_timer_get_time() / 1000);
-  int32_t max_wait = static_cast<int32_t>(_config.get_period() * 1000) -
-                     elapsed_time - static_cast<int32_t>(OVERHEAD) / 1000;
+  int32_t elapsed_time = static_cast<int32_t>(get_awake_time_us() / 1000);
+  int32_t max_wait =
+      static_cast<int32_t>(_config.get_period() * 1000) - elapsed_time -
+      static_cast<int32_t>(get_wake_overhead_us() / 1000);
   max_wait = MAX(max_wait, 0);
   ESP_LOGI(TAG, "Max wait time: %lu ms", max_wait);
   return static_cast<uint32_t>(max_wait);
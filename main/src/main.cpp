@@ -20,6 +20,8 @@ void setup_qr_reader_mode_events(QRReaderApp &app, Button &button, Led &led);
 
 // *********************** MAIN APP ***********************
 extern "C" void app_main(void) {
+  // The wake-up latency is measured before anything else runs
+  record_wake();
   auto res = xTaskCreate(&main_task, "main_task", 4096, NULL, 15, NULL);
   if (res != pdPASS) {
     ESP_LOGE(TAG, "Failed to create main task");
@@ -108,15 +110,15 @@ void setup_camera_mode_events(CameraApp &app, Button &button, Led &led) {
     led.stop();
     ESP_LOGW(TAG, "Device going to sleep until next period!");
     deinit_components();
-    mysleep(static_cast<uint64_t>(Config::get_period()));
+    mysleep(static_cast<uint64_t>(Config::get_period()),
+            Config::get_next_transition_us());
   });
 
   SUBSCRIBE(EventType::SLEEP_UNTIL_NEXT_TIMING, {
     button.stop();
     led.stop();
     deinit_components();
-    TimingConfig timing = Config::get_active_config();
-    mysleep(timing.end);
+    sleep_until_next_timing(Config::get_next_transition_us());
   });
 
   SUBSCRIBE(EventType::SLEEP_UNTIL_BUTTON_PRESS, {
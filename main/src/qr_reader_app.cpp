@@ -1,6 +1,7 @@
 #include "qr_reader_app.h"
 #include "error_handler.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "event_manager.h"
 #include "http_client.h"
 #include "led.h"
@@ -24,12 +25,14 @@ void QRReaderApp::start() {
 
 void QRReaderApp::stop() {
 
-  if (_decode_task_handle != nullptr) {
-    eTaskState taskState = eTaskGetState(_decode_task_handle);
-    if (taskState != eDeleted && taskState != eInvalid) {
-      vTaskSuspend(_decode_task_handle);
-      vTaskDelete(_decode_task_handle);
-      _decode_task_handle = nullptr;
+  for (TaskHandle_t &handle : _decode_task_handles) {
+    if (handle != nullptr) {
+      eTaskState taskState = eTaskGetState(handle);
+      if (taskState != eDeleted && taskState != eInvalid) {
+        vTaskSuspend(handle);
+        vTaskDelete(handle);
+      }
+      handle = nullptr;
     }
   }
   if (_qr_app_task_handle != nullptr) {
@@ -55,7 +58,9 @@ void QRReaderApp::run() {
   get_qr_code();
 
   // -------- Connect to the WiFi network -------- //
-  _wifi.connect();
+  if (!_wifi.connect()) {
+    restart();
+  }
 
   // -------- Get the static configuration from the server -------- //
   get_static_config();
@@ -77,73 +82,114 @@ void QRReaderApp::qr_decode_task(void *arg) {
   auto *context = static_cast<TaskContext *>(arg);
 
   while (!context->decoded) {
-    camera_fb_t *pic = NULL;
-    if (xQueueReceive(context->queue, &pic, pdMS_TO_TICKS(10000)) != pdTRUE) {
-      ESP_LOGE(TAG, "Failed to receive frame from queue");
+    FramePool::Frame *frame = nullptr;
+    // Wakes up regularly to notice when the other decoder found the code
+    if (xQueueReceive(context->queue, &frame, pdMS_TO_TICKS(POLL_MS)) !=
+        pdTRUE) {
       continue;
     }
 
-    if (context->decoder.decode_frame(pic)) {
-      context->decoded = true;
+    bool decoded =
+        context->decoder.decode_frame(frame->data, frame->width, frame->height);
+    // The frame buffer goes back to the camera before the capture loop can
+    // tear it down
+    context->pool.release(frame);
+    context->frames_decoded++;
+    // Only the first decoder to find the code saves it
+    if (decoded && !context->decoded.exchange(true)) {
+      context->decoder.save_decoded_data();
     }
-    vTaskDelay(pdMS_TO_TICKS(50));
   }
 
+  SemaphoreHandle_t stopped = context->stopped;
   delete context;
-  // The qr task handles the clean up
-  while (true) {
-    vTaskDelay(portMAX_DELAY);
-  }
+  xSemaphoreGive(stopped);
+  vTaskDelete(nullptr);
 }
 
 void QRReaderApp::get_qr_code() {
-  // The pictures are sent through the queue to the QR code decoding task
-  auto processing_queue = xQueueCreate(1, sizeof(camera_fb_t *));
-  if (!processing_queue) {
+  // The frames are sent through the queue to the QR code decoding tasks, a
+  // frame is queued for every decoder while the others are being decoded
+  auto processing_queue =
+      xQueueCreate(DECODER_COUNT, sizeof(FramePool::Frame *));
+  auto decoders_stopped = xSemaphoreCreateCounting(DECODER_COUNT, 0);
+  if (!processing_queue || !decoders_stopped) {
     ESP_LOGE(TAG, "Failed to create queue");
     restart();
   }
 
-  // Camera framebuffer is: FRAMESIZE_VGA = 640x480
-  auto context = std::make_unique<TaskContext>(640, 480, processing_queue,
-                                               _qr_code_decoded);
-
-  ESP_LOGI(TAG, "Starting QR code decoding task");
-
-  auto result = xTaskCreatePinnedToCore(
-      &qr_decode_task, "qr_decode", 24000,
-      context.release(), // Transfer ownership to the task
-      5, &_decode_task_handle, tskNO_AFFINITY);
-  if (result != pdPASS) {
-    ESP_LOGE(TAG, "Failed to create task");
-    restart();
+  ESP_LOGI(TAG, "Starting %u QR code decoding tasks", DECODER_COUNT);
+  for (size_t i = 0; i < DECODER_COUNT; i++) {
+    // Camera framebuffer is: FRAMESIZE_VGA = 640x480
+    auto context = std::make_unique<TaskContext>(
+        640, 480, processing_queue, _frame_pool, _qr_code_decoded,
+        _frames_decoded, decoders_stopped);
+    auto result = xTaskCreatePinnedToCore(
+        &qr_decode_task, "qr_decode", 24000,
+        context.release(), // Transfer ownership to the task
+        5, &_decode_task_handles[i], static_cast<BaseType_t>(i));
+    if (result != pdPASS) {
+      ESP_LOGE(TAG, "Failed to create task");
+      restart();
+    }
   }
 
   /*
    * The loop is responsible for getting the camera frame buffer and
-   * sending it to the QR code decoding task. The loop runs until the QR code
-   * is decoded.
+   * sending it to the QR code decoding tasks. The frame buffer is returned to
+   * the camera by the frame pool, once a decoder released it. The camera and
+   * the queue block while every frame buffer is held, so the loop runs as
+   * fast as the decoders take the frames. It runs until the QR code is
+   * decoded.
    */
+  int64_t start = esp_timer_get_time();
+  uint32_t frames_captured = 0;
   while (!_qr_code_decoded) {
-    camera_fb_t *pic = NULL;
-    pic = esp_camera_fb_get();
-    if (pic) {
-      xQueueSend(processing_queue, &pic, pdMS_TO_TICKS(5000));
-    } else {
+    camera_fb_t *pic = esp_camera_fb_get();
+    if (!pic) {
       ESP_LOGE(TAG, "Failed to get frame buffer");
+      continue;
+    }
+    frames_captured++;
+    FramePool::Frame *frame = _frame_pool.wrap(
+        pic, pic->buf, static_cast<uint16_t>(pic->width),
+        static_cast<uint16_t>(pic->height));
+    if (!frame) {
+      ESP_LOGW(TAG, "Frame pool is full, dropping frame");
+      esp_camera_fb_return(pic);
+    } else if (xQueueSend(processing_queue, &frame, pdMS_TO_TICKS(POLL_MS)) !=
+               pdTRUE) {
+      // The decoders are busy, a fresher frame is taken instead
+      _frame_pool.release(frame);
     }
-    esp_camera_fb_return(pic);
-    vTaskDelay(pdMS_TO_TICKS(500));
   }
+  double elapsed_s = (esp_timer_get_time() - start) / 1e6;
 
-  // Clean up
+  // Clean up, the decoders stop after their current frame
   ESP_LOGI(TAG, "QR code decoded!");
-  if (_decode_task_handle != nullptr) {
-    vTaskDelete(_decode_task_handle);
-    _decode_task_handle = nullptr;
+  for (size_t i = 0; i < DECODER_COUNT; i++) {
+    if (xSemaphoreTake(decoders_stopped, pdMS_TO_TICKS(10000)) != pdTRUE) {
+      ESP_LOGE(TAG, "QR code decoding task didn't stop");
+      restart();
+    }
   }
+  _decode_task_handles.fill(nullptr);
+  ESP_LOGI(TAG,
+           "Captured %.1f frames/s, decoded %.1f frames/s, first decode "
+           "after %.2f s",
+           frames_captured / elapsed_s, _frames_decoded / elapsed_s, elapsed_s);
+
   Led::set_pattern(Led::Pattern::ON);
+  // The queued frames still hold their frame buffers
+  FramePool::Frame *frame = nullptr;
+  while (xQueueReceive(processing_queue, &frame, 0) == pdTRUE) {
+    _frame_pool.release(frame);
+  }
+  if (_frame_pool.in_use() != 0) {
+    ESP_LOGW(TAG, "%u frames were not released", _frame_pool.in_use());
+  }
   vQueueDelete(processing_queue);
+  vSemaphoreDelete(decoders_stopped);
   esp_camera_deinit();
 }
 
@@ -189,6 +235,10 @@ void QRReaderApp::get_static_config() {
   }
 }
 
+void QRReaderApp::return_frame_buffer(void *owner) {
+  esp_camera_fb_return(static_cast<camera_fb_t *>(owner));
+}
+
 void QRReaderApp::save_static_config(const JsonDocument &doc) {
   Storage::write("mqttAddress", doc["mqttAddress"].as<std::string>());
   Storage::write("mqttUser", doc["mqttUser"].as<std::string>());
@@ -200,5 +250,13 @@ void QRReaderApp::save_static_config(const JsonDocument &doc) {
   Storage::write("logTopic", doc["logTopic"].as<std::string>());
   Storage::write("cameraMode", doc["cameraMode"].as<std::string>());
 
+  // Optional keys, the camera app uses defaults when they are missing
+  if (doc["imageCodec"].is<std::string>()) {
+    Storage::write("imageCodec", doc["imageCodec"].as<std::string>());
+  }
+  if (doc["messageFormat"].is<std::string>()) {
+    Storage::write("messageFormat", doc["messageFormat"].as<std::string>());
+  }
+
   ESP_LOGI(TAG, "Static configuration saved!");
 }
\ No newline at end of file
@@ -1,4 +1,4 @@
-import json
+import message_codec
 from paho.mqtt import client as mqtt_client
 import logging
 import os
@@ -33,8 +33,7 @@ def subscribe(client):
     def on_message(client, userdata, msg):
         try:
             # Decode message
-            message = msg.payload.decode()
-            battery_data = json.loads(message)
+            battery_data = message_codec.decode(msg.payload)
 
             # Save battery percentage and uptime
             with open(battery_data_path, 'a') as file:
@@ -0,0 +1,150 @@
+"""Host benchmark for the chunked image upload.
+
+Streams a WQXGA GRAY frame (2560x1600, ~4 MB) through the same chunking as
+MQTT::publish_chunked() and rebuilds it with the ImageReassembler, for several
+chunk sizes. Reports the throughput, the peak memory held by the publisher
+(the chunks kept in flight, like the MQTT outbox on the device) and the total
+traced peak, which includes the receiver's copy of the frame.
+
+Without arguments the publisher and the receiver run in-process. With
+--broker the chunks travel through a real MQTT5 broker.
+
+    python chunk_benchmark.py
+    python chunk_benchmark.py --broker 192.168.0.232 --sizes 16384 65536
+"""
+import argparse
+import collections
+import os
+import threading
+import time
+import tracemalloc
+
+from image_reassembler import ImageReassembler
+
+FRAME_SIZE = 2560 * 1600
+MAX_CHUNKS_IN_FLIGHT = 2  # mqtt.h
+DEFAULT_SIZES = [0, 4096, 16384, 32768, 65536, 262144]  # 0: single publish
+
+
+def chunks(frame, chunk_size):
+    view = memoryview(frame)
+    if chunk_size == 0:
+        yield 0, 1, view
+        return
+    count = (len(frame) + chunk_size - 1) // chunk_size
+    for index in range(count):
+        yield index, count, view[index * chunk_size:(index + 1) * chunk_size]
+
+
+def run_in_process(frame, chunk_size):
+    reassembler = ImageReassembler(len(frame))
+    outbox = collections.deque()
+    outbox_peak = 0
+    image = None
+
+    tracemalloc.start()
+    start = time.perf_counter()
+    for index, count, chunk in chunks(frame, chunk_size):
+        # The client keeps a copy of every unacknowledged message
+        outbox.append(bytes(chunk))
+        outbox_peak = max(outbox_peak, sum(len(c) for c in outbox))
+        if len(outbox) >= MAX_CHUNKS_IN_FLIGHT or index == count - 1:
+            while outbox:
+                result = reassembler.add(index - len(outbox) + 1, count,
+                                         outbox.popleft())
+                if result is not None:
+                    image = result
+    elapsed = time.perf_counter() - start
+    _, peak = tracemalloc.get_traced_memory()
+    tracemalloc.stop()
+
+    assert image == frame, "Reassembled image differs from the frame"
+    return elapsed, outbox_peak, peak
+
+
+def run_with_broker(frame, chunk_size, broker, port, topic):
+    from paho.mqtt import client as mqtt_client
+    from paho.mqtt.packettypes import PacketTypes
+    from paho.mqtt.properties import Properties
+    from image_reassembler import chunk_properties
+
+    done = threading.Event()
+    reassembler = ImageReassembler(len(frame))
+    result = {}
+    in_flight = collections.deque()
+    outbox_peak = 0
+
+    def on_message(client, userdata, msg):
+        chunk = chunk_properties(msg) or (0, 1)
+        image = reassembler.add(chunk[0], chunk[1], msg.payload)
+        if image is not None:
+            result['image'] = image
+            done.set()
+
+    receiver = mqtt_client.Client(mqtt_client.CallbackAPIVersion.VERSION2,
+                                  protocol=mqtt_client.MQTTv5)
+    receiver.on_message = on_message
+    receiver.connect(broker, port)
+    receiver.subscribe(topic, qos=2)
+    receiver.loop_start()
+
+    sender = mqtt_client.Client(mqtt_client.CallbackAPIVersion.VERSION2,
+                                protocol=mqtt_client.MQTTv5)
+    sender.max_inflight_messages_set(MAX_CHUNKS_IN_FLIGHT)
+    sender.connect(broker, port)
+    sender.loop_start()
+    time.sleep(0.5)
+
+    tracemalloc.start()
+    start = time.perf_counter()
+    for index, count, chunk in chunks(frame, chunk_size):
+        properties = Properties(PacketTypes.PUBLISH)
+        properties.UserProperty = [('chunk', str(index)),
+                                   ('chunks', str(count))]
+        data = bytes(chunk)
+        in_flight.append((data, sender.publish(topic, data, qos=2,
+                                               properties=properties)))
+        outbox_peak = max(outbox_peak, sum(len(d) for d, _ in in_flight))
+        if len(in_flight) >= MAX_CHUNKS_IN_FLIGHT:
+            in_flight.popleft()[1].wait_for_publish()
+    for _, info in in_flight:
+        info.wait_for_publish()
+    done.wait(60)
+    elapsed = time.perf_counter() - start
+    _, peak = tracemalloc.get_traced_memory()
+    tracemalloc.stop()
+
+    sender.loop_stop()
+    receiver.loop_stop()
+    sender.disconnect()
+    receiver.disconnect()
+    assert result.get('image') == frame, "Reassembled image differs"
+    return elapsed, outbox_peak, peak
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--sizes', type=int, nargs='+', default=DEFAULT_SIZES,
+                        help='chunk sizes in bytes, 0 means a single publish')
+    parser.add_argument('--broker', help='MQTT5 broker address')
+    parser.add_argument('--port', type=int, default=1883)
+    parser.add_argument('--topic', default='benchmark/image')
+    args = parser.parse_args()
+
+    frame = os.urandom(FRAME_SIZE)
+    print(f"{'chunk size':>12} {'chunks':>8} {'MB/s':>8} "
+          f"{'publisher peak':>16} {'total peak':>12}")
+    for chunk_size in args.sizes:
+        if args.broker:
+            elapsed, outbox_peak, peak = run_with_broker(
+                frame, chunk_size, args.broker, args.port, args.topic)
+        else:
+            elapsed, outbox_peak, peak = run_in_process(frame, chunk_size)
+        count = 1 if chunk_size == 0 else -(-FRAME_SIZE // chunk_size)
+        label = 'single' if chunk_size == 0 else str(chunk_size)
+        print(f"{label:>12} {count:>8} {FRAME_SIZE / elapsed / 1e6:>8.1f} "
+              f"{outbox_peak / 1024:>13.0f} kB {peak / 1024:>9.0f} kB")
+
+
+if __name__ == '__main__':
+    main()
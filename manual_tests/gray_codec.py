@@ -0,0 +1,96 @@
+"""Decoder for the lossless GRAY codec of the camera (components/imaging,
+GrayCodec). Usage: width, height, pixels = decode(payload)"""
+
+NAME = 'sgc1'
+HEADER_SIZE = 8
+BLOCK_SIZE = 32
+FILTER_COUNT = 4
+MAX_PARAM = 6
+ZERO_BLOCK = 7
+ESCAPE = 12
+
+
+class _BitReader:
+    def __init__(self, data):
+        self._data = data
+        self._pos = 0
+        self._acc = 0
+        self._bits = 0
+
+    def get(self, bits):
+        if bits == 0:
+            return 0
+        while self._bits < bits:
+            byte = self._data[self._pos] if self._pos < len(self._data) else 0
+            if self._pos >= len(self._data) + 8:
+                raise ValueError("Encoded data is truncated")
+            self._pos += 1
+            self._acc = (self._acc << 8) | byte
+            self._bits += 8
+        self._bits -= bits
+        value = self._acc >> self._bits
+        self._acc &= (1 << self._bits) - 1
+        return value
+
+    def get_unary(self, limit):
+        count = 0
+        while count < limit and self.get(1):
+            count += 1
+        return count
+
+
+def _predict(filter_id, left, up, up_left):
+    if filter_id == 0:
+        return left
+    if filter_id == 1:
+        return up
+    if filter_id == 2:
+        return (left + up) >> 1
+    if up_left >= max(left, up):
+        return min(left, up)
+    if up_left <= min(left, up):
+        return max(left, up)
+    return left + up - up_left
+
+
+def decode(data):
+    """Returns (width, height, pixels) of an encoded frame."""
+    if len(data) < HEADER_SIZE or data[:3] != b'SGC' or data[3] != 1:
+        raise ValueError("Not a GRAY codec frame")
+    width = data[4] | (data[5] << 8)
+    height = data[6] | (data[7] << 8)
+    reader = _BitReader(memoryview(data)[HEADER_SIZE:])
+    pixels = bytearray(width * height)
+    up = bytearray(width)
+
+    for y in range(height):
+        filter_id = reader.get(3)
+        if filter_id >= FILTER_COUNT:
+            raise ValueError(f"Invalid filter {filter_id} in row {y}")
+
+        residuals = []
+        for start in range(0, width, BLOCK_SIZE):
+            n = min(BLOCK_SIZE, width - start)
+            k = reader.get(3)
+            if k == ZERO_BLOCK:
+                residuals.extend([0] * n)
+                continue
+            if k > MAX_PARAM:
+                raise ValueError(f"Invalid Rice parameter in row {y}")
+            for _ in range(n):
+                q = reader.get_unary(ESCAPE)
+                residuals.append((q << k) | reader.get(k)
+                                 if q < ESCAPE else reader.get(8))
+
+        row = bytearray(width)
+        left = up_left = 0
+        for x in range(width):
+            value = residuals[x]
+            residual = (value >> 1) ^ -(value & 1)
+            row[x] = (_predict(filter_id, left, up[x], up_left) + residual) & 0xFF
+            left = row[x]
+            up_left = up[x]
+        pixels[y * width:(y + 1) * width] = row
+        up = row
+
+    return width, height, bytes(pixels)
@@ -0,0 +1,263 @@
+/*
+ * Host micro-benchmark for the binarisation of the QR decoder (components/qr,
+ * AdaptiveThreshold).
+ *
+ * quirc_end() thresholds every frame itself: it builds a histogram of the
+ * plane for its Otsu threshold and rewrites every pixel with it. The decoder
+ * binarises the frame before that, so AdaptiveThreshold is an extra pass, and
+ * the benchmark reports what it adds, in nanoseconds and, on x86, in TSC
+ * cycles per pixel:
+ *
+ *    quirc      quirc_end()'s threshold alone, otsu() and pixels_setup() of
+ *               quirc 1.2, the cost of the unmodified decoder
+ *    reference  AdaptiveThreshold::binarise_reference(), pixel by pixel
+ *    swar       AdaptiveThreshold::binarise(), four pixels at a time
+ *    columns    the column sums of binarise() alone, update_columns() on
+ *               every row
+ *    decoder    binarise() followed by quirc's threshold, as decode_frame()
+ *               runs them
+ *
+ * Of the three passes of binarise() over a row, the column sums and the
+ * compares run in 16-bit and 8-bit lanes and would map onto the 128-bit PIE
+ * of the ESP32-S3, the box sum along the row is a running sum carried from
+ * pixel to pixel. The columns line bounds the first of them.
+ *
+ * The reference and the word-parallel kernel must be bit-exact, and quirc's
+ * threshold must keep their dark and light pixels, the benchmark fails
+ * otherwise. Without frames a VGA gradient with noise is used. Frames are
+ * binary PGM (P5) files without comments, or raw 640x480 GRAY frame buffers.
+ *
+ * This only covers the thresholds: the finder search and the decoding of
+ * quirc run on the device, where the "QR decoder reads a code in the shadow
+ * only with the adaptive threshold" test of components/qr decodes a frame
+ * both ways and logs the time of decode_frame().
+ *
+ * Build and run from this directory:
+ *
+ *    g++ -O2 -std=c++17 -I../../components/qr/include \
+ *        -I../../components/imaging/include adaptive_threshold_bench.cpp \
+ *        ../../components/qr/adaptive_threshold.cpp \
+ *        -o adaptive_threshold_bench
+ *    ./adaptive_threshold_bench [frame.pgm...]
+ *
+ * Add -fno-tree-vectorize to compare the kernels as the ESP32-S3 toolchain
+ * builds them, it doesn't vectorise the pixel loops on its own.
+ */
+#include "adaptive_threshold.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+namespace {
+
+constexpr uint16_t RAW_WIDTH = 640;
+constexpr uint16_t RAW_HEIGHT = 480;
+constexpr int REPEAT = 20;
+
+struct Frame {
+  const char *path = "gradient";
+  uint16_t width = 0;
+  uint16_t height = 0;
+  std::vector<uint8_t> pixels;
+};
+
+bool load_frame(const char *path, Frame &frame) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  if (data.size() == static_cast<size_t>(RAW_WIDTH) * RAW_HEIGHT) {
+    frame.width = RAW_WIDTH;
+    frame.height = RAW_HEIGHT;
+    frame.pixels = std::move(data);
+    return true;
+  }
+  data.push_back(0); // terminates the header for sscanf
+  unsigned width = 0, height = 0, max_value = 0;
+  int header = 0;
+  if (sscanf(reinterpret_cast<const char *>(data.data()), "P5 %u %u %u%n",
+             &width, &height, &max_value, &header) != 3 ||
+      max_value > 255 ||
+      data.size() < header + 2 + static_cast<size_t>(width) * height) {
+    return false;
+  }
+  frame.width = static_cast<uint16_t>(width);
+  frame.height = static_cast<uint16_t>(height);
+  frame.pixels.assign(data.begin() + header + 1,
+                      data.begin() + header + 1 +
+                          static_cast<size_t>(width) * height);
+  return true;
+}
+
+Frame gradient_frame() {
+  Frame frame;
+  frame.width = RAW_WIDTH;
+  frame.height = RAW_HEIGHT;
+  frame.pixels.resize(static_cast<size_t>(RAW_WIDTH) * RAW_HEIGHT);
+  uint32_t seed = 1;
+  for (uint32_t y = 0; y < RAW_HEIGHT; y++) {
+    for (uint32_t x = 0; x < RAW_WIDTH; x++) {
+      seed = seed * 1103515245 + 12345;
+      frame.pixels[y * RAW_WIDTH + x] = static_cast<uint8_t>(
+          ((seed >> 16) & 63) + (x + y) * 191 / (RAW_WIDTH + RAW_HEIGHT));
+    }
+  }
+  return frame;
+}
+
+// quirc_end()'s threshold from quirc 1.2 identify.c: otsu() over the
+// histogram of the plane, then pixels_setup(), black is 1 and white 0
+void quirc_threshold(uint8_t *pixels, int width, int height) {
+  unsigned num_pixels = static_cast<unsigned>(width) * height;
+  unsigned histogram[256] = {};
+  for (unsigned i = 0; i < num_pixels; i++) {
+    histogram[pixels[i]]++;
+  }
+  unsigned sum = 0;
+  for (unsigned i = 0; i < 256; i++) {
+    sum += i * histogram[i];
+  }
+  float sum_b = 0;
+  unsigned q1 = 0;
+  double max = 0;
+  uint8_t threshold = 0;
+  for (unsigned i = 0; i < 256; i++) {
+    q1 += histogram[i];
+    if (q1 == 0) {
+      continue;
+    }
+    unsigned q2 = num_pixels - q1;
+    if (q2 == 0) {
+      break;
+    }
+    sum_b += i * histogram[i];
+    double m1 = sum_b / q1;
+    double m2 = (static_cast<double>(sum) - sum_b) / q2;
+    double variance = (m1 - m2) * (m1 - m2) * q1 * q2;
+    if (variance >= max) {
+      threshold = static_cast<uint8_t>(i);
+      max = variance;
+    }
+  }
+  for (unsigned i = 0; i < num_pixels; i++) {
+    pixels[i] = pixels[i] < threshold ? 1 : 0;
+  }
+}
+
+void column_pass(uint8_t *pixels, int width, int height) {
+  std::vector<uint16_t> columns(width);
+  std::vector<uint8_t> zero_row(width);
+  for (int y = 0; y < height; y++) {
+    const uint8_t *leaving =
+        y >= AdaptiveThreshold::WINDOW_HEIGHT
+            ? pixels + (y - AdaptiveThreshold::WINDOW_HEIGHT) * width
+            : zero_row.data();
+    AdaptiveThreshold::update_columns(columns.data(), pixels + y * width,
+                                      leaving, static_cast<uint16_t>(width));
+  }
+  // Keeps the pass from being optimised away
+  pixels[0] = static_cast<uint8_t>(columns[0]);
+}
+
+void decoder_threshold(uint8_t *pixels, int width, int height) {
+  AdaptiveThreshold::binarise(pixels, static_cast<uint16_t>(width),
+                              static_cast<uint16_t>(height));
+  quirc_threshold(pixels, width, height);
+}
+
+struct Cost {
+  double ns = 1e12;
+  double cycles = 1e12;
+};
+
+// The fastest of REPEAT runs on a fresh copy of the frame, per pixel
+template <typename F>
+Cost measure(const Frame &frame, std::vector<uint8_t> &work, F &&kernel) {
+  Cost cost;
+  double pixels = static_cast<double>(frame.width) * frame.height;
+  for (int i = 0; i < REPEAT; i++) {
+    work = frame.pixels;
+    auto start = std::chrono::steady_clock::now();
+#ifdef HAVE_TSC
+    uint64_t start_cycles = __rdtsc();
+#endif
+    kernel(work.data(), frame.width, frame.height);
+#ifdef HAVE_TSC
+    cost.cycles = std::min(cost.cycles, (__rdtsc() - start_cycles) / pixels);
+#endif
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    cost.ns = std::min(cost.ns, elapsed.count() / pixels);
+  }
+  return cost;
+}
+
+void print_cost(const char *name, const Cost &cost) {
+#ifdef HAVE_TSC
+  printf("  %-10s %8.2f ns/pixel %8.2f cycles/pixel\n", name, cost.ns,
+         cost.cycles);
+#else
+  printf("  %-10s %8.2f ns/pixel\n", name, cost.ns);
+#endif
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::vector<Frame> frames;
+  for (int i = 1; i < argc; i++) {
+    Frame frame;
+    frame.path = argv[i];
+    if (load_frame(argv[i], frame)) {
+      frames.push_back(std::move(frame));
+    } else {
+      fprintf(stderr, "Skipping %s: not a PGM or raw frame\n", argv[i]);
+    }
+  }
+  if (frames.empty()) {
+    frames.push_back(gradient_frame());
+  }
+
+  bool exact = true;
+  std::vector<uint8_t> work;
+  std::vector<uint8_t> reference;
+  for (const Frame &frame : frames) {
+    printf("%s (%ux%u)\n", frame.path, frame.width, frame.height);
+
+    Cost quirc = measure(frame, work, quirc_threshold);
+    Cost scalar = measure(frame, work, AdaptiveThreshold::binarise_reference);
+    reference = work;
+    Cost swar = measure(frame, work, AdaptiveThreshold::binarise);
+    if (work != reference) {
+      fprintf(stderr, "  The kernels differ from the reference\n");
+      exact = false;
+    }
+    Cost columns = measure(frame, work, column_pass);
+    Cost decoder = measure(frame, work, decoder_threshold);
+    for (size_t i = 0; i < work.size(); i++) {
+      if (work[i] != (reference[i] == AdaptiveThreshold::DARK ? 1 : 0)) {
+        fprintf(stderr, "  quirc's threshold changes the binarised pixels\n");
+        exact = false;
+        break;
+      }
+    }
+
+    print_cost("quirc", quirc);
+    print_cost("reference", scalar);
+    print_cost("swar", swar);
+    print_cost("columns", columns);
+    print_cost("decoder", decoder);
+    printf("  swar %.2fx faster than the reference, %.0f%% of it in the "
+           "column sums, the decoder threshold costs %.2fx quirc's alone\n",
+           scalar.ns / swar.ns, 100.0 * columns.ns / swar.ns,
+           decoder.ns / quirc.ns);
+  }
+  return exact ? 0 : 1;
+}
@@ -0,0 +1,9 @@
+/*
+ * Host stand-in of the ESP-IDF header, for the host benchmarks
+ */
+#pragma once
+
+#define RTC_SLOW_ATTR
+#define RTC_DATA_ATTR
+#define IRAM_ATTR
+#define RTC_IRAM_ATTR
@@ -0,0 +1,10 @@
+/*
+ * Host stand-in of the ESP-IDF header, for the host benchmarks. The logs are
+ * dropped, the formats expect the 32-bit types of the ESP32.
+ */
+#pragma once
+
+#define ESP_LOGE(tag, ...) ((void)(tag))
+#define ESP_LOGW(tag, ...) ((void)(tag))
+#define ESP_LOGI(tag, ...) ((void)(tag))
+#define ESP_LOGD(tag, ...) ((void)(tag))
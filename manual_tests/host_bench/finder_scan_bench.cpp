@@ -0,0 +1,343 @@
+/*
+ * Host benchmark for the finder pattern prefilter of the QR decoder
+ * (components/qr, FinderScan).
+ *
+ * Scans a corpus of frames with and without QR codes, and reports the cost
+ * of the scan, the share of frames without a code it rejects, the recall on
+ * the frames with a code, and the share of the pixels left for quirc. quirc
+ * isn't built on the host, so its per-pixel work is stood in for by a
+ * sliding-mean binarisation like the one quirc_end() starts with, run on the
+ * whole frame without the prefilter and on the region with it.
+ *
+ * Frames are binary PGM (P5) files without comments, or raw 640x480 GRAY
+ * frame buffers. Without any, a synthetic set is used: a code on a plain
+ * background, the same code under rows of texture which look like finder
+ * patterns on a single row, the code lit unevenly, noise and a gradient.
+ *
+ * The "thr us" and "runs us" columns split the row work of the scan, over
+ * every scanned row without the early stop of busy frames: the windowed
+ * thresholds, a running sum carried from pixel to pixel, and the run
+ * splitting, which compares four pixels at a time (see swar.h) but stops at
+ * every change of colour. The word-parallel compares are what a wider SIMD
+ * path, such as the PIE of the ESP32-S3, would speed up.
+ *
+ * The prefilter isn't free: it costs a scan of every second row, and frames
+ * too busy to tell ("busy") go to quirc whole after the first busy row.
+ * Besides the average, the frames it made slower are reported.
+ *
+ * QRDecoder only runs the prefilter when it is asked to (QRDecodeStages),
+ * because the synthetic frames say nothing about the recall on real ones.
+ * Run the bench on frames captured by the camera, sorted with --with and
+ * --without, before turning it on: it fails if a frame with a code is
+ * rejected.
+ *
+ * Build and run from this directory:
+ *
+ *    g++ -O2 -std=c++17 -I../../components/qr/include \
+ *        -I../../components/imaging/include finder_scan_bench.cpp \
+ *        ../../components/qr/finder_scan.cpp -o finder_scan_bench
+ *    ./finder_scan_bench [--with qr_frame.pgm... --without frame.pgm...]
+ */
+#include "finder_scan.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+namespace {
+
+constexpr uint16_t RAW_WIDTH = 640;
+constexpr uint16_t RAW_HEIGHT = 480;
+constexpr int REPEAT = 5;
+
+struct Frame {
+  const char *path = nullptr;
+  bool has_code = false;
+  uint16_t width = 0;
+  uint16_t height = 0;
+  std::vector<uint8_t> pixels;
+};
+
+bool load_frame(const char *path, Frame &frame) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  if (data.size() == static_cast<size_t>(RAW_WIDTH) * RAW_HEIGHT) {
+    frame.width = RAW_WIDTH;
+    frame.height = RAW_HEIGHT;
+    frame.pixels = std::move(data);
+    return true;
+  }
+  data.push_back(0); // terminates the header for sscanf
+  unsigned width = 0, height = 0, max_value = 0;
+  int header = 0;
+  if (sscanf(reinterpret_cast<const char *>(data.data()), "P5 %u %u %u%n",
+             &width, &height, &max_value, &header) != 3 ||
+      max_value > 255 ||
+      data.size() < header + 2 + static_cast<size_t>(width) * height) {
+    return false;
+  }
+  frame.width = static_cast<uint16_t>(width);
+  frame.height = static_cast<uint16_t>(height);
+  frame.pixels.assign(data.begin() + header + 1,
+                      data.begin() + header + 1 +
+                          static_cast<size_t>(width) * height);
+  return true;
+}
+
+// Stand-in for quirc's per-pixel work: a sliding row mean threshold
+uint32_t binarise(const uint8_t *pixels, uint16_t stride, uint16_t x0,
+                  uint16_t y0, uint16_t width, uint16_t height) {
+  int window = std::max(width / 8, 1);
+  uint32_t black = 0;
+  for (uint16_t y = y0; y < y0 + height; y++) {
+    const uint8_t *row = pixels + static_cast<size_t>(y) * stride + x0;
+    int sum = 0;
+    for (int x = 0; x < window; x++) {
+      sum += row[x];
+    }
+    for (int x = 0; x < width; x++) {
+      int mean = sum / window;
+      if (x + window < width) {
+        sum += row[x + window] - row[x];
+      }
+      black += row[x] * 100 < mean * 95;
+    }
+  }
+  return black;
+}
+
+// The synthetic code: version 2 sized, random modules, three finder patterns
+// with their light separators
+void draw_code(Frame &frame, int left, int top, int module) {
+  constexpr int MODULES = 25;
+  auto fill = [&](int x, int y, uint8_t value) {
+    for (int j = 0; j < module; j++) {
+      memset(frame.pixels.data() + (top + y * module + j) * frame.width +
+                 left + x * module,
+             value, module);
+    }
+  };
+  uint32_t seed = 1;
+  for (int y = 0; y < MODULES; y++) {
+    for (int x = 0; x < MODULES; x++) {
+      seed = seed * 1103515245 + 12345;
+      fill(x, y, (seed >> 16) & 1 ? 20 : 230);
+    }
+  }
+  const int origins[3][2] = {{0, 0}, {MODULES - 7, 0}, {0, MODULES - 7}};
+  for (const auto &origin : origins) {
+    for (int y = -1; y < 8; y++) {
+      for (int x = -1; x < 8; x++) {
+        int mx = origin[0] + x;
+        int my = origin[1] + y;
+        if (mx < 0 || my < 0 || mx >= MODULES || my >= MODULES) {
+          continue;
+        }
+        bool ring = x == 0 || x == 6 || y == 0 || y == 6;
+        bool centre = x >= 2 && x <= 4 && y >= 2 && y <= 4;
+        bool inside = x >= 0 && x <= 6 && y >= 0 && y <= 6;
+        fill(mx, my, inside && (ring || centre) ? 20 : 230);
+      }
+    }
+  }
+}
+
+// 1:1:3:1:1 runs on single rows above the code, like texture produces
+void draw_texture(Frame &frame, int rows) {
+  const int runs[5] = {1, 1, 3, 1, 1};
+  for (int i = 0; i < rows; i++) {
+    uint8_t *row = frame.pixels.data() + (1 + 4 * i) * frame.width + 20 +
+                   24 * (i % 24);
+    bool dark = true;
+    for (int run : runs) {
+      memset(row, dark ? 20 : 200, run * 4);
+      row += run * 4;
+      dark = !dark;
+    }
+  }
+}
+
+std::vector<Frame> synthetic_frames() {
+  std::vector<Frame> frames(5);
+  for (Frame &frame : frames) {
+    frame.width = RAW_WIDTH;
+    frame.height = RAW_HEIGHT;
+    frame.pixels.assign(static_cast<size_t>(RAW_WIDTH) * RAW_HEIGHT, 200);
+  }
+  frames[0].path = "synthetic code";
+  frames[0].has_code = true;
+  draw_code(frames[0], 150, 100, 6);
+
+  frames[1].path = "synthetic code, textured rows";
+  frames[1].has_code = true;
+  draw_texture(frames[1], 24);
+  draw_code(frames[1], 150, 100, 6);
+
+  frames[2].path = "synthetic code, uneven light";
+  frames[2].has_code = true;
+  draw_code(frames[2], 150, 100, 6);
+  for (uint32_t y = 0; y < RAW_HEIGHT; y++) {
+    for (uint32_t x = 0; x < RAW_WIDTH; x++) {
+      uint8_t &pixel = frames[2].pixels[y * RAW_WIDTH + x];
+      pixel = static_cast<uint8_t>(pixel * (16 + x * 240 / RAW_WIDTH) / 256);
+    }
+  }
+
+  frames[3].path = "synthetic noise";
+  uint32_t seed = 7;
+  for (uint8_t &pixel : frames[3].pixels) {
+    seed = seed * 1103515245 + 12345;
+    pixel = static_cast<uint8_t>(seed >> 16);
+  }
+
+  frames[4].path = "synthetic gradient";
+  for (uint32_t y = 0; y < RAW_HEIGHT; y++) {
+    for (uint32_t x = 0; x < RAW_WIDTH; x++) {
+      frames[4].pixels[y * RAW_WIDTH + x] = static_cast<uint8_t>((x + y) / 5);
+    }
+  }
+  return frames;
+}
+
+// The thresholds of every scanned row, and the runs of those rows
+uint32_t row_thresholds(const Frame &frame, std::vector<uint8_t> &thresholds) {
+  for (uint32_t y = FinderScan::ROW_STEP / 2; y < frame.height;
+       y += FinderScan::ROW_STEP) {
+    FinderScan::row_thresholds(frame.pixels.data() + y * frame.width,
+                               frame.width,
+                               thresholds.data() + y * frame.width);
+  }
+  return thresholds[frame.width];
+}
+
+uint32_t row_runs(const Frame &frame, const std::vector<uint8_t> &thresholds) {
+  std::vector<uint16_t> runs(frame.width + 1);
+  uint32_t total = 0;
+  for (uint32_t y = FinderScan::ROW_STEP / 2; y < frame.height;
+       y += FinderScan::ROW_STEP) {
+    bool first_dark = false;
+    total += FinderScan::run_lengths(frame.pixels.data() + y * frame.width,
+                                     thresholds.data() + y * frame.width,
+                                     frame.width, frame.width, runs.data(),
+                                     &first_dark);
+  }
+  return total;
+}
+
+template <typename F> double best_us(F &&function) {
+  double best = 1e12;
+  for (int i = 0; i < REPEAT; i++) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::vector<Frame> frames;
+  bool has_code = true;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--with") == 0) {
+      has_code = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--without") == 0) {
+      has_code = false;
+      continue;
+    }
+    Frame frame;
+    frame.path = argv[i];
+    frame.has_code = has_code;
+    if (load_frame(argv[i], frame)) {
+      frames.push_back(std::move(frame));
+    } else {
+      fprintf(stderr, "Skipping %s: not a PGM or raw frame\n", argv[i]);
+    }
+  }
+  if (frames.empty()) {
+    frames = synthetic_frames();
+  }
+
+  printf("%-32s %5s %7s %9s %8s %8s %9s %10s %10s\n", "frame", "code",
+         "finders", "scan us", "thr us", "runs us", "region", "before us",
+         "after us");
+  int with_code = 0, found = 0, without_code = 0, rejected = 0;
+  double total_before = 0, total_after = 0;
+  int slower = 0;
+  double worst_before = 0, worst_after = 0;
+  volatile uint32_t sink = 0;
+
+  for (const Frame &frame : frames) {
+    FinderScan::Region region;
+    uint32_t finders = 0;
+    double scan_us = best_us([&] {
+      finders = FinderScan::scan(frame.pixels.data(), frame.width,
+                                 frame.height, &region);
+    });
+    std::vector<uint8_t> thresholds(frame.pixels.size());
+    double thresholds_us =
+        best_us([&] { sink = sink + row_thresholds(frame, thresholds); });
+    double runs_us = best_us([&] { sink = sink + row_runs(frame, thresholds); });
+    bool busy = finders == FinderScan::BUSY;
+    bool passed = finders >= FinderScan::MIN_FINDERS;
+
+    double before_us = best_us([&] {
+      sink = sink + binarise(frame.pixels.data(), frame.width, 0, 0,
+                             frame.width, frame.height);
+    });
+    double after_us = scan_us;
+    if (passed) {
+      after_us += best_us([&] {
+        sink = sink + binarise(frame.pixels.data(), frame.width, region.x,
+                               region.y, region.width, region.height);
+      });
+    }
+    double area = passed ? 100.0 * region.width * region.height /
+                               (frame.width * frame.height)
+                         : 0;
+
+    char count[8];
+    snprintf(count, sizeof(count), busy ? "busy" : "%u", finders);
+    printf("%-32.32s %5s %7s %9.1f %8.1f %8.1f %8.1f%% %10.1f %10.1f\n",
+           frame.path, frame.has_code ? "yes" : "no", count, scan_us,
+           thresholds_us, runs_us, area, before_us, after_us);
+    total_before += before_us;
+    total_after += after_us;
+    if (after_us > before_us) {
+      slower++;
+      if (after_us - before_us > worst_after - worst_before) {
+        worst_before = before_us;
+        worst_after = after_us;
+      }
+    }
+    if (frame.has_code) {
+      with_code++;
+      found += passed;
+    } else {
+      without_code++;
+      rejected += !passed;
+    }
+  }
+
+  printf("\nRecall %d/%d frames with a code, rejected %d/%d frames without\n",
+         found, with_code, rejected, without_code);
+  printf("Per-frame cost %.1f us -> %.1f us (%.2fx)\n",
+         total_before / frames.size(), total_after / frames.size(),
+         total_before / total_after);
+  if (slower > 0) {
+    printf("Slower with the prefilter on %d/%zu frames, worst %.1f us -> "
+           "%.1f us (%.2fx)\n",
+           slower, frames.size(), worst_before, worst_after,
+           worst_before / worst_after);
+  }
+  return found == with_code ? 0 : 1;
+}
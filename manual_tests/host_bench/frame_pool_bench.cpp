@@ -0,0 +1,232 @@
+/*
+ * Host benchmark for the frame handoff of the QR reader app (components/qr,
+ * FramePool).
+ *
+ * A capture thread fills the driver's frame buffers with the recorded frames
+ * and queues them to a decoder thread, which binarises them like quirc_end()
+ * does. Two handoffs are compared:
+ *
+ *    copy       the decoder copies the frame into its own image plane and
+ *               returns the frame buffer, as before the frame pool
+ *    zero-copy  the decoder binarises the frame buffer in place and releases
+ *               it to the frame pool, which returns it to the driver
+ *
+ * and the decoded frames per second are reported for both. Frames are VGA
+ * binary PGM (P5) files, or raw 640x480 GRAY frame buffers.
+ *
+ * Build and run from this directory:
+ *
+ *    g++ -O2 -std=c++17 -pthread -I../../components/qr/include \
+ *        frame_pool_bench.cpp ../../components/qr/frame_pool.cpp \
+ *        -o frame_pool_bench
+ *    ./frame_pool_bench [--frames N] frame.pgm...
+ */
+#include "frame_pool.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr uint16_t WIDTH = 640;
+constexpr uint16_t HEIGHT = 480;
+constexpr size_t FRAME_SIZE = static_cast<size_t>(WIDTH) * HEIGHT;
+constexpr size_t DRIVER_BUFFERS = 3; // QR_FRAME_BUFFER_COUNT
+constexpr size_t QUEUE_DEPTH = 1;
+
+// Loads a VGA PGM or raw frame, the PGM header is assumed to have no comments
+bool load_frame(const char *path, std::vector<uint8_t> &pixels) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  if (data.size() == FRAME_SIZE) {
+    pixels = std::move(data);
+    return true;
+  }
+  unsigned width = 0, height = 0, max_value = 0;
+  int header = 0;
+  if (data.size() < FRAME_SIZE ||
+      sscanf(reinterpret_cast<const char *>(data.data()), "P5 %u %u %u%n",
+             &width, &height, &max_value, &header) != 3 ||
+      width != WIDTH || height != HEIGHT || max_value > 255 ||
+      data.size() < header + 1 + FRAME_SIZE) {
+    return false;
+  }
+  pixels.assign(data.begin() + header + 1,
+                data.begin() + header + 1 + FRAME_SIZE);
+  return true;
+}
+
+// Stand-in for quirc's adaptive threshold: a sliding row mean, in place
+uint32_t binarise(uint8_t *plane) {
+  constexpr int WINDOW = WIDTH / 8;
+  uint32_t black = 0;
+  for (int y = 0; y < HEIGHT; y++) {
+    uint8_t *row = plane + y * WIDTH;
+    int sum = 0;
+    for (int x = 0; x < WINDOW; x++) {
+      sum += row[x];
+    }
+    for (int x = 0; x < WIDTH; x++) {
+      int mean = sum / WINDOW;
+      if (x + WINDOW < WIDTH) {
+        sum += row[x + WINDOW] - row[x];
+      }
+      row[x] = row[x] * 100 < mean * 95 ? 1 : 0;
+      black += row[x];
+    }
+  }
+  return black;
+}
+
+// The camera driver: a fixed set of frame buffers, handed out when free
+class Driver {
+public:
+  Driver() : _buffers(DRIVER_BUFFERS, std::vector<uint8_t>(FRAME_SIZE)) {
+    for (size_t i = 0; i < DRIVER_BUFFERS; i++) {
+      _free.push_back(i);
+    }
+  }
+
+  size_t get() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [&] { return !_free.empty(); });
+    size_t index = _free.front();
+    _free.pop_front();
+    return index;
+  }
+
+  void put(size_t index) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _free.push_back(index);
+    _cv.notify_all();
+  }
+
+  uint8_t *data(size_t index) { return _buffers[index].data(); }
+
+private:
+  std::vector<std::vector<uint8_t>> _buffers;
+  std::deque<size_t> _free;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+};
+
+Driver *driver = nullptr;
+
+void return_to_driver(void *owner) {
+  driver->put(reinterpret_cast<size_t>(owner) - 1);
+}
+
+template <typename T> class Queue {
+public:
+  void push(T value) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [&] { return _items.size() < QUEUE_DEPTH; });
+    _items.push_back(value);
+    _cv.notify_all();
+  }
+
+  T pop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [&] { return !_items.empty(); });
+    T value = _items.front();
+    _items.pop_front();
+    _cv.notify_all();
+    return value;
+  }
+
+private:
+  std::deque<T> _items;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+};
+
+double run(bool zero_copy, const std::vector<std::vector<uint8_t>> &corpus,
+           int frames, uint64_t &checksum) {
+  Driver camera;
+  driver = &camera;
+  FramePool pool(return_to_driver);
+  Queue<FramePool::Frame *> queue;
+  std::vector<uint8_t> plane(FRAME_SIZE);
+  checksum = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  std::thread decoder([&] {
+    for (int i = 0; i < frames; i++) {
+      FramePool::Frame *frame = queue.pop();
+      if (zero_copy) {
+        checksum += binarise(frame->data);
+        pool.release(frame);
+      } else {
+        memcpy(plane.data(), frame->data, FRAME_SIZE);
+        pool.release(frame);
+        checksum += binarise(plane.data());
+      }
+    }
+  });
+
+  for (int i = 0; i < frames; i++) {
+    size_t index = camera.get();
+    // The DMA fill, the same for both handoffs
+    memcpy(camera.data(index), corpus[i % corpus.size()].data(), FRAME_SIZE);
+    FramePool::Frame *frame =
+        pool.wrap(reinterpret_cast<void *>(index + 1), camera.data(index),
+                  WIDTH, HEIGHT);
+    queue.push(frame);
+  }
+  decoder.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  if (pool.in_use() != 0) {
+    fprintf(stderr, "%zu frames were not released\n", pool.in_use());
+  }
+  return frames / elapsed.count();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int frames = 2000;
+  std::vector<std::vector<uint8_t>> corpus;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+      continue;
+    }
+    std::vector<uint8_t> pixels;
+    if (load_frame(argv[i], pixels)) {
+      corpus.push_back(std::move(pixels));
+    } else {
+      fprintf(stderr, "Skipping %s: not a VGA PGM or raw frame\n", argv[i]);
+    }
+  }
+  if (corpus.empty() || frames <= 0) {
+    fprintf(stderr, "Usage: %s [--frames N] frame...\n", argv[0]);
+    return 1;
+  }
+
+  uint64_t copy_checksum = 0;
+  uint64_t zero_copy_checksum = 0;
+  double copy_fps = run(false, corpus, frames, copy_checksum);
+  double zero_copy_fps = run(true, corpus, frames, zero_copy_checksum);
+
+  printf("%-10s %10s\n", "handoff", "frames/s");
+  printf("%-10s %10.1f\n", "copy", copy_fps);
+  printf("%-10s %10.1f\n", "zero-copy", zero_copy_fps);
+  printf("\nSpeedup %.2fx over %d frames of %zu recorded frames\n",
+         zero_copy_fps / copy_fps, frames, corpus.size());
+  if (copy_checksum != zero_copy_checksum) {
+    fprintf(stderr, "The handoffs binarised different pixels\n");
+    return 1;
+  }
+  return 0;
+}
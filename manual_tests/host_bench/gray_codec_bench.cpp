@@ -0,0 +1,219 @@
+/*
+ * Host benchmark for the lossless GRAY codec (components/imaging).
+ *
+ * Encodes and decodes every frame of a corpus, checks the round trip, and
+ * reports the compression ratio, the throughput and the time on air of the
+ * raw and the compressed frame at the given uplink rate.
+ *
+ * The "filters" column is the share of the encoding spent in choose_filter()
+ * and filter_row(), the word-parallel part (see swar.h). It bounds what a
+ * wider SIMD path, such as the PIE of the ESP32-S3, could save: the Rice
+ * coding is bit-serial, and so is the decoding, whose predictions need the
+ * decoded left neighbour.
+ *
+ * The output buffer is as large as the raw frame, like on the camera, so a
+ * frame which doesn't compress is listed as sent raw and counted raw in the
+ * totals. Only a round trip which doesn't give back the frame fails.
+ *
+ * Frames are binary PGM (P5) files, or raw 2560x1600 GRAY frame buffers as
+ * dumped by the camera.
+ *
+ * Build and run from this directory:
+ *
+ *    g++ -O2 -std=c++17 -I../../components/imaging/include \
+ *        gray_codec_bench.cpp ../../components/imaging/gray_codec.cpp \
+ *        -o gray_codec_bench
+ *    ./gray_codec_bench [--rate MB/s] frame.pgm...
+ *
+ * Add -fno-tree-vectorize to compare the kernels as the ESP32-S3 toolchain
+ * builds them, it doesn't vectorise the pixel loops on its own.
+ */
+#include "gray_codec.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr uint16_t RAW_WIDTH = 2560;
+constexpr uint16_t RAW_HEIGHT = 1600;
+constexpr int REPEAT = 3;
+
+struct Frame {
+  uint16_t width = 0;
+  uint16_t height = 0;
+  std::vector<uint8_t> pixels;
+};
+
+// Skips whitespace and comments of a PGM header
+void skip_pgm_space(const std::vector<uint8_t> &data, size_t &pos) {
+  while (pos < data.size()) {
+    if (data[pos] == '#') {
+      while (pos < data.size() && data[pos] != '\n') {
+        pos++;
+      }
+    } else if (isspace(data[pos])) {
+      pos++;
+    } else {
+      break;
+    }
+  }
+}
+
+bool read_pgm_number(const std::vector<uint8_t> &data, size_t &pos,
+                     unsigned &value) {
+  skip_pgm_space(data, pos);
+  if (pos >= data.size() || !isdigit(data[pos])) {
+    return false;
+  }
+  value = 0;
+  while (pos < data.size() && isdigit(data[pos])) {
+    value = value * 10 + (data[pos++] - '0');
+  }
+  return true;
+}
+
+bool load_frame(const char *path, Frame &frame) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  if (data.size() == static_cast<size_t>(RAW_WIDTH) * RAW_HEIGHT) {
+    frame.width = RAW_WIDTH;
+    frame.height = RAW_HEIGHT;
+    frame.pixels = std::move(data);
+    return true;
+  }
+
+  size_t pos = 2;
+  unsigned width, height, max_value;
+  if (data.size() < 2 || data[0] != 'P' || data[1] != '5' ||
+      !read_pgm_number(data, pos, width) ||
+      !read_pgm_number(data, pos, height) ||
+      !read_pgm_number(data, pos, max_value) || max_value > 255 ||
+      data.size() < pos + 1 + static_cast<size_t>(width) * height) {
+    return false;
+  }
+  pos++; // single whitespace after the header
+  frame.width = static_cast<uint16_t>(width);
+  frame.height = static_cast<uint16_t>(height);
+  frame.pixels.assign(data.begin() + pos,
+                      data.begin() + pos + static_cast<size_t>(width) * height);
+  return true;
+}
+
+// The filter choice and the residuals of every row, without the Rice coding
+void filter_frame(const Frame &frame, uint8_t *residuals) {
+  std::vector<uint8_t> zero_row(frame.width);
+  for (uint32_t y = 0; y < frame.height; y++) {
+    const uint8_t *cur = frame.pixels.data() + y * frame.width;
+    const uint8_t *up = y > 0 ? cur - frame.width : zero_row.data();
+    GrayCodec::Filter filter = GrayCodec::choose_filter(cur, up, frame.width);
+    GrayCodec::filter_row(cur, up, frame.width, filter, residuals);
+  }
+}
+
+template <typename F> double best_seconds(F &&function) {
+  double best = 1e9;
+  for (int i = 0; i < REPEAT; i++) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  double rate = 1.0; // MB/s, typical MQTT upload rate of the device
+  std::vector<const char *> paths;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      rate = atof(argv[++i]);
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (paths.empty() || rate <= 0) {
+    fprintf(stderr, "Usage: %s [--rate MB/s] frame...\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-32s %9s %7s %10s %8s %10s %9s %9s\n", "frame", "encoded",
+         "ratio", "enc MB/s", "filters", "dec MB/s", "raw air", "enc air");
+  size_t total_raw = 0;
+  size_t total_encoded = 0;
+  int incompressible = 0;
+  int failures = 0;
+
+  for (const char *path : paths) {
+    Frame frame;
+    if (!load_frame(path, frame)) {
+      fprintf(stderr, "Skipping %s: not a PGM or raw frame\n", path);
+      continue;
+    }
+    size_t raw_size = frame.pixels.size();
+    std::vector<uint8_t> encoded(raw_size);
+    std::vector<uint8_t> decoded(raw_size);
+    size_t size = 0;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    bool decoded_ok = false;
+
+    double encode_s = best_seconds([&] {
+      size = GrayCodec::encode(frame.pixels.data(), frame.width, frame.height,
+                               encoded.data(), encoded.size());
+    });
+    std::vector<uint8_t> residuals(frame.width);
+    double filter_s =
+        best_seconds([&] { filter_frame(frame, residuals.data()); });
+    double filter_share = 100.0 * filter_s / encode_s;
+    if (size == 0) {
+      // The camera sends these frames raw
+      double raw_s = raw_size / 1e6 / rate;
+      printf("%-32.32s %9s %7s %10.1f %7.0f%% %10s %8.2fs %8.2fs\n", path,
+             "raw", "-", raw_size / 1e6 / encode_s, filter_share, "-", raw_s,
+             raw_s);
+      total_raw += raw_size;
+      total_encoded += raw_size;
+      incompressible++;
+      continue;
+    }
+    double decode_s = best_seconds([&] {
+      decoded_ok = GrayCodec::decode(encoded.data(), size, decoded.data(),
+                                     decoded.size(), &width, &height);
+    });
+    if (!decoded_ok || decoded != frame.pixels) {
+      fprintf(stderr, "Round trip failed for %s\n", path);
+      failures++;
+      continue;
+    }
+
+    double raw_mb = raw_size / 1e6;
+    printf("%-32.32s %9zu %7.2f %10.1f %7.0f%% %10.1f %8.2fs %8.2fs\n", path,
+           size, static_cast<double>(raw_size) / size, raw_mb / encode_s,
+           filter_share, raw_mb / decode_s, raw_mb / rate, size / 1e6 / rate);
+    total_raw += raw_size;
+    total_encoded += size;
+  }
+
+  if (total_encoded > 0) {
+    printf("\nTotal: ratio %.2f, time on air %.2fs -> %.2fs at %.2f MB/s\n",
+           static_cast<double>(total_raw) / total_encoded,
+           total_raw / 1e6 / rate, total_encoded / 1e6 / rate, rate);
+  }
+  if (incompressible > 0) {
+    printf("%d incompressible frames sent raw\n", incompressible);
+  }
+  if (failures > 0) {
+    printf("%d round trips failed\n", failures);
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,554 @@
+/*
+ * Host simulation of the store-and-forward image journal (components/storage,
+ * ImageJournal) on the NOR flash of its partition.
+ *
+ * The partition is a buffer with the semantics of the SPI flash: an erase
+ * sets whole sectors, or 64 KB blocks, to 0xff and programming only clears
+ * bits. The journal must never program a bit which isn't erased. The power
+ * can be cut before any erase step or programmed byte: a cut erase leaves
+ * random bits set, a cut program random bits cleared. Three scenarios:
+ *
+ *    wrap   appends records of random size through several laps of the
+ *           partition while draining some, and checks after every append
+ *           that only the records under the new one were dropped, and after
+ *           every remount that the rest reads back intact
+ *    power  cuts the power at random points of appends and drains, and
+ *           checks after the remount that every committed record which
+ *           wasn't overwritten survived, the torn record is never visible,
+ *           and the journal keeps working
+ *    drain  fills a journal of the size in partitions.csv with frames of the
+ *           given size, then drains it oldest-first, one wake after the
+ *           other within the per-wake budget at the given uplink rate. The
+ *           flash time is estimated from the typical timings of the flash
+ *           datasheet.
+ *
+ * Build and run from this directory:
+ *
+ *    g++ -O2 -std=c++17 -Iesp_shim -I../../components/storage/include \
+ *        journal_sim.cpp ../../components/storage/image_journal.cpp \
+ *        -o journal_sim
+ *    ./journal_sim [--rounds N] [--frame KB] [--rate MB/s] [--budget s]
+ */
+#include "esp_partition.h"
+#include "image_journal.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t SECTOR_SIZE = ImageJournal::SECTOR_SIZE;
+constexpr uint32_t BLOCK_SIZE = 64 * 1024;
+constexpr uint32_t RECORD_HEADER_SIZE = 32; // RecordHeader, image_journal.cpp
+constexpr uint32_t DEVICE_JOURNAL_SIZE = 0x600000; // partitions.csv
+
+// Typical timings of the 8 MB QIO flash of the module
+constexpr double SECTOR_ERASE_S = 0.045;
+constexpr double BLOCK_ERASE_S = 0.150;
+constexpr double PAGE_PROGRAM_S = 0.0004; // 256 bytes
+constexpr double READ_MBPS = 40;          // 80 MHz QIO through the cache
+
+struct PowerLoss {};
+
+/**
+ * @brief The partition of the journal, and the counters of the flash work
+ */
+struct Flash {
+  esp_partition_t partition{};
+  std::vector<uint8_t> bytes;
+  std::mt19937 rng{1};
+  // Erase steps and programmed bytes until the power is cut, -1 for never
+  int64_t erase_budget = -1;
+  int64_t program_budget = -1;
+  uint64_t erased_sectors = 0;
+  uint64_t erased_blocks = 0;
+  uint64_t programmed = 0;
+  uint64_t read = 0;
+  uint64_t overprogrammed = 0; // bytes which needed an erase first
+  int mapped = 0;
+
+  void reset(uint32_t size) {
+    partition = {};
+    partition.type = ESP_PARTITION_TYPE_DATA;
+    partition.subtype = ImageJournal::PARTITION_SUBTYPE;
+    partition.size = size;
+    partition.erase_size = SECTOR_SIZE;
+    strcpy(partition.label, ImageJournal::PARTITION_LABEL);
+    // A new chip holds anything
+    bytes.resize(size);
+    for (auto &byte : bytes) {
+      byte = static_cast<uint8_t>(rng());
+    }
+    reset_counters();
+  }
+
+  void reset_counters() {
+    erased_sectors = erased_blocks = programmed = read = 0;
+  }
+
+  double estimated_s() const {
+    return erased_sectors * SECTOR_ERASE_S + erased_blocks * BLOCK_ERASE_S +
+           programmed / 256.0 * PAGE_PROGRAM_S + read / (READ_MBPS * 1e6);
+  }
+};
+
+Flash flash;
+
+bool in_bounds(size_t offset, size_t size) {
+  return offset <= flash.bytes.size() && size <= flash.bytes.size() - offset;
+}
+
+} // namespace
+
+// The partition API of ESP-IDF on the simulated flash
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+                                                esp_partition_subtype_t subtype,
+                                                const char *label) {
+  if (type != flash.partition.type || subtype != flash.partition.subtype ||
+      strcmp(label, flash.partition.label) != 0) {
+    return nullptr;
+  }
+  return &flash.partition;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *, size_t src_offset,
+                             void *dst, size_t size) {
+  if (!in_bounds(src_offset, size)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(dst, flash.bytes.data() + src_offset, size);
+  flash.read += size;
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *, size_t dst_offset,
+                              const void *src, size_t size) {
+  if (!in_bounds(dst_offset, size)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  const auto *data = static_cast<const uint8_t *>(src);
+  for (size_t i = 0; i < size; i++) {
+    uint8_t &byte = flash.bytes[dst_offset + i];
+    if (flash.program_budget == 0) {
+      byte &= data[i] | static_cast<uint8_t>(flash.rng());
+      throw PowerLoss();
+    }
+    if (flash.program_budget > 0) {
+      flash.program_budget--;
+    }
+    if (data[i] & ~byte) {
+      flash.overprogrammed++;
+    }
+    byte &= data[i];
+  }
+  flash.programmed += size;
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *, size_t offset,
+                                    size_t size) {
+  if (!in_bounds(offset, size) || offset % SECTOR_SIZE != 0 ||
+      size % SECTOR_SIZE != 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  // Like spi_flash, a whole aligned block takes one block erase
+  while (size > 0) {
+    size_t step =
+        offset % BLOCK_SIZE == 0 && size >= BLOCK_SIZE ? BLOCK_SIZE
+                                                       : SECTOR_SIZE;
+    if (flash.erase_budget == 0) {
+      for (size_t i = 0; i < step; i++) {
+        flash.bytes[offset + i] |= static_cast<uint8_t>(flash.rng());
+      }
+      throw PowerLoss();
+    }
+    if (flash.erase_budget > 0) {
+      flash.erase_budget--;
+    }
+    memset(flash.bytes.data() + offset, 0xff, step);
+    (step == BLOCK_SIZE ? flash.erased_blocks : flash.erased_sectors)++;
+    offset += step;
+    size -= step;
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *, size_t offset,
+                             size_t size, esp_partition_mmap_memory_t,
+                             const void **out_ptr,
+                             esp_partition_mmap_handle_t *out_handle) {
+  if (!in_bounds(offset, size)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  *out_ptr = flash.bytes.data() + offset;
+  *out_handle = static_cast<esp_partition_mmap_handle_t>(++flash.mapped);
+  // The CRC check reads the whole mapping
+  flash.read += size;
+  return ESP_OK;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t) { flash.mapped--; }
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char *what, uint32_t sequence = 0) {
+  if (!condition) {
+    fprintf(stderr, "FAILED: %s (record %u)\n", what, sequence);
+    failures++;
+  }
+}
+
+/**
+ * @brief The content of a record is derived from its id, so it can be
+ * checked after it was read back
+ */
+struct Content {
+  std::string header;
+  std::vector<uint8_t> data;
+};
+
+Content make_content(uint32_t id, size_t size) {
+  Content content;
+  content.header = "{\"timestamp\":\"" + std::to_string(id) +
+                   "\",\"size\":" + std::to_string(size) + "}";
+  content.data.resize(size);
+  std::mt19937 rng(id);
+  for (auto &byte : content.data) {
+    byte = static_cast<uint8_t>(rng());
+  }
+  return content;
+}
+
+uint32_t record_span(size_t header_size, size_t data_size) {
+  size_t size = RECORD_HEADER_SIZE + header_size + data_size;
+  return static_cast<uint32_t>((size + SECTOR_SIZE - 1) / SECTOR_SIZE *
+                               SECTOR_SIZE);
+}
+
+uint32_t record_end(const ImageJournal::Record &record) {
+  return record.offset + record_span(record.header_size, record.data_size);
+}
+
+bool overlaps(const ImageJournal::Record &record, uint32_t start,
+              uint32_t end) {
+  return record.offset < end && start < record_end(record);
+}
+
+/**
+ * @brief Reads the record back, returns ESP_ERR_INVALID_CRC if it is
+ * corrupt and ESP_FAIL if it is intact but holds the wrong content
+ */
+esp_err_t read_back(ImageJournal &journal,
+                    const ImageJournal::Record &record, uint32_t id,
+                    size_t size) {
+  const char *header = nullptr;
+  const uint8_t *data = nullptr;
+  esp_partition_mmap_handle_t handle;
+  esp_err_t err = journal.map(record, &header, &data, &handle);
+  if (err != ESP_OK) {
+    return err;
+  }
+  Content expected = make_content(id, size);
+  bool same = record.data_size == size &&
+              std::string(header, record.header_size) == expected.header &&
+              memcmp(data, expected.data.data(), size) == 0;
+  ImageJournal::unmap(handle);
+  return same ? ESP_OK : ESP_FAIL;
+}
+
+/**
+ * @brief The records the test expects in the journal, by sequence
+ */
+struct Expected {
+  uint32_t id;
+  size_t size;
+};
+
+std::unique_ptr<ImageJournal> remount() {
+  auto journal = std::make_unique<ImageJournal>();
+  check(journal->mount() == ESP_OK, "mount");
+  return journal;
+}
+
+esp_err_t append(ImageJournal &journal, uint32_t id, size_t size) {
+  Content content = make_content(id, size);
+  return journal.append(content.header.data(), content.header.size(),
+                        content.data.data(), content.data.size());
+}
+
+void check_all(ImageJournal &journal,
+               const std::map<uint32_t, Expected> &expected) {
+  check(journal.records().size() == expected.size(), "number of records");
+  for (const auto &record : journal.records()) {
+    auto it = expected.find(record.sequence);
+    if (it == expected.end()) {
+      check(false, "unexpected record", record.sequence);
+      continue;
+    }
+    check(read_back(journal, record, it->second.id, it->second.size) ==
+              ESP_OK,
+          "record reads back", record.sequence);
+  }
+}
+
+void run_wrap(int rounds) {
+  constexpr uint32_t SIZE = 512 * 1024;
+  flash.reset(SIZE);
+  auto journal = remount();
+  check(journal->records().empty(), "a new journal is empty");
+
+  std::mt19937 rng(2);
+  std::map<uint32_t, Expected> expected;
+  uint32_t laps = 0;
+  uint32_t dropped = 0;
+  for (int i = 0; i < rounds; i++) {
+    size_t size = 8 * 1024 + rng() % (96 * 1024);
+    uint32_t id = static_cast<uint32_t>(i) + 1;
+    uint32_t head = journal->head();
+    uint32_t span = record_span(make_content(id, size).header.size(), size);
+    uint32_t start = head + span > SIZE ? 0 : head;
+    laps += start < head;
+
+    auto before = journal->records();
+    check(append(*journal, id, size) == ESP_OK, "append");
+    const auto &after = journal->records();
+    for (const auto &record : before) {
+      bool kept = std::any_of(after.begin(), after.end(), [&](const auto &r) {
+        return r.sequence == record.sequence;
+      });
+      check(kept != overlaps(record, start, start + span),
+            "only the overwritten records are dropped", record.sequence);
+      if (!kept) {
+        expected.erase(record.sequence);
+        dropped++;
+      }
+    }
+    check(std::is_sorted(after.begin(), after.end(),
+                         [](const auto &a, const auto &b) {
+                           return a.sequence < b.sequence;
+                         }),
+          "records are oldest first");
+    expected[after.back().sequence] = {id, size};
+
+    // Drain the oldest now and then
+    if (rng() % 3 == 0 && !after.empty()) {
+      ImageJournal::Record oldest = after.front();
+      check(read_back(*journal, oldest, expected[oldest.sequence].id,
+                      expected[oldest.sequence].size) == ESP_OK,
+            "oldest record reads back", oldest.sequence);
+      check(journal->consume(oldest) == ESP_OK, "consume");
+      expected.erase(oldest.sequence);
+    }
+    if (i % 10 == 9) {
+      journal = remount();
+      check_all(*journal, expected);
+    }
+  }
+  check(laps >= 3, "the journal wrapped around several times");
+  check(flash.overprogrammed == 0, "no bit is programmed before an erase");
+  printf("wrap:  %d appends in %u laps, %u dropped, %zu pending, %s\n",
+         rounds, laps, dropped, expected.size(),
+         failures == 0 ? "ok" : "FAILED");
+}
+
+void run_power(int rounds) {
+  constexpr uint32_t SIZE = 256 * 1024;
+  flash.reset(SIZE);
+  auto journal = remount();
+
+  std::mt19937 rng(3);
+  std::map<uint32_t, Expected> expected;
+  uint32_t next_id = 1;
+  int cuts = 0;
+  int torn_appends = 0;
+  for (int i = 0; i < rounds; i++) {
+    bool drain = !expected.empty() && rng() % 4 == 0;
+    size_t size = 1 + rng() % (40 * 1024);
+    uint32_t id = next_id++;
+    uint32_t span = record_span(make_content(id, size).header.size(), size);
+    uint32_t start = journal->head() + span > SIZE ? 0 : journal->head();
+
+    // Cut the power somewhere in the operation
+    if (drain) {
+      flash.program_budget = rng() % 4;
+    } else if (rng() % 3 == 0) {
+      flash.erase_budget = rng() % (span / SECTOR_SIZE);
+    } else {
+      flash.program_budget = rng() % (RECORD_HEADER_SIZE + span);
+    }
+
+    ImageJournal::Record oldest{};
+    bool cut = false;
+    try {
+      if (drain) {
+        oldest = journal->records().front();
+        check(journal->consume(oldest) == ESP_OK, "consume");
+        expected.erase(oldest.sequence);
+      } else {
+        check(append(*journal, id, size) == ESP_OK, "append");
+        for (auto it = expected.begin(); it != expected.end();) {
+          bool kept = std::any_of(
+              journal->records().begin(), journal->records().end(),
+              [&](const auto &r) { return r.sequence == it->first; });
+          it = kept ? std::next(it) : expected.erase(it);
+        }
+        expected[journal->records().back().sequence] = {id, size};
+      }
+    } catch (const PowerLoss &) {
+      cut = true;
+    }
+    flash.erase_budget = flash.program_budget = -1;
+    if (!cut) {
+      continue;
+    }
+    cuts++;
+
+    // The records under a torn append may be lost, the consumed one may be
+    // back, every other record has to survive
+    std::vector<ImageJournal::Record> before = journal->records();
+    journal = remount();
+    std::map<uint32_t, Expected> recovered;
+    std::vector<ImageJournal::Record> records = journal->records();
+    for (const auto &record : records) {
+      auto it = expected.find(record.sequence);
+      if (it == expected.end()) {
+        check(false, "torn record is not visible", record.sequence);
+        continue;
+      }
+      esp_err_t err =
+          read_back(*journal, record, it->second.id, it->second.size);
+      bool overwritten = !drain && overlaps(record, start, start + span);
+      check(err == ESP_OK || (err == ESP_ERR_INVALID_CRC && overwritten),
+            "record survives the power loss", record.sequence);
+      if (err == ESP_OK) {
+        recovered[record.sequence] = it->second;
+      } else {
+        // The drain drops a corrupt record
+        check(journal->consume(record) == ESP_OK, "consume corrupt record");
+      }
+    }
+    for (const auto &entry : expected) {
+      bool found = std::any_of(records.begin(), records.end(),
+                               [&](const auto &r) {
+                                 return r.sequence == entry.first;
+                               });
+      auto it = std::find_if(before.begin(), before.end(), [&](const auto &r) {
+        return r.sequence == entry.first;
+      });
+      bool overwritten =
+          !drain && (it == before.end() || overlaps(*it, start, start + span));
+      bool consumed = drain && entry.first == oldest.sequence;
+      check(found || overwritten || consumed, "committed record is kept",
+            entry.first);
+    }
+    torn_appends += !drain;
+    expected = recovered;
+  }
+  check(flash.overprogrammed == 0, "no bit is programmed before an erase");
+  printf("power: %d operations, %d power cuts (%d in appends), %s\n", rounds,
+         cuts, torn_appends, failures == 0 ? "ok" : "FAILED");
+}
+
+void run_drain(size_t frame_size, double rate, double budget) {
+  flash.reset(DEVICE_JOURNAL_SIZE);
+  auto journal = remount();
+
+  // One frame per wake of the outage, until the oldest is overwritten
+  flash.reset_counters();
+  uint32_t appended = 0;
+  while (journal->dropped() == 0 &&
+         appended <= DEVICE_JOURNAL_SIZE / frame_size + 1) {
+    if (append(*journal, ++appended, frame_size) != ESP_OK) {
+      check(false, "the frame fits in the journal");
+      return;
+    }
+  }
+  check(journal->dropped() == 1, "the oldest frame is dropped when full");
+  double append_s = flash.estimated_s() / appended;
+  size_t stored = journal->records().size();
+
+  // Oldest first, a record is started while the wake has budget left
+  flash.reset_counters();
+  int wakes = 0;
+  double host_s = 0;
+  uint64_t mapped_bytes = 0;
+  while (!journal->records().empty() && wakes < 1000) {
+    wakes++;
+    double elapsed = 0;
+    while (!journal->records().empty() && elapsed < budget) {
+      ImageJournal::Record record = journal->records().front();
+      const char *header = nullptr;
+      const uint8_t *data = nullptr;
+      esp_partition_mmap_handle_t handle;
+      auto start = std::chrono::steady_clock::now();
+      esp_err_t err = journal->map(record, &header, &data, &handle);
+      host_s += std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+      check(err == ESP_OK, "record maps", record.sequence);
+      if (err == ESP_OK) {
+        ImageJournal::unmap(handle);
+      }
+      size_t size = RECORD_HEADER_SIZE + record.header_size + record.data_size;
+      mapped_bytes += size;
+      elapsed += size / (READ_MBPS * 1e6) + record.data_size / (rate * 1e6);
+      check(journal->consume(record) == ESP_OK, "consume");
+    }
+  }
+  check(journal->records().empty(), "the journal is drained");
+  check(flash.mapped == 0, "every record is unmapped");
+
+  printf("drain: %zu KB frames, %zu of %u kept in %u KB, %.2f s of flash "
+         "work per append\n",
+         frame_size / 1024, stored, appended, DEVICE_JOURNAL_SIZE / 1024,
+         append_s);
+  printf("       drained in %d wakes of %.0f s at %.1f MB/s, %.1f records per "
+         "wake, %.0f ms flash reads per record, host map+CRC %.0f MB/s, %s\n",
+         wakes, budget, rate, static_cast<double>(stored) / wakes,
+         flash.estimated_s() * 1000 / stored, mapped_bytes / 1e6 / host_s,
+         failures == 0 ? "ok" : "FAILED");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int rounds = 500;
+  double frame_kb = 1500; // a compressed 2560x1600 GRAY frame
+  double rate = 1.0;      // MB/s, typical MQTT upload rate of the device
+  double budget = 10;     // s, CameraApp::JOURNAL_DRAIN_BUDGET_MS
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--frame") == 0 && i + 1 < argc) {
+      frame_kb = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+      budget = atof(argv[++i]);
+    } else {
+      rounds = 0;
+      break;
+    }
+  }
+  if (rounds <= 0 || frame_kb <= 0 || rate <= 0 || budget <= 0) {
+    fprintf(stderr,
+            "Usage: %s [--rounds N] [--frame KB] [--rate MB/s] [--budget s]\n",
+            argv[0]);
+    return 1;
+  }
+
+  run_wrap(rounds);
+  run_power(rounds * 4);
+  run_drain(static_cast<size_t>(frame_kb * 1024), rate, budget);
+  return failures == 0 ? 0 : 1;
+}
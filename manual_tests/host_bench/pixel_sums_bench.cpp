@@ -0,0 +1,305 @@
+/*
+ * Host micro-benchmark for the box sums of the imaging component
+ * (components/imaging, ChangeDetector and Thumbnail).
+ *
+ * The change detection signature and the thumbnail sum the pixels of every
+ * box four at a time in 32-bit words (see swar.h). The benchmark reports the
+ * cost of each kernel per frame and, on x86, in TSC cycles per pixel of the
+ * frame:
+ *
+ *    loads      the 32-bit words the kernel reads, only added up, the floor
+ *               of any kernel with 32-bit loads
+ *    reference  the same box means, pixel by pixel
+ *    swar       ChangeDetector::compute_signature(), Thumbnail::downscale()
+ *               at the scales 4, 8 and 16
+ *
+ * The reference and the word-parallel kernel must give the same output, the
+ * benchmark fails otherwise. Without frames a 2560x1600 gradient with
+ * noise is used. Frames are binary PGM (P5) files without comments, or raw
+ * 2560x1600 GRAY frame buffers.
+ *
+ * Both run once per wake, on the frame in PSRAM. The gap between swar and
+ * loads is the arithmetic a wider SIMD path, such as the PIE of the
+ * ESP32-S3, would take over, its wider loads only help as far as the PSRAM
+ * keeps up. On the device the "Diff score" and "Thumbnail" log lines give the
+ * time of the kernels, next to a wake of seconds.
+ *
+ * Build and run from this directory:
+ *
+ *    g++ -O2 -std=c++17 -I../../components/imaging/include \
+ *        pixel_sums_bench.cpp ../../components/imaging/change_detector.cpp \
+ *        ../../components/imaging/thumbnail.cpp -o pixel_sums_bench
+ *    ./pixel_sums_bench [frame.pgm...]
+ *
+ * Add -fno-tree-vectorize to compare the kernels as the ESP32-S3 toolchain
+ * builds them, it doesn't vectorise the pixel loops on its own.
+ */
+#include "change_detector.h"
+#include "swar.h"
+#include "thumbnail.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+namespace {
+
+constexpr uint16_t RAW_WIDTH = 2560;
+constexpr uint16_t RAW_HEIGHT = 1600;
+constexpr int REPEAT = 20;
+
+struct Frame {
+  const char *path = "gradient";
+  uint16_t width = 0;
+  uint16_t height = 0;
+  std::vector<uint8_t> pixels;
+};
+
+bool load_frame(const char *path, Frame &frame) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  if (data.size() == static_cast<size_t>(RAW_WIDTH) * RAW_HEIGHT) {
+    frame.width = RAW_WIDTH;
+    frame.height = RAW_HEIGHT;
+    frame.pixels = std::move(data);
+    return true;
+  }
+  data.push_back(0); // terminates the header for sscanf
+  unsigned width = 0, height = 0, max_value = 0;
+  int header = 0;
+  if (sscanf(reinterpret_cast<const char *>(data.data()), "P5 %u %u %u%n",
+             &width, &height, &max_value, &header) != 3 ||
+      max_value > 255 ||
+      data.size() < header + 2 + static_cast<size_t>(width) * height) {
+    return false;
+  }
+  frame.width = static_cast<uint16_t>(width);
+  frame.height = static_cast<uint16_t>(height);
+  frame.pixels.assign(data.begin() + header + 1,
+                      data.begin() + header + 1 +
+                          static_cast<size_t>(width) * height);
+  return true;
+}
+
+Frame gradient_frame() {
+  Frame frame;
+  frame.width = RAW_WIDTH;
+  frame.height = RAW_HEIGHT;
+  frame.pixels.resize(static_cast<size_t>(RAW_WIDTH) * RAW_HEIGHT);
+  uint32_t seed = 1;
+  for (uint32_t y = 0; y < RAW_HEIGHT; y++) {
+    for (uint32_t x = 0; x < RAW_WIDTH; x++) {
+      seed = seed * 1103515245 + 12345;
+      frame.pixels[y * RAW_WIDTH + x] = static_cast<uint8_t>(
+          ((seed >> 16) & 63) + (x + y) * 191 / (RAW_WIDTH + RAW_HEIGHT));
+    }
+  }
+  return frame;
+}
+
+// The blocks of compute_signature(): whole words, every ROW_STEP-th row
+struct Blocks {
+  uint32_t width;
+  uint32_t height;
+};
+
+Blocks signature_blocks(const Frame &frame) {
+  return {(frame.width / ChangeDetector::SIGNATURE_WIDTH) & ~3u,
+          static_cast<uint32_t>(frame.height /
+                                ChangeDetector::SIGNATURE_HEIGHT)};
+}
+
+uint32_t signature_loads(const Frame &frame) {
+  Blocks blocks = signature_blocks(frame);
+  uint32_t total = 0;
+  for (uint32_t y = 0; y < blocks.height * ChangeDetector::SIGNATURE_HEIGHT;
+       y += ChangeDetector::ROW_STEP) {
+    const uint8_t *row = frame.pixels.data() + static_cast<size_t>(y) *
+                                                   frame.width;
+    for (uint32_t bx = 0; bx < ChangeDetector::SIGNATURE_WIDTH; bx++) {
+      const uint8_t *block = row + bx * blocks.width;
+      for (uint32_t x = 0; x < blocks.width; x += 4) {
+        total += swar::load(block + x);
+      }
+    }
+  }
+  return total;
+}
+
+void signature_reference(const Frame &frame, uint8_t *signature) {
+  Blocks blocks = signature_blocks(frame);
+  uint32_t count =
+      (blocks.height + ChangeDetector::ROW_STEP - 1) /
+      ChangeDetector::ROW_STEP * blocks.width;
+  for (uint32_t by = 0; by < ChangeDetector::SIGNATURE_HEIGHT; by++) {
+    for (uint32_t bx = 0; bx < ChangeDetector::SIGNATURE_WIDTH; bx++) {
+      uint32_t sum = 0;
+      for (uint32_t y = by * blocks.height; y < (by + 1) * blocks.height;
+           y += ChangeDetector::ROW_STEP) {
+        const uint8_t *block = frame.pixels.data() +
+                               static_cast<size_t>(y) * frame.width +
+                               bx * blocks.width;
+        for (uint32_t x = 0; x < blocks.width; x++) {
+          sum += block[x];
+        }
+      }
+      signature[by * ChangeDetector::SIGNATURE_WIDTH + bx] =
+          static_cast<uint8_t>((sum + count / 2) / count);
+    }
+  }
+}
+
+// Every word of the thumbnail boxes, the whole frame but the dropped edges
+uint32_t thumbnail_loads(const Frame &frame, uint16_t scale) {
+  uint32_t width = frame.width / scale * scale;
+  uint32_t height = frame.height / scale * scale;
+  uint32_t total = 0;
+  for (uint32_t y = 0; y < height; y++) {
+    const uint8_t *row = frame.pixels.data() + static_cast<size_t>(y) *
+                                                   frame.width;
+    for (uint32_t x = 0; x < width; x += 4) {
+      total += swar::load(row + x);
+    }
+  }
+  return total;
+}
+
+void thumbnail_reference(const Frame &frame, uint16_t scale, uint8_t *dst) {
+  uint32_t width = frame.width / scale;
+  uint32_t height = frame.height / scale;
+  uint32_t count = scale * scale;
+  for (uint32_t ty = 0; ty < height; ty++) {
+    for (uint32_t tx = 0; tx < width; tx++) {
+      uint32_t sum = 0;
+      for (uint32_t y = ty * scale; y < (ty + 1) * scale; y++) {
+        const uint8_t *box = frame.pixels.data() +
+                             static_cast<size_t>(y) * frame.width + tx * scale;
+        for (uint32_t x = 0; x < scale; x++) {
+          sum += box[x];
+        }
+      }
+      dst[ty * width + tx] = static_cast<uint8_t>((sum + count / 2) / count);
+    }
+  }
+}
+
+struct Cost {
+  double ms = 1e12;
+  double cycles = 1e12;
+};
+
+// The fastest of REPEAT runs, per frame and per pixel of the frame
+template <typename F> Cost measure(const Frame &frame, F &&kernel) {
+  Cost cost;
+  double pixels = static_cast<double>(frame.width) * frame.height;
+  for (int i = 0; i < REPEAT; i++) {
+    auto start = std::chrono::steady_clock::now();
+#ifdef HAVE_TSC
+    uint64_t start_cycles = __rdtsc();
+#endif
+    kernel();
+#ifdef HAVE_TSC
+    cost.cycles = std::min(cost.cycles, (__rdtsc() - start_cycles) / pixels);
+#endif
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    cost.ms = std::min(cost.ms, elapsed.count());
+  }
+  return cost;
+}
+
+void print_cost(const char *name, const Cost &cost) {
+#ifdef HAVE_TSC
+  printf("  %-10s %8.3f ms/frame %8.3f cycles/pixel\n", name, cost.ms,
+         cost.cycles);
+#else
+  printf("  %-10s %8.3f ms/frame\n", name, cost.ms);
+#endif
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::vector<Frame> frames;
+  for (int i = 1; i < argc; i++) {
+    Frame frame;
+    frame.path = argv[i];
+    if (load_frame(argv[i], frame)) {
+      frames.push_back(std::move(frame));
+    } else {
+      fprintf(stderr, "Skipping %s: not a PGM or raw frame\n", argv[i]);
+    }
+  }
+  if (frames.empty()) {
+    frames.push_back(gradient_frame());
+  }
+
+  bool exact = true;
+  volatile uint32_t sink = 0;
+  for (const Frame &frame : frames) {
+    printf("%s (%ux%u)\n", frame.path, frame.width, frame.height);
+
+    uint8_t reference[ChangeDetector::SIGNATURE_SIZE];
+    uint8_t signature[ChangeDetector::SIGNATURE_SIZE];
+    if (!ChangeDetector::compute_signature(frame.pixels.data(), frame.width,
+                                           frame.height, signature)) {
+      fprintf(stderr, "  Too small or too wide for a signature\n");
+      exact = false;
+      continue;
+    }
+    Cost loads = measure(frame, [&] { sink = sink + signature_loads(frame); });
+    Cost scalar = measure(frame, [&] { signature_reference(frame, reference); });
+    Cost swar = measure(frame, [&] {
+      ChangeDetector::compute_signature(frame.pixels.data(), frame.width,
+                                        frame.height, signature);
+    });
+    if (memcmp(reference, signature, sizeof(signature)) != 0) {
+      fprintf(stderr, "  The signature differs from the reference\n");
+      exact = false;
+    }
+
+    printf(" signature\n");
+    print_cost("loads", loads);
+    print_cost("reference", scalar);
+    print_cost("swar", swar);
+    printf("  swar %.2fx faster than the reference, %.2fx the loads\n",
+           scalar.ms / swar.ms, swar.ms / loads.ms);
+
+    for (uint16_t scale : {4, 8, 16}) {
+      size_t size = static_cast<size_t>(frame.width / scale) *
+                    (frame.height / scale);
+      std::vector<uint8_t> expected(size);
+      std::vector<uint8_t> thumbnail(size);
+      loads = measure(frame, [&] {
+        sink = sink + thumbnail_loads(frame, scale);
+      });
+      scalar = measure(frame, [&] {
+        thumbnail_reference(frame, scale, expected.data());
+      });
+      swar = measure(frame, [&] {
+        Thumbnail::downscale(frame.pixels.data(), frame.width, frame.height,
+                             scale, thumbnail.data(), thumbnail.size());
+      });
+      if (thumbnail != expected) {
+        fprintf(stderr, "  The thumbnail differs from the reference\n");
+        exact = false;
+      }
+
+      printf(" thumbnail, scale %u\n", scale);
+      print_cost("loads", loads);
+      print_cost("reference", scalar);
+      print_cost("swar", swar);
+      printf("  swar %.2fx faster than the reference, %.2fx the loads\n",
+             scalar.ms / swar.ms, swar.ms / loads.ms);
+    }
+  }
+  return exact ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+/*
+ * Host test and benchmark of the compiled schedule index (components/
+ * utilities, ScheduleIndex).
+ *
+ * Random schedules of overlapping windows, some sleeping and some wrapping
+ * around midnight, are compiled, and for every second of the day the index
+ * is compared with a linear scan of the windows, the way
+ * Config::set_active_config() matched them before:
+ *
+ *    - lookup() finds the sleeping window with the highest index which
+ *      contains the time, otherwise the active one, otherwise a gap
+ *    - next_transition_s() is the first second at which the scan changes
+ *      its decision, for a sleeping window the first second it doesn't sleep
+ *    - to_wake_schedule() makes the wake stub sleep exactly as long
+ *
+ * Then the lookup and the next transition of random times are timed against
+ * the linear scan for growing schedules.
+ *
+ * Build and run from this directory:
+ *
+ *    g++ -O2 -std=c++17 -Iesp_shim -I../../components/utilities/include \
+ *        schedule_index_bench.cpp ../../components/utilities/schedule_index.cpp \
+ *        ../../components/utilities/wake_schedule.cpp -o schedule_index_bench
+ *    ./schedule_index_bench
+ */
+#include "schedule_index.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// Whether the window contains the time, also if it wraps around midnight
+static bool contains(const ScheduleWindow &window, uint32_t now_s) {
+  if (window.start_s <= window.end_s) {
+    return now_s >= window.start_s && now_s <= window.end_s;
+  }
+  return now_s >= window.start_s || now_s <= window.end_s;
+}
+
+// The linear scan: the state of the time, -2 if asleep, -1 in a gap,
+// otherwise the index of the active window
+static int32_t scan(const std::vector<ScheduleWindow> &windows,
+                    uint32_t now_s) {
+  int32_t active = -1;
+  for (size_t i = 0; i < windows.size(); i++) {
+    if (contains(windows[i], now_s)) {
+      if (windows[i].period == -1) {
+        return -2;
+      }
+      active = static_cast<int32_t>(i);
+    }
+  }
+  return active;
+}
+
+// Windows of up to max_length_s, one in sleeping_one_in sleeps
+static std::vector<ScheduleWindow> random_schedule(std::mt19937 &rng,
+                                                   size_t count,
+                                                   uint32_t max_length_s,
+                                                   uint32_t sleeping_one_in) {
+  std::uniform_int_distribution<uint32_t> second(0, SECONDS_PER_DAY - 1);
+  std::uniform_int_distribution<uint32_t> length(0, max_length_s);
+  std::uniform_int_distribution<uint32_t> sleeping(1, sleeping_one_in);
+  std::uniform_int_distribution<int32_t> period(1, 120);
+  std::vector<ScheduleWindow> windows;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t start_s = second(rng);
+    uint32_t end_s = (start_s + length(rng)) % SECONDS_PER_DAY;
+    int32_t p = sleeping(rng) == 1 ? -1 : period(rng);
+    windows.push_back({.start_s = start_s, .end_s = end_s, .period = p});
+  }
+  return windows;
+}
+
+static int check(const std::vector<ScheduleWindow> &windows) {
+  ScheduleIndex index;
+  index.compile(windows);
+  WakeSchedule schedule;
+  bool stub = index.to_wake_schedule(schedule);
+
+  std::vector<int32_t> expected(SECONDS_PER_DAY);
+  for (uint32_t now_s = 0; now_s < SECONDS_PER_DAY; now_s++) {
+    expected[now_s] = scan(windows, now_s);
+  }
+
+  // The seconds until the decision changes, a day if it never does
+  std::vector<uint32_t> transition(SECONDS_PER_DAY, SECONDS_PER_DAY);
+  uint32_t change_s = SECONDS_PER_DAY;
+  for (uint32_t now_s = 0; now_s < SECONDS_PER_DAY; now_s++) {
+    if (expected[now_s] != expected[(now_s + 1) % SECONDS_PER_DAY]) {
+      change_s = now_s;
+    }
+  }
+  if (change_s < SECONDS_PER_DAY) {
+    // Backwards around the day from the last change
+    for (uint32_t step = 0; step < SECONDS_PER_DAY; step++) {
+      uint32_t now_s = (change_s + SECONDS_PER_DAY - step) % SECONDS_PER_DAY;
+      uint32_t next_s = (now_s + 1) % SECONDS_PER_DAY;
+      transition[now_s] =
+          expected[now_s] != expected[next_s] ? 1 : transition[next_s] + 1;
+    }
+  }
+
+  int failures = 0;
+  for (uint32_t now_s = 0; now_s < SECONDS_PER_DAY; now_s++) {
+    const ScheduleInterval &interval = index.lookup(now_s);
+    int32_t state = interval.period == -1 ? -2 : interval.timing;
+    uint32_t next_s = index.next_transition_s(now_s);
+    bool correct = state == expected[now_s] && next_s == transition[now_s];
+
+    if (stub) {
+      uint32_t stub_s = 0;
+      if (expected[now_s] == -2 && transition[now_s] >= MIN_STUB_SLEEP_S) {
+        stub_s = transition[now_s];
+      }
+      uint32_t sleep_s = schedule_sleep_s(schedule, now_s);
+      // A day asleep sleeps at least a day
+      correct = correct && (stub_s == SECONDS_PER_DAY ? sleep_s >= stub_s
+                                                      : sleep_s == stub_s);
+    }
+    if (!correct && failures++ < 5) {
+      printf("  %02u:%02u:%02u: state %d next %u s, expected %d %u s\n",
+             now_s / 3600, now_s / 60 % 60, now_s % 60, state, next_s,
+             expected[now_s], transition[now_s]);
+    }
+  }
+  return failures;
+}
+
+template <typename F> static double time_ns(size_t lookups, F lookup) {
+  auto start = std::chrono::steady_clock::now();
+  lookup();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+         lookups;
+}
+
+int main() {
+  std::mt19937 rng(2024);
+  int failures = 0;
+  for (size_t count : {0, 1, 2, 5, 16, 64, 256}) {
+    for (int round = 0; round < 20; round++) {
+      failures += check(random_schedule(rng, count, SECONDS_PER_DAY / 8, 8));
+    }
+  }
+  printf("random schedules against the linear scan: %s\n\n",
+         failures == 0 ? "ok" : "FAILED");
+
+  printf("%8s %10s %12s %12s %8s\n", "windows", "intervals", "scan ns",
+         "index ns", "speedup");
+  std::uniform_int_distribution<uint32_t> second(0, SECONDS_PER_DAY - 1);
+  for (size_t count : {4, 16, 64, 256, 1024, 4096}) {
+    // Short windows, so the intervals grow with the schedule
+    std::vector<ScheduleWindow> windows = random_schedule(
+        rng, count, static_cast<uint32_t>(2 * SECONDS_PER_DAY / count), 64);
+    ScheduleIndex index;
+    index.compile(windows);
+    std::vector<uint32_t> times(1 << 16);
+    for (uint32_t &t : times) {
+      t = second(rng);
+    }
+
+    volatile int64_t sink = 0;
+    double scan_ns = time_ns(times.size(), [&] {
+      for (uint32_t t : times) {
+        sink = sink + scan(windows, t);
+      }
+    });
+    double index_ns = time_ns(times.size(), [&] {
+      for (uint32_t t : times) {
+        sink = sink + index.lookup(t).timing + index.next_transition_s(t);
+      }
+    });
+    printf("%8zu %10zu %12.1f %12.1f %7.1fx\n", count,
+           index.get_intervals().size(), scan_ns, index_ns,
+           scan_ns / index_ns);
+  }
+  return failures == 0 ? 0 : 1;
+}
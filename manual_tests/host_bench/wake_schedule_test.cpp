@@ -0,0 +1,171 @@
+/*
+ * Host test of the decision of the deep sleep wake stub (components/utilities,
+ * schedule_sleep_s()).
+ *
+ * The timings of the dynamic configurations are compiled like
+ * Config::compile_schedule() does, through the ScheduleIndex, and for every
+ * second of the day the decision of the stub is compared with what the
+ * application would do after a full boot: Config::set_active_config() sends
+ * the device to sleep if a window with period -1 contains the time, also
+ * one which wraps around midnight, otherwise the application runs.
+ * The stub must
+ *
+ *    - run the application at every second the application would work
+ *    - sleep at every other second, unless the sleep is shorter than
+ *      MIN_STUB_SLEEP_S
+ *    - wake up at the first second the application would work, also past
+ *      midnight
+ *
+ * The schedules are the ones in the given config files, and a few edge
+ * cases: overlapping windows, a gap in the schedule, a window across
+ * midnight, a day asleep.
+ *
+ * Build and run from this directory:
+ *
+ *    g++ -O2 -std=c++17 -Iesp_shim -I../../components/utilities/include \
+ *        wake_schedule_test.cpp ../../components/utilities/wake_schedule.cpp \
+ *        ../../components/utilities/schedule_index.cpp -o wake_schedule_test
+ *    ./wake_schedule_test [../test_dynamic_config.json...]
+ */
+#include "schedule_index.h"
+#include "wake_schedule.h"
+#include <cstdio>
+#include <fstream>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Timing {
+  int period;
+  const char *start;
+  const char *end;
+};
+
+static uint32_t parse_time(const std::string &time) {
+  int hours = 0, minutes = 0, seconds = 0;
+  sscanf(time.c_str(), "%d:%d:%d", &hours, &minutes, &seconds);
+  return hours * 3600 + minutes * 60 + seconds;
+}
+
+static void add_window(std::vector<ScheduleWindow> &windows, int period,
+                       const std::string &start, const std::string &end) {
+  windows.push_back(
+      {.start_s = parse_time(start), .end_s = parse_time(end), .period = period});
+}
+
+static std::vector<ScheduleWindow> compile(const std::vector<Timing> &timings) {
+  std::vector<ScheduleWindow> windows;
+  for (const Timing &timing : timings) {
+    add_window(windows, timing.period, timing.start, timing.end);
+  }
+  return windows;
+}
+
+// The timing objects of the config, in the order of the file
+static bool load(const char *path, std::vector<ScheduleWindow> &windows) {
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  std::string json = buffer.str();
+
+  std::regex timing_regex(
+      R"re(\{\s*"period"\s*:\s*(-?\d+)\s*,\s*"start"\s*:\s*"([\d:]+)"\s*,)re"
+      R"re(\s*"end"\s*:\s*"([\d:]+)"\s*\})re");
+  windows.clear();
+  for (auto it = std::sregex_iterator(json.begin(), json.end(), timing_regex);
+       it != std::sregex_iterator(); ++it) {
+    add_window(windows, std::stoi((*it)[1]), (*it)[2], (*it)[3]);
+  }
+  return !windows.empty();
+}
+
+// Config::set_active_config() after a full boot
+static bool app_sleeps(const std::vector<ScheduleWindow> &windows,
+                       uint32_t now_s) {
+  for (const ScheduleWindow &window : windows) {
+    bool contains = window.start_s <= window.end_s
+                        ? now_s >= window.start_s && now_s <= window.end_s
+                        : now_s >= window.start_s || now_s <= window.end_s;
+    if (contains && window.period == -1) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int check(const char *name, const std::vector<ScheduleWindow> &windows) {
+  ScheduleIndex index;
+  index.compile(windows);
+  WakeSchedule schedule;
+  if (!index.to_wake_schedule(schedule)) {
+    printf("%-28s too many sleeping intervals for the stub\n", name);
+    return 1;
+  }
+
+  int failures = 0;
+  uint32_t stub_sleeps = 0;
+  for (uint32_t now_s = 0; now_s < SECONDS_PER_DAY; now_s++) {
+    uint32_t expected = 0;
+    if (app_sleeps(windows, now_s)) {
+      // The first working second, a day asleep sleeps at least a day
+      uint32_t wait_s = 1;
+      while (wait_s <= SECONDS_PER_DAY &&
+             app_sleeps(windows, (now_s + wait_s) % SECONDS_PER_DAY)) {
+        wait_s++;
+      }
+      expected = wait_s >= MIN_STUB_SLEEP_S ? wait_s : 0;
+    }
+
+    uint32_t sleep_s = schedule_sleep_s(schedule, now_s);
+    bool correct = expected > SECONDS_PER_DAY ? sleep_s >= SECONDS_PER_DAY
+                                              : sleep_s == expected;
+    if (!correct && failures++ < 5) {
+      printf("  %s %02u:%02u:%02u: slept %u s, expected %u s\n", name,
+             now_s / 3600, now_s / 60 % 60, now_s % 60, sleep_s, expected);
+    }
+    stub_sleeps += sleep_s > 0;
+  }
+  printf("%-28s %2zu windows, stub sleeps at %5u s of the day: %s\n", name,
+         windows.size(), stub_sleeps, failures == 0 ? "ok" : "FAILED");
+  return failures;
+}
+
+int main(int argc, char **argv) {
+  int failures = 0;
+  std::vector<const char *> paths(argv + 1, argv + argc);
+  if (paths.empty()) {
+    paths.push_back("../test_dynamic_config.json");
+  }
+  for (const char *path : paths) {
+    std::vector<ScheduleWindow> windows;
+    if (!load(path, windows)) {
+      printf("%s: no timings found\n", path);
+      return 1;
+    }
+    failures += check(path, windows);
+  }
+
+  failures += check("overlapping windows",
+                    compile({{30, "06:00:00", "08:00:00"},
+                             {-1, "07:00:00", "09:00:00"},
+                             {-1, "08:30:00", "10:00:00"},
+                             {40, "10:00:00", "23:59:59"}}));
+  failures += check("gap in the schedule",
+                    compile({{-1, "00:00:00", "05:00:00"},
+                             {-1, "05:00:02", "06:00:00"},
+                             {30, "08:00:00", "20:00:00"}}));
+  failures += check("a second awake",
+                    compile({{-1, "00:00:00", "11:59:58"},
+                             {-1, "12:00:00", "23:59:59"}}));
+  failures += check("across midnight",
+                    compile({{-1, "22:00:00", "05:59:59"},
+                             {30, "06:00:00", "21:59:59"}}));
+  failures += check("a day asleep", compile({{-1, "00:00:00", "23:59:59"}}));
+  failures += check("no schedule", compile({}));
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+import collections
+import logging
+import zlib
+
+
+def chunk_properties(msg):
+    """Returns the (chunk index, chunk count) user properties of an MQTT5
+    message, or None if the message is not a chunk."""
+    properties = getattr(msg, 'properties', None)
+    user_properties = dict(getattr(properties, 'UserProperty', []) or [])
+    if 'chunk' not in user_properties or 'chunks' not in user_properties:
+        return None
+    return int(user_properties['chunk']), int(user_properties['chunks'])
+
+
+def chunk_crc(msg):
+    """Returns the CRC-32 of the chunk payload sent in the "crc" user
+    property, or None if the chunk has none."""
+    properties = getattr(msg, 'properties', None)
+    user_properties = dict(getattr(properties, 'UserProperty', []) or [])
+    if 'crc' not in user_properties:
+        return None
+    return int(user_properties['crc'], 16)
+
+
+def chunk_key(msg):
+    """Returns the dedupe key of the chunk sent in the "image" user property,
+    or None if the chunk has none."""
+    properties = getattr(msg, 'properties', None)
+    user_properties = dict(getattr(properties, 'UserProperty', []) or [])
+    return user_properties.get('image')
+
+
+def chunk_intact(payload, crc):
+    """Whether the chunk payload matches its CRC, a chunk without a CRC is
+    taken as intact."""
+    return crc is None or zlib.crc32(payload) == crc
+
+
+def header_properties(msg):
+    """Returns the image header carried by the user properties of the first
+    chunk of a one-shot upload, or None if the chunk has no header. Numeric
+    values are converted to int, like in the JSON header."""
+    properties = getattr(msg, 'properties', None)
+    user_properties = dict(getattr(properties, 'UserProperty', []) or [])
+    if 'timestamp' not in user_properties:
+        return None
+    header = {}
+    for key, value in user_properties.items():
+        if key in ('chunk', 'chunks', 'crc', 'image'):
+            continue
+        header[key] = int(value) if value.lstrip('-').isdigit() else value
+    return header
+
+
+class ImageReassembler:
+    """Collects the chunks published by MQTT::publish_chunked() and rebuilds
+    the original buffer once every chunk arrived."""
+
+    def __init__(self, expected_size=None):
+        self.reset(expected_size)
+
+    def reset(self, expected_size=None):
+        self.expected_size = expected_size
+        self._chunks = {}
+        self._count = None
+        self._received_bytes = 0
+
+    @property
+    def received_bytes(self):
+        return self._received_bytes
+
+    @property
+    def contiguous(self):
+        """The number of leading chunks held, the sender resumes after
+        them."""
+        held = 0
+        while held in self._chunks:
+            held += 1
+        return held
+
+    def add(self, index, count, payload, crc=None):
+        """Stores one chunk. Returns the reassembled buffer when the last
+        missing chunk arrives, otherwise None. A chunk which doesn't match
+        its CRC is dropped, so it is sent again when the upload resumes."""
+        if not chunk_intact(payload, crc):
+            logging.warning(f"Chunk {index}/{count} failed its CRC, dropped")
+            return None
+        if self._count is None:
+            self._count = count
+        elif count != self._count:
+            logging.warning(
+                f"Chunk count changed from {self._count} to {count}, "
+                "dropping the partial image")
+            self.reset(self.expected_size)
+            self._count = count
+
+        if index >= count:
+            logging.error(f"Invalid chunk index {index}/{count}")
+            return None
+        if index in self._chunks:
+            logging.debug(f"Duplicate chunk {index}/{count} ignored")
+            return None
+
+        self._chunks[index] = bytes(payload)
+        self._received_bytes += len(payload)
+        if len(self._chunks) < self._count:
+            return None
+
+        image = b''.join(self._chunks[i] for i in range(self._count))
+        if self.expected_size is not None and len(image) != self.expected_size:
+            logging.error(
+                f"Reassembled {len(image)} bytes, expected {self.expected_size}")
+        self.reset()
+        return image
+
+
+class ChunkDeduper:
+    """Drops the chunks which QoS 1 delivered more than once. A chunk is
+    identified by its dedupe key and its index, the keys of the last
+    `history` chunked messages are remembered."""
+
+    def __init__(self, history=16):
+        self._history = history
+        self._seen = collections.OrderedDict()
+        self.duplicates = 0
+
+    def seen(self, key, index):
+        """Whether the chunk was remembered already, it is counted as a
+        duplicate then."""
+        if index in self._seen.get(key, ()):
+            self.duplicates += 1
+            return True
+        return False
+
+    def remember(self, key, index):
+        """Remembers a chunk which was taken. A corrupt or stray chunk isn't
+        remembered, so its resent copy isn't taken for a duplicate."""
+        if key is None:
+            return
+        indexes = self._seen.get(key)
+        if indexes is None:
+            indexes = self._seen[key] = set()
+            if len(self._seen) > self._history:
+                self._seen.popitem(last=False)
+        else:
+            self._seen.move_to_end(key)
+        indexes.add(index)
@@ -0,0 +1,102 @@
+"""Decoder of the health report, image header and battery current messages of
+the camera (main/src/camera_app.cpp, CameraApp::send_message). A message is
+JSON, or a version byte followed by MessagePack when the messageFormat of the
+static configuration is MSGPACK. Usage: doc = decode(payload)"""
+
+import json
+import struct
+
+MSGPACK_VERSION = 1
+
+
+class _Reader:
+    def __init__(self, data):
+        self._data = data
+        self._pos = 0
+
+    def take(self, size):
+        if self._pos + size > len(self._data):
+            raise ValueError("MessagePack data is truncated")
+        chunk = self._data[self._pos:self._pos + size]
+        self._pos += size
+        return chunk
+
+    def unpack(self, fmt):
+        return struct.unpack('>' + fmt, self.take(struct.calcsize(fmt)))[0]
+
+    def at_end(self):
+        return self._pos == len(self._data)
+
+
+def _read_value(reader):
+    tag = reader.take(1)[0]
+    if tag <= 0x7f:
+        return tag
+    if tag >= 0xe0:
+        return tag - 0x100
+    if 0x80 <= tag <= 0x8f:
+        return _read_map(reader, tag & 0x0f)
+    if 0x90 <= tag <= 0x9f:
+        return _read_array(reader, tag & 0x0f)
+    if 0xa0 <= tag <= 0xbf:
+        return reader.take(tag & 0x1f).decode('utf-8')
+
+    if tag == 0xc0:
+        return None
+    if tag == 0xc2:
+        return False
+    if tag == 0xc3:
+        return True
+    if tag in (0xc4, 0xc5, 0xc6):
+        return bytes(reader.take(reader.unpack('BHI'[tag - 0xc4])))
+    if tag == 0xca:
+        return reader.unpack('f')
+    if tag == 0xcb:
+        return reader.unpack('d')
+    if 0xcc <= tag <= 0xcf:
+        return reader.unpack('BHIQ'[tag - 0xcc])
+    if 0xd0 <= tag <= 0xd3:
+        return reader.unpack('bhiq'[tag - 0xd0])
+    if tag in (0xd9, 0xda, 0xdb):
+        size = reader.unpack('BHI'[tag - 0xd9])
+        return reader.take(size).decode('utf-8')
+    if tag in (0xdc, 0xdd):
+        return _read_array(reader, reader.unpack('HI'[tag - 0xdc]))
+    if tag in (0xde, 0xdf):
+        return _read_map(reader, reader.unpack('HI'[tag - 0xde]))
+    raise ValueError(f"Unsupported MessagePack type 0x{tag:02x}")
+
+
+def _read_array(reader, count):
+    return [_read_value(reader) for _ in range(count)]
+
+
+def _read_map(reader, count):
+    doc = {}
+    for _ in range(count):
+        key = _read_value(reader)
+        doc[key] = _read_value(reader)
+    return doc
+
+
+def decode_msgpack(data):
+    """Decodes a MessagePack message after its version byte."""
+    reader = _Reader(data)
+    doc = _read_value(reader)
+    if not isinstance(doc, dict) or not reader.at_end():
+        raise ValueError("Message is not a single MessagePack map")
+    return doc
+
+
+def decode(payload):
+    """Decodes a message in either format, raises ValueError if the payload
+    is neither, e.g. image data."""
+    if payload[:1] == bytes([MSGPACK_VERSION]):
+        return decode_msgpack(payload[1:])
+    try:
+        doc = json.loads(payload.decode('utf-8').strip())
+    except (UnicodeDecodeError, json.JSONDecodeError) as e:
+        raise ValueError(f"Message is neither JSON nor MessagePack: {e}")
+    if not isinstance(doc, dict):
+        raise ValueError("Message is not a JSON object")
+    return doc
@@ -1,8 +1,13 @@
 # python 3.11
 from paho.mqtt import client as mqtt_client
 import logging
-import json
+import message_codec
 from PIL import Image
+from image_reassembler import (ChunkDeduper, ImageReassembler, chunk_crc,
+                               chunk_intact, chunk_key, chunk_properties,
+                               header_properties)
+import gray_codec
+import tile_delta
 
 broker = "192.168.0.232"
 port = 1883
@@ -16,6 +21,26 @@ logging.basicConfig(level=logging.DEBUG,
 # Global variables to track state
 expecting_image = False
 last_timestamp = None
+last_codec = "raw"
+last_header = {}
+reassembler = ImageReassembler()
+# The chunks are published at QoS 1, a redelivered chunk is dropped by its
+# key and index
+deduper = ChunkDeduper()
+# The chunks of interrupted uploads by timestamp, kept until the camera
+# resumes them
+unfinished = {}
+MAX_UNFINISHED = 8
+# The last keyframe received in full, delta frames are applied to it
+held_keyframe_id = 0
+held_keyframe = None
+# The part of a progressive upload which is expected next: "thumbnail",
+# "full", "roi", or None for a plain upload
+expected_part = None
+# Answer to a progressive thumbnail: "full", "skip" or "roi:x,y,w,h"
+progressive_request = "full"
+# The header came with the first chunk, the ack follows the image
+one_shot = False
 
 
 def connect_mqtt() -> mqtt_client.Client:
@@ -25,56 +50,237 @@ def connect_mqtt() -> mqtt_client.Client:
         else:
             logging.error(f"Failed to connect, return code {rc}")
 
-    client = mqtt_client.Client(mqtt_client.CallbackAPIVersion.VERSION2)
+    # MQTT5 is needed for the chunk user properties
+    client = mqtt_client.Client(mqtt_client.CallbackAPIVersion.VERSION2,
+                                protocol=mqtt_client.MQTTv5)
     client.enable_logger()
     client.on_connect = on_connect
     client.connect(broker, port)
     return client
 
 
+def reset_state():
+    global expecting_image, last_timestamp, last_codec, last_header
+    global expected_part, one_shot
+    expecting_image = False
+    last_timestamp = None
+    last_codec = "raw"
+    last_header = {}
+    expected_part = None
+    one_shot = False
+
+
+def expected_key():
+    """The dedupe key of the expected chunks, the thumbnail and the region
+    of a progressive upload have keys of their own."""
+    if expected_part in ("thumbnail", "roi"):
+        return f"{last_timestamp}/{expected_part}"
+    return last_timestamp
+
+
+def start_image(timestamp, header):
+    """Starts collecting the image of the header, or resumes the interrupted
+    upload of the same image. Returns the number of leading chunks held, the
+    camera sends the image from there."""
+    global reassembler
+    if expecting_image and last_timestamp == timestamp:
+        held = (last_header, reassembler)
+    else:
+        if expecting_image and reassembler.contiguous > 0:
+            unfinished[last_timestamp] = (last_header, reassembler)
+            if len(unfinished) > MAX_UNFINISHED:
+                unfinished.pop(next(iter(unfinished)))
+        held = unfinished.pop(timestamp, None)
+
+    # The chunks only fit the same encoding of the same frame
+    if held is not None and all(held[0].get(key) == header.get(key)
+                                for key in ('size', 'codec')):
+        reassembler = held[1]
+        logging.info(
+            f"Resuming {timestamp} after {reassembler.contiguous} chunks")
+    else:
+        reassembler = ImageReassembler(header['size'])
+    return reassembler.contiguous
+
+
+def start_one_shot(header):
+    global expecting_image, last_timestamp, last_codec, last_header
+    global expected_part, one_shot
+    start_image(header['timestamp'][:20], header)
+    last_timestamp = header['timestamp'][:20]
+    last_header = header
+    last_codec = header.get('codec', 'raw')
+    expected_part = None
+    expecting_image = True
+    one_shot = True
+    logging.info(
+        f"Received one-shot header: Timestamp={last_timestamp}, "
+        f"Size={header['size']}")
+
+
+def choose_request(thumbnail, width, height):
+    """Decides what to fetch after the thumbnail, a classifier goes here."""
+    return progressive_request
+
+
+def process_thumbnail(client, payload):
+    global expecting_image
+    if last_codec == gray_codec.NAME:
+        width, height, payload = gray_codec.decode(payload)
+    else:
+        width = last_header['thumbnail']['width']
+        height = last_header['thumbnail']['height']
+    thumbnail = Image.frombytes("L", (width, height), payload)
+    request = choose_request(thumbnail, width, height)
+    # The ack of a progressive header is sent after the thumbnail, with the
+    # part of the image to send
+    ack = f"{last_timestamp};keyframe={held_keyframe_id};request={request}"
+    client.publish(ack_topic, ack, qos=2)
+    logging.info(f"Received {width}x{height} thumbnail, sent ACK: {ack}")
+    if request == "skip":
+        reset_state()
+    else:
+        # The part header of the requested part comes next
+        expecting_image = False
+
+
+def process_region(payload):
+    x, y, width, height = last_header['roi']
+    if last_codec == gray_codec.NAME:
+        width, height, payload = gray_codec.decode(payload)
+    region = Image.frombytes("L", (width, height), payload)
+    logging.info(f"Region {x},{y} {width}x{height} decoded successfully")
+    # region.save(f"images/region_{x}_{y}.jpg")
+
+
+def process_image(client, payload):
+    global held_keyframe_id, held_keyframe
+    if expected_part == "thumbnail":
+        try:
+            process_thumbnail(client, payload)
+        except Exception as e:
+            logging.error(f"Failed to process thumbnail: {e}")
+            reset_state()
+        return
+    try:
+        if expected_part == "roi":
+            process_region(payload)
+            return
+
+        if not last_timestamp:
+            logging.error("Image received but no timestamp available")
+            return
+        safe_timestamp = last_timestamp.replace(
+            ":", "-").replace("T", "_")
+        output_path = f"images/image_{safe_timestamp}.jpg"
+
+        width = last_header.get('width', 2560)
+        height = last_header.get('height', 1600)
+        if last_codec == tile_delta.NAME:
+            if held_keyframe is None:
+                raise ValueError("Delta frame received without a keyframe")
+            keyframe_id, payload = tile_delta.apply(
+                payload, held_keyframe, width, height)
+            if keyframe_id != held_keyframe_id:
+                raise ValueError(f"Delta frame of unknown keyframe {keyframe_id}")
+            logging.info(
+                f"Applied {last_header.get('tiles')} tiles to keyframe {keyframe_id}")
+        elif last_codec == gray_codec.NAME:
+            width, height, payload = gray_codec.decode(payload)
+            logging.info(f"Decompressed image to {len(payload)} bytes")
+        image = Image.frombytes("L", (width, height), payload)
+        if last_header.get('frame') == 'key':
+            held_keyframe_id = last_header['keyframe']
+            held_keyframe = payload
+            logging.info(f"Holding keyframe {held_keyframe_id}")
+        logging.info("Image decoded successfully")
+        # image.save(output_path)
+        # logging.info(f"Saved image to {output_path}")
+    except Exception as e:
+        logging.error(f"Failed to process image: {e}")
+    finally:
+        reset_state()
+
+
 def subscribe(client: mqtt_client.Client):
     def on_message(client, userdata, msg):
-        global expecting_image, last_timestamp
+        global expecting_image, last_timestamp, last_codec, last_header
+        global expected_part
+        chunk = chunk_properties(msg)
+        if chunk is not None:
+            index, count = chunk
+            key = chunk_key(msg)
+            if deduper.seen(key, index):
+                logging.debug(f"Duplicate chunk {index}/{count} of {key}")
+                return
+            if not chunk_intact(msg.payload, chunk_crc(msg)):
+                logging.warning(f"Chunk {index}/{count} failed its CRC, dropped")
+                return
+            header = header_properties(msg) if index == 0 else None
+            if header is not None:
+                start_one_shot(header)
+            if not expecting_image:
+                logging.warning("Unexpected chunk: Not expecting image data")
+                return
+            if key is not None and key != expected_key():
+                logging.warning(
+                    f"Chunk {index}/{count} of {key} dropped, expected "
+                    f"{expected_key()}")
+                return
+            deduper.remember(key, index)
+            image_data = reassembler.add(index, count, msg.payload)
+            if image_data is not None:
+                logging.info(
+                    f"Reassembled {len(image_data)} bytes from {count} chunks")
+                timestamp, acked = last_timestamp, one_shot
+                process_image(client, image_data)
+                if acked:
+                    # Tells the camera whether the keyframe is held now
+                    ack = f"{timestamp};keyframe={held_keyframe_id}"
+                    client.publish(ack_topic, ack, qos=2)
+                    logging.info(f"Sent ACK: {ack}")
+            return
+
         try:
-            # Attempt to decode JSON metadata
-            payload = msg.payload.decode('utf-8').strip()
-            doc = json.loads(payload)
+            # Attempt to decode the JSON or MessagePack metadata
+            doc = message_codec.decode(msg.payload)
             if 'timestamp' in doc and 'size' in doc:
                 timestamp = doc['timestamp'][:20]
                 logging.info(
                     f"Received metadata: Timestamp={timestamp}, Size={doc['size']}")
-                client.publish(ack_topic, timestamp, qos=2)
-                logging.info(f"Sent ACK for timestamp: {timestamp}")
+                held = start_image(timestamp, doc)
+                if 'part' in doc:
+                    # The requested part of a progressive upload, not acked
+                    expected_part = doc['part']
+                    last_header = {**last_header, **doc}
+                elif doc.get('progressive'):
+                    # Acked after the thumbnail
+                    expected_part = "thumbnail"
+                    last_header = doc
+                else:
+                    # The ack tells the camera which keyframe deltas can
+                    # refer to, and where an interrupted upload resumes
+                    ack = (f"{timestamp};keyframe={held_keyframe_id};"
+                           f"chunks={held}")
+                    client.publish(ack_topic, ack, qos=2)
+                    logging.info(f"Sent ACK: {ack}")
+                    expected_part = None
+                    last_header = doc
 
                 expecting_image = True
                 last_timestamp = timestamp
+                last_codec = doc.get('codec', 'raw')
                 return
-        except (UnicodeDecodeError, json.JSONDecodeError):
-            pass  # Not a JSON message
+        except ValueError:
+            pass  # Not a metadata message
 
         if expecting_image:
-            try:
-                if not last_timestamp:
-                    logging.error("Image received but no timestamp available")
-                    return
-                safe_timestamp = last_timestamp.replace(
-                    ":", "-").replace("T", "_")
-                output_path = f"images/image_{safe_timestamp}.jpg"
-
-                image = Image.frombytes("L", (2560, 1600), msg.payload)
-                logging.info("Image decoded successfully")
-                # image.save(output_path)
-                # logging.info(f"Saved image to {output_path}")
-                expecting_image = False
-                last_timestamp = None
-            except Exception as e:
-                logging.error(f"Failed to process image: {e}")
-                expecting_image = False
-                last_timestamp = None
+            process_image(client, msg.payload)
         else:
             logging.warning("Unexpected message: Not expecting image data")
 
-    client.subscribe(topic)
+    # The headers stay exactly-once, the chunks arrive at their QoS 1
+    client.subscribe(topic, qos=2)
     client.on_message = on_message
 
 
@@ -1,4 +1,5 @@
 import json
+import message_codec
 from paho.mqtt import client as mqtt_client
 import logging
 import os
@@ -18,6 +19,14 @@ logging.basicConfig(level=logging.DEBUG,
                     handlers=[logging.StreamHandler()])
 
 
+def config_hash(message):
+    """32-bit FNV-1a of the config message, like Config::hash()."""
+    value = 2166136261
+    for byte in message.encode('utf-8'):
+        value = ((value ^ byte) * 16777619) & 0xffffffff
+    return f"{value:08x}"
+
+
 def connect_mqtt():
     def on_connect(client, userdata, flags, rc, properties=None):
         if rc == 0:
@@ -35,8 +44,7 @@ def subscribe(client):
     def on_message(client, userdata, msg):
         try:
             # Decode message and load new config
-            health_report = msg.payload.decode()
-            old_config = json.loads(health_report)
+            old_config = message_codec.decode(msg.payload)
             with open(config_path, 'r') as file:
                 new_config = json.load(file)
 
@@ -45,14 +53,22 @@ def subscribe(client):
                 file.write(
                     f"{old_config['timestamp']}, {old_config['batteryCharge']}, {old_config['chargeCurrent']}, {old_config['uptime']}, ")
 
-            # Compare old and new config
-            if old_config['configId'] == new_config['configId']:
-                message = json.dumps("config-ok")
+            # Compare old and new config, by the hash of the config message
+            # if the camera reports it
+            message = json.dumps(new_config)
+            if 'configHash' in old_config:
+                unchanged = old_config['configHash'] == config_hash(message)
             else:
-                message = json.dumps(new_config)
+                unchanged = old_config['configId'] == new_config['configId']
+            # A retained config is read by the camera after the next
+            # subscription, without waiting for this answer
+            retain = bool(new_config.get('retainedConfig')) and not unchanged
+            if unchanged:
+                message = json.dumps("config-ok")
 
             # Publish new config or config-ok
-            result = client.publish(config_topic, message, qos=2)
+            result = client.publish(config_topic, message, qos=2,
+                                    retain=retain)
             status = result[0]
             if status == 0:
                 logging.info(f"Sent message: {message}")
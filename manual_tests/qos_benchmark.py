@@ -0,0 +1,205 @@
+"""Throughput of the chunked image upload at QoS 1 and QoS 2 on a lossy link.
+
+Simulates MQTT::publish_chunked() against a broker stand-in which behaves
+like mosquitto for one publisher: it forwards every PUBLISH it receives at
+QoS 1, and a QoS 2 message only once. The device and the broker talk over
+one TCP connection, modelled as an in-order link per direction with a
+bandwidth, a one-way latency and a packet loss rate. A lost packet is
+delivered after the TCP retransmission timeout, and holds up the packets
+behind it. Like esp-mqtt, the publisher sends an unacknowledged message
+again after the retransmit timeout, with the DUP flag.
+
+The subscriber drops the chunks which arrive twice with the ChunkDeduper
+which mqtt_sub.py uses, and the reassembled frame is checked against the sent
+one.
+
+    python qos_benchmark.py
+    python qos_benchmark.py --loss 0 0.02 0.1 --window 2 4 --runs 5
+"""
+import argparse
+import heapq
+import os
+import random
+import statistics
+
+from image_reassembler import ChunkDeduper, ImageReassembler
+
+FRAME_SIZE = 2560 * 1600
+IMAGE_CHUNK_SIZE = 32 * 1024  # mqtt.h
+MAX_CHUNKS_IN_FLIGHT = 2  # mqtt.h
+HEADER_SIZE = 80  # fixed header, topic, packet id and user properties
+ACK_SIZE = 4  # PUBACK, PUBREC, PUBREL and PUBCOMP
+
+
+class Link:
+    """One direction of the TCP connection, the packets arrive in order."""
+
+    def __init__(self, rng, bandwidth, latency, loss, rto):
+        self.rng = rng
+        self.bandwidth = bandwidth
+        self.latency = latency
+        self.loss = loss
+        self.rto = rto
+        self.busy_until = 0.0
+        self.last_arrival = 0.0
+
+    def send(self, now, size):
+        """Returns the arrival time of a packet of the given size."""
+        self.busy_until = max(self.busy_until, now) + size / self.bandwidth
+        arrival = self.busy_until + self.latency
+        while self.rng.random() < self.loss:
+            arrival += self.rto
+        self.last_arrival = max(self.last_arrival, arrival)
+        return self.last_arrival
+
+
+class Simulation:
+    def __init__(self, frame, qos, window, args, seed):
+        self.frame = frame
+        self.qos = qos
+        self.window = window
+        self.retransmit = args.retransmit
+        rng = random.Random(seed)
+        self.uplink = Link(rng, args.bandwidth, args.latency, args.loss_rate,
+                           args.rto)
+        self.downlink = Link(rng, args.bandwidth, args.latency, args.loss_rate,
+                             args.rto)
+        self.events = []
+        self.sequence = 0
+        self.count = (len(frame) + IMAGE_CHUNK_SIZE - 1) // IMAGE_CHUNK_SIZE
+        self.next_chunk = 0
+        self.pending = {}  # chunk -> "publish" or "pubrel", unacknowledged
+        self.sent_at = {}
+        self.broker_qos2 = set()  # packet ids the broker forwarded already
+        self.retransmissions = 0
+        self.deduper = ChunkDeduper()
+        self.reassembler = ImageReassembler(len(frame))
+        self.image = None
+
+    def schedule(self, time, action, *args):
+        heapq.heappush(self.events, (time, self.sequence, action, args))
+        self.sequence += 1
+
+    def run(self):
+        for _ in range(self.window):
+            self.publish_next(0.0)
+        now = 0.0
+        while self.events and self.image is None:
+            now, _, action, args = heapq.heappop(self.events)
+            action(now, *args)
+        return now
+
+    # ----------------------------- device ------------------------------ #
+
+    def publish_next(self, now):
+        if self.next_chunk < self.count:
+            self.send_publish(now, self.next_chunk)
+            self.next_chunk += 1
+
+    def send_publish(self, now, chunk):
+        offset = chunk * IMAGE_CHUNK_SIZE
+        size = min(IMAGE_CHUNK_SIZE, len(self.frame) - offset)
+        self.pending[chunk] = "publish"
+        self.sent_at[chunk] = now
+        arrival = self.uplink.send(now, HEADER_SIZE + size)
+        self.schedule(arrival, self.broker_publish, chunk)
+        self.schedule(now + self.retransmit, self.check_retransmit, chunk, now)
+
+    def send_pubrel(self, now, chunk):
+        self.pending[chunk] = "pubrel"
+        self.sent_at[chunk] = now
+        self.schedule(self.uplink.send(now, ACK_SIZE), self.broker_pubrel,
+                      chunk)
+        self.schedule(now + self.retransmit, self.check_retransmit, chunk, now)
+
+    def check_retransmit(self, now, chunk, sent_at):
+        if chunk not in self.pending or self.sent_at[chunk] != sent_at:
+            return
+        self.retransmissions += 1
+        if self.pending[chunk] == "publish":
+            self.send_publish(now, chunk)
+        else:
+            self.send_pubrel(now, chunk)
+
+    def device_ack(self, now, chunk, packet):
+        state = self.pending.get(chunk)
+        if packet == "pubrec" and state == "publish":
+            self.send_pubrel(now, chunk)
+        elif packet in ("puback", "pubcomp") and state is not None:
+            del self.pending[chunk]
+            self.publish_next(now)
+
+    # ----------------------------- broker ------------------------------ #
+
+    def broker_publish(self, now, chunk):
+        if self.qos == 1:
+            self.deliver(chunk)
+            ack = "puback"
+        else:
+            if chunk not in self.broker_qos2:
+                self.broker_qos2.add(chunk)
+                self.deliver(chunk)
+            ack = "pubrec"
+        self.schedule(self.downlink.send(now, ACK_SIZE), self.device_ack,
+                      chunk, ack)
+
+    def broker_pubrel(self, now, chunk):
+        self.broker_qos2.discard(chunk)
+        self.schedule(self.downlink.send(now, ACK_SIZE), self.device_ack,
+                      chunk, "pubcomp")
+
+    # --------------------------- subscriber ---------------------------- #
+
+    def deliver(self, chunk):
+        offset = chunk * IMAGE_CHUNK_SIZE
+        payload = self.frame[offset:offset + IMAGE_CHUNK_SIZE]
+        if self.deduper.seen("frame", chunk):
+            return
+        self.deduper.remember("frame", chunk)
+        image = self.reassembler.add(chunk, self.count, payload)
+        if image is not None:
+            self.image = image
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--loss', type=float, nargs='+',
+                        default=[0, 0.01, 0.05, 0.2],
+                        help='packet loss rates of the link')
+    parser.add_argument('--window', type=int, nargs='+',
+                        default=[MAX_CHUNKS_IN_FLIGHT],
+                        help='chunks in flight')
+    parser.add_argument('--bandwidth', type=float, default=1.5e6,
+                        help='bytes per second of the link')
+    parser.add_argument('--latency', type=float, default=0.01,
+                        help='one-way latency in seconds')
+    parser.add_argument('--rto', type=float, default=0.25,
+                        help='TCP retransmission timeout in seconds')
+    parser.add_argument('--retransmit', type=float, default=1.0,
+                        help='MQTT retransmit timeout of esp-mqtt in seconds')
+    parser.add_argument('--runs', type=int, default=3)
+    args = parser.parse_args()
+
+    frame = os.urandom(FRAME_SIZE)
+    print(f"{'loss':>6} {'window':>6} {'QoS':>4} {'MB/s':>8} {'resent':>7} "
+          f"{'duplicates':>11}")
+    for loss in args.loss:
+        args.loss_rate = loss
+        for window in args.window:
+            for qos in (2, 1):
+                rates, resent, duplicates = [], [], []
+                for run in range(args.runs):
+                    sim = Simulation(frame, qos, window, args, seed=run)
+                    elapsed = sim.run()
+                    assert sim.image == frame, "Reassembled image differs"
+                    rates.append(len(frame) / elapsed / 1e6)
+                    resent.append(sim.retransmissions)
+                    duplicates.append(sim.deduper.duplicates)
+                print(f"{loss:>6.2f} {window:>6} {qos:>4} "
+                      f"{statistics.median(rates):>8.2f} "
+                      f"{statistics.median(resent):>7.0f} "
+                      f"{statistics.median(duplicates):>11.0f}")
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,115 @@
+"""Connect-to-first-publish latency with and without a resumed MQTT5 session.
+
+Every round does what the camera does after waking up: connects, subscribes
+to the acknowledgement and config topics unless the broker resumed the
+session, and publishes a health report at QoS 2. The time from the connect
+until the broker completed the publish is measured, then the client
+disconnects like before deep sleep.
+
+"clean" connects with clean start, like the camera used to. "resumed"
+connects with a stable client id, without clean start and with a session
+expiry interval (mqtt.h, SESSION_EXPIRY_S), its first round creates the
+session and is not counted.
+
+    python session_benchmark.py --broker 127.0.0.1
+    python session_benchmark.py --broker 192.168.0.232 --rounds 50 --sleep 1
+"""
+import argparse
+import statistics
+import threading
+import time
+
+from paho.mqtt import client as mqtt_client
+from paho.mqtt.packettypes import PacketTypes
+from paho.mqtt.properties import Properties
+
+SESSION_EXPIRY_S = 24 * 60 * 60  # mqtt.h
+QOS = 2
+HEALTH_REPORT = (b'{"timestamp":"2025-02-26T10:05:11Z",'
+                 b'"configId":"8D8AC610-566D-4EF0-9C22-186B2A5ED793",'
+                 b'"period":40,"batteryCharge":90,"batteryTemp":25,'
+                 b'"cpuTemp":30,"luminosity":3000,"chargeCurrent":400,'
+                 b'"skipped":false,"uptime":3150}')
+
+
+def run_round(args, client_id, resume):
+    connected = threading.Event()
+    subscribed = threading.Event()
+    state = {}
+
+    def on_connect(client, userdata, flags, reason_code, properties):
+        state['session_present'] = bool(flags.session_present)
+        state['reason_code'] = reason_code
+        connected.set()
+
+    def on_subscribe(client, userdata, mid, reason_codes, properties):
+        subscribed.set()
+
+    client = mqtt_client.Client(mqtt_client.CallbackAPIVersion.VERSION2,
+                                client_id=client_id,
+                                protocol=mqtt_client.MQTTv5)
+    client.on_connect = on_connect
+    client.on_subscribe = on_subscribe
+    properties = Properties(PacketTypes.CONNECT)
+    properties.SessionExpiryInterval = SESSION_EXPIRY_S if resume else 0
+
+    start = time.perf_counter()
+    client.connect(args.broker, args.port, clean_start=not resume,
+                   properties=properties)
+    client.loop_start()
+    try:
+        if not connected.wait(args.timeout) or state['reason_code'].is_failure:
+            raise RuntimeError("Not connected to the broker")
+        resumed = resume and state['session_present']
+        if not resumed:
+            client.subscribe([(args.ack_topic, QOS), (args.config_topic, QOS)])
+            if not subscribed.wait(args.timeout):
+                raise RuntimeError("Subscriptions were not acknowledged")
+        client.publish(args.health_topic, HEALTH_REPORT,
+                       qos=QOS).wait_for_publish(args.timeout)
+        elapsed = time.perf_counter() - start
+    finally:
+        client.disconnect()
+        client.loop_stop()
+    return elapsed, resumed
+
+
+def measure(args, resume):
+    client_id = f"session-benchmark-{'resumed' if resume else 'clean'}"
+    if resume:
+        run_round(args, client_id, resume)
+    latencies = []
+    resumed_rounds = 0
+    for _ in range(args.rounds):
+        time.sleep(args.sleep)
+        elapsed, resumed = run_round(args, client_id, resume)
+        latencies.append(elapsed * 1000)
+        resumed_rounds += resumed
+    return latencies, resumed_rounds
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--broker', required=True, help='MQTT5 broker address')
+    parser.add_argument('--port', type=int, default=1883)
+    parser.add_argument('--rounds', type=int, default=20)
+    parser.add_argument('--sleep', type=float, default=0.2,
+                        help='seconds between the rounds')
+    parser.add_argument('--timeout', type=float, default=10)
+    parser.add_argument('--ack-topic', default='benchmark/image_ack')
+    parser.add_argument('--config-topic', default='benchmark/health_resp')
+    parser.add_argument('--health-topic', default='benchmark/health')
+    args = parser.parse_args()
+
+    print(f"{'session':>8} {'resumed':>8} {'min ms':>8} {'median ms':>10} "
+          f"{'max ms':>8}")
+    for resume in (False, True):
+        latencies, resumed_rounds = measure(args, resume)
+        label = 'resumed' if resume else 'clean'
+        print(f"{label:>8} {resumed_rounds:>4}/{args.rounds:<3} "
+              f"{min(latencies):>8.1f} {statistics.median(latencies):>10.1f} "
+              f"{max(latencies):>8.1f}")
+
+
+if __name__ == '__main__':
+    main()
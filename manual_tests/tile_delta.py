@@ -0,0 +1,45 @@
+"""Applies the tile delta frames of the camera (components/imaging,
+TileDelta) to their keyframe.
+Usage: keyframe_id, pixels = apply(payload, keyframe_pixels, width, height)"""
+import struct
+
+import gray_codec
+
+NAME = 'sgd1'
+HEADER_SIZE = 16
+TILE_HEADER_SIZE = 4
+
+
+def apply(data, keyframe, width, height):
+    """Returns (keyframe id, pixels) of the frame rebuilt from the keyframe
+    pixels and the delta frame."""
+    if len(data) < HEADER_SIZE or data[:3] != b'SGD' or data[3] != 1:
+        raise ValueError("Not a tile delta frame")
+    delta_width, delta_height, tile_size, count, keyframe_id = struct.unpack_from(
+        '<HHHHI', data, 4)
+    if (delta_width, delta_height) != (width, height):
+        raise ValueError("The delta doesn't match the keyframe size")
+
+    pixels = bytearray(keyframe)
+    columns = width // tile_size
+    tile_pixels = tile_size * tile_size
+    pos = HEADER_SIZE
+    for _ in range(count):
+        tile, size = struct.unpack_from('<HH', data, pos)
+        pos += TILE_HEADER_SIZE
+        if size == 0:
+            tile_data = data[pos:pos + tile_pixels]
+            pos += tile_pixels
+        else:
+            _, _, tile_data = gray_codec.decode(data[pos:pos + size])
+            pos += size
+        if len(tile_data) != tile_pixels:
+            raise ValueError("The delta frame is truncated")
+
+        origin = (tile // columns) * tile_size * width + \
+            (tile % columns) * tile_size
+        for y in range(tile_size):
+            start = origin + y * width
+            pixels[start:start + tile_size] = \
+                tile_data[y * tile_size:(y + 1) * tile_size]
+    return keyframe_id, bytes(pixels)
@@ -0,0 +1,66 @@
+"""Awake time of the camera, from the phases reported with the battery current.
+
+Every wake the camera publishes the time of its phases in milliseconds since
+boot (CameraApp::upload_image()). This collects them and prints the median
+awake time until the image was sent, and the time spent on the config
+handshake between the capture join and the handled config. Run it once with
+and once without "retainedConfig" in the dynamic config to measure the
+saving of the retained config.
+
+    python wake_phases.py --broker 192.168.0.232 --wakes 30
+"""
+import argparse
+import statistics
+import threading
+
+from paho.mqtt import client as mqtt_client
+
+import message_codec
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--broker', required=True, help='MQTT broker address')
+    parser.add_argument('--port', type=int, default=1883)
+    parser.add_argument('--topic', default='battery_current')
+    parser.add_argument('--wakes', type=int, default=20,
+                        help='number of wakes to collect')
+    args = parser.parse_args()
+
+    awake = []
+    handshake = []
+    done = threading.Event()
+
+    def on_message(client, userdata, msg):
+        try:
+            doc = message_codec.decode(msg.payload)
+        except ValueError as e:
+            print(f"Skipped a message: {e}")
+            return
+        phases = doc.get('phases', {})
+        if 'imageSent' not in phases:
+            return
+        awake.append(phases['imageSent'])
+        handshake.append(phases['config'] - phases['captureJoined'])
+        print(f"wake {len(awake):>3}: image sent at {awake[-1]:>6} ms, "
+              f"config handshake {handshake[-1]:>5} ms, "
+              f"session resumed: {doc.get('mqttResumed', False)}")
+        if len(awake) >= args.wakes:
+            done.set()
+
+    client = mqtt_client.Client(mqtt_client.CallbackAPIVersion.VERSION2)
+    client.on_message = on_message
+    client.connect(args.broker, args.port)
+    client.subscribe(args.topic)
+    client.loop_start()
+    done.wait()
+    client.loop_stop()
+    client.disconnect()
+
+    print(f"median of {len(awake)} wakes: image sent at "
+          f"{statistics.median(awake):.0f} ms, config handshake "
+          f"{statistics.median(handshake):.0f} ms")
+
+
+if __name__ == '__main__':
+    main()